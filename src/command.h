@@ -0,0 +1,153 @@
+#ifndef _ALICE_SRC_COMMAND_H
+#define _ALICE_SRC_COMMAND_H
+
+#include <stdint.h>
+
+#include <array>
+#include <string_view>
+
+namespace alice {
+
+// 服务器、sentinel以及所有存储引擎支持的命令名
+// 新增命令时必须先在这里添加它的名字，编译期会为这些名字生成一个完美哈希，
+// 一个命令的编号就是它在command_names中的下标
+inline constexpr std::string_view command_names[] = {
+    // server
+    "SLAVEOF", "PSYNC", "REPLCONF", "PING", "PUBLISH", "SUBSCRIBE", "CONFIG",
+    "INFO", "MULTI", "EXEC", "DISCARD", "WATCH", "UNWATCH", "WAIT",
+    "MAXSTALENESS",
+    // sentinel
+    "SENTINEL",
+    // keyspace
+    "SELECT", "EXISTS", "TYPE", "TTL", "PTTL", "EXPIRE", "PEXPIRE", "DEL",
+    "KEYS", "SAVE", "BGSAVE", "BGREWRITEAOF", "LASTSAVE", "FLUSHDB", "FLUSHALL",
+    "DBSIZE", "RENAME", "RENAMENX", "MOVE", "LRU", "SORT", "OBJECT",
+    // string
+    "SET", "SETNX", "GET", "GETSET", "APPEND", "STRLEN", "MSET", "MGET",
+    "INCR", "INCRBY", "DECR", "DECRBY", "SETRANGE", "GETRANGE",
+    // list
+    "LPUSH", "LPUSHX", "RPUSH", "RPUSHX", "LPOP", "RPOP", "RPOPLPUSH", "LREM",
+    "LLEN", "LINDEX", "LSET", "LRANGE", "LTRIM", "BLPOP", "BRPOP", "BRPOPLPUSH",
+    // hash
+    "HSET", "HSETNX", "HGET", "HEXISTS", "HDEL", "HLEN", "HSTRLEN", "HINCRBY",
+    "HMSET", "HMGET", "HKEYS", "HVALS", "HGETALL",
+    // set
+    "SADD", "SISMEMBER", "SPOP", "SRANDMEMBER", "SREM", "SMOVE", "SCARD",
+    "SMEMBERS", "SINTER", "SINTERSTORE", "SUNION", "SUNIONSTORE",
+    // zset
+    "ZADD", "ZSCORE", "ZINCRBY", "ZCARD", "ZCOUNT", "ZRANGE", "ZREVRANGE",
+    "ZRANK", "ZREVRANK", "ZREM", "ZRANGEBYSCORE", "ZREVRANGEBYSCORE",
+    "ZREMRANGEBYRANK", "ZREMRANGEBYSCORE",
+};
+
+inline constexpr size_t command_nums = std::size(command_names);
+
+namespace phash {
+
+constexpr char upper(char c)
+{
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+// 忽略大小写的FNV-1a，最后再混合一下，让不同的seed得到的结果足够分散
+constexpr uint32_t hash(std::string_view s, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (char c : s) {
+        h ^= static_cast<unsigned char>(upper(c));
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+constexpr bool equal(std::string_view name, std::string_view s)
+{
+    if (name.size() != s.size()) return false;
+    for (size_t i = 0; i < s.size(); i++)
+        if (name[i] != upper(s[i])) return false;
+    return true;
+}
+
+// 槽数至少是命令数的两倍，且必须是2的整数次幂
+inline constexpr size_t slots = 256;
+inline constexpr size_t buckets = 64;
+
+static_assert(slots >= command_nums * 2, "too many commands, enlarge phash::slots");
+
+struct table {
+    std::array<uint16_t, buckets> seeds{};
+    std::array<int16_t, slots> index{};
+};
+
+// 采用hash-and-displace的方法：先用hash(name, 0)将所有命令分到各个桶中，
+// 再按从大到小的顺序为每个桶寻找一个种子d，使桶中所有命令经hash(name, d)
+// 之后都恰好落在不同的空槽上
+constexpr table build()
+{
+    table t;
+    std::array<size_t, buckets> count{};
+    std::array<bool, buckets> done{};
+    for (auto& i : t.index) i = -1;
+    for (auto& name : command_names)
+        count[hash(name, 0) % buckets]++;
+    for (size_t n = 0; n < buckets; n++) {
+        size_t b = buckets;
+        for (size_t i = 0; i < buckets; i++) {
+            if (!done[i] && (b == buckets || count[i] > count[b]))
+                b = i;
+        }
+        done[b] = true;
+        if (count[b] == 0) continue;
+        for (uint16_t d = 1; ; d++) {
+            auto index = t.index;
+            bool ok = true;
+            for (size_t i = 0; i < command_nums && ok; i++) {
+                if (hash(command_names[i], 0) % buckets != b) continue;
+                auto slot = hash(command_names[i], d) % slots;
+                if (index[slot] != -1) ok = false;
+                else index[slot] = i;
+            }
+            if (ok) {
+                t.index = index;
+                t.seeds[b] = d;
+                break;
+            }
+        }
+    }
+    return t;
+}
+
+inline constexpr table command_table = build();
+
+}
+
+// 返回命令的编号，如果name不是一个已知的命令，就返回-1
+// name不区分大小写
+constexpr int lookup_command(std::string_view name)
+{
+    auto& t = phash::command_table;
+    auto d = t.seeds[phash::hash(name, 0) % phash::buckets];
+    int i = t.index[phash::hash(name, d) % phash::slots];
+    if (i < 0 || !phash::equal(command_names[i], name)) return -1;
+    return i;
+}
+
+namespace phash {
+
+constexpr bool verify()
+{
+    for (size_t i = 0; i < command_nums; i++)
+        if (lookup_command(command_names[i]) != static_cast<int>(i))
+            return false;
+    return true;
+}
+
+static_assert(verify(), "duplicate name in command_names");
+
+}
+}
+
+#endif // _ALICE_SRC_COMMAND_H
@@ -69,14 +69,35 @@ void read_server_conf(const std::string& filename)
             ASSERT(server_conf.repl_ping_period > 0, "repl-ping-period");
             server_conf.repl_ping_period *= 1000;
         } else if (strcasecmp(it[0].c_str(), "repl-backlog-size") == 0) {
-            server_conf.repl_backlog_size = human_size_to_bytes(it[1].c_str());
-            ASSERT(server_conf.repl_backlog_size > 0, "repl-backlog-size");
+            ssize_t size = human_size_to_bytes(it[1].c_str());
+            ASSERT(size > 0, "repl-backlog-size");
+            server_conf.repl_backlog_size = size;
+        } else if (strcasecmp(it[0].c_str(), "repl-diskless-sync") == 0) {
+            if (!parse_yes_or_no(it[1], server_conf.repl_diskless_sync))
+                error("repl-diskless-sync");
+        } else if (strcasecmp(it[0].c_str(), "repl-diskless-load") == 0) {
+            if (!parse_yes_or_no(it[1], server_conf.repl_diskless_load))
+                error("repl-diskless-load");
         } else if (strcasecmp(it[0].c_str(), "slowlog-log-slower-than") == 0) {
             server_conf.slowlog_log_slower_than = atoi(it[1].c_str());
             ASSERT(server_conf.slowlog_log_slower_than >= 0, "slowlog-log-slower-than");
         } else if (strcasecmp(it[0].c_str(), "slowlog-max-len") == 0) {
             server_conf.slowlog_max_len = atoi(it[1].c_str());
             ASSERT(server_conf.slowlog_max_len >= 0, "slowlog-max-len");
+        } else if (strcasecmp(it[0].c_str(), "io-threads") == 0) {
+            server_conf.io_threads = atoi(it[1].c_str());
+            ASSERT(server_conf.io_threads >= 0, "io-threads");
+        } else if (strcasecmp(it[0].c_str(), "expire-stale-percent") == 0) {
+            server_conf.expire_stale_percent = atoi(it[1].c_str());
+            ASSERT(server_conf.expire_stale_percent > 0 &&
+                   server_conf.expire_stale_percent <= 100, "expire-stale-percent");
+        } else if (strcasecmp(it[0].c_str(), "expire-cycle-time-percent") == 0) {
+            server_conf.expire_cycle_time_percent = atoi(it[1].c_str());
+            ASSERT(server_conf.expire_cycle_time_percent > 0 &&
+                   server_conf.expire_cycle_time_percent <= 100, "expire-cycle-time-percent");
+        } else if (strcasecmp(it[0].c_str(), "expire-index") == 0) {
+            if (!parse_yes_or_no(it[1], server_conf.expire_index))
+                error("expire-index");
         } else if (strcasecmp(it[0].c_str(), "slaveof") == 0) {
             server_conf.master_ip = it[1];
             server_conf.master_port = atoi(it[2].c_str());
@@ -84,6 +105,9 @@ void read_server_conf(const std::string& filename)
         } else if (strcasecmp(it[0].c_str(), "mmdb-databases") == 0) {
             server_conf.mmdb_databases = atoi(it[1].c_str());
             ASSERT(server_conf.mmdb_databases > 0, "databases");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-shards") == 0) {
+            server_conf.mmdb_shards = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_shards >= 0, "mmdb-shards");
         } else if (strcasecmp(it[0].c_str(), "mmdb-expire-check-dbnums") == 0) {
             server_conf.mmdb_expire_check_dbnums = atoi(it[1].c_str());
             ASSERT(server_conf.mmdb_expire_check_dbnums > 0, "mmdb-expire-check-dbnums");
@@ -109,6 +133,27 @@ void read_server_conf(const std::string& filename)
         } else if (strcasecmp(it[0].c_str(), "mmdb-maxmemory-samples") == 0) {
             server_conf.mmdb_maxmemory_samples = atoi(it[1].c_str());
             ASSERT(server_conf.mmdb_maxmemory_samples > 0, "mmdb-maxmemory-samples");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-activerehashing") == 0) {
+            if (!parse_yes_or_no(it[1], server_conf.mmdb_active_rehashing))
+                error("mmdb-activerehashing");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-list-max-listpack-entries") == 0) {
+            server_conf.mmdb_list_max_listpack_entries = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_list_max_listpack_entries >= 0, "mmdb-list-max-listpack-entries");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-hash-max-listpack-entries") == 0) {
+            server_conf.mmdb_hash_max_listpack_entries = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_hash_max_listpack_entries >= 0, "mmdb-hash-max-listpack-entries");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-set-max-listpack-entries") == 0) {
+            server_conf.mmdb_set_max_listpack_entries = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_set_max_listpack_entries >= 0, "mmdb-set-max-listpack-entries");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-set-max-intset-entries") == 0) {
+            server_conf.mmdb_set_max_intset_entries = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_set_max_intset_entries >= 0, "mmdb-set-max-intset-entries");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-zset-max-listpack-entries") == 0) {
+            server_conf.mmdb_zset_max_listpack_entries = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_zset_max_listpack_entries >= 0, "mmdb-zset-max-listpack-entries");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-listpack-max-value") == 0) {
+            server_conf.mmdb_listpack_max_value = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_listpack_max_value >= 0, "mmdb-listpack-max-value");
         } else if (strcasecmp(it[0].c_str(), "mmdb-save") == 0) {
             auto seconds = atol(it[1].c_str());
             auto changes = atol(it[2].c_str());
@@ -121,6 +166,12 @@ void read_server_conf(const std::string& filename)
             ASSERT(server_conf.mmdb_rdb_compress_limit >= 0, "mmdb-rdb-compress-limit");
         } else if (strcasecmp(it[0].c_str(), "mmdb-rdb-file") == 0) {
             server_conf.mmdb_rdb_file = it[1];
+        } else if (strcasecmp(it[0].c_str(), "mmdb-forkless-snapshot") == 0) {
+            if (!parse_yes_or_no(it[1], server_conf.mmdb_forkless_snapshot))
+                error("mmdb-forkless-snapshot");
+        } else if (strcasecmp(it[0].c_str(), "mmdb-rdb-load-threads") == 0) {
+            server_conf.mmdb_rdb_load_threads = atoi(it[1].c_str());
+            ASSERT(server_conf.mmdb_rdb_load_threads > 0, "mmdb-rdb-load-threads");
         } else if (strcasecmp(it[0].c_str(), "mmdb-appendonly") == 0) {
             if (!parse_yes_or_no(it[1], server_conf.mmdb_enable_appendonly))
                 error("mmdb_appendonly");
@@ -149,6 +200,27 @@ void read_server_conf(const std::string& filename)
         } else if (strcasecmp(it[0].c_str(), "ssdb-leveldb-max-file-size") == 0) {
             server_conf.ssdb_leveldb_max_file_size = human_size_to_bytes(it[1].c_str());
             ASSERT(server_conf.ssdb_leveldb_max_file_size > 0, "ssdb-leveldb-max-file-size");
+        } else if (strcasecmp(it[0].c_str(), "ssdb-leveldb-block-cache-size") == 0) {
+            ssize_t size = human_size_to_bytes(it[1].c_str());
+            ASSERT(size >= 0, "ssdb-leveldb-block-cache-size");
+            server_conf.ssdb_leveldb_block_cache_size = size;
+        } else if (strcasecmp(it[0].c_str(), "ssdb-leveldb-bloom-bits-per-key") == 0) {
+            server_conf.ssdb_leveldb_bloom_bits_per_key = atoi(it[1].c_str());
+            ASSERT(server_conf.ssdb_leveldb_bloom_bits_per_key >= 0, "ssdb-leveldb-bloom-bits-per-key");
+        } else if (strcasecmp(it[0].c_str(), "ssdb-leveldb-block-size") == 0) {
+            server_conf.ssdb_leveldb_block_size = human_size_to_bytes(it[1].c_str());
+            ASSERT(server_conf.ssdb_leveldb_block_size > 0, "ssdb-leveldb-block-size");
+        } else if (strcasecmp(it[0].c_str(), "ssdb-leveldb-compression") == 0) {
+            if (strcasecmp(it[1].c_str(), "snappy") == 0)
+                server_conf.ssdb_leveldb_compression = true;
+            else if (strcasecmp(it[1].c_str(), "no") == 0)
+                server_conf.ssdb_leveldb_compression = false;
+            else
+                error("ssdb-leveldb-compression");
+        } else if (strcasecmp(it[0].c_str(), "ssdb-read-cache-size") == 0) {
+            ssize_t size = human_size_to_bytes(it[1].c_str());
+            ASSERT(size >= 0, "ssdb-read-cache-size");
+            server_conf.ssdb_read_cache_size = size;
         }
     }
 }
@@ -194,12 +266,26 @@ static void get_config(context_t& con, const std::string& arg)
         con.append_reply_string(i2s(server_conf.repl_ping_period));
     } else if (strcasecmp(arg.c_str(), "repl-backlog-size") == 0) {
         con.append_reply_string(i2s(server_conf.repl_backlog_size));
+    } else if (strcasecmp(arg.c_str(), "repl-diskless-sync") == 0) {
+        con.append_reply_string(server_conf.repl_diskless_sync ? "yes" : "no");
+    } else if (strcasecmp(arg.c_str(), "repl-diskless-load") == 0) {
+        con.append_reply_string(server_conf.repl_diskless_load ? "yes" : "no");
     } else if (strcasecmp(arg.c_str(), "slowlog-log-slower-than") == 0) {
         con.append_reply_string(i2s(server_conf.slowlog_log_slower_than));
     } else if (strcasecmp(arg.c_str(), "slowlog-max-len") == 0) {
         con.append_reply_string(i2s(server_conf.slowlog_max_len));
+    } else if (strcasecmp(arg.c_str(), "io-threads") == 0) {
+        con.append_reply_string(i2s(server_conf.io_threads));
+    } else if (strcasecmp(arg.c_str(), "expire-stale-percent") == 0) {
+        con.append_reply_string(i2s(server_conf.expire_stale_percent));
+    } else if (strcasecmp(arg.c_str(), "expire-cycle-time-percent") == 0) {
+        con.append_reply_string(i2s(server_conf.expire_cycle_time_percent));
+    } else if (strcasecmp(arg.c_str(), "expire-index") == 0) {
+        con.append_reply_string(server_conf.expire_index ? "yes" : "no");
     } else if (strcasecmp(arg.c_str(), "mmdb-databases") == 0) {
         con.append_reply_string(i2s(server_conf.mmdb_databases));
+    } else if (strcasecmp(arg.c_str(), "mmdb-shards") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_shards));
     } else if (strcasecmp(arg.c_str(), "mmdb-expire-check-dbnums") == 0) {
         con.append_reply_string(i2s(server_conf.mmdb_expire_check_dbnums));
     } else if (strcasecmp(arg.c_str(), "mmdb-expire-check-keys") == 0) {
@@ -210,6 +296,20 @@ static void get_config(context_t& con, const std::string& arg)
         con.append_reply_string(i2s(server_conf.mmdb_maxmemory_policy));
     } else if (strcasecmp(arg.c_str(), "mmdb-maxmemory-samples") == 0) {
         con.append_reply_string(i2s(server_conf.mmdb_maxmemory_samples));
+    } else if (strcasecmp(arg.c_str(), "mmdb-activerehashing") == 0) {
+        con.append_reply_string(server_conf.mmdb_active_rehashing ? "yes" : "no");
+    } else if (strcasecmp(arg.c_str(), "mmdb-list-max-listpack-entries") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_list_max_listpack_entries));
+    } else if (strcasecmp(arg.c_str(), "mmdb-hash-max-listpack-entries") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_hash_max_listpack_entries));
+    } else if (strcasecmp(arg.c_str(), "mmdb-set-max-listpack-entries") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_set_max_listpack_entries));
+    } else if (strcasecmp(arg.c_str(), "mmdb-set-max-intset-entries") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_set_max_intset_entries));
+    } else if (strcasecmp(arg.c_str(), "mmdb-zset-max-listpack-entries") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_zset_max_listpack_entries));
+    } else if (strcasecmp(arg.c_str(), "mmdb-listpack-max-value") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_listpack_max_value));
     } else if (strcasecmp(arg.c_str(), "mmdb-save") == 0) {
         std::string s;
         for (auto& it : server_conf.mmdb_save_params) {
@@ -220,6 +320,10 @@ static void get_config(context_t& con, const std::string& arg)
         }
         s.pop_back();
         con.append_reply_string(s);
+    } else if (strcasecmp(arg.c_str(), "mmdb-forkless-snapshot") == 0) {
+        con.append_reply_string(server_conf.mmdb_forkless_snapshot ? "yes" : "no");
+    } else if (strcasecmp(arg.c_str(), "mmdb-rdb-load-threads") == 0) {
+        con.append_reply_string(i2s(server_conf.mmdb_rdb_load_threads));
     } else if (strcasecmp(arg.c_str(), "mmdb-appendonly") == 0) {
         con.append_reply_string(server_conf.mmdb_enable_appendonly ? "yes" : "no");
     } else if (strcasecmp(arg.c_str(), "mmdb-appendfsync") == 0) {
@@ -229,6 +333,16 @@ static void get_config(context_t& con, const std::string& arg)
             con.append_reply_string("always");
         else
             con.append_reply_string("no");
+    } else if (strcasecmp(arg.c_str(), "ssdb-leveldb-block-cache-size") == 0) {
+        con.append_reply_string(i2s(server_conf.ssdb_leveldb_block_cache_size));
+    } else if (strcasecmp(arg.c_str(), "ssdb-leveldb-bloom-bits-per-key") == 0) {
+        con.append_reply_string(i2s(server_conf.ssdb_leveldb_bloom_bits_per_key));
+    } else if (strcasecmp(arg.c_str(), "ssdb-leveldb-block-size") == 0) {
+        con.append_reply_string(i2s(server_conf.ssdb_leveldb_block_size));
+    } else if (strcasecmp(arg.c_str(), "ssdb-leveldb-compression") == 0) {
+        con.append_reply_string(server_conf.ssdb_leveldb_compression ? "snappy" : "no");
+    } else if (strcasecmp(arg.c_str(), "ssdb-read-cache-size") == 0) {
+        con.append_reply_string(i2s(server_conf.ssdb_read_cache_size));
     } else
         con.append(shared.nil);
 }
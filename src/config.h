@@ -34,14 +34,28 @@ struct server_conf_t {
     // 从服务器向主服务器发送PING的周期
     int repl_ping_period = 10 * 1000;
     // 复制积压缓冲区的大小
-    int repl_backlog_size = 1024 * 1024;
+    size_t repl_backlog_size = 1024 * 1024;
+    // 主服务器是否将快照通过管道直接发送给从服务器，不经过磁盘
+    bool repl_diskless_sync = false;
+    // 从服务器是否直接从连接中载入无盘复制的快照，不经过磁盘
+    bool repl_diskless_load = false;
     int slowlog_log_slower_than = 10000;
     int slowlog_max_len = 128;
+    // io线程数，为0时所有的读写都在主线程中进行
+    int io_threads = 0;
+    // 主动删除过期键时，取样到的键中已过期的比例超过该值就继续取样
+    int expire_stale_percent = 10;
+    // 定时任务中主动删除过期键最多占用一个周期的百分之多少的时间
+    int expire_cycle_time_percent = 25;
+    // 是否为带过期时间的键额外维护一个按到期时间排序的索引(mmdb)
+    bool expire_index = false;
     // 将要去复制的主服务器
     std::string master_ip;
     int master_port;
     // 要创建多少个数据库
     int mmdb_databases = 16;
+    // 键空间被划分成多少个分片，每个分片由一个独立的线程负责，为0时不分片
+    int mmdb_shards = 0;
     // 每次定期删除过期键时检查的数据库个数
     int mmdb_expire_check_dbnums = 16;
     // 每个数据库检查的键数
@@ -52,18 +66,32 @@ struct server_conf_t {
     int mmdb_maxmemory_policy = EVICT_NO;
     // 内存淘汰时的随机取样精度
     int mmdb_maxmemory_samples = 5;
+    // 是否在定时任务中主动为正在rehash的数据库迁移键
+    bool mmdb_active_rehashing = true;
+    // 元素个数不超过以下值时使用紧凑编码
+    int mmdb_list_max_listpack_entries = 128;
+    int mmdb_hash_max_listpack_entries = 128;
+    int mmdb_set_max_listpack_entries = 128;
+    int mmdb_set_max_intset_entries = 512;
+    int mmdb_zset_max_listpack_entries = 128;
+    // 紧凑编码中单个元素的最大长度
+    int mmdb_listpack_max_value = 64;
     std::vector<std::tuple<time_t, int>> mmdb_save_params;
-    // 是否压缩rdb文件
+    // 是否压缩rdb文件中的数据块
     bool mmdb_rdb_compress = true;
-    // len(value)大于多少时进行压缩
+    // 数据块大于多少字节时进行压缩
     int mmdb_rdb_compress_limit = 20;
     // rdb文件的存储位置
     std::string mmdb_rdb_file = "dump.rdb";
+    // 是否在不fork的情况下生成rdb快照
+    bool mmdb_forkless_snapshot = false;
+    // 载入rdb文件时使用的线程数，为1时只在主线程中顺序载入
+    int mmdb_rdb_load_threads = 4;
     // 是否开启aof持久化
     bool mmdb_enable_appendonly = false;
     // aof持久化的模式
     int mmdb_aof_mode = AOF_EVERYSEC;
-    // aof文件的存储位置
+    // aof文件的存储位置，清单、基础文件和增量日志都以它为前缀
     std::string mmdb_appendonly_file = "appendonly.aof";
     // ssdb-options
     std::string ssdb_snapshot_name = "ssdb-dump.tar";
@@ -71,6 +99,15 @@ struct server_conf_t {
     int ssdb_leveldb_write_buffer_size = 4 * 1024 * 1024;
     int ssdb_leveldb_max_open_files = 65535;
     int ssdb_leveldb_max_file_size = 2 * 1024 * 1024;
+    // LRU块缓存的大小，为0时使用leveldb内部默认的8MB缓存(不统计命中率)
+    size_t ssdb_leveldb_block_cache_size = 64 * 1024 * 1024;
+    // 布隆过滤器中每个键占用的位数，为0时不使用布隆过滤器
+    int ssdb_leveldb_bloom_bits_per_key = 10;
+    int ssdb_leveldb_block_size = 4 * 1024;
+    // 是否使用snappy压缩
+    bool ssdb_leveldb_compression = true;
+    // 热点键的读缓存(元数据、过期时间和字符串的值)的最大字节数，为0时不缓存
+    size_t ssdb_read_cache_size = 64 * 1024 * 1024;
 };
 
 struct sentinel_instance_conf_t {
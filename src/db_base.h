@@ -3,12 +3,22 @@
 
 #include <string>
 #include <vector>
+#include <array>
+#include <atomic>
 #include <functional>
+#include <initializer_list>
+#include <deque>
+#include <memory>
+#include <optional>
 #include <limits.h>
+#include <assert.h>
 
 #include <angel/inet_addr.h>
 #include <angel/connection.h>
+#include <angel/util.h>
 
+#include "command.h"
+#include "config.h"
 #include "util.h"
 
 namespace alice {
@@ -79,14 +89,19 @@ struct context_t {
         append(i2s(count));
         append("\r\n");
     }
-    void append_reply_string(const std::string& s)
+    void append_reply_string(std::string_view s)
     {
         append("$");
         append(i2s(s.size()));
         append("\r\n");
-        append(s);
+        append(s.data(), s.size());
         append("\r\n");
     }
+    // s可能指向i2s()/d2s()的缓冲区，所以要先拷贝一份
+    void append_reply_string(const char *s)
+    {
+        append_reply_string(std::string(s));
+    }
     void append_reply_string(std::string&& s)
     {
         append("$");
@@ -137,6 +152,8 @@ struct context_t {
     int repl_state = 0;
     angel::connection *conn = nullptr;
     argv_t argv; // 请求参数表 argv[0]为命令名
+    argv_view_t argv_view; // 指向输入缓冲区的请求参数表
+    argv_t argv_spare; // 供argv复用的string
     std::string buf; // 回复缓冲区
     size_t buf_resize = 0;
     std::vector<argv_t> transaction_list; // 事务队列
@@ -146,41 +163,212 @@ struct context_t {
     time_t block_start_time = 0;
     time_t blocked_time = 0;
     int block_db_num = 0;
+    size_t block_seq = 0; // 阻塞命令的回复在pending_replies中的序号
     std::string des; // for brpoplpush
     std::string last_cmd;
+    // 从服务器落后主服务器超过这么多毫秒时拒绝读请求，为0时不限制
+    int64_t max_staleness = 0;
     void *priv = nullptr;
+    // 已交给其他线程执行但回复还不能发送的命令，按请求的顺序排列
+    std::deque<std::optional<std::string>> pending_replies;
+    // pending_replies.front()的序号
+    size_t pending_seq = 0;
+};
+
+// 由存储引擎交给其他线程执行的一条命令，完成后在主线程中调用
+// dbserver::finish_command()
+struct async_command_t {
+    angel::connection_ptr conn;
+    size_t seq = 0; // 在context_t::pending_replies中的序号
+    int perm = 0;
+    argv_t argv;
+    std::string query; // 原始请求
+    std::string reply;
+    std::string writes; // 执行期间产生的其他需要传播的写命令，如删除过期键
+    int64_t start = 0;
+    int64_t end = 0;
+    uint64_t log_seq = 0; // 回复要等到日志持久化到这个序号之后才能发送，为0表示不用等待
 };
 
 struct command_t {
-    typedef std::function<void(context_t&)> command_callback_t;
-    command_t(int arity, int perm, const command_callback_t cb)
-        : arity(arity), perm(perm), command_cb(cb)
+    typedef void (*command_callback_t)(void *, context_t&);
+    int arity = 0;
+    int perm = 0;
+    command_callback_t command_cb = nullptr;
+    void *priv = nullptr; // 命令的执行者，作为command_cb的第一个参数
+    void call(context_t& con) { command_cb(priv, con); }
+};
+
+// 以命令编号为下标的命令表，查找一个命令只需计算一次完美哈希
+class CommandTable {
+public:
+    CommandTable() = default;
+    CommandTable(void *priv, std::initializer_list<std::pair<std::string_view, command_t>> cmds)
+    {
+        for (auto& [name, cmd] : cmds) {
+            int id = lookup_command(name);
+            assert(id >= 0);
+            table[id] = cmd;
+            table[id].priv = priv;
+        }
+    }
+    command_t *get(int id)
+    {
+        if (id < 0 || !table[id].command_cb) return nullptr;
+        return &table[id];
+    }
+    command_t *find(std::string_view name)
     {
+        return get(lookup_command(name));
     }
-    int arity;
-    int perm;
-    command_callback_t command_cb;
+private:
+    std::array<command_t, command_nums> table;
 };
 
-using CommandTable = std::unordered_map<std::string, command_t>;
+// 主动删除过期键的状态和统计信息
+// 定时任务中的慢速模式每次最多占用一个周期的expire_cycle_time_percent，
+// 事件循环进入等待之前的快速模式每次最多占用FAST_DURATION，并且只在上一次
+// 超时退出或者取样到的键中已过期的比例较高时才执行
+struct expire_cycle_t {
+    static constexpr int64_t CRON_PERIOD = 100 * 1000; // us
+    static constexpr int64_t FAST_DURATION = 1000; // us
+    int cur_db = 0; // 下一次从这个数据库开始检查
+    bool timelimit_exit = false;
+    int64_t start = 0;
+    int64_t limit = 0;
+    int64_t last_fast_start = 0;
+    // 统计信息
+    size_t expired_keys = 0;
+    size_t sampled_keys = 0;
+    double stale_perc = 0; // 取样到的键中已过期的比例的滑动平均值
+    int64_t time_used = 0; // us
+    size_t fast_cycles = 0;
+    size_t timelimit_exits = 0;
+    double expired_per_sec = 0;
+    size_t last_expired_keys = 0;
+    int64_t last_rate_time = 0; // ms
+
+    // 返回false时本次不需要执行
+    bool begin(bool fast)
+    {
+        start = angel::util::get_cur_time_us();
+        if (fast) {
+            if (!timelimit_exit && stale_perc * 100 < server_conf.expire_stale_percent)
+                return false;
+            if (start < last_fast_start + FAST_DURATION * 2)
+                return false;
+            last_fast_start = start;
+            fast_cycles++;
+            limit = FAST_DURATION;
+        } else {
+            limit = CRON_PERIOD * server_conf.expire_cycle_time_percent / 100;
+        }
+        return true;
+    }
+    bool timeout() const
+    {
+        return angel::util::get_cur_time_us() - start >= limit;
+    }
+    // 一轮取样了sampled个键，其中expired个已过期，返回是否需要继续取样
+    bool stale(size_t sampled, size_t expired) const
+    {
+        return expired * 100 > sampled * server_conf.expire_stale_percent;
+    }
+    void end(size_t sampled, size_t expired, bool timedout)
+    {
+        sampled_keys += sampled;
+        expired_keys += expired;
+        time_used += angel::util::get_cur_time_us() - start;
+        timelimit_exit = timedout;
+        if (timedout) timelimit_exits++;
+        double perc = sampled > 0 ? 1.0 * expired / sampled : 0;
+        stale_perc = perc * 0.05 + stale_perc * 0.95;
+    }
+    // 由定时任务调用，每秒更新一次expired_per_sec
+    void update_rate(int64_t now)
+    {
+        if (now - last_rate_time < 1000) return;
+        if (last_rate_time > 0)
+            expired_per_sec = 1000.0 * (expired_keys - last_expired_keys) / (now - last_rate_time);
+        last_expired_keys = expired_keys;
+        last_rate_time = now;
+    }
+    // 合并多个分片的统计信息
+    void merge(const expire_cycle_t& c, size_t n)
+    {
+        expired_keys += c.expired_keys;
+        sampled_keys += c.sampled_keys;
+        stale_perc += c.stale_perc / n;
+        time_used += c.time_used;
+        fast_cycles += c.fast_cycles;
+        timelimit_exits += c.timelimit_exits;
+        expired_per_sec += c.expired_per_sec;
+    }
+    void append_info(std::string& s) const
+    {
+        s.append("expired_keys:").append(i2s(expired_keys)).append("\n");
+        s.append("expired_keys_per_sec:").append(d2s(expired_per_sec)).append("\n");
+        s.append("expired_sampled_keys:").append(i2s(sampled_keys)).append("\n");
+        s.append("expired_stale_perc:").append(d2s(stale_perc * 100)).append("\n");
+        s.append("expired_time_used_us:").append(i2s(time_used)).append("\n");
+        s.append("expired_fast_cycles:").append(i2s(fast_cycles)).append("\n");
+        s.append("expired_time_cap_reached_count:").append(i2s(timelimit_exits)).append("\n");
+    }
+};
+
+// 从服务器直接从连接中载入快照，不经过磁盘
+struct snapshot_loader_t {
+    virtual ~snapshot_loader_t() {  }
+    // 按顺序传入快照的数据，返回false表示快照有误
+    virtual bool feed(const char *data, size_t len) = 0;
+    // 快照的数据已经全部传入，返回false表示快照不完整
+    virtual bool finish() = 0;
+};
 
 struct db_base_t {
     virtual ~db_base_t() {  }
     virtual void start() {  }
     virtual void exit() {  }
     virtual void server_cron() {  }
-    virtual command_t *find_command(const std::string& name) = 0;
+    // 事件循环处理完一轮事件后调用
+    virtual void before_sleep() {  }
+    // 向INFO的回复中追加引擎相关的信息，每行以\n结尾
+    virtual void info(std::string& s) {  }
+    // id是lookup_command()返回的命令编号
+    virtual command_t *get_command(int id) = 0;
+    command_t *find_command(std::string_view name)
+    {
+        return get_command(lookup_command(name));
+    }
     virtual void connection_handler(const angel::connection_ptr&) {  }
     virtual void close_handler(const angel::connection_ptr&) {  }
     virtual void slave_connection_handler(const angel::connection_ptr&) {  }
     virtual void slave_close_handler(const angel::connection_ptr&) {  }
     virtual void do_after_exec_write_cmd(const argv_t& argv, const char *query, size_t len) {  }
+    // 需要等写命令持久化之后才能回复时，返回已经写入日志的命令的序号，否则返回0
+    // 日志持久化到序号seq之后由引擎调用dbserver::release_durable_replies(seq)
+    virtual uint64_t write_log_seq() { return 0; }
+    // 日志无法写入时返回拒绝写命令的错误回复，否则返回nullptr
+    virtual const char *write_error() { return nullptr; }
     virtual void free_memory_if_needed() {  }
+    // 尝试将命令交给其他线程异步执行，返回false时由调用者在当前线程中执行
+    virtual bool dispatch_command(context_t& con, command_t *c,
+                                  const char *query, size_t len, size_t seq) { return false; }
+    // 暂停所有在其他线程中访问数据的任务，期间可以在主线程中安全地访问所有数据
+    // 可以嵌套调用
+    virtual void lock() {  }
+    virtual void unlock() {  }
     virtual void creat_snapshot() = 0;
     virtual bool is_creating_snapshot() = 0;
     virtual bool is_created_snapshot() = 0;
     virtual std::string get_snapshot_name() = 0;
     virtual void load_snapshot() = 0;
+    // 无盘复制: 是否能在后台将快照写到一个管道中
+    virtual bool can_stream_snapshot() { return false; }
+    // 在后台将快照写到fd中，写完后关闭它，完成后is_created_snapshot()返回true
+    virtual void creat_snapshot_to(int fd) {  }
+    // 不支持从连接中载入快照时返回nullptr
+    virtual std::unique_ptr<snapshot_loader_t> creat_snapshot_loader() { return nullptr; }
     virtual void watch(context_t&) = 0;
     virtual void unwatch(context_t&) = 0;
 };
@@ -216,7 +404,8 @@ struct shared_obj {
 };
 
 extern shared_obj shared;
-extern int64_t lru_clock;
+// 由主线程更新，分片线程也会读取
+extern std::atomic<int64_t> lru_clock;
 
 #define ret(con, str) \
     do { (con).append(str); return; } while (0)
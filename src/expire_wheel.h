@@ -0,0 +1,185 @@
+#ifndef _ALICE_SRC_EXPIRE_WHEEL_H
+#define _ALICE_SRC_EXPIRE_WHEEL_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace alice {
+
+// 按到期时间组织带过期时间的键的多层时间轮，精度为1ms
+// 第l层有SLOTS个槽位，每个槽位的跨度为SLOTS^l ms，键按(到期时间 - 当前时间)
+// 放入能容纳它的最低一层，低层每转完一圈就将高层的下一个槽位中的键重新分配到低层，
+// 所以定时任务只需要依次弹出第0层中已经走过的槽位，就能恰好得到所有已到期的键
+// 插入、更新和删除一个键都是O(1)的
+class expire_wheel {
+public:
+    explicit expire_wheel(int64_t now) : cur(now)
+    {
+        for (auto& level : wheel)
+            for (auto& head : level)
+                head.prev = head.next = &head;
+        due.prev = due.next = &due;
+    }
+    expire_wheel(const expire_wheel&) = delete;
+    expire_wheel& operator=(const expire_wheel&) = delete;
+    ~expire_wheel() { clear(); }
+
+    size_t size() const { return index.size(); }
+    bool empty() const { return index.empty(); }
+
+    // 添加一个键或者更新它的到期时间
+    void add(std::string_view key, int64_t expire)
+    {
+        auto it = index.find(key);
+        node *n;
+        if (it != index.end()) {
+            n = it->second;
+            unlink(n);
+        } else {
+            n = new node;
+            n->key.assign(key.data(), key.size());
+            index.emplace(n->key, n);
+        }
+        n->expire = expire;
+        place(n);
+    }
+
+    void remove(std::string_view key)
+    {
+        auto it = index.find(key);
+        if (it == index.end()) return;
+        node *n = it->second;
+        index.erase(it);
+        unlink(n);
+        delete n;
+    }
+
+    void clear()
+    {
+        for (auto& [key, n] : index) {
+            unlink(n);
+            delete n;
+        }
+        index.clear();
+    }
+
+    // 弹出至多max个到期时间不晚于now的键，对每个键调用f(key)，返回弹出的个数
+    // f()中可以调用remove()
+    template <typename F>
+    size_t pop(int64_t now, size_t max, F f)
+    {
+        size_t popped = pop_list(&due, max, f);
+        // 没有键时直接跳过中间的时间
+        if (empty() && cur <= now) {
+            cur = now + 1;
+            cascaded = false;
+        }
+        while (cur <= now && popped < max) {
+            if (!cascaded) {
+                cascade();
+                cascaded = true;
+            }
+            auto head = &wheel[0][cur & MASK];
+            popped += pop_list(head, max - popped, f);
+            if (head->next != head) break;
+            cur++;
+            cascaded = false;
+        }
+        return popped;
+    }
+private:
+    static constexpr int BITS = 6;
+    static constexpr int SLOTS = 1 << BITS;
+    static constexpr int MASK = SLOTS - 1;
+    // 8层可以表示2^48ms，约8900年
+    static constexpr int LEVELS = 8;
+
+    struct link_t {
+        link_t *prev = nullptr;
+        link_t *next = nullptr;
+    };
+    struct node : link_t {
+        int64_t expire = 0;
+        std::string key;
+    };
+
+    static void unlink(link_t *n)
+    {
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+    }
+    static void link(link_t *head, link_t *n)
+    {
+        n->prev = head->prev;
+        n->next = head;
+        head->prev->next = n;
+        head->prev = n;
+    }
+    template <typename F>
+    size_t pop_list(link_t *head, size_t max, F& f)
+    {
+        size_t popped = 0;
+        while (head->next != head && popped < max) {
+            node *n = static_cast<node*>(head->next);
+            index.erase(n->key);
+            unlink(n);
+            std::string key = std::move(n->key);
+            delete n;
+            f(key);
+            popped++;
+        }
+        return popped;
+    }
+    // 早于cur到期的键所在的槽位已经走过了，所以放在单独的链表中
+    void place(node *n)
+    {
+        int64_t t = n->expire;
+        if (t < cur) {
+            link(&due, n);
+            return;
+        }
+        uint64_t delta = t - cur;
+        int l = 0;
+        while (l < LEVELS - 1 && delta >= (uint64_t(1) << (BITS * (l + 1))))
+            l++;
+        link(&wheel[l][(t >> (BITS * l)) & MASK], n);
+    }
+    // 第0层转完一圈时，将上一层的下一个槽位中的键重新分配到下层，以此类推
+    void cascade()
+    {
+        if ((cur & MASK) != 0) return;
+        for (int l = 1; l < LEVELS; l++) {
+            int i = (cur >> (BITS * l)) & MASK;
+            auto& head = wheel[l][i];
+            link_t list;
+            list.prev = list.next = &list;
+            if (head.next != &head) {
+                list.next = head.next;
+                list.prev = head.prev;
+                list.next->prev = &list;
+                list.prev->next = &list;
+                head.prev = head.next = &head;
+            }
+            while (list.next != &list) {
+                node *n = static_cast<node*>(list.next);
+                unlink(n);
+                place(n);
+            }
+            if (i != 0) break;
+        }
+    }
+
+    link_t wheel[LEVELS][SLOTS];
+    link_t due;
+    std::unordered_map<std::string_view, node*> index;
+    // 下一个要处理的时刻，所有早于它到期的键都已经被弹出了
+    int64_t cur;
+    // cur时刻是否已经进行过cascade()
+    bool cascaded = false;
+};
+
+}
+
+#endif // _ALICE_SRC_EXPIRE_WHEEL_H
@@ -2,306 +2,541 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <chrono>
 
 #include "../config.h"
 #include "../server.h"
 
 #include "internal.h"
 #include "aof.h"
+#include "rdb.h"
 
 namespace alice {
 
 namespace mmdb {
 
+// 增量日志中的每条命令:
+// <payload-len(4)><crc32c(4)><payload>
+// <payload>: <argc><<arg-len><arg> ...>
+//
+// EXPIRE、PEXPIRE和SET的EX、PX参数都被转换为绝对时间(ms)，分别记为PEXPIRE和PX，
+// 载入时再转换回相对时间，所以重放时键的过期时间不会被推迟
+//
+// 清单文件:
+// seq <最近一次分配的文件序号>
+// base <基础文件>
+// incr <增量日志> ...
+
+static const size_t record_header_size = 8;
+// 载入时丢弃回复的阈值
+static const size_t replay_reply_limit = 64 * 1024;
+
 Aof::Aof(mmdb::engine *engine)
     : engine(engine),
     child_pid(-1),
-    last_sync_time(0),
     cur_file_size(0),
     last_rewrite_file_size(0),
     fd(-1)
 {
-    bzero(tmpfile, sizeof(tmpfile));
 }
 
-// 保存服务器执行的所有写命令
-void Aof::append(const argv_t& argv, const char *query, size_t len)
+static bool equal(std::string_view s, const char *t)
 {
-    dbserver::conv2resp_with_expire(buffer, argv, query, len);
+    return s.size() == strlen(t) && strncasecmp(s.data(), t, s.size()) == 0;
 }
 
-// 保存aof重写过程中执行的所有写命令
-void Aof::append_rewrite_buffer(const argv_t& argv, const char *query, size_t len)
+static size_t file_size(const std::string& file)
 {
-    dbserver::conv2resp_with_expire(rewrite_buffer, argv, query, len);
+    struct stat st;
+    if (stat(file.c_str(), &st) < 0) return 0;
+    return st.st_size;
 }
 
-// 将缓冲区中的命令flush到文件中
-void Aof::fsync()
+std::string Aof::manifest_file() const
 {
-    auto now = lru_clock;
-    if (buffer.empty()) return;
-    auto sync_interval = now - last_sync_time;
-    int fd = open(server_conf.mmdb_appendonly_file.c_str(), O_RDWR | O_APPEND | O_CREAT, 0660);
-    fwrite(fd, buffer.data(), buffer.size());
-    cur_file_size = get_filesize(fd);
-    buffer.clear();
-    if (server_conf.mmdb_aof_mode == AOF_ALWAYS) {
-        __server->fsync(fd);
-    } else if (server_conf.mmdb_aof_mode == AOF_EVERYSEC) {
-        if (sync_interval >= 1000) {
-            __server->fsync(fd);
-            last_sync_time = now;
-        }
-    }
+    return server_conf.mmdb_appendonly_file + ".manifest";
 }
 
-static void aof_set(argv_t& argv, int64_t now)
+std::string Aof::file_name(uint64_t seq, const char *type) const
 {
-    for (size_t i = 1; i < argv.size(); i++) {
-        if (strcasecmp(argv[i].c_str(), "EX") == 0) {
-            int64_t timeval = atoll(argv[i+1].c_str()) - now;
-            argv[i+1] = i2s(timeval / 1000);
-            break;
-        } else if (strcasecmp(argv[i].c_str(), "PX") == 0) {
-            int64_t timeval = atoll(argv[i+1].c_str()) - now;
-            argv[i+1] = i2s(timeval);
-            break;
-        }
-    }
+    return server_conf.mmdb_appendonly_file + "." + std::to_string(seq) + "." + type;
 }
 
-void Aof::load()
+bool Aof::exists() const
 {
-    context_t con(nullptr, engine);
-    angel::buffer buf;
-    FILE *fp = fopen(server_conf.mmdb_appendonly_file.c_str(), "r");
-    if (!fp || get_filesize(fileno(fp)) == 0) {
-        rewrite_select_db(0);
-        if (fp) fclose(fp);
-        return;
-    }
-    int64_t now = angel::util::get_cur_time_ms();
+    return is_file_exists(manifest_file()) || is_file_exists(server_conf.mmdb_appendonly_file);
+}
+
+bool Aof::read_manifest(manifest_t& m)
+{
+    FILE *fp = fopen(manifest_file().c_str(), "r");
+    if (!fp) return false;
     char *line = nullptr;
     size_t len = 0;
     ssize_t n;
     while ((n = ::getline(&line, &len, fp)) > 0) {
-        buf.append(line, n);
-        free(line);
-        line = nullptr;
-        len = 0;
-        ssize_t n = parse_request(con.argv, buf);
-        if (n <= 0) continue;
-        auto c = engine->find_command(con.argv[0]);
-        assert(c);
-        if (con.argv[0].compare("PEXPIRE") == 0) {
-            int64_t timeval = atoll(con.argv[2].c_str()) - now;
-            con.argv[2] = i2s(timeval);
-        } else if (con.argv[0].compare("SET") == 0 && con.argv.size() >= 5) {
-            aof_set(con.argv, now);
-        }
-        c->command_cb(con);
-        con.argv.clear();
-        buf.retrieve(n);
-        con.buf.clear();
+        std::string s(line, n);
+        if (s.back() == '\n') s.pop_back();
+        auto sep = s.find(' ');
+        if (sep == std::string::npos) continue;
+        auto type = s.substr(0, sep);
+        auto value = s.substr(sep + 1);
+        if (type == "seq")
+            m.seq = str2ll(value);
+        else if (type == "base")
+            m.base = value;
+        else if (type == "incr")
+            m.incrs.push_back(value);
     }
-    engine->switch_db(0);
+    free(line);
     fclose(fp);
+    return true;
 }
 
-void Aof::rewrite_background()
+// 先写临时文件再rename()，清单总是完整的，失败时原来的清单保持不变
+bool Aof::write_manifest(const manifest_t& m)
 {
-    strcpy(tmpfile, "tmp.XXXXX");
-    mktemp(tmpfile);
-    child_pid = fork();
-    // logInfo("Background AOF rewrite started by pid %ld", _childPid);
-    if (child_pid == 0) {
-        rewrite();
-        done();
-        abort();
+    std::string data = "seq " + std::to_string(m.seq) + "\n";
+    if (!m.base.empty())
+        data += "base " + m.base + "\n";
+    for (auto& incr : m.incrs)
+        data += "incr " + incr + "\n";
+    std::string tmpfile = manifest_file() + ".tmp";
+    int fd = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0) {
+        log_error("Can't open %s: %s", tmpfile.c_str(), strerror(errno));
+        return false;
+    }
+    if (fwrite(fd, data.data(), data.size()) < 0 || ::fsync(fd) < 0) {
+        log_error("Can't write %s: %s", tmpfile.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmpfile.c_str());
+        return false;
     }
+    close(fd);
+    if (rename(tmpfile.c_str(), manifest_file().c_str()) < 0) {
+        log_error("Can't rename %s: %s", tmpfile.c_str(), strerror(errno));
+        unlink(tmpfile.c_str());
+        return false;
+    }
+    return true;
 }
 
-void Aof::rewrite()
+// 切换到一个新的增量日志，它的第一条命令是SELECT当前的数据库，
+// 所以它可以接在任何一个基础文件之后重放
+void Aof::open_incr()
 {
-    fd = open(tmpfile, O_RDWR | O_CREAT | O_APPEND, 0660);
-    last_rewrite_file_size = get_filesize(fd);
-    buffer.clear();
-    int64_t now = angel::util::get_cur_time_ms();
-    int index = 0;
-    for (auto& db : engine->dbs) {
-        auto& dict = db->get_dict();
-        auto& expire_keys = db->get_expire_keys();
-        if (dict.empty()) {
-            index++;
+    // 旧的日志中的命令先交给aof线程，它看到新的fd后会fsync并关闭旧的fd
+    push_buffer();
+    if (!writer.joinable())
+        writer = std::thread([this]{ this->writer_loop(); });
+    std::string file = file_name(++manifest.seq, "incr.aof");
+    fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0660);
+    if (fd < 0)
+        log_fatal("Can't open the append only file %s: %s", file.c_str(), strerror(errno));
+    manifest.incrs.push_back(file);
+    // 不在清单中的增量日志重启后不会被载入，继续写入只会丢失数据
+    if (!write_manifest(manifest))
+        log_fatal("Can't add %s to the append only file manifest", file.c_str());
+    std::string dbnum = i2s(engine->get_cur_db_num());
+    append_command({ "SELECT", dbnum });
+}
+
+// 保存服务器执行的所有写命令
+void Aof::append(const argv_t& argv, const char *query, size_t len)
+{
+    thread_local argv_view_t args;
+    // 启动后第一次写入时打开新的增量日志，不会接在可能不完整的旧日志后面
+    if (fd < 0) open_incr();
+    if (!argv.empty()) {
+        args.assign(argv.begin(), argv.end());
+        append_command(args);
+        return;
+    }
+    // 分片模式下合并后的写命令是RESP形式的
+    const char *s = query, *es = query + len;
+    while (s < es) {
+        ssize_t n = parse_request(args, s, es);
+        if (n <= 0) break;
+        append_command(args);
+        s += n;
+    }
+}
+
+void Aof::append_command(const argv_view_t& args)
+{
+    thread_local argv_view_t conv;
+    thread_local std::string payload;
+    std::string timeval;
+    conv.assign(args.begin(), args.end());
+    auto now = angel::util::get_cur_time_ms();
+    if (conv.size() == 3 && (equal(conv[0], "EXPIRE") || equal(conv[0], "PEXPIRE"))) {
+        int64_t expire = str2ll(std::string(conv[2]));
+        if (equal(conv[0], "EXPIRE")) expire *= 1000;
+        timeval = i2s(now + expire);
+        conv[0] = "PEXPIRE";
+        conv[2] = timeval;
+    } else if (conv.size() >= 5 && equal(conv[0], "SET")) {
+        for (size_t i = 3; i + 1 < conv.size(); i++) {
+            if (equal(conv[i], "EX") || equal(conv[i], "PX")) {
+                int64_t expire = str2ll(std::string(conv[i+1]));
+                if (equal(conv[i], "EX")) expire *= 1000;
+                timeval = i2s(now + expire);
+                conv[i] = "PX";
+                conv[i+1] = timeval;
+                break;
+            }
+        }
+    }
+    payload.clear();
+    save_len(payload, conv.size());
+    for (auto& arg : conv) {
+        save_len(payload, arg.size());
+        payload.append(arg);
+    }
+    uint32_t size = payload.size();
+    uint32_t crc = crc32c(0, payload.data(), payload.size());
+    buffer.append(reinterpret_cast<char*>(&size), 4);
+    buffer.append(reinterpret_cast<char*>(&crc), 4);
+    buffer.append(payload);
+    appended += record_header_size + payload.size();
+}
+
+// aof线程在重试写入失败的数据时，命令先留在缓冲区中，以免队列被填满后阻塞主线程
+void Aof::flush()
+{
+    if (write_failed.load(std::memory_order_acquire)) return;
+    push_buffer();
+}
+
+void Aof::push_buffer()
+{
+    if (buffer.empty() || fd < 0) return;
+    cur_file_size += buffer.size();
+    chunk_t chunk;
+    chunk.fd = fd;
+    chunk.data.swap(buffer);
+    chunk.seq = flushed = appended;
+    ring.push(std::move(chunk));
+}
+
+void Aof::server_cron()
+{
+    flush();
+    if (server_conf.mmdb_aof_mode != AOF_EVERYSEC || fd < 0) return;
+    if (write_failed.load(std::memory_order_acquire)) return;
+    if (flushed == durable.load(std::memory_order_acquire)) return;
+    chunk_t chunk;
+    chunk.fd = fd;
+    chunk.seq = flushed;
+    ring.push(std::move(chunk));
+}
+
+void Aof::stop()
+{
+    if (!writer.joinable()) return;
+    push_buffer();
+    ring.push(chunk_t());
+    writer.join();
+}
+
+// aof线程: 把队列中已有的命令都写完后才fsync一次，
+// 所以fsync越慢，每次提交的命令就越多
+void Aof::writer_loop()
+{
+    chunk_t chunk;
+    int fd = -1;
+    uint64_t written = 0;
+    int64_t last_sync_time = 0;
+    while (true) {
+        if (!ring.pop(chunk)) {
+            ring.wait();
             continue;
         }
-        rewrite_select_db(index);
-        for (auto it = dict.begin(); it != dict.end(); ++it) {
-            auto expire = expire_keys.find(it->first);
-            if (expire != expire_keys.end()) {
-                if (expire->second <= now) {
-                    db->del_key_with_expire(it->first);
-                    continue;
-                } else {
-                    rewrite_expire(it->first, expire->second);
-                }
+        if (chunk.fd != fd) {
+            if (fd >= 0) {
+                if (sync(fd)) synced(written);
+                ::close(fd);
             }
-            if (is_type(it, DB::String))
-                rewrite_string(it);
-            else if (is_type(it, DB::List))
-                rewrite_list(it);
-            else if (is_type(it, DB::Set))
-                rewrite_set(it);
-            else if (is_type(it, DB::Hash))
-                rewrite_hash(it);
-            else if (is_type(it, Zset))
-                rewrite_zset(it);
-            index++;
+            fd = chunk.fd;
+        }
+        if (fd < 0) break;
+        write_until_ok(fd, chunk.data);
+        written = chunk.seq;
+        if (!ring.empty()) continue;
+        auto now = angel::util::get_cur_time_ms();
+        if (server_conf.mmdb_aof_mode == AOF_ALWAYS ||
+            (server_conf.mmdb_aof_mode == AOF_EVERYSEC && now - last_sync_time >= 1000)) {
+            last_sync_time = now;
+            if (sync(fd)) synced(written);
         }
     }
-    if (buffer.size() > 0) flush();
-    __server->fsync(fd);
-    rename(tmpfile, server_conf.mmdb_appendonly_file.c_str());
 }
 
-// 将aof重写缓冲区中的命令写到文件中
-void Aof::fsync_rewrite_buffer()
+// 写入失败时data中只留下还没有写入的部分
+static bool write_all(int fd, std::string& data)
 {
-    if (rewrite_buffer.empty()) return;
-    int fd = open(server_conf.mmdb_appendonly_file.c_str(), O_RDWR | O_APPEND | O_CREAT, 0660);
-    fwrite(fd, rewrite_buffer.data(), rewrite_buffer.size());
-    rewrite_buffer.clear();
-    __server->fsync(fd);
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = ::write(fd, data.data() + off, data.size() - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            data.erase(0, off);
+            return false;
+        }
+        off += n;
+    }
+    data.clear();
+    return true;
 }
 
-void Aof::rewrite_select_db(int dbnum)
+// 写入失败后每秒重试一次，期间拒绝执行写命令，直到写入成功
+void Aof::write_until_ok(int fd, std::string& data)
 {
-    append("*2\r\n$6\r\nSELECT\r\n$");
-    append(i2s(strlen(i2s(dbnum))));
-    append("\r\n");
-    append(i2s(dbnum));
-    append("\r\n");
+    while (!write_all(fd, data)) {
+        if (!write_failed.exchange(true, std::memory_order_acq_rel))
+            log_error("Can't write the append only file: %s", strerror(errno));
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (write_failed.exchange(false, std::memory_order_acq_rel))
+        log_info("Append only file write error is resolved");
 }
 
-void Aof::rewrite_expire(const std::string& key, int64_t expire)
+// fsync失败后内核可能已经丢弃了脏页，之后的fsync成功也不能说明数据已经落盘，
+// 所以appendfsync always时只能退出，其他模式下拒绝执行写命令直到下一次fsync成功
+bool Aof::sync(int fd)
 {
-    append("*3\r\n$7\r\nPEXPIRE\r\n$");
-    append(i2s(key.size()));
-    append("\r\n");
-    append(key + "\r\n$");
-    append(i2s(strlen(i2s(expire))));
-    append("\r\n");
-    append(i2s(expire));
-    append("\r\n");
+    if (::fdatasync(fd) < 0) {
+        if (server_conf.mmdb_aof_mode == AOF_ALWAYS)
+            log_fatal("Can't fsync the append only file: %s", strerror(errno));
+        if (!sync_failed.exchange(true, std::memory_order_acq_rel))
+            log_error("Can't fsync the append only file: %s", strerror(errno));
+        return false;
+    }
+    if (sync_failed.exchange(false, std::memory_order_acq_rel))
+        log_info("Append only file fsync error is resolved");
+    return true;
+}
 
+// 在aof线程中调用，通知主线程发送已经持久化的写命令的回复
+void Aof::synced(uint64_t seq)
+{
+    durable.store(seq, std::memory_order_release);
+    if (server_conf.mmdb_aof_mode != AOF_ALWAYS) return;
+    if (notify_queued.exchange(true, std::memory_order_acq_rel)) return;
+    __server->get_loop()->queue_in_loop([this]{
+        notify_queued.store(false, std::memory_order_release);
+        __server->release_durable_replies(durable.load(std::memory_order_acquire));
+    });
 }
 
-void Aof::rewrite_string(const iterator& it)
+// 过期时间已经过去的键仍然要设置一个过期时间，让它在载入后立即过期
+static void to_relative(std::string& timeval, int64_t now)
 {
-    auto& value = get_string_value(it);
-    append("*3\r\n$3\r\nSET\r\n$");
-    append(i2s(it->first.size()));
-    append("\r\n");
-    append(it->first + "\r\n$");
-    append(i2s(value.size()));
-    append("\r\n");
-    append(value + "\r\n");
+    timeval = i2s(std::max<int64_t>(str2ll(timeval) - now, 1));
 }
 
-void Aof::rewrite_list(const iterator& it)
+static void aof_set(argv_t& argv, int64_t now)
 {
-    auto& list = get_list_value(it);
-    if (list.empty()) return;
-    append("*");
-    append(i2s(list.size() + 2));
-    append("\r\n$5\r\nRPUSH\r\n$");
-    append(i2s(it->first.size()));
-    append("\r\n");
-    append(it->first + "\r\n");
-    for (auto& it : list) {
-        append("$");
-        append(i2s(it.size()));
-        append("\r\n");
-        append(it + "\r\n");
+    for (size_t i = 1; i < argv.size(); i++) {
+        if (strcasecmp(argv[i].c_str(), "EX") == 0) {
+            int64_t timeval = atoll(argv[i+1].c_str()) - now;
+            argv[i+1] = i2s(timeval / 1000);
+            break;
+        } else if (strcasecmp(argv[i].c_str(), "PX") == 0) {
+            int64_t timeval = atoll(argv[i+1].c_str()) - now;
+            argv[i+1] = i2s(timeval);
+            break;
+        }
     }
 }
 
-void Aof::rewrite_set(const iterator& it)
+void Aof::load()
+{
+    manifest = manifest_t();
+    // 旧版本的aof只有一个RESP格式的文件，把它当作基础文件，下一次重写时删除
+    if (!read_manifest(manifest) && is_file_exists(server_conf.mmdb_appendonly_file))
+        manifest.base = server_conf.mmdb_appendonly_file;
+    if (!manifest.base.empty())
+        load_base(manifest.base);
+    for (size_t i = 0; i < manifest.incrs.size(); i++)
+        load_incr(manifest.incrs[i], i + 1 == manifest.incrs.size());
+    engine->switch_db(0);
+    last_rewrite_file_size = file_size(manifest.base);
+    cur_file_size = last_rewrite_file_size;
+    for (auto& incr : manifest.incrs)
+        cur_file_size += file_size(incr);
+}
+
+void Aof::load_base(const std::string& file)
 {
-    auto& set = get_set_value(it);
-    if (set.empty()) return;
-    append("*");
-    append(i2s(set.size() + 2));
-    append("\r\n$4\r\nSADD\r\n$");
-    append(i2s(it->first.size()));
-    append("\r\n");
-    append(it->first + "\r\n");
-    for (auto& it : set) {
-        append("$");
-        append(i2s(it.size()));
-        append("\r\n");
-        append(it + "\r\n");
+    if (!engine->rdb->load(file))
+        load_resp(file);
+}
+
+// 将整个文件只读地映射到内存中，命令直接在映射的内存上解析
+static char *map_file(const std::string& file, size_t& size)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        log_fatal("Can't open the append only file %s: %s", file.c_str(), strerror(errno));
+    size = get_filesize(fd);
+    if (size == 0) {
+        close(fd);
+        return nullptr;
     }
+    void *start = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (start == MAP_FAILED)
+        log_fatal("Can't mmap the append only file %s: %s", file.c_str(), strerror(errno));
+    madvise(start, size, MADV_SEQUENTIAL);
+    return reinterpret_cast<char*>(start);
 }
 
-void Aof::rewrite_hash(const iterator& it)
+// 直接调用命令的处理函数，回复没有用处，积累到一定大小后再一起丢弃
+void Aof::replay(context_t& con)
 {
-    auto& hash = get_hash_value(it);
-    if (hash.empty()) return;
-    append("*");
-    append(i2s(hash.size() * 2 + 2));
-    append("\r\n$5\r\nHMSET\r\n$");
-    append(i2s(it->first.size()));
-    append("\r\n");
-    append(it->first + "\r\n");
-    for (auto& it : hash) {
-        append("$");
-        append(i2s(it.first.size()));
-        append("\r\n");
-        append(it.first + "\r\n$");
-        append(i2s(it.second.size()));
-        append("\r\n");
-        append(it.second + "\r\n");
+    auto c = engine->find_command(con.argv[0]);
+    if (!c) log_fatal("Bad append only file: unknown command %s", con.argv[0].c_str());
+    c->call(con);
+    if (con.buf.size() >= replay_reply_limit)
+        con.buf.clear();
+}
+
+void Aof::load_resp(const std::string& file)
+{
+    size_t size;
+    char *start = map_file(file, size);
+    if (!start) return;
+    context_t con(nullptr, engine);
+    argv_view_t views;
+    int64_t now = angel::util::get_cur_time_ms();
+    const char *s = start, *es = start + size;
+    while (s < es) {
+        ssize_t n = parse_request(views, s, es);
+        if (n < 0)
+            log_fatal("Bad append only file %s: protocol error at offset %zu",
+                      file.c_str(), static_cast<size_t>(s - start));
+        if (n == 0) {
+            log_warn("Append only file %s is truncated, ignoring the last %zu bytes",
+                     file.c_str(), static_cast<size_t>(es - s));
+            break;
+        }
+        s += n;
+        assign_argv(con.argv, con.argv_spare, views);
+        if (con.argv[0].compare("PEXPIRE") == 0) {
+            int64_t timeval = atoll(con.argv[2].c_str()) - now;
+            con.argv[2] = i2s(timeval);
+        } else if (con.argv[0].compare("SET") == 0 && con.argv.size() >= 5) {
+            aof_set(con.argv, now);
+        }
+        replay(con);
     }
+    munmap(start, size);
 }
 
-void Aof::rewrite_zset(const iterator& it)
+// 只有最后一个增量日志的末尾可能因为宕机而不完整，忽略这部分命令
+void Aof::load_incr(const std::string& file, bool last)
 {
-    auto& zset = get_zset_value(it);
-    if (zset.zmap.empty()) return;
-    append("*");
-    append(i2s(zset.size() * 2 + 2));
-    append("\r\n$4\r\nZADD\r\n$");
-    append(i2s(it->first.size()));
-    append("\r\n");
-    append(it->first + "\r\n");
-    for (auto& it : zset.zmap) {
-        append("$");
-        append(i2s(strlen(d2s(it.second))));
-        append("\r\n");
-        append(d2s(it.second));
-        append("\r\n$");
-        append(i2s(it.first.size()));
-        append("\r\n");
-        append(it.first + "\r\n");
+    size_t size;
+    char *start = map_file(file, size);
+    if (!start) return;
+    context_t con(nullptr, engine);
+    argv_view_t views;
+    int64_t now = angel::util::get_cur_time_ms();
+    char *ptr = start, *end = start + size;
+    while (ptr < end) {
+        uint32_t len32, crc;
+        if (static_cast<size_t>(end - ptr) >= record_header_size)
+            memcpy(&len32, ptr, 4);
+        if (static_cast<size_t>(end - ptr) < record_header_size ||
+                static_cast<size_t>(end - ptr) - record_header_size < len32) {
+            if (!last)
+                log_fatal("Bad append only file %s: unexpected end of file", file.c_str());
+            log_warn("Append only file %s is truncated, ignoring the last %zu bytes",
+                     file.c_str(), static_cast<size_t>(end - ptr));
+            break;
+        }
+        memcpy(&crc, ptr + 4, 4);
+        ptr += record_header_size;
+        if (crc32c(0, ptr, len32) != crc)
+            log_fatal("Bad append only file %s: checksum mismatch at offset %zu",
+                      file.c_str(), static_cast<size_t>(ptr - start));
+        char *p = ptr;
+        ptr += len32;
+        uint64_t argc, len;
+        p += load_len(p, &argc);
+        views.clear();
+        for (uint64_t i = 0; i < argc; i++) {
+            p += load_len(p, &len);
+            views.emplace_back(p, len);
+            p += len;
+        }
+        assign_argv(con.argv, con.argv_spare, views);
+        if (con.argv[0] == "PEXPIRE") {
+            to_relative(con.argv[2], now);
+        } else if (con.argv[0] == "SET") {
+            for (size_t i = 3; i + 1 < con.argv.size(); i++) {
+                if (con.argv[i] == "PX") {
+                    to_relative(con.argv[i+1], now);
+                    break;
+                }
+            }
+        }
+        replay(con);
     }
+    munmap(start, size);
 }
 
-// aof重写过程中使用，将重写的命令先追加到缓冲区中，
-// 然后在合适的时候flush到文件中
-void Aof::append(const std::string& s)
+// 重写期间的写命令记录在新的增量日志中，子进程只需要生成新的基础文件，
+// 然后把清单替换为<新的基础文件, 新的增量日志>
+void Aof::rewrite_background()
 {
-    buffer.append(s);
-    if (buffer.size() >= buffer_flush_size) {
-        flush();
+    // 先锁住所有分片，分片已经完成的写命令会写入旧的增量日志，
+    // 之后才切换日志，新的增量日志中只有fork之后的写命令
+    engine->lock();
+    uint64_t base_seq = ++manifest.seq;
+    open_incr();
+    rewrite_manifest.base = file_name(base_seq, "base.rdb");
+    rewrite_manifest.incrs = { manifest.incrs.back() };
+    rewrite_manifest.seq = manifest.seq;
+    child_pid = fork();
+    // logInfo("Background AOF rewrite started by pid %ld", _childPid);
+    if (child_pid == 0) {
+        engine->rdb->save(rewrite_manifest.base);
+        // 清单写入失败时不会被替换，父进程由此判断重写失败
+        if (!write_manifest(rewrite_manifest))
+            log_error("Can't write the rewritten append only file manifest");
+        done();
+        abort();
     }
+    engine->unlock();
 }
 
-void Aof::flush()
+// 子进程总是以abort()退出，根据清单判断重写是否成功
+void Aof::rewrite_done()
 {
-    fwrite(fd, buffer.data(), buffer.size());
-    buffer.clear();
+    done();
+    manifest_t m;
+    if (!read_manifest(m) || m.base != rewrite_manifest.base) {
+        log_error("Background AOF rewrite failed");
+        return;
+    }
+    if (!manifest.base.empty())
+        unlink(manifest.base.c_str());
+    for (auto& incr : manifest.incrs)
+        if (incr != rewrite_manifest.incrs.back())
+            unlink(incr.c_str());
+    manifest.base = m.base;
+    manifest.incrs = m.incrs;
+    last_rewrite_file_size = file_size(manifest.base);
+    cur_file_size = last_rewrite_file_size + get_filesize(fd) + buffer.size();
+    log_info("Background AOF rewrite finished successfully");
 }
 
 bool Aof::can_rewrite()
@@ -1,6 +1,11 @@
 #ifndef _ALICE_SRC_MMDB_AOF_H
 #define _ALICE_SRC_MMDB_AOF_H
 
+#include <atomic>
+#include <thread>
+
+#include "../task_queue.h"
+
 #include "mmdb.h"
 
 namespace alice {
@@ -9,47 +14,93 @@ namespace mmdb {
 
 class engine;
 
+// aof由多个文件组成，清单文件<appendonly-file>.manifest中按顺序记录了它们:
+// 一个rdb格式的基础文件和若干个二进制格式的增量日志，
+// 载入时先用rdb的方式载入基础文件，再依次重放各个增量日志
+//
+// 重写开始时先切换到一个新的增量日志，子进程只需要把数据库保存为新的基础文件，
+// 完成后清单中只剩下新的基础文件和新的增量日志，重写期间的写命令不需要再拷贝一次
+//
+// 主线程只把每一轮事件循环中产生的命令交给aof线程，由它批量地write()和fsync()，
+// appendfsync always时写命令的回复要等到它所在的批次被fsync之后才发送(组提交)
 class Aof {
 public:
-    using iterator = DB::iterator;
-
-    static const size_t buffer_flush_size = 4096;
     static const size_t rewrite_min_filesize = 16 * 1024 * 1024;
     static const size_t rewrite_rate = 2;
 
     explicit Aof(engine *engine);
+    ~Aof() { stop(); }
     pid_t get_child_pid() const { return child_pid; }
     void append(const argv_t& argv, const char *query, size_t len);
-    void append_rewrite_buffer(const argv_t& argv, const char *query, size_t len);
-    // void appendAof(int64_t now);
-    void fsync();
-    void fsync_rewrite_buffer();
+    // 将缓冲区中的命令交给aof线程
+    void flush();
+    // 由定时任务调用，没有新的命令时也让aof线程检查是否需要fsync
+    void server_cron();
+    // 写完所有的命令后停止aof线程
+    void stop();
+    // 写入或fsync失败后返回true，直到再次成功
+    bool failed() const
+    {
+        return write_failed.load(std::memory_order_acquire) ||
+               sync_failed.load(std::memory_order_acquire);
+    }
+    // 已经追加的命令的总字节数，用作组提交的序号
+    uint64_t appended_seq() const { return appended; }
+    // 是否有可以载入的aof文件
+    bool exists() const;
     void load();
     void rewrite_background();
     bool doing() const { return child_pid != -1; }
     void done() { child_pid = -1; }
+    // 重写的子进程退出后调用，成功时删除旧的文件
+    void rewrite_done();
     bool can_rewrite();
 private:
-    void append(const std::string& s);
-    void flush();
-    void rewrite();
-    void rewrite_select_db(int dbnum);
-    void rewrite_expire(const std::string& key, int64_t expire);
-    void rewrite_string(const iterator& it);
-    void rewrite_list(const iterator& it);
-    void rewrite_set(const iterator& it);
-    void rewrite_hash(const iterator& it);
-    void rewrite_zset(const iterator& it);
+    struct manifest_t {
+        std::string base;
+        std::vector<std::string> incrs;
+        uint64_t seq = 0; // 最近一次分配的文件序号
+    };
+    std::string manifest_file() const;
+    std::string file_name(uint64_t seq, const char *type) const;
+    bool read_manifest(manifest_t& m);
+    bool write_manifest(const manifest_t& m);
+    void open_incr();
+    void push_buffer();
+    void writer_loop();
+    void write_until_ok(int fd, std::string& data);
+    bool sync(int fd);
+    void synced(uint64_t seq);
+    void append_command(const argv_view_t& args);
+    void load_base(const std::string& file);
+    void load_resp(const std::string& file);
+    void load_incr(const std::string& file, bool last);
+    void replay(context_t& con);
 
     engine *engine;
     std::string buffer;
-    std::string rewrite_buffer;
     pid_t child_pid;
-    time_t last_sync_time;
-    size_t cur_file_size;
-    size_t last_rewrite_file_size;
-    char tmpfile[16];
-    int fd;
+    size_t cur_file_size; // 基础文件和增量日志的总大小
+    size_t last_rewrite_file_size; // 上一次重写后基础文件的大小
+    manifest_t manifest;
+    // 重写成功后的清单
+    manifest_t rewrite_manifest;
+    int fd; // 当前的增量日志，一直保持打开，由aof线程关闭
+    uint64_t appended = 0;
+    uint64_t flushed = 0; // 已经交给aof线程的序号
+    // 交给aof线程的一批命令，fd为-1时表示停止
+    struct chunk_t {
+        int fd = -1;
+        std::string data;
+        uint64_t seq = 0; // 写完这批命令后的appended
+    };
+    spsc_ring<chunk_t, 256> ring;
+    std::thread writer;
+    // 已经fsync的序号
+    std::atomic<uint64_t> durable = 0;
+    std::atomic<bool> notify_queued = false;
+    std::atomic<bool> write_failed = false;
+    std::atomic<bool> sync_failed = false;
 };
 }
 }
@@ -0,0 +1,474 @@
+#ifndef _ALICE_SRC_MMDB_DICT_H
+#define _ALICE_SRC_MMDB_DICT_H
+
+#include <string.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <new>
+
+#include <angel/util.h>
+#include <angel/logger.h>
+
+namespace alice {
+
+namespace mmdb {
+
+// 保存数据库中所有键的哈希表
+// 使用线性探测的开放寻址法，所有元素都保存在一块连续的内存中，不需要为每个元素单独分配节点，
+// 另外用一个控制字节数组记录每个槽位的状态(空、已删除或哈希值的低7位)，
+// 查找时只有控制字节匹配时才需要比较键
+//
+// 扩容和缩容都是渐进式的，新建一张表后由rehash_step()每次迁移一小部分元素，
+// 迁移期间查找会检查两张表，新元素总是插入到新表中
+// 元素只会在rehash_step()、rehash_ms()和插入时被移动，删除元素不会移动其他元素
+// 迁移期间新表快要被填满时，插入会顺带多迁移一些元素，保证迁移在新表被填满之前完成
+//
+// 控制字节的低6位是哈希值，第6位是标记位，新元素的标记位总是等于mark，
+// flip_mark()之后原有的元素都会变成stale()的，不fork的快照用它来区分还没有保存过的键
+template <typename V>
+class dict {
+public:
+    using key_type = std::string;
+    using mapped_type = V;
+    using value_type = std::pair<std::string, V>;
+    static constexpr size_t MIN_CAP = 16;
+
+    template <bool Const>
+    class basic_iterator {
+    public:
+        using dict_ptr = std::conditional_t<Const, const dict*, dict*>;
+        using reference = std::conditional_t<Const, const value_type&, value_type&>;
+        using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+        basic_iterator() = default;
+        basic_iterator(dict_ptr d, int t, size_t i) : d(d), t(t), i(i) {  }
+        // iterator可以隐式转换为const_iterator
+        template <bool C = Const, typename = std::enable_if_t<C>>
+        basic_iterator(const basic_iterator<false>& it) : d(it.d), t(it.t), i(it.i) {  }
+        reference operator*() const { return d->ht[t].slots[i]; }
+        pointer operator->() const { return &d->ht[t].slots[i]; }
+        basic_iterator& operator++()
+        {
+            i++;
+            settle();
+            return *this;
+        }
+        bool operator==(const basic_iterator& it) const { return t == it.t && i == it.i; }
+        bool operator!=(const basic_iterator& it) const { return !(*this == it); }
+    private:
+        friend class dict;
+        template <bool> friend class basic_iterator;
+        // 跳到下一个有元素的槽位，两张表都遍历完后停在end()
+        void settle()
+        {
+            for ( ; t < 2; t++, i = 0) {
+                auto& tb = d->ht[t];
+                for ( ; i < tb.cap; i++)
+                    if (is_full(tb.ctrl[i])) return;
+            }
+        }
+
+        dict_ptr d = nullptr;
+        int t = 2;
+        size_t i = 0;
+    };
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    dict() = default;
+    dict(const dict&) = delete;
+    dict& operator=(const dict&) = delete;
+    ~dict() { clear(); }
+
+    size_t size() const { return ht[0].used + ht[1].used; }
+    bool empty() const { return size() == 0; }
+    bool rehashing() const { return rehashidx != npos; }
+    // 两张表占用的内存
+    size_t bytes() const
+    {
+        return (ht[0].cap + ht[1].cap) * (sizeof(value_type) + 1);
+    }
+
+    iterator begin()
+    {
+        iterator it(this, 0, 0);
+        it.settle();
+        return it;
+    }
+    iterator end() { return iterator(this, 2, 0); }
+    const_iterator begin() const
+    {
+        const_iterator it(this, 0, 0);
+        it.settle();
+        return it;
+    }
+    const_iterator end() const { return const_iterator(this, 2, 0); }
+
+    iterator find(std::string_view key) { return find(key, hash(key)); }
+    const_iterator find(std::string_view key) const
+    {
+        return const_cast<dict*>(this)->find(key);
+    }
+    bool contains(std::string_view key) const { return find(key) != end(); }
+
+    // key已存在时不会覆盖它
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> emplace(K&& key, Args&&... args)
+    {
+        size_t h = hash(key);
+        auto it = find(key, h);
+        if (it != end()) return { it, false };
+        if (need_grow()) grow();
+        int t = rehashing() ? 1 : 0;
+        size_t i = insert_slot(ht[t], h, cur_mark);
+        new (&ht[t].slots[i]) value_type(std::piecewise_construct,
+                                         std::forward_as_tuple(std::forward<K>(key)),
+                                         std::forward_as_tuple(std::forward<Args>(args)...));
+        return { iterator(this, t, i), true };
+    }
+
+    template <typename K, typename T>
+    void insert_or_assign(K&& key, T&& value)
+    {
+        auto [it, inserted] = emplace(std::forward<K>(key), std::forward<T>(value));
+        if (!inserted) it->second = std::forward<T>(value);
+    }
+
+    void erase(iterator it)
+    {
+        auto& tb = ht[it.t];
+        tb.slots[it.i].~value_type();
+        mark_deleted(tb, it.i);
+    }
+    size_t erase(std::string_view key)
+    {
+        auto it = find(key);
+        if (it == end()) return 0;
+        erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        for (auto& tb : ht) {
+            for (size_t i = 0; i < tb.cap; i++)
+                if (is_full(tb.ctrl[i]))
+                    tb.slots[i].~value_type();
+            free_table(tb);
+        }
+        rehashidx = npos;
+        gen++;
+        table_gen++;
+    }
+
+    // 随机返回一个元素，表不可为空
+    // 先按两张表的元素个数选出一张表，再从表中一个随机的槽位开始向后找到第一个元素，
+    // 由于表的负载因子不会太低(见shrink())，所以只需要探测常数个槽位
+    iterator random()
+    {
+        int t = 0;
+        if (rehashing() && rand() % size() >= ht[0].used)
+            t = 1;
+        auto& tb = ht[t];
+        size_t mask = tb.cap - 1;
+        size_t i = rand() & mask;
+        // 旧表中rehashidx之前的元素都已经被迁移走了
+        if (t == 0 && rehashing())
+            i = rehashidx + rand() % (tb.cap - rehashidx);
+        for ( ; ; i = (i + 1) & mask)
+            if (is_full(tb.ctrl[i])) return iterator(this, t, i);
+    }
+
+    // 随机选出至多n个不同的元素追加到out中，每张表访问的槽位数不超过n*10，
+    // 所以选出的元素可能少于n个
+    // 元素是从随机的位置开始连续收集的，比调用n次random()更快，但随机性要差一些
+    void sample(size_t n, std::vector<iterator>& out)
+    {
+        if (n > size()) n = size();
+        size_t n0 = rehashing() ? n * ht[0].used / size() : n;
+        sample(0, n0, out);
+        sample(1, n - n0, out);
+    }
+
+    // 迁移旧表中的至多n个元素，为了避免在稀疏的表上耗费太多时间，最多只访问n*10个槽位
+    // 返回是否还需要继续迁移
+    bool rehash_step(size_t n)
+    {
+        if (!rehashing()) return false;
+        migrate(n, n * 10);
+        return rehashing();
+    }
+
+    // 在ms毫秒内尽可能多地迁移元素，返回是否还需要继续迁移
+    bool rehash_ms(int64_t ms)
+    {
+        auto start = angel::util::get_cur_time_ms();
+        while (rehash_step(100)) {
+            if (angel::util::get_cur_time_ms() - start >= ms)
+                return true;
+        }
+        return false;
+    }
+
+    // 元素是否是在上一次flip_mark()之前插入并且还没有被mark()过的
+    // 保存下来的迭代器指向的元素可能已经被删除了，这时返回false
+    bool stale(const_iterator it) const
+    {
+        unsigned char c = ht[it.t].ctrl[it.i];
+        return is_full(c) && (c & MARK) != cur_mark;
+    }
+    void mark(iterator it)
+    {
+        auto& c = ht[it.t].ctrl[it.i];
+        c = (c & ~MARK) | cur_mark;
+    }
+    void flip_mark() { cur_mark ^= MARK; }
+    // 每次移动元素时都会增加，迭代器在此期间可能已经失效
+    size_t generation() const { return gen; }
+    // 只在表被替换(迁移完成、重建或清空)时增加
+    size_t table_generation() const { return table_gen; }
+    // 迁移只会把元素从第一张表移到第二张表中，所以只要表没有被替换，
+    // 正在遍历第一张表的迭代器在元素移动之后仍然有效，也不会错过任何元素
+    static bool in_first_table(const_iterator it) { return it.t == 0; }
+
+    // 预先分配能容纳size() + n个元素的表，批量插入时避免反复扩容
+    void reserve(size_t n)
+    {
+        size_t cap = cap_for(size() + n);
+        if (rehashing() || cap > ht[0].cap)
+            rebuild(std::max(cap, ht[0].cap));
+    }
+    // 元素过少时开始缩容，负载因子不会低于1/8
+    void shrink()
+    {
+        if (rehashing() || ht[0].cap <= MIN_CAP) return;
+        if (ht[0].used * 8 < ht[0].cap && cap_for(ht[0].used) < ht[0].cap)
+            resize();
+    }
+private:
+    struct table {
+        unsigned char *ctrl = nullptr;
+        value_type *slots = nullptr;
+        size_t cap = 0; // 0或者2的幂
+        size_t used = 0;
+        size_t deleted = 0;
+    };
+    static constexpr size_t npos = -1;
+    static constexpr unsigned char EMPTY = 0x80;
+    static constexpr unsigned char DELETED = 0xfe;
+    static constexpr unsigned char MARK = 0x40;
+    static constexpr unsigned char HASH_MASK = 0x3f;
+
+    static bool is_full(unsigned char c) { return c < 0x80; }
+    static size_t hash(std::string_view key)
+    {
+        return std::hash<std::string_view>()(key);
+    }
+    static size_t rand()
+    {
+        static thread_local std::mt19937_64 e(std::random_device{}());
+        return e();
+    }
+    // 已删除的槽位也会拉长探测序列，所以一并计算在负载因子中，
+    // 迁移期间旧表中剩余的元素最终也会进入新表
+    bool need_grow() const
+    {
+        auto& tb = ht[rehashing() ? 1 : 0];
+        size_t n = tb.used + tb.deleted + 1;
+        if (rehashing()) n += ht[0].used;
+        return n * 8 > tb.cap * 7;
+    }
+    // 负载因子不超过1/2
+    static size_t cap_for(size_t n)
+    {
+        size_t cap = MIN_CAP;
+        while (cap < n * 2 + 2)
+            cap <<= 1;
+        return cap;
+    }
+
+    void sample(int t, size_t n, std::vector<iterator>& out)
+    {
+        auto& tb = ht[t];
+        if (n == 0 || tb.used == 0) return;
+        size_t mask = tb.cap - 1;
+        size_t i = rand() & mask;
+        if (t == 0 && rehashing())
+            i = rehashidx + rand() % (tb.cap - rehashidx);
+        size_t visits = std::min(n * 10, tb.cap);
+        for ( ; n > 0 && visits-- > 0; i = (i + 1) & mask) {
+            if (is_full(tb.ctrl[i])) {
+                out.emplace_back(this, t, i);
+                n--;
+            }
+        }
+    }
+    iterator find(std::string_view key, size_t h)
+    {
+        for (int t = 0; t < 2; t++) {
+            size_t i = find_slot(ht[t], key, h);
+            if (i != npos) return iterator(this, t, i);
+            if (!rehashing()) break;
+        }
+        return end();
+    }
+    size_t find_slot(const table& tb, std::string_view key, size_t h) const
+    {
+        if (tb.cap == 0) return npos;
+        size_t mask = tb.cap - 1;
+        unsigned char h2 = h & HASH_MASK;
+        size_t i = (h >> 7) & mask;
+        for (size_t n = 0; n < tb.cap; n++, i = (i + 1) & mask) {
+            if (tb.ctrl[i] == EMPTY) return npos;
+            // 忽略标记位，已删除的槽位的最高位是1，不会匹配
+            if ((tb.ctrl[i] & ~MARK) == h2 && tb.slots[i].first == key) return i;
+        }
+        return npos;
+    }
+    // 调用者需要保证键不在表中并且表中有空闲的槽位
+    size_t insert_slot(table& tb, size_t h, unsigned char mark)
+    {
+        size_t mask = tb.cap - 1;
+        size_t i = (h >> 7) & mask;
+        while (is_full(tb.ctrl[i]))
+            i = (i + 1) & mask;
+        if (tb.ctrl[i] == DELETED) tb.deleted--;
+        tb.ctrl[i] = (h & HASH_MASK) | mark;
+        tb.used++;
+        return i;
+    }
+    void mark_deleted(table& tb, size_t i)
+    {
+        size_t mask = tb.cap - 1;
+        tb.used--;
+        if (tb.ctrl[(i + 1) & mask] != EMPTY) {
+            tb.ctrl[i] = DELETED;
+            tb.deleted++;
+            return;
+        }
+        // 下一个槽位是空的，说明没有探测序列会经过这里，可以直接置空，
+        // 紧挨在前面的已删除槽位也是如此
+        tb.ctrl[i] = EMPTY;
+        for (i = (i - 1) & mask; tb.ctrl[i] == DELETED; i = (i - 1) & mask) {
+            tb.ctrl[i] = EMPTY;
+            tb.deleted--;
+        }
+    }
+    // 从rehashidx开始访问至多visits个槽位，迁移其中的至多n个元素
+    void migrate(size_t n, size_t visits)
+    {
+        auto& from = ht[0];
+        while (n > 0 && visits-- > 0 && rehashidx < from.cap) {
+            if (is_full(from.ctrl[rehashidx])) {
+                move_slot(rehashidx);
+                n--;
+            }
+            rehashidx++;
+        }
+        if (rehashidx == from.cap) {
+            rehashidx = npos;
+            free_table(ht[0]);
+            ht[0] = ht[1];
+            ht[1] = table();
+            gen++;
+            table_gen++;
+        }
+    }
+    void move_slot(size_t i)
+    {
+        auto& e = ht[0].slots[i];
+        size_t j = insert_slot(ht[1], hash(e.first), ht[0].ctrl[i] & MARK);
+        new (&ht[1].slots[j]) value_type(std::move(e));
+        e.~value_type();
+        mark_deleted(ht[0], i);
+        gen++;
+    }
+    void grow()
+    {
+        if (ht[0].cap == 0) {
+            alloc_table(ht[0], MIN_CAP);
+            return;
+        }
+        if (rehashing()) {
+            finish_rehash();
+            if (rehashing()) return;
+        }
+        if (need_grow())
+            resize();
+    }
+    // 迁移期间新表的负载因子超过7/8后，允许它继续增长到15/16，
+    // 每次插入按旧表剩余的槽位数和新表剩余的空间成比例地迁移，
+    // 这样在新表被填满之前就能迁移完，每次插入的工作量也是有上限的
+    void finish_rehash()
+    {
+        auto& to = ht[1];
+        size_t n = to.used + to.deleted + ht[0].used + 1;
+        size_t limit = to.cap - to.cap / 16;
+        if (n > limit) {
+            log_warn("dict rehash falls behind, rebuilding %zu keys at once", size());
+            rebuild(cap_for(size()));
+            return;
+        }
+        size_t left = ht[0].cap - rehashidx;
+        migrate(npos, left / (limit - n + 1) + 1);
+    }
+    // 已删除的槽位较多时可能会重建一张同样大小的表
+    void resize()
+    {
+        alloc_table(ht[1], cap_for(ht[0].used));
+        rehashidx = 0;
+    }
+    // 一次性将两张表中的元素都迁移到一张新表中
+    void rebuild(size_t cap)
+    {
+        table to;
+        alloc_table(to, cap);
+        for (auto& from : ht) {
+            for (size_t i = 0; i < from.cap; i++) {
+                if (!is_full(from.ctrl[i])) continue;
+                auto& e = from.slots[i];
+                size_t j = insert_slot(to, hash(e.first), from.ctrl[i] & MARK);
+                new (&to.slots[j]) value_type(std::move(e));
+                e.~value_type();
+            }
+            free_table(from);
+        }
+        ht[0] = to;
+        rehashidx = npos;
+        gen++;
+        table_gen++;
+    }
+    static void alloc_table(table& tb, size_t cap)
+    {
+        tb.ctrl = new unsigned char[cap];
+        memset(tb.ctrl, EMPTY, cap);
+        tb.slots = static_cast<value_type*>(::operator new(cap * sizeof(value_type)));
+        tb.cap = cap;
+        tb.used = tb.deleted = 0;
+    }
+    static void free_table(table& tb)
+    {
+        delete [] tb.ctrl;
+        ::operator delete(tb.slots);
+        tb = table();
+    }
+
+    table ht[2];
+    // 旧表中下一个要迁移的槽位，npos表示没有在迁移
+    size_t rehashidx = npos;
+    unsigned char cur_mark = 0;
+    size_t gen = 0;
+    size_t table_gen = 0;
+};
+
+}
+}
+
+#endif // _ALICE_SRC_MMDB_DICT_H
@@ -0,0 +1,628 @@
+#include <algorithm>
+
+#include "mmdb.h"
+
+#include "../config.h"
+
+namespace alice {
+
+namespace mmdb {
+
+static size_t max_value()
+{
+    return server_conf.mmdb_listpack_max_value;
+}
+
+// 配置中的元素个数已经检查过不是负数
+static size_t max_entries(int entries)
+{
+    return entries;
+}
+
+// List
+
+void List::check_convert(std::string_view s, size_t adds)
+{
+    if (!packed) return;
+    if (lp.size() + adds <= max_entries(server_conf.mmdb_list_max_listpack_entries) &&
+        s.size() <= max_value())
+        return;
+    for (size_t off = lp.begin(); off != lp.end(); off = lp.next(off))
+        list.emplace_back(lp.get(off));
+    lp.clear();
+    packed = false;
+}
+
+void List::push_front(std::string_view s)
+{
+    check_convert(s, 1);
+    packed ? lp.push_front(s) : void(list.emplace_front(s));
+}
+
+void List::push_back(std::string_view s)
+{
+    check_convert(s, 1);
+    packed ? lp.push_back(s) : void(list.emplace_back(s));
+}
+
+std::string List::front() const
+{
+    return packed ? std::string(lp.get(lp.begin())) : list.front();
+}
+
+std::string List::back() const
+{
+    return packed ? std::string(lp.get(lp.prev(lp.end()))) : list.back();
+}
+
+void List::pop_front()
+{
+    packed ? void(lp.erase(lp.begin())) : list.pop_front();
+}
+
+void List::pop_back()
+{
+    packed ? void(lp.erase(lp.prev(lp.end()))) : list.pop_back();
+}
+
+std::string List::at(size_t i) const
+{
+    if (packed) return std::string(lp.get(lp.index(i)));
+    return *std::next(list.begin(), i);
+}
+
+void List::set(size_t i, std::string_view s)
+{
+    check_convert(s, 0);
+    if (packed) lp.replace(lp.index(i), s);
+    else std::next(list.begin(), i)->assign(s);
+}
+
+size_t List::remove(std::string_view s, long count)
+{
+    size_t rems = 0;
+    size_t limit = count < 0 ? -count : count;
+    if (packed) {
+        if (count >= 0) {
+            for (size_t off = lp.begin(); off != lp.end(); ) {
+                if (lp.get(off) == s) {
+                    off = lp.erase(off);
+                    if (++rems == limit) break;
+                } else
+                    off = lp.next(off);
+            }
+        } else {
+            for (size_t off = lp.end(); off != lp.begin(); ) {
+                off = lp.prev(off);
+                if (lp.get(off) == s) {
+                    lp.erase(off);
+                    if (++rems == limit) break;
+                }
+            }
+        }
+    } else {
+        if (count >= 0) {
+            for (auto it = list.begin(); it != list.end(); ) {
+                if (*it == s) {
+                    it = list.erase(it);
+                    if (++rems == limit) break;
+                } else
+                    ++it;
+            }
+        } else {
+            for (auto it = list.end(); it != list.begin(); ) {
+                if (*--it == s) {
+                    it = list.erase(it);
+                    if (++rems == limit) break;
+                }
+            }
+        }
+    }
+    return rems;
+}
+
+void List::trim(size_t start, size_t stop)
+{
+    size_t size = this->size();
+    if (packed) {
+        lp.erase(lp.index(stop + 1), lp.end(), size - stop - 1);
+        lp.erase(lp.begin(), lp.index(start), start);
+    } else {
+        list.erase(std::next(list.begin(), stop + 1), list.end());
+        list.erase(list.begin(), std::next(list.begin(), start));
+    }
+}
+
+void List::clear()
+{
+    lp.clear();
+    list.clear();
+    packed = true;
+}
+
+// Hash
+
+bool Hash::can_pack(std::string_view field, std::string_view value, size_t adds) const
+{
+    return size() + adds <= max_entries(server_conf.mmdb_hash_max_listpack_entries) &&
+           field.size() <= max_value() && value.size() <= max_value();
+}
+
+void Hash::convert()
+{
+    for (size_t off = lp.begin(); off != lp.end(); ) {
+        size_t voff = lp.next(off);
+        dict.emplace(lp.get(off), lp.get(voff));
+        off = lp.next(voff);
+    }
+    lp.clear();
+    packed = false;
+}
+
+std::optional<std::string_view> Hash::get(std::string_view field) const
+{
+    if (packed) {
+        size_t off = lp.find(field, 2);
+        if (off == lp.end()) return std::nullopt;
+        return lp.get(lp.next(off));
+    }
+    auto it = dict.find(field);
+    if (it == dict.end()) return std::nullopt;
+    return it->second;
+}
+
+bool Hash::insert(std::string_view field, std::string_view value)
+{
+    if (contains(field)) return false;
+    if (packed && !can_pack(field, value, 1)) convert();
+    if (packed) {
+        lp.push_back(field);
+        lp.push_back(value);
+    } else {
+        dict.emplace(field, value);
+    }
+    return true;
+}
+
+void Hash::set(std::string_view field, std::string_view value)
+{
+    if (packed) {
+        size_t off = lp.find(field, 2);
+        if (off != lp.end()) {
+            if (value.size() <= max_value()) {
+                lp.replace(lp.next(off), value);
+                return;
+            }
+            convert();
+        } else if (can_pack(field, value, 1)) {
+            lp.push_back(field);
+            lp.push_back(value);
+            return;
+        } else {
+            convert();
+        }
+    }
+    auto it = dict.find(field);
+    if (it != dict.end()) it->second.assign(value);
+    else dict.emplace(field, value);
+}
+
+bool Hash::erase(std::string_view field)
+{
+    if (packed) {
+        size_t off = lp.find(field, 2);
+        if (off == lp.end()) return false;
+        lp.erase(off);
+        lp.erase(off);
+        return true;
+    }
+    auto it = dict.find(field);
+    if (it == dict.end()) return false;
+    dict.erase(it);
+    return true;
+}
+
+// Set
+
+// s能否无损地转换为整数，只有这样的整数才能放进intset或编码为INT
+static bool string_to_int(std::string_view s, int64_t& v)
+{
+    if (s.empty() || s.size() > 20) return false;
+    if (s[0] == '0' && s.size() > 1) return false;
+    if (s[0] == '-' && (s.size() == 1 || s[1] == '0')) return false;
+    auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+const char *Set::encoding() const
+{
+    switch (enc) {
+    case INTSET: return "intset";
+    case LISTPACK: return "listpack";
+    default: return "hashtable";
+    }
+}
+
+bool Set::contains(std::string_view member) const
+{
+    int64_t v;
+    switch (enc) {
+    case INTSET:
+        return string_to_int(member, v) && std::binary_search(ints.begin(), ints.end(), v);
+    case LISTPACK:
+        return lp.find(member) != lp.end();
+    default:
+        return set.find(member) != set.end();
+    }
+}
+
+bool Set::insert(std::string_view member)
+{
+    if (contains(member)) return false;
+    size_t size = this->size();
+    bool small = size + 1 <= max_entries(server_conf.mmdb_set_max_listpack_entries) &&
+                 member.size() <= max_value();
+    if (enc == INTSET) {
+        int64_t v;
+        if (string_to_int(member, v) &&
+                size + 1 <= max_entries(server_conf.mmdb_set_max_intset_entries)) {
+            ints.insert(std::upper_bound(ints.begin(), ints.end(), v), v);
+            return true;
+        }
+        convert(small ? LISTPACK : HASHTABLE);
+    } else if (enc == LISTPACK && !small) {
+        convert(HASHTABLE);
+    }
+    if (enc == LISTPACK) lp.push_back(member);
+    else set.emplace(member);
+    return true;
+}
+
+bool Set::erase(std::string_view member)
+{
+    switch (enc) {
+    case INTSET: {
+        int64_t v;
+        if (!string_to_int(member, v)) return false;
+        auto it = std::lower_bound(ints.begin(), ints.end(), v);
+        if (it == ints.end() || *it != v) return false;
+        ints.erase(it);
+        return true;
+    }
+    case LISTPACK: {
+        size_t off = lp.find(member);
+        if (off == lp.end()) return false;
+        lp.erase(off);
+        return true;
+    }
+    default: {
+        auto it = set.find(member);
+        if (it == set.end()) return false;
+        set.erase(it);
+        return true;
+    }
+    }
+}
+
+std::string Set::random_member() const
+{
+    thread_local std::default_random_engine e(clock());
+    if (enc == HASHTABLE) {
+        auto [bucket, where] = get_rand_hash_key(set);
+        auto it = set.cbegin(bucket);
+        std::advance(it, where);
+        return *it;
+    }
+    std::uniform_int_distribution<size_t> u(0, size() - 1);
+    if (enc == INTSET) return i2s(ints[u(e)]);
+    return std::string(lp.get(lp.index(u(e))));
+}
+
+void Set::convert(Encoding to)
+{
+    if (to == LISTPACK) {
+        for (auto i : ints) lp.push_back(i2s(i));
+    } else {
+        for_each([this](std::string_view member){ set.emplace(member); });
+        lp.clear();
+    }
+    ints.clear();
+    ints.shrink_to_fit();
+    enc = to;
+}
+
+// Zset
+
+static std::string_view pack_score(const double& score)
+{
+    return std::string_view(reinterpret_cast<const char*>(&score), sizeof(score));
+}
+
+static double unpack_score(std::string_view s)
+{
+    double score;
+    memcpy(&score, s.data(), sizeof(score));
+    return score;
+}
+
+double Zset::iterator::score() const
+{
+    if (lp) return unpack_score(lp->get(lp->next(off)));
+    return zsl_t::iterator(sit)->first.score;
+}
+
+std::string_view Zset::iterator::member() const
+{
+    if (lp) return lp->get(off);
+    return zsl_t::iterator(sit)->first.member;
+}
+
+Zset::iterator& Zset::iterator::operator++()
+{
+    if (lp) {
+        off = lp->next(lp->next(off));
+        idx++;
+    } else {
+        ++sit;
+    }
+    return *this;
+}
+
+Zset::iterator& Zset::iterator::operator--()
+{
+    if (lp) {
+        off = lp->prev(lp->prev(off));
+        idx--;
+    } else {
+        --sit;
+    }
+    return *this;
+}
+
+Zset::iterator Zset::make_iterator(size_t off, size_t idx) const
+{
+    iterator it;
+    it.lp = &lp;
+    it.off = off;
+    it.idx = idx;
+    return it;
+}
+
+Zset::iterator Zset::make_iterator(zsl_t::iterator sit) const
+{
+    iterator it;
+    it.sit = sit;
+    return it;
+}
+
+Zset::iterator Zset::begin()
+{
+    return packed ? make_iterator(lp.begin(), 0) : make_iterator(zsl.begin());
+}
+
+Zset::iterator Zset::end()
+{
+    return packed ? make_iterator(lp.end(), size()) : make_iterator(zsl.end());
+}
+
+void Zset::check_convert(std::string_view member)
+{
+    if (!packed) return;
+    if (size() + 1 <= max_entries(server_conf.mmdb_zset_max_listpack_entries) &&
+        member.size() <= max_value())
+        return;
+    for (auto it = begin(); it != end(); ++it) {
+        zsl.insert(zslkey(it.score(), it.member()), false);
+        zmap.emplace(it.member(), it.score());
+    }
+    lp.clear();
+    packed = false;
+}
+
+std::optional<double> Zset::score(std::string_view member) const
+{
+    if (packed) {
+        size_t off = lp.find(member, 2);
+        if (off == lp.end()) return std::nullopt;
+        return unpack_score(lp.get(lp.next(off)));
+    }
+    auto it = zmap.find(member);
+    if (it == zmap.end()) return std::nullopt;
+    return it->second;
+}
+
+void Zset::insert(double score, std::string_view member)
+{
+    check_convert(member);
+    if (packed) {
+        auto it = begin();
+        while (it != end() && (it.score() < score ||
+                    (it.score() == score && it.member() < member)))
+            ++it;
+        size_t off = lp.insert(it.off, member);
+        lp.insert(lp.next(off), pack_score(score));
+    } else {
+        zsl.insert(zslkey(score, member), false);
+        zmap.insert_or_assign(std::string(member), score);
+    }
+}
+
+void Zset::erase(double score, std::string_view member)
+{
+    if (packed) {
+        size_t off = lp.find(member, 2);
+        if (off == lp.end()) return;
+        lp.erase(off);
+        lp.erase(off);
+    } else {
+        // member可能指向被删除的节点，所以要先拷贝一份
+        zslkey key(score, member);
+        zsl.erase(key);
+        auto it = zmap.find(key.member);
+        if (it != zmap.end()) zmap.erase(it);
+    }
+}
+
+size_t Zset::erase(iterator first, iterator last)
+{
+    if (packed) {
+        size_t n = last.idx - first.idx;
+        lp.erase(first.off, last.off, n * 2);
+        return n;
+    }
+    size_t n = 0;
+    while (first != last) {
+        auto e = first;
+        ++first;
+        erase(e.score(), e.member());
+        n++;
+    }
+    return n;
+}
+
+size_t Zset::order_of_key(double score, std::string_view member)
+{
+    if (packed) {
+        for (auto it = begin(); it != end(); ++it)
+            if (it.member() == member)
+                return it.idx + 1;
+        return 0;
+    }
+    return zsl.order_of_key(zslkey(score, member));
+}
+
+size_t Zset::diff_range(iterator it, iterator last)
+{
+    if (packed) return last.idx - it.idx;
+    auto l = order_of_key(it.score(), it.member());
+    if (last == end()) return zsl.size() - l + 1;
+    return order_of_key(last.score(), last.member()) - l;
+}
+
+Zset::iterator Zset::lower_bound(double score)
+{
+    if (packed) {
+        auto it = begin();
+        while (it != end() && it.score() < score)
+            ++it;
+        return it;
+    }
+    return make_iterator(zsl.lower_bound(zslkey(score, "")));
+}
+
+// 与skiplist::upper_bound()保持一致: 返回lower_bound()的下一个位置
+Zset::iterator Zset::upper_bound(double score)
+{
+    if (packed) {
+        auto it = lower_bound(score);
+        if (it != end()) ++it;
+        return it;
+    }
+    return make_iterator(zsl.upper_bound(zslkey(score, "")));
+}
+
+// Value
+
+Value::Value(std::string&& s) : type_(STRING), lru_(lru_now())
+{
+    int64_t v;
+    if (s.size() <= EMBSTR_MAX || string_to_int(s, v)) {
+        set_string(s);
+    } else {
+        enc_ = RAW;
+        u.raw = new std::string(std::move(s));
+    }
+}
+
+Value::Value(const Value& v)
+    : type_(v.type_), enc_(v.enc_), lru_(v.lru_), len_(v.len_), u(v.u)
+{
+    switch (type_) {
+    case STRING:
+        if (enc_ == RAW) u.raw = new std::string(*v.u.raw);
+        break;
+    case LIST: u.list = new List(*v.u.list); break;
+    case SET: u.set = new Set(*v.u.set); break;
+    case ZSET: u.zset = new Zset(*v.u.zset); break;
+    case HASH: u.hash = new Hash(*v.u.hash); break;
+    }
+}
+
+void Value::destroy()
+{
+    switch (type_) {
+    case STRING:
+        if (enc_ == RAW) delete u.raw;
+        break;
+    case LIST: delete u.list; break;
+    case SET: delete u.set; break;
+    case ZSET: delete u.zset; break;
+    case HASH: delete u.hash; break;
+    }
+}
+
+void Value::set_string(std::string_view s)
+{
+    if (string_to_int(s, u.ival)) {
+        enc_ = INT;
+    } else if (s.size() <= EMBSTR_MAX) {
+        enc_ = EMBSTR;
+        len_ = s.size();
+        memcpy(u.buf, s.data(), s.size());
+    } else {
+        enc_ = RAW;
+        u.raw = new std::string(s);
+    }
+}
+
+const char *Value::encoding() const
+{
+    switch (type_) {
+    case STRING:
+        if (enc_ == INT) return "int";
+        return enc_ == EMBSTR ? "embstr" : "raw";
+    case LIST: return u.list->encoding();
+    case SET: return u.set->encoding();
+    case ZSET: return u.zset->encoding();
+    default: return u.hash->encoding();
+    }
+}
+
+std::string_view Value::str(char (&buf)[32]) const
+{
+    switch (enc_) {
+    case INT: {
+        auto r = std::to_chars(buf, buf + sizeof(buf), u.ival);
+        return std::string_view(buf, r.ptr - buf);
+    }
+    case EMBSTR:
+        return std::string_view(u.buf, len_);
+    default:
+        return *u.raw;
+    }
+}
+
+std::string& Value::raw_string()
+{
+    if (enc_ != RAW) {
+        char buf[32];
+        auto raw = new std::string(str(buf));
+        enc_ = RAW;
+        u.raw = raw;
+    }
+    return *u.raw;
+}
+
+bool Value::get_integer(int64_t& v) const
+{
+    if (enc_ == INT) {
+        v = u.ival;
+        return true;
+    }
+    char buf[32];
+    v = str2ll(std::string(str(buf)));
+    return !str2numerr();
+}
+
+}
+}
@@ -0,0 +1,273 @@
+#ifndef _ALICE_SRC_MMDB_ENCODING_H
+#define _ALICE_SRC_MMDB_ENCODING_H
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <functional>
+#include <charconv>
+
+#include "../skiplist.h"
+#include "../util.h"
+#include "listpack.h"
+
+// 列表、哈希表、集合和有序集合对象在元素较少且较短时使用紧凑编码，
+// 超过mmdb-*-max-listpack-entries或mmdb-listpack-max-value后
+// 会被转换为普通编码，并且不会再转换回去
+
+namespace alice {
+
+namespace mmdb {
+
+// 可以直接用string_view查找std::string
+struct sv_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const
+    {
+        return std::hash<std::string_view>()(s);
+    }
+};
+
+// 编码: listpack -> linkedlist
+class List {
+public:
+    using list_t = std::list<std::string>;
+    bool empty() const { return size() == 0; }
+    size_t size() const { return packed ? lp.size() : list.size(); }
+    const char *encoding() const { return packed ? "listpack" : "linkedlist"; }
+    void push_front(std::string_view s);
+    void push_back(std::string_view s);
+    std::string front() const;
+    std::string back() const;
+    void pop_front();
+    void pop_back();
+    // i必须位于[0, size())中
+    std::string at(size_t i) const;
+    void set(size_t i, std::string_view s);
+    // 删除count个等于s的元素，count < 0时从表尾开始删除，为0时删除所有
+    // 返回删除的元素个数
+    size_t remove(std::string_view s, long count);
+    // 只保留[start, stop]之间的元素
+    void trim(size_t start, size_t stop);
+    void clear();
+    template <typename F>
+    void for_each(F f) const
+    {
+        if (packed) {
+            for (size_t off = lp.begin(); off != lp.end(); off = lp.next(off))
+                f(lp.get(off));
+        } else {
+            for (auto& it : list) f(it);
+        }
+    }
+    // 对[start, stop]之间的元素调用f
+    template <typename F>
+    void range(size_t start, size_t stop, F f) const
+    {
+        if (packed) {
+            size_t off = lp.index(start);
+            for (size_t i = start; i <= stop; i++, off = lp.next(off))
+                f(lp.get(off));
+        } else {
+            auto it = std::next(list.begin(), start);
+            for (size_t i = start; i <= stop; i++, ++it)
+                f(*it);
+        }
+    }
+private:
+    void check_convert(std::string_view s, size_t adds);
+
+    bool packed = true;
+    listpack lp;
+    list_t list;
+};
+
+// 编码: listpack -> hashtable
+// listpack中field和value交替存放
+class Hash {
+public:
+    using dict_t = std::unordered_map<std::string, std::string, sv_hash, std::equal_to<>>;
+    bool empty() const { return size() == 0; }
+    size_t size() const { return packed ? lp.size() / 2 : dict.size(); }
+    const char *encoding() const { return packed ? "listpack" : "hashtable"; }
+    bool contains(std::string_view field) const { return get(field).has_value(); }
+    // 返回的string_view在下一次修改哈希表之前有效
+    std::optional<std::string_view> get(std::string_view field) const;
+    // field已存在时不会覆盖它，返回是否插入成功
+    bool insert(std::string_view field, std::string_view value);
+    // field已存在时会覆盖它
+    void set(std::string_view field, std::string_view value);
+    bool erase(std::string_view field);
+    template <typename F>
+    void for_each(F f) const
+    {
+        if (packed) {
+            for (size_t off = lp.begin(); off != lp.end(); ) {
+                size_t voff = lp.next(off);
+                f(lp.get(off), lp.get(voff));
+                off = lp.next(voff);
+            }
+        } else {
+            for (auto& [field, value] : dict) f(field, value);
+        }
+    }
+private:
+    bool can_pack(std::string_view field, std::string_view value, size_t adds) const;
+    void convert();
+
+    bool packed = true;
+    listpack lp;
+    dict_t dict;
+};
+
+// 编码: intset -> listpack -> hashtable
+// intset是一个有序的整数数组，只有所有成员都是整数时才会使用它
+class Set {
+public:
+    using set_t = std::unordered_set<std::string, sv_hash, std::equal_to<>>;
+    enum Encoding { INTSET, LISTPACK, HASHTABLE };
+    bool empty() const { return size() == 0; }
+    size_t size() const
+    {
+        switch (enc) {
+        case INTSET: return ints.size();
+        case LISTPACK: return lp.size();
+        default: return set.size();
+        }
+    }
+    const char *encoding() const;
+    bool contains(std::string_view member) const;
+    bool insert(std::string_view member);
+    bool erase(std::string_view member);
+    // 集合不可为空
+    std::string random_member() const;
+    template <typename F>
+    void for_each(F f) const
+    {
+        switch (enc) {
+        case INTSET:
+            // 不能使用i2s()，f()中可能还会用到它的缓冲区
+            for (auto i : ints) {
+                char buf[32];
+                auto r = std::to_chars(buf, buf + sizeof(buf), i);
+                f(std::string_view(buf, r.ptr - buf));
+            }
+            break;
+        case LISTPACK:
+            for (size_t off = lp.begin(); off != lp.end(); off = lp.next(off))
+                f(lp.get(off));
+            break;
+        default:
+            for (auto& it : set) f(it);
+            break;
+        }
+    }
+private:
+    void convert(Encoding to);
+
+    Encoding enc = INTSET;
+    std::vector<int64_t> ints;
+    listpack lp;
+    set_t set;
+};
+
+struct zslkey {
+    zslkey() {  }
+    zslkey(double score, std::string_view member)
+        : score(score), member(member) {  }
+    double score;
+    std::string member;
+};
+
+// 对于对象l和r，如果l.score < r.score，就认为l < r
+// 否则如果l.score == r.score，就继续比较键值，如果l.member < r.member，
+// 就认为l < r，否则就认为l >= r
+class zslkeycmp {
+public:
+    bool operator()(const zslkey& lhs, const zslkey& rhs) const
+    {
+        if (lhs.score < rhs.score) {
+            return true;
+        } else if (lhs.score == rhs.score) {
+            if (lhs.member.compare(rhs.member) < 0)
+                return true;
+        }
+        return false;
+    }
+};
+
+// 编码: listpack -> skiplist
+// listpack中member和score(8字节的double)交替存放，并按(score, member)排序
+class Zset {
+public:
+    using zsl_t = skiplist<zslkey, bool, zslkeycmp>;
+    using zmap_t = std::unordered_map<std::string, double, sv_hash, std::equal_to<>>;
+    class iterator {
+    public:
+        iterator() = default;
+        double score() const;
+        std::string_view member() const;
+        iterator& operator++();
+        iterator& operator--();
+        bool operator==(const iterator& it) const
+        {
+            return lp ? off == it.off : zsl_t::iterator(sit) == it.sit;
+        }
+        bool operator!=(const iterator& it) const { return !(*this == it); }
+    private:
+        friend class Zset;
+        const listpack *lp = nullptr;
+        size_t off = 0;
+        size_t idx = 0; // 在listpack中的排名，用于常数时间计算diff_range()
+        zsl_t::iterator sit;
+    };
+    bool empty() const { return size() == 0; }
+    size_t size() const { return packed ? lp.size() / 2 : zmap.size(); }
+    const char *encoding() const { return packed ? "listpack" : "skiplist"; }
+    std::optional<double> score(std::string_view member) const;
+    // member必须不存在
+    void insert(double score, std::string_view member);
+    void erase(double score, std::string_view member);
+    // 删除[first, last)之间的元素，返回删除的个数
+    size_t erase(iterator first, iterator last);
+    // 返回(score, member)的排名，从1开始
+    size_t order_of_key(double score, std::string_view member);
+    size_t diff_range(iterator it, iterator last);
+    iterator begin();
+    iterator end();
+    iterator lower_bound(double score);
+    iterator upper_bound(double score);
+    double min_score() { return begin().score(); }
+    double max_score() { return (--end()).score(); }
+    template <typename F>
+    void for_each(F f) const
+    {
+        if (packed) {
+            auto it = const_cast<Zset*>(this)->begin();
+            for (size_t i = 0; i < lp.size() / 2; i++, ++it)
+                f(it.member(), it.score());
+        } else {
+            for (auto& [member, score] : zmap) f(member, score);
+        }
+    }
+private:
+    void check_convert(std::string_view member);
+    iterator make_iterator(size_t off, size_t idx) const;
+    iterator make_iterator(zsl_t::iterator it) const;
+
+    bool packed = true;
+    listpack lp;
+    // value(bool)不作使用
+    zsl_t zsl;
+    // 根据一个member可以在常数时间找到其score
+    zmap_t zmap;
+};
+
+}
+}
+
+#endif // _ALICE_SRC_MMDB_ENCODING_H
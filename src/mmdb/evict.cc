@@ -1,6 +1,7 @@
 #include <unistd.h>
 
 #include "mmdb.h"
+#include "rdb.h"
 
 #include "../server.h"
 
@@ -11,6 +12,8 @@ namespace mmdb {
 void engine::free_memory_if_needed()
 {
     if (server_conf.mmdb_maxmemory == 0) return;
+    // 分片模式下由执行写命令的分片从自己的数据库中淘汰
+    if (is_sharded() && !shard_db) return;
     auto memory_size = get_proc_memory();
     if (memory_size < 0) {
         log_error("get_proc_memory error: %s", angel::util::strerrno());
@@ -33,117 +36,85 @@ void engine::free_memory_if_needed()
 // 真正的lru算法需要一个双端链表来保存维护所有键的lru关系，这需要额外的内存，
 // 所以我们这里只是近似模拟一下lru算法
 // 我们从当前操作的数据库中随机选出server_conf.mmdb_maxmemory_samples个键，
-// 剔除掉其中lru值最大的，即相对来说最近没有被使用的
+// 剔除掉其中空闲时间最长的，即相对来说最近没有被使用的
 // 显然mmdb_maxmemory_samples越大，就越接近真正的lru算法，但相对的会有一定的性能
 // 损失，所以需要在这两者之间达到一定的平衡
 void engine::evict_all_keys_with_lru()
 {
-    int64_t lastlru = 0;
-    int evict[2] = { -1 };
+    int64_t maxidle = -1;
     auto& dict = db()->get_dict();
-    for (int i = 0; i < server_conf.mmdb_maxmemory_samples; i++) {
-        auto randkey = get_rand_hash_key(dict);
-        auto bucket = std::get<0>(randkey);
-        auto where = std::get<1>(randkey);
-        auto j = where;
-        for (auto it = dict.cbegin(bucket); it != dict.end(bucket); ++it) {
-            if (j-- == 0) {
-                if (it->second.lru > lastlru) {
-                    lastlru = it->second.lru;
-                    evict[0] = bucket;
-                    evict[1] = where;
-                    break;
-                }
-            }
+    if (dict.empty()) return;
+    std::vector<DB::iterator> samples;
+    dict.sample(server_conf.mmdb_maxmemory_samples, samples);
+    if (samples.empty()) return;
+    auto evict = samples[0];
+    for (auto& it : samples) {
+        if (it->second.idle_time() > maxidle) {
+            maxidle = it->second.idle_time();
+            evict = it;
         }
     }
-    if (evict[0] == -1) return;
-    evict_key(dict, evict);
+    evict_key(evict->first);
 }
 
 void engine::evict_volatile_with_lru()
 {
-    int64_t lastlru = 0;
-    int evict[2] = { -1 };
-    auto& dict = db()->get_expire_keys();
-    for (int i = 0; i < server_conf.mmdb_maxmemory_samples; i++) {
-        auto randkey = get_rand_hash_key(dict);
-        auto bucket = std::get<0>(randkey);
-        auto where = std::get<1>(randkey);
-        auto j = where;
-        for (auto it = dict.cbegin(bucket); it != dict.end(bucket); ++it) {
-            if (j-- == 0) {
-                auto e = db()->get_dict().find(it->first);
-                if (e->second.lru > lastlru) {
-                    lastlru = e->second.lru;
-                    evict[0] = bucket;
-                    evict[1] = where;
-                    break;
-                }
-            }
+    int64_t maxidle = -1;
+    auto& dict = db()->get_dict();
+    auto& expire_keys = db()->get_expire_keys();
+    if (expire_keys.empty()) return;
+    std::vector<DB::expire_keys_t::iterator> samples;
+    expire_keys.sample(server_conf.mmdb_maxmemory_samples, samples);
+    auto evict = dict.end();
+    for (auto& it : samples) {
+        auto e = dict.find(it->first);
+        if (e == dict.end()) continue;
+        if (e->second.idle_time() > maxidle) {
+            maxidle = e->second.idle_time();
+            evict = e;
         }
     }
-    if (evict[0] == -1) return;
-    evict_key(dict, evict);
+    if (evict == dict.end()) return;
+    evict_key(evict->first);
 }
 
 void engine::evict_all_keys_with_random()
 {
-    int evict[2];
     auto& dict = db()->get_dict();
-    auto randkey = get_rand_hash_key(dict);
-    evict[0] = std::get<0>(randkey);
-    evict[1] = std::get<1>(randkey);
-    evict_key(dict, evict);
+    if (dict.empty()) return;
+    evict_key(dict.random()->first);
 }
 
 void engine::evict_volatile_with_random()
 {
-    auto& dict = db()->get_expire_keys();
-    auto randkey = get_rand_hash_key(dict);
-    auto bucket = std::get<0>(randkey);
-    auto where = std::get<1>(randkey);
-    for (auto it = dict.cbegin(bucket); it != dict.end(bucket); ++it) {
-        if (where-- == 0) {
-            auto e = db()->get_dict().find(it->first);
-            evict_key(e->first);
-            break;
-        }
-    }
+    auto& expire_keys = db()->get_expire_keys();
+    if (expire_keys.empty()) return;
+    evict_key(expire_keys.random()->first);
 }
 
-// 从当前操作的数据库的expireMap中随机选出server_conf.mmdb_maxmemory_samples个键,
-// 剔除掉其中ttl值最小的，即存活时间最短的
+// 从当前操作的数据库的expire_keys中随机选出server_conf.mmdb_maxmemory_samples个键,
+// 剔除掉其中到期时间最早的，即剩余存活时间最短的
 void engine::evict_volatile_with_ttl()
 {
-    int64_t ttl = 0;
-    int evict[2] = { -1 };
-    auto& dict = db()->get_expire_keys();
-    for (int i = 0; i < server_conf.mmdb_maxmemory_samples; i++) {
-        auto randkey = get_rand_hash_key(dict);
-        auto bucket = std::get<0>(randkey);
-        auto where = std::get<1>(randkey);
-        auto j = where;
-        for (auto it = dict.cbegin(bucket); it != dict.end(bucket); ++it) {
-            if (j-- == 0) {
-                if (it->second < ttl) {
-                    ttl = it->second;
-                    evict[0] = bucket;
-                    evict[1] = where;
-                    break;
-                }
-            }
-        }
+    auto& expire_keys = db()->get_expire_keys();
+    if (expire_keys.empty()) return;
+    std::vector<DB::expire_keys_t::iterator> samples;
+    expire_keys.sample(server_conf.mmdb_maxmemory_samples, samples);
+    if (samples.empty()) return;
+    auto evict = samples[0];
+    for (auto& it : samples) {
+        if (it->second < evict->second)
+            evict = it;
     }
-    if (evict[0] == -1) return;
-    evict_key(dict, evict);
+    evict_key(evict->first);
 }
 
 void engine::evict_key(const std::string& key)
 {
     argv_t cl = { "DEL", key };
+    rdb->before_modify(db(), key);
     db()->del_key_with_expire(key);
-    __server->append_write_command(cl, nullptr, 0);
+    propagate(cl);
 }
 
 }
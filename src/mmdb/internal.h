@@ -7,7 +7,7 @@
 
 // type(it) is DB::iterator
 #define is_type(it, _type) \
-    ((it)->second.value.type() == typeid(_type))
+    ((it)->second.type() == type_of<_type>())
 
 // type(con) is context_t
 // type(it) is DB::iterator
@@ -18,17 +18,13 @@
             (con).append(shared.type_err); \
             return; \
         } \
-        (it)->second.lru = lru_clock; \
+        (it)->second.touch(); \
     } while (0)
 
 // type(it) is DB::iterator
-#define get_value(it, _type) \
-    (std::any_cast<_type>((it)->second.value))
-
-#define get_string_value(it) get_value(it, DB::String&)
-#define get_list_value(it)   get_value(it, DB::List&)
-#define get_hash_value(it)   get_value(it, DB::Hash&)
-#define get_set_value(it)    get_value(it, DB::Set&)
-#define get_zset_value(it)   get_value(it, Zset&)
+#define get_list_value(it)   ((it)->second.list())
+#define get_hash_value(it)   ((it)->second.hash())
+#define get_set_value(it)    ((it)->second.set())
+#define get_zset_value(it)   ((it)->second.zset())
 
 #endif // _ALICE_SRC_MMDB_INTERNAL_H
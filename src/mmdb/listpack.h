@@ -0,0 +1,147 @@
+#ifndef _ALICE_SRC_MMDB_LISTPACK_H
+#define _ALICE_SRC_MMDB_LISTPACK_H
+
+#include <string.h>
+
+#include <string>
+#include <string_view>
+
+namespace alice {
+
+namespace mmdb {
+
+// 紧凑列表，所有元素依次存放在一块连续的内存中，用于编码较小的集合对象
+// 每个元素的布局为 <len><data><backlen>
+// len为data的长度，backlen为<len><data>的长度，用于反向遍历
+// 两者小于128时只占1个字节，否则占5个字节:
+// len为0x80 + 4字节长度，backlen为4字节长度 + 0x80
+// 元素用它在缓冲区中的偏移量表示，end()表示最后一个元素之后的位置
+class listpack {
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t bytes() const { return buf.capacity(); }
+    size_t begin() const { return 0; }
+    size_t end() const { return buf.size(); }
+    size_t next(size_t off) const
+    {
+        size_t len = header_len(off) + data_len(off);
+        return off + len + (len < 0x80 ? 1 : 5);
+    }
+    size_t prev(size_t off) const
+    {
+        auto p = data() + off;
+        if (p[-1] < 0x80) return off - 1 - p[-1];
+        return off - 5 - load(p - 5);
+    }
+    std::string_view get(size_t off) const
+    {
+        return std::string_view(buf.data() + off + header_len(off), data_len(off));
+    }
+    // 第i个元素的偏移量，i < 0时从表尾开始计算
+    size_t index(long i) const
+    {
+        size_t off;
+        if (i >= 0) {
+            for (off = begin(); i-- > 0; off = next(off)) ;
+        } else {
+            for (off = end(); i++ < 0; off = prev(off)) ;
+        }
+        return off;
+    }
+    // 从off开始每隔step个元素比较一次，返回第一个等于s的元素
+    size_t find(std::string_view s, size_t step = 1, size_t off = 0) const
+    {
+        while (off < end()) {
+            if (get(off) == s) return off;
+            for (size_t i = 0; i < step; i++) off = next(off);
+        }
+        return end();
+    }
+    // 在off之前插入s，返回s的偏移量
+    size_t insert(size_t off, std::string_view s)
+    {
+        size_t hlen = s.size() < 0x80 ? 1 : 5;
+        size_t len = hlen + s.size();
+        buf.insert(off, len + (len < 0x80 ? 1 : 5), '\0');
+        auto p = data() + off;
+        if (hlen == 1) {
+            *p++ = s.size();
+        } else {
+            *p++ = 0x80;
+            p = store(p, s.size());
+        }
+        memcpy(p, s.data(), s.size());
+        p += s.size();
+        if (len < 0x80) {
+            *p = len;
+        } else {
+            p = store(p, len);
+            *p = 0x80;
+        }
+        count++;
+        return off;
+    }
+    void push_front(std::string_view s) { insert(begin(), s); }
+    void push_back(std::string_view s) { insert(end(), s); }
+    // 返回被删除元素的下一个元素的偏移量(即off)
+    size_t erase(size_t off)
+    {
+        buf.erase(off, next(off) - off);
+        count--;
+        return off;
+    }
+    // 删除[first, last)之间的n个元素
+    void erase(size_t first, size_t last, size_t n)
+    {
+        buf.erase(first, last - first);
+        count -= n;
+    }
+    size_t replace(size_t off, std::string_view s)
+    {
+        erase(off);
+        return insert(off, s);
+    }
+    void clear()
+    {
+        buf.clear();
+        buf.shrink_to_fit();
+        count = 0;
+    }
+private:
+    unsigned char *data()
+    {
+        return reinterpret_cast<unsigned char*>(buf.data());
+    }
+    const unsigned char *data() const
+    {
+        return reinterpret_cast<const unsigned char*>(buf.data());
+    }
+    size_t header_len(size_t off) const
+    {
+        return data()[off] < 0x80 ? 1 : 5;
+    }
+    size_t data_len(size_t off) const
+    {
+        auto p = data() + off;
+        return p[0] < 0x80 ? p[0] : load(p + 1);
+    }
+    static size_t load(const unsigned char *p)
+    {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<size_t>(p[3]) << 24);
+    }
+    static unsigned char *store(unsigned char *p, size_t n)
+    {
+        for (int i = 0; i < 4; i++, n >>= 8)
+            *p++ = n & 0xff;
+        return p;
+    }
+
+    std::string buf;
+    size_t count = 0;
+};
+
+}
+}
+
+#endif // _ALICE_SRC_MMDB_LISTPACK_H
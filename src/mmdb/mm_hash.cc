@@ -15,18 +15,17 @@ void DB::hset(context_t& con)
     auto it = find(key);
     if (not_found(it)) {
         Hash hash;
-        hash.emplace(field, value);
+        hash.insert(field, value);
         insert(key, std::move(hash));
         ret(con, shared.n1);
     }
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
-    if (hash.find(field) != hash.end()) {
-        con.append(shared.n0);
-    } else {
+    if (hash.insert(field, value)) {
         con.append(shared.n1);
+    } else {
+        con.append(shared.n0);
     }
-    hash.emplace(field, value);
 }
 
 // HSETNX key field value
@@ -39,19 +38,18 @@ void DB::hsetnx(context_t& con)
     auto it = find(key);
     if (not_found(it)) {
         Hash hash;
-        hash.emplace(field, value);
+        hash.insert(field, value);
         insert(key, std::move(hash));
         touch_watch_key(key);
         ret(con, shared.n1);
     }
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
-    if (hash.find(field) != hash.end()) {
-        con.append(shared.n0);
-    } else {
-        hash.emplace(field, value);
+    if (hash.insert(field, value)) {
         touch_watch_key(key);
         con.append(shared.n1);
+    } else {
+        con.append(shared.n0);
     }
 }
 
@@ -65,9 +63,9 @@ void DB::hget(context_t& con)
     if (not_found(it)) ret(con, shared.nil);
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
-    auto value = hash.find(field);
-    if (value != hash.end()) {
-        con.append_reply_string(value->second);
+    auto value = hash.get(field);
+    if (value) {
+        con.append_reply_string(*value);
     } else
         con.append(shared.nil);
 }
@@ -82,7 +80,7 @@ void DB::hexists(context_t& con)
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
-    if (hash.find(field) != hash.end()) {
+    if (hash.contains(field)) {
         con.append(shared.n1);
     } else {
         con.append(shared.n0);
@@ -101,11 +99,8 @@ void DB::hdel(context_t& con)
     int dels = 0;
     auto& hash = get_hash_value(it);
     for (size_t i = 2; i < size; i++) {
-        auto it = hash.find(con.argv[i]);
-        if (it != hash.end()) {
-            hash.erase(it);
+        if (hash.erase(con.argv[i]))
             dels++;
-        }
     }
     del_key_if_empty(hash, key);
     touch_watch_key(key);
@@ -134,9 +129,9 @@ void DB::hstrlen(context_t& con)
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
-    auto value = hash.find(field);
-    if (value != hash.end()) {
-        con.append_reply_number(value->second.size());
+    auto value = hash.get(field);
+    if (value) {
+        con.append_reply_number(value->size());
     } else {
         con.append(shared.n0);
     }
@@ -154,22 +149,22 @@ void DB::hincrby(context_t& con)
     auto it = find(key);
     if (not_found(it)) {
         Hash hash;
-        hash.emplace(field, incr_str);
+        hash.insert(field, incr_str);
         insert(key, std::move(hash));
         touch_watch_key(key);
         ret(con, shared.n0);
     }
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
-    auto value = hash.find(field);
-    if (value != hash.end()) {
-        int64_t number = str2ll(value->second);
+    auto value = hash.get(field);
+    if (value) {
+        int64_t number = str2ll(String(*value));
         if (str2numerr()) ret(con, shared.integer_err);
         number += incr;
-        value->second.assign(i2s(number));
+        hash.set(field, i2s(number));
         con.append_reply_number(number);
     } else {
-        hash.emplace(field, String(i2s(incr)));
+        hash.insert(field, i2s(incr));
         con.append_reply_number(incr);
     }
     touch_watch_key(key);
@@ -187,14 +182,14 @@ void DB::hmset(context_t& con)
     if (not_found(it)) {
         Hash hash;
         for (size_t i = 2; i < size; i += 2)
-            hash.emplace(con.argv[i], con.argv[i+1]);
+            hash.insert(con.argv[i], con.argv[i+1]);
         insert(key, std::move(hash));
         ret(con, shared.ok);
     }
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
     for (size_t i = 2; i < size; i += 2)
-        hash.emplace(con.argv[i], con.argv[i+1]);
+        hash.insert(con.argv[i], con.argv[i+1]);
     con.append(shared.ok);
 }
 
@@ -214,9 +209,9 @@ void DB::hmget(context_t& con)
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
     for (size_t i = 2; i < size; i++) {
-        auto it = hash.find(con.argv[i]);
-        if (it != hash.end()) {
-            con.append_reply_string(it->second);
+        auto value = hash.get(con.argv[i]);
+        if (value) {
+            con.append_reply_string(*value);
         } else {
             con.append(shared.nil);
         }
@@ -237,16 +232,16 @@ void DB::_hget(context_t& con, int what)
     check_type(con, it, Hash);
     auto& hash = get_hash_value(it);
     con.append_reply_multi(what == HGETALL ? hash.size() * 2 : hash.size());
-    for (auto& it : hash) {
+    hash.for_each([&con, what](std::string_view field, std::string_view value){
         if (what == HGETKEYS) {
-            con.append_reply_string(it.first);
+            con.append_reply_string(field);
         } else if (what == HGETVALUES) {
-            con.append_reply_string(it.second);
+            con.append_reply_string(value);
         } else {
-            con.append_reply_string(it.first);
-            con.append_reply_string(it.second);
+            con.append_reply_string(field);
+            con.append_reply_string(value);
         }
-    }
+    });
 }
 
 void DB::hkeys(context_t& con)
@@ -1,4 +1,5 @@
 #include "internal.h"
+#include "rdb.h"
 
 #include "../server.h"
 
@@ -16,8 +17,8 @@ void DB::_lpush(context_t& con, bool is_lpush)
     if (not_found(it)) {
         List list;
         for (size_t i = 2; i < size; i++) {
-            is_lpush ? list.emplace_front(con.argv[i])
-                     : list.emplace_back(con.argv[i]);
+            is_lpush ? list.push_front(con.argv[i])
+                     : list.push_back(con.argv[i]);
         }
         insert(key, std::move(list));
         con.append_reply_number(list.size());
@@ -25,8 +26,8 @@ void DB::_lpush(context_t& con, bool is_lpush)
         check_type(con, it, List);
         auto& list = get_list_value(it);
         for (size_t i = 2; i < size; i++) {
-            is_lpush ? list.emplace_front(con.argv[i])
-                     : list.emplace_back(con.argv[i]);
+            is_lpush ? list.push_front(con.argv[i])
+                     : list.push_back(con.argv[i]);
         }
         con.append_reply_number(list.size());
     }
@@ -53,8 +54,8 @@ void DB::_lpushx(context_t& con, bool is_lpushx)
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, List);
     auto& list = get_list_value(it);
-    is_lpushx ? list.emplace_front(value)
-              : list.emplace_back(value);
+    is_lpushx ? list.push_front(value)
+              : list.push_back(value);
     touch_watch_key(key);
     con.append_reply_number(list.size());
 }
@@ -130,13 +131,13 @@ void DB::_rpoplpush(context_t& con, bool is_nonblock)
     auto des_it = find(des_key);
     if (not_found(des_it)) {
         List des_list;
-        des_list.emplace_front(src_list.back());
+        des_list.push_front(src_list.back());
         insert(des_key, std::move(des_list));
         touch_watch_key(src_key);
     } else {
         check_type(con, des_it, List);
         auto& des_list = get_list_value(des_it);
-        des_list.emplace_front(src_list.back());
+        des_list.push_front(src_list.back());
         touch_watch_key(src_key);
         touch_watch_key(des_key);
     }
@@ -161,37 +162,7 @@ void DB::lrem(context_t& con)
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, List);
     auto& list = get_list_value(it);
-    int rems = 0;
-    if (count > 0) {
-        for (auto it = list.cbegin(); it != list.cend(); ) {
-            if ((*it).compare(value) == 0) {
-                auto tmp = it++;
-                list.erase(tmp);
-                rems++;
-                if (--count == 0)
-                    break;
-            } else
-                ++it;
-        }
-    } else if (count < 0) {
-        for (auto it = list.crbegin(); it != list.crend(); ++it) {
-            if ((*it).compare(value) == 0) {
-                // &*(reverse_iterator(i)) == &*(i - 1)
-                list.erase((++it).base());
-                rems++;
-                if (++count == 0)
-                    break;
-            }
-        }
-    } else {
-        for (auto it = list.cbegin(); it != list.cend(); ) {
-            if ((*it).compare(value) == 0) {
-                auto tmp = it++;
-                list.erase(tmp);
-                rems++;
-            }
-        }
-    }
+    size_t rems = list.remove(value, count);
     del_key_if_empty(list, key);
     touch_watch_key(key);
     con.append_reply_number(rems);
@@ -226,11 +197,7 @@ void DB::lindex(context_t& con)
     if (index < 0 || index >= size) {
         ret(con, shared.nil);
     }
-    for (auto& it : list)
-        if (index-- == 0) {
-            con.append_reply_string(it);
-            break;
-        }
+    con.append_reply_string(list.at(index));
 }
 
 // LSET key index value
@@ -251,11 +218,7 @@ void DB::lset(context_t& con)
     if (index < 0 || index >= size) {
         ret(con, shared.index_out_of_range);
     }
-    for (auto& it : list)
-        if (index-- == 0) {
-            it.assign(value);
-            break;
-        }
+    list.set(index, value);
     touch_watch_key(key);
     con.append(shared.ok);
 }
@@ -278,17 +241,9 @@ void DB::lrange(context_t& con)
     if (check_range_index(con, start, stop, lower, upper) == C_ERR)
         return;
     con.append_reply_multi(stop - start + 1);
-    long long i = 0;
-    for (auto& it : list) {
-        if (i < start) {
-            i++;
-            continue;
-        }
-        if (i > stop)
-            break;
-        con.append_reply_string(it);
-        i++;
-    }
+    list.range(start, stop, [&con](std::string_view value){
+        con.append_reply_string(value);
+    });
 }
 
 // LTRIM key start stop
@@ -313,12 +268,7 @@ void DB::ltrim(context_t& con)
         list.clear();
         ret(con, shared.ok);
     }
-    int i = 0;
-    for (auto it = list.cbegin(); it != list.cend(); i++) {
-        auto tmp = it++;
-        if (i >= start && i <= stop) continue;
-        list.erase(tmp);
-    }
+    list.trim(start, stop);
     del_key_if_empty(list, key);
     touch_watch_key(key);
     con.append(shared.ok);
@@ -397,21 +347,22 @@ void DB::blocking_pop(const key_t& key)
     other.append("+(");
     other.append(d2s(seconds));
     other.append("s)\r\n");
-    conn->send(other.buf);
+    __server->unblock_reply(conn, std::move(other.buf));
 
     clear_blocking_keys_for_context(con);
     engine->del_block_client(conn->id());
 
     if (bops == BLOCK_RPOPLPUSH) {
-        auto& src = list.back();
+        engine->rdb->before_modify(this, con.des);
+        auto src = list.back();
         auto it = find(con.des);
         if (not_found(it)) {
             List list;
-            list.emplace_front(src);
+            list.push_front(src);
             insert(con.des, std::move(list));
         } else {
             auto& list = get_list_value(it);
-            list.emplace_front(src);
+            list.push_front(src);
         }
     }
     (bops == BLOCK_LPOP) ? list.pop_front() : list.pop_back();
@@ -438,6 +389,7 @@ void DB::set_context_to_block(context_t& con, int timeout)
     con.block_db_num = engine->get_cur_db_num();
     con.block_start_time = angel::util::get_cur_time_ms();
     con.blocked_time = timeout * 1000;
+    __server->block_reply(con);
     engine->add_block_client(con.conn->id());
 }
 
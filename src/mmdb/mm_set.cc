@@ -15,15 +15,13 @@ void DB::sadd(context_t& con)
     if (not_found(it)) {
         Set set;
         for (size_t i = 2; i < size; i++)
-            set.emplace(con.argv[i]);
+            if (set.insert(con.argv[i])) adds++;
         insert(key, std::move(set));
-        adds = size - 2;
     } else {
         check_type(con, it, Set);
         auto& set = get_set_value(it);
         for (size_t i = 2; i < size; i++) {
-            auto it = set.emplace(con.argv[i]);
-            if (it.second) adds++;
+            if (set.insert(con.argv[i])) adds++;
         }
     }
     con.append_reply_number(adds);
@@ -40,7 +38,7 @@ void DB::sismember(context_t& con)
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, Set);
     auto& set = get_set_value(it);
-    if (set.find(member) != set.end())
+    if (set.contains(member))
         con.append(shared.n1);
     else
         con.append(shared.n0);
@@ -55,16 +53,9 @@ void DB::spop(context_t& con)
     if (not_found(it)) ret(con, shared.nil);
     check_type(con, it, Set);
     auto& set = get_set_value(it);
-    auto randkey = get_rand_hash_key(set);
-    size_t bucket = std::get<0>(randkey);
-    size_t where = std::get<1>(randkey);
-    for (auto it = set.cbegin(bucket); it != set.cend(bucket); ++it) {
-        if (where-- == 0) {
-            con.append_reply_string(*it);
-            set.erase(set.find(*it));
-            break;
-        }
-    }
+    auto member = set.random_member();
+    set.erase(member);
+    con.append_reply_string(std::move(member));
     del_key_if_empty(set, key);
     touch_watch_key(key);
 }
@@ -86,45 +77,26 @@ void DB::srandmember(context_t& con)
     auto& set = get_set_value(it);
     if (count >= static_cast<ssize_t>(set.size())) {
         con.append_reply_multi(set.size());
-        for (auto& it : set) {
-            con.append_reply_string(it);
-        }
+        set.for_each([&con](std::string_view member){
+            con.append_reply_string(member);
+        });
         return;
     }
     if (count == 0 || count < 0) {
         if (count == 0) count = -1;
         con.append_reply_multi(-count);
         while (count++ < 0) {
-            auto randkey = get_rand_hash_key(set);
-            size_t bucket = std::get<0>(randkey);
-            size_t where = std::get<1>(randkey);
-            for (auto it = set.cbegin(bucket); it != set.cend(bucket); ++it) {
-                if (where-- == 0) {
-                    con.append_reply_string(*it);
-                    break;
-                }
-            }
+            con.append_reply_string(set.random_member());
         }
         return;
     }
     con.append_reply_multi(count);
-    Set tset;
+    std::unordered_set<std::string> tset;
     while (count-- > 0) {
-        auto randkey = get_rand_hash_key(set);
-        size_t bucket = std::get<0>(randkey);
-        size_t where = std::get<1>(randkey);
-        for (auto it = set.cbegin(bucket); it != set.cend(bucket); ++it) {
-            if (where-- == 0) {
-                if (tset.find(*it) != tset.end()) {
-                    count++;
-                    break;
-                }
-                tset.insert(*it);
-                break;
-            }
-        }
+        if (!tset.insert(set.random_member()).second)
+            count++;
     }
-    for (auto it : tset) {
+    for (auto& it : tset) {
         con.append_reply_string(it);
     }
 }
@@ -141,11 +113,8 @@ void DB::srem(context_t& con)
     auto& set = get_set_value(it);
     size_t rems = 0;
     for (size_t i = 2; i < size; i++) {
-        auto it = set.find(con.argv[i]);
-        if (it != set.end()) {
-            set.erase(it);
+        if (set.erase(con.argv[i]))
             rems++;
-        }
     }
     del_key_if_empty(set, key);
     touch_watch_key(key);
@@ -164,19 +133,17 @@ void DB::smove(context_t& con)
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, Set);
     auto& src_set = get_set_value(it);
-    auto src_it = src_set.find(member);
-    if (src_it == src_set.end()) ret(con, shared.n0);
-    src_set.erase(src_it);
+    if (!src_set.erase(member)) ret(con, shared.n0);
     del_key_if_empty(src_set, src);
     auto des_it = find(des);
     if (not_found(des_it)) {
         Set set;
-        set.emplace(member);
+        set.insert(member);
         insert(des, std::move(set));
     } else {
         check_type(con, des_it, Set);
         auto& des_set = get_set_value(des_it);
-        des_set.emplace(member);
+        des_set.insert(member);
     }
     touch_watch_key(src);
     touch_watch_key(des);
@@ -205,9 +172,9 @@ void DB::smembers(context_t& con)
     check_type(con, it, Set);
     auto& set = get_set_value(it);
     con.append_reply_multi(set.size());
-    for (auto& member : set) {
+    set.for_each([&con](std::string_view member){
         con.append_reply_string(member);
-    }
+    });
 }
 
 void DB::_sinter(context_t& con, Set& rset, int start)
@@ -227,17 +194,17 @@ void DB::_sinter(context_t& con, Set& rset, int start)
         }
     }
     auto& set = get_set_value(find(con.argv[j]));
-    for (auto& member : set) {
+    set.for_each([this, &con, &rset, start, size, j](std::string_view member){
         size_t i;
         for (i = start; i < size; i++) {
             if (i == j) continue;
             auto& set = get_set_value(find(con.argv[i]));
-            if (set.find(member) == set.end())
+            if (!set.contains(member))
                 break;
         }
         if (i == size)
-            rset.emplace(member);
-    }
+            rset.insert(member);
+    });
 }
 
 void DB::_sunion(context_t& con, Set& rset, int start)
@@ -249,9 +216,9 @@ void DB::_sunion(context_t& con, Set& rset, int start)
         if (not_found(it)) continue;
         check_type(con, it, Set);
         auto& set = get_set_value(it);
-        for (auto& member : set) {
-            rset.emplace(member);
-        }
+        set.for_each([&rset](std::string_view member){
+            rset.insert(member);
+        });
     }
 }
 
@@ -259,8 +226,9 @@ void DB::sreply(context_t& con, Set& rset)
 {
     if (rset.empty()) ret(con, shared.nil);
     con.append_reply_multi(rset.size());
-    for (auto& member : rset)
+    rset.for_each([&con](std::string_view member){
         con.append_reply_string(member);
+    });
 }
 
 void DB::sstore(context_t& con, Set& rset)
@@ -273,7 +241,7 @@ void DB::sstore(context_t& con, Set& rset)
     } else {
         check_type(con, it, Set);
         auto& set = get_set_value(it);
-        set.swap(rset);
+        set = std::move(rset);
         con.append_reply_number(set.size());
     }
 }
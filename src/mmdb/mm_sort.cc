@@ -110,7 +110,10 @@ integer_err:
     return C_ERR;
 }
 
-int DB::sort_get_result(context_t& con, sobj_list& result, const key_t& key, unsigned& cmdops)
+// 紧凑编码的对象中没有现成的std::string可供引用，所以先将元素拷贝到values中，
+// BY和GET引用的字符串也是如此
+int DB::sort_get_result(context_t& con, sobj_list& result, std::deque<std::string>& values,
+                        const key_t& key, unsigned& cmdops)
 {
     check_expire(key);
     auto it = find(key);
@@ -121,17 +124,21 @@ int DB::sort_get_result(context_t& con, sobj_list& result, const key_t& key, uns
     if (is_type(it, List)) {
         cmdops |= SORT_LIST_TYPE;
         auto& list = get_list_value(it);
-        for (auto& it : list)
-            result.emplace_back(&it);
+        list.for_each([&values](std::string_view value){
+            values.emplace_back(value);
+        });
     } else if (is_type(it, Set)) {
         cmdops |= SORT_SET_TYPE;
         auto& set = get_set_value(it);
-        for (auto& it : set)
-            result.emplace_back(&it);
+        set.for_each([&values](std::string_view value){
+            values.emplace_back(value);
+        });
     } else {
         con.append(shared.type_err);
         return C_ERR;
     }
+    for (auto& value : values)
+        result.emplace_back(&value);
     return C_OK;
 
 }
@@ -146,7 +153,8 @@ int DB::sort_get_result(context_t& con, sobj_list& result, const key_t& key, uns
             + by.substr(star - by.begin(), by.size()); \
     }
 
-void DB::sort_by_pattern(sobj_list& result, const key_t& by, unsigned& cmdops)
+void DB::sort_by_pattern(sobj_list& result, std::deque<std::string>& values,
+                         const key_t& by, unsigned& cmdops)
 {
     std::string key;
     auto star = std::find(by.begin(), by.end(), '*');
@@ -158,8 +166,8 @@ void DB::sort_by_pattern(sobj_list& result, const key_t& by, unsigned& cmdops)
         sub_key(key, star, by, it);
         auto e = find(key);
         if (!not_found(e) && is_type(e, String)) {
-            auto& val = get_string_value(e);
-            it.u.cmpval = &val;
+            char buf[32];
+            it.u.cmpval = &values.emplace_back(e->second.str(buf));
         } else {
             it.u.cmpval = it.value;
         }
@@ -216,7 +224,8 @@ static int sort_limit(context_t& con, DB::sobj_list& result, int offset, int cou
     return C_OK;
 }
 
-void DB::sort_by_get_keys(sobj_list& result, const std::vector<std::string>& getset, unsigned cmdops)
+void DB::sort_by_get_keys(sobj_list& result, std::deque<std::string>& values,
+                          const std::vector<std::string>& getset, unsigned cmdops)
 {
     sobj_list tres;
     std::string key;
@@ -232,8 +241,8 @@ void DB::sort_by_get_keys(sobj_list& result, const std::vector<std::string>& get
             sub_key(key, star, p, it);
             auto e = find(key);
             if (!not_found(e) && is_type(e, String)) {
-                auto& val = get_string_value(e);
-                tres.emplace_back(&val);
+                char buf[32];
+                tres.emplace_back(&values.emplace_back(e->second.str(buf)));
             } else
                 tres.emplace_back(nullptr);
         }
@@ -246,12 +255,12 @@ void DB::sort_store(sobj_list& result, const key_t& des, unsigned cmdops)
     if (cmdops & SORT_LIST_TYPE) {
         List list;
         for (auto& it : result)
-            list.emplace_back(it.value ? *it.value : "");
+            list.push_back(it.value ? *it.value : "");
         insert(des, std::move(list));
     } else if (cmdops & SORT_SET_TYPE) {
         Set set;
         for (auto& it : result)
-            set.emplace(it.value ? *it.value : "");
+            set.insert(it.value ? *it.value : "");
         insert(des, std::move(set));
     }
 }
@@ -265,13 +274,14 @@ void DB::sort(context_t& con)
     if (parse_sort_args(con, cmdops, key, by, des, getset, offset, count) == C_ERR)
         return;
     sobj_list result;
-    if (sort_get_result(con, result, key, cmdops) == C_ERR) return;
-    if (cmdops & SORT_BY) sort_by_pattern(result, by, cmdops);
+    std::deque<std::string> values;
+    if (sort_get_result(con, result, values, key, cmdops) == C_ERR) return;
+    if (cmdops & SORT_BY) sort_by_pattern(result, values, by, cmdops);
     if (cmdops & SORT_NOT) goto end;
     if (sort_result(con, result, cmdops) == C_ERR) return;
     if ((cmdops & SORT_LIMIT) && sort_limit(con, result, offset, count) == C_ERR)
         return;
-    if (cmdops & SORT_GET) sort_by_get_keys(result, getset, cmdops);
+    if (cmdops & SORT_GET) sort_by_get_keys(result, values, getset, cmdops);
     if (cmdops & SORT_STORE) sort_store(result, des, cmdops);
 end:
     con.append_reply_multi(result.size());
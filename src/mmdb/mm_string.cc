@@ -50,8 +50,8 @@ void DB::get(context_t& con)
     auto it = find(key);
     if (not_found(it)) ret(con, shared.nil);
     check_type(con, it, String);
-    auto& value = get_string_value(it);
-    con.append_reply_string(value);
+    char buf[32];
+    con.append_reply_string(it->second.str(buf));
 }
 
 // GETSET key value
@@ -67,8 +67,8 @@ void DB::getset(context_t& con)
         ret(con, shared.nil);
     }
     check_type(con, it, String);
-    auto& old_value = get_string_value(it);
-    con.append_reply_string(old_value);
+    char buf[32];
+    con.append_reply_string(it->second.str(buf));
     insert(key, new_value);
 }
 
@@ -80,8 +80,8 @@ void DB::strlen(context_t& con)
     auto it = find(key);
     if (not_found(it)) ret(con, shared.n0);
     check_type(con, it, String);
-    auto& value = get_string_value(it);
-    con.append_reply_number(value.size());
+    char buf[32];
+    con.append_reply_number(it->second.str(buf).size());
 }
 
 // APPEND key value
@@ -98,7 +98,7 @@ void DB::append(context_t& con)
         return;
     }
     check_type(con, it, String);
-    auto& old_value = get_string_value(it);
+    auto& old_value = it->second.raw_string();
     old_value.append(value);
     con.append_reply_number(old_value.size());
 }
@@ -128,7 +128,8 @@ void DB::mget(context_t& con)
             con.append(shared.nil);
         } else {
             if (is_type(it, String)) {
-                con.append_reply_string(get_string_value(it));
+                char buf[32];
+                con.append_reply_string(it->second.str(buf));
             } else {
                 con.append(shared.nil);
             }
@@ -143,12 +144,11 @@ void DB::_incr(context_t& con, int64_t incr)
     auto it = find(key);
     if (!not_found(it)) {
         check_type(con, it, String);
-        auto& value = get_string_value(it);
-        auto number = str2ll(value);
-        if (str2numerr()) ret(con, shared.integer_err);
+        int64_t number;
+        if (!it->second.get_integer(number)) ret(con, shared.integer_err);
         incr += number;
     }
-    insert(key, String(i2s(incr)));
+    insert(key, i2s(incr));
     con.append_reply_number(incr);
     touch_watch_key(key);
 }
@@ -202,7 +202,7 @@ void DB::setrange(context_t& con)
         return;
     }
     check_type(con, it, String);
-    new_value.swap(get_string_value(it));
+    new_value.swap(it->second.raw_string());
     size_t len = offset + value.size();
     if (len > new_value.capacity()) new_value.reserve(len);
     if (len > new_value.size()) new_value.resize(len);
@@ -225,7 +225,8 @@ void DB::getrange(context_t& con)
     auto it = find(key);
     if (not_found(it)) ret(con, shared.nil);
     check_type(con, it, String);
-    auto& value = get_string_value(it);
+    char buf[32];
+    auto value = it->second.str(buf);
     long long upper = value.size() - 1;
     long long lower = -value.size();
     if (check_range_index(con, start, stop, lower, upper) == C_ERR)
@@ -22,10 +22,12 @@ void DB::zadd(context_t& con)
         Zset zset;
         for (size_t i = 2; i < size; i += 2) {
             double score = atof(con.argv[i].c_str());
+            auto old_score = zset.score(con.argv[i+1]);
+            if (old_score) zset.erase(*old_score, con.argv[i+1]);
             zset.insert(score, con.argv[i+1]);
         }
+        con.append_reply_number(zset.size());
         insert(key, std::move(zset));
-        con.append_reply_number((size - 2) / 2);
         return;
     }
     check_type(con, it, Zset);
@@ -33,10 +35,10 @@ void DB::zadd(context_t& con)
     int adds = 0;
     for (size_t i = 2; i < size; i += 2) {
         double score = atof(con.argv[i].c_str());
-        auto it = zset.zmap.find(con.argv[i+1]);
-        if (it != zset.zmap.end()) {
+        auto old_score = zset.score(con.argv[i+1]);
+        if (old_score) {
             // 如果成员已存在，则会更新它的分数
-            zset.erase(it->second, con.argv[i+1]);
+            zset.erase(*old_score, con.argv[i+1]);
         } else {
             adds++;
         }
@@ -55,9 +57,9 @@ void DB::zscore(context_t& con)
     if (not_found(it)) ret(con, shared.nil);
     check_type(con, it, Zset);
     auto& zset = get_zset_value(it);
-    auto e = zset.zmap.find(member);
-    if (e != zset.zmap.end()) {
-        con.append_reply_double(e->second);
+    auto score = zset.score(member);
+    if (score) {
+        con.append_reply_double(*score);
     } else
         con.append(shared.nil);
 }
@@ -81,13 +83,10 @@ void DB::zincrby(context_t& con)
     }
     check_type(con, it, Zset);
     auto& zset = get_zset_value(it);
-    auto e = zset.zmap.find(member);
-    if (e != zset.zmap.end()) {
-        zslkey zk;
-        zk.score = e->second;
-        zk.member = member;
-        zset.zsl.erase(zk);
-        score += e->second;
+    auto old_score = zset.score(member);
+    if (old_score) {
+        zset.erase(*old_score, member);
+        score += *old_score;
     }
     zset.insert(score, member);
     con.append_reply_double(score);
@@ -121,7 +120,7 @@ void DB::zcount(context_t& con)
     check_type(con, it, Zset);
     auto& zset = get_zset_value(it);
     auto [first, last] = zset_range(zset, cmdops, r);
-    if (first == last) con.append_reply_number(0);
+    if (first == last) ret(con, shared.n0);
     con.append_reply_number(zset.diff_range(first, last));
 }
 
@@ -153,22 +152,22 @@ void DB::_zrange(context_t& con, bool is_reverse)
         con.append_reply_multi(stop - start + 1);
     long long i = 0;
     if (!is_reverse) {
-        for (auto it = zset.zsl.cbegin(); it != zset.zsl.cend(); ++it, ++i) {
+        for (auto it = zset.begin(); it != zset.end(); ++it, ++i) {
             if (i < start) continue;
             if (i > stop) break;
-            con.append_reply_string(it->first.member);
+            con.append_reply_string(it.member());
             if (withscores)
-                con.append_reply_double(it->first.score);
+                con.append_reply_double(it.score());
         }
     }
     if (is_reverse) {
-        for (auto it = --zset.zsl.end(); ; --it, ++i) {
+        for (auto it = --zset.end(); ; --it, ++i) {
             if (i < start) continue;
             if (i > stop) break;
-            con.append_reply_string(it->first.member);
+            con.append_reply_string(it.member());
             if (withscores)
-                con.append_reply_double(it->first.score);
-            if (it == zset.zsl.begin())
+                con.append_reply_double(it.score());
+            if (it == zset.begin())
                 break;
         }
     }
@@ -194,9 +193,9 @@ void DB::_zrank(context_t& con, bool is_reverse)
     if (not_found(it)) ret(con, shared.nil);
     check_type(con, it, Zset);
     auto& zset = get_zset_value(it);
-    auto e = zset.zmap.find(member);
-    if (e == zset.zmap.end()) ret(con, shared.nil);
-    size_t rank = zset.order_of_key(e->second, member);
+    auto score = zset.score(member);
+    if (!score) ret(con, shared.nil);
+    size_t rank = zset.order_of_key(*score, member);
     if (is_reverse) rank = zset.size() - rank;
     else rank -= 1; // base on 0
     con.append_reply_number(rank);
@@ -231,18 +230,18 @@ static void zrangefor(context_t& con, unsigned cmdops, Zset::iterator it, Zset::
     con.append_reply_multi(withscores ? limit * 2 : limit);
     if (!is_reverse) {
         while (it != last) {
-            con.append_reply_string(it->first.member);
+            con.append_reply_string(it.member());
             if (withscores)
-                con.append_reply_double(it->first.score);
+                con.append_reply_double(it.score());
             ++it;
             if (is_limit && --limit == 0)
                 break;
         }
     } else {
         for (--last; ; --last) {
-            con.append_reply_string(last->first.member);
+            con.append_reply_string(last.member());
             if (withscores)
-                con.append_reply_double(last->first.score);
+                con.append_reply_double(last.score());
             if (last == it || (is_limit && --limit == 0))
                 break;
         }
@@ -295,9 +294,9 @@ void DB::zrem(context_t& con)
     int rems = 0;
     size_t size = con.argv.size();
     for (size_t i = 2; i < size; i++) {
-        auto e = zset.zmap.find(con.argv[i]);
-        if (e != zset.zmap.end()) {
-            zset.erase(e->second, e->first);
+        auto score = zset.score(con.argv[i]);
+        if (score) {
+            zset.erase(*score, con.argv[i]);
             rems++;
         }
     }
@@ -323,14 +322,10 @@ void DB::zremrangebyrank(context_t& con)
     long long lower = -zset.size();
     if (check_range_index(con, start, stop, lower, upper) == C_ERR)
         return;
-    long long i = 0, rems = 0;
-    for (auto it = zset.zmap.begin(); it != zset.zmap.end(); i++) {
-        if (i < start) continue;
-        if (i > stop) break;
-        auto e = it++;
-        zset.erase(e->second, e->first);
-        rems++;
-    }
+    auto first = zset.begin(), last = zset.begin();
+    for (long long i = 0; i < start; i++) ++first;
+    for (long long i = 0; i <= stop; i++) ++last;
+    size_t rems = zset.erase(first, last);
     del_key_if_empty(zset, key);
     touch_watch_key(key);
     con.append_reply_number(rems);
@@ -353,12 +348,7 @@ void DB::zremrangebyscore(context_t& con)
     auto& zset = get_zset_value(it);
     auto [first, last] = zset_range(zset, cmdops, r);
     if (first == last) ret(con, shared.n0);
-    int rems = 0;
-    while (first != last) {
-        auto e = first++;
-        zset.erase(e->first.score, e->first.member);
-        rems++;
-    }
+    size_t rems = zset.erase(first, last);
     del_key_if_empty(zset, key);
     con.append_reply_number(rems);
 }
@@ -367,25 +357,25 @@ zsk_range DB::zset_range(Zset& zset, unsigned cmdops, score_range& r)
 {
     double min_score = zset.min_score();
     double max_score = zset.max_score();
-    auto it = zset.zsl.begin();
-    auto last = zset.zsl.end();
+    auto it = zset.begin();
+    auto last = zset.end();
     if ((!r.lower && r.min > max_score) || (!r.upper && r.max < min_score)) {
         return { last, last };
     }
     if (!r.lower && r.min > min_score) it = zset.lower_bound(r.min);
     if (!r.upper && r.max < max_score) last = zset.upper_bound(r.max);
-    double score = (--last)->first.score;
-    for (++last; last != zset.zsl.end() && last->first.score == score; ++last)
+    double score = (--last).score();
+    for (++last; last != zset.end() && last.score() == score; ++last)
         ;
     if (!r.lower && (cmdops & LOI)) {
-        while (it != last && it->first.score == r.min)
+        while (it != last && it.score() == r.min)
             ++it;
     }
     if (it == last) return { it, last };
     if (!r.upper && (cmdops & ROI)) {
-        for (--last; it != last && last->first.score == r.max; --last)
+        for (--last; it != last && last.score() == r.max; --last)
             ;
-        if (last->first.score != r.max)
+        if (last.score() != r.max)
             ++last;
     }
     return { it, last };
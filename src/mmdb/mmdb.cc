@@ -5,6 +5,7 @@
 #include "internal.h"
 #include "rdb.h"
 #include "aof.h"
+#include "shard.h"
 
 #include <fcntl.h>
 
@@ -12,9 +13,9 @@ namespace alice {
 
 namespace mmdb {
 
-using std::placeholders::_1;
-
-#define BIND(f) std::bind(&DB::f, this, _1)
+// 命令总是作用于当前选中的数据库
+#define BIND(f) [](void *e, context_t& con) \
+    { static_cast<engine*>(e)->call(con, [](DB *db, context_t& con) { db->f(con); }); }
 
 engine::engine()
     : rdb(new Rdb(this)),
@@ -24,21 +25,124 @@ engine::engine()
         std::unique_ptr<DB> db(new DB(this));
         dbs.emplace_back(std::move(db));
     }
+    cmdtable = CommandTable(this, {
+        { "SELECT",     { -2, IS_WRITE, BIND(select) } },
+        { "EXISTS",     { -2, IS_READ,  BIND(exists) } },
+        { "TYPE",       { -2, IS_READ,  BIND(type) } },
+        { "TTL",        { -2, IS_READ,  BIND(ttl) } },
+        { "PTTL",       { -2, IS_READ,  BIND(pttl) } },
+        { "EXPIRE",     { -3, IS_WRITE, BIND(expire) } },
+        { "PEXPIRE",    { -3, IS_WRITE, BIND(pexpire) } },
+        { "DEL",        {  2, IS_WRITE, BIND(del) } },
+        { "KEYS",       { -2, IS_READ,  BIND(keys) } },
+        { "SAVE",       { -1, IS_READ,  BIND(save) } },
+        { "BGSAVE",     { -1, IS_READ,  BIND(bgsave) } },
+        { "BGREWRITEAOF",{-1, IS_READ,  BIND(bgrewriteaof) } },
+        { "LASTSAVE",   { -1, IS_READ,  BIND(lastsave) } },
+        { "FLUSHDB",    { -1, IS_WRITE, BIND(flushdb) } },
+        { "FLUSHALL",   { -1, IS_WRITE, BIND(flushall) } },
+        { "DBSIZE",     { -1, IS_READ,  BIND(dbsize) } },
+        { "RENAME",     { -3, IS_WRITE, BIND(rename) } },
+        { "RENAMENX",   { -3, IS_WRITE, BIND(renamenx) } },
+        { "MOVE",       { -3, IS_WRITE, BIND(move) } },
+        { "LRU",        { -2, IS_READ,  BIND(lru) } },
+        { "SORT",       {  2, IS_READ,  BIND(sort) } },
+        { "OBJECT",     { -3, IS_READ,  BIND(object) } },
+        { "SET",        {  3, IS_WRITE, BIND(set) } },
+        { "SETNX",      { -3, IS_WRITE, BIND(setnx) } },
+        { "GET",        { -2, IS_READ,  BIND(get) } },
+        { "GETSET",     { -3, IS_WRITE, BIND(getset) } },
+        { "APPEND",     { -3, IS_WRITE, BIND(append) } },
+        { "STRLEN",     { -2, IS_READ,  BIND(strlen) } },
+        { "MSET",       {  3, IS_WRITE, BIND(mset) } },
+        { "MGET",       {  2, IS_READ,  BIND(mget) } },
+        { "INCR",       { -2, IS_WRITE, BIND(incr) } },
+        { "INCRBY",     { -3, IS_WRITE, BIND(incrby) } },
+        { "DECR",       { -2, IS_WRITE, BIND(decr) } },
+        { "DECRBY",     { -3, IS_WRITE, BIND(decrby) } },
+        { "SETRANGE",   { -4, IS_WRITE, BIND(setrange) } },
+        { "GETRANGE",   { -4, IS_READ,  BIND(getrange) } },
+        { "LPUSH",      {  3, IS_WRITE, BIND(lpush) } },
+        { "LPUSHX",     { -3, IS_WRITE, BIND(lpushx) } },
+        { "RPUSH",      {  3, IS_WRITE, BIND(rpush) } },
+        { "RPUSHX",     { -3, IS_WRITE, BIND(rpushx) } },
+        { "LPOP",       { -2, IS_WRITE, BIND(lpop) } },
+        { "RPOP",       { -2, IS_WRITE, BIND(rpop) } },
+        { "RPOPLPUSH",  { -3, IS_WRITE, BIND(rpoplpush) } },
+        { "LREM",       { -4, IS_WRITE, BIND(lrem) } },
+        { "LLEN",       { -2, IS_READ,  BIND(llen) } },
+        { "LINDEX",     { -3, IS_READ,  BIND(lindex) } },
+        { "LSET",       { -4, IS_WRITE, BIND(lset) } },
+        { "LRANGE",     { -4, IS_READ,  BIND(lrange) } },
+        { "LTRIM",      { -4, IS_WRITE, BIND(ltrim) } },
+        { "BLPOP",      {  3, IS_READ,  BIND(blpop) } },
+        { "BRPOP",      {  3, IS_READ,  BIND(brpop) } },
+        { "BRPOPLPUSH", { -4, IS_READ,  BIND(brpoplpush) } },
+        { "HSET",       { -4, IS_WRITE, BIND(hset) } },
+        { "HSETNX",     { -4, IS_WRITE, BIND(hsetnx) } },
+        { "HGET",       { -3, IS_READ,  BIND(hget) } },
+        { "HEXISTS",    { -3, IS_READ,  BIND(hexists) } },
+        { "HDEL",       {  3, IS_WRITE, BIND(hdel) } },
+        { "HLEN",       { -2, IS_READ,  BIND(hlen) } },
+        { "HSTRLEN",    { -3, IS_READ,  BIND(hstrlen) } },
+        { "HINCRBY",    { -4, IS_WRITE, BIND(hincrby) } },
+        { "HMSET",      {  4, IS_WRITE, BIND(hmset) } },
+        { "HMGET",      {  3, IS_READ,  BIND(hmget) } },
+        { "HKEYS",      { -2, IS_READ,  BIND(hkeys) } },
+        { "HVALS",      { -2, IS_READ,  BIND(hvals) } },
+        { "HGETALL",    { -2, IS_READ,  BIND(hgetall) } },
+        { "SADD",       {  3, IS_WRITE, BIND(sadd) } },
+        { "SISMEMBER",  { -3, IS_READ,  BIND(sismember) } },
+        { "SPOP",       { -2, IS_WRITE, BIND(spop) } },
+        { "SRANDMEMBER",{  2, IS_READ,  BIND(srandmember) } },
+        { "SREM",       {  3, IS_WRITE, BIND(srem)  } },
+        { "SMOVE",      { -4, IS_WRITE, BIND(smove) } },
+        { "SCARD",      { -2, IS_READ,  BIND(scard) } },
+        { "SMEMBERS",   { -2, IS_READ,  BIND(smembers) } },
+        { "SINTER",     {  2, IS_READ,  BIND(sinter) } },
+        { "SINTERSTORE",{  3, IS_WRITE, BIND(sinterstore) } },
+        { "SUNION",     {  2, IS_READ,  BIND(sunion) } },
+        { "SUNIONSTORE",{  3, IS_WRITE, BIND(sunionstore) } },
+        { "ZADD",       {  4, IS_WRITE, BIND(zadd) } },
+        { "ZSCORE",     { -3, IS_READ,  BIND(zscore) } },
+        { "ZINCRBY",    { -4, IS_WRITE, BIND(zincrby) } },
+        { "ZCARD",      { -2, IS_READ,  BIND(zcard) } },
+        { "ZCOUNT",     { -4, IS_READ,  BIND(zcount) } },
+        { "ZRANGE",     {  4, IS_READ,  BIND(zrange) } },
+        { "ZREVRANGE",  {  4, IS_READ,  BIND(zrevrange) } },
+        { "ZRANK",      { -3, IS_READ,  BIND(zrank) } },
+        { "ZREVRANK",   { -3, IS_READ,  BIND(zrevrank) } },
+        { "ZREM",       {  3, IS_WRITE, BIND(zrem) } },
+        { "ZRANGEBYSCORE",      {  4, IS_READ,  BIND(zrangebyscore) } },
+        { "ZREVRANGEBYSCORE",   {  4, IS_READ,  BIND(zrevrangebyscore) } },
+        { "ZREMRANGEBYRANK",    { -4, IS_WRITE, BIND(zremrangebyrank) } },
+        { "ZREMRANGEBYSCORE",   { -4, IS_WRITE, BIND(zremrangebyscore) } },
+    });
 }
 
 void engine::start()
 {
+    start_shards();
+    lock();
     // 优先使用AOF文件来载入数据
-    if (is_file_exists(server_conf.mmdb_appendonly_file))
+    if (aof->exists())
         aof->load();
     else
         rdb->load();
+    unlock();
 }
 
 void engine::exit()
 {
-    rdb->save_background();
+    // 不fork的快照只能在退出前完成
+    if (server_conf.mmdb_forkless_snapshot && !is_sharded()) {
+        rdb->save_incremental();
+        rdb->finish_incremental();
+    } else {
+        rdb->save_background();
+    }
     aof->rewrite_background();
+    aof->stop();
 }
 
 void engine::close_handler(const angel::connection_ptr& conn)
@@ -56,8 +160,21 @@ void engine::do_after_exec_write_cmd(const argv_t& argv, const char *query, size
     dirty++;
     if (server_conf.mmdb_enable_appendonly)
         aof->append(argv, query, len);
-    if (aof->doing())
-        aof->append_rewrite_buffer(argv, query, len);
+}
+
+// 只有appendfsync always时回复才需要等待写命令被fsync
+uint64_t engine::write_log_seq()
+{
+    if (!server_conf.mmdb_enable_appendonly || server_conf.mmdb_aof_mode != AOF_ALWAYS)
+        return 0;
+    return aof->appended_seq();
+}
+
+const char *engine::write_error()
+{
+    if (!server_conf.mmdb_enable_appendonly || !aof->failed())
+        return nullptr;
+    return "-MISCONF Errors writing to the AOF file, write commands are disabled\r\n";
 }
 
 void engine::creat_snapshot()
@@ -72,7 +189,11 @@ bool engine::is_creating_snapshot()
 
 bool engine::is_created_snapshot()
 {
-    if (rdb->doing()) {
+    if (rdb->take_incremental_done()) {
+        log_info("DB saved on disk");
+        return true;
+    }
+    if (rdb->doing() && rdb->get_child_pid() != -1) {
         pid_t pid = waitpid(rdb->get_child_pid(), nullptr, WNOHANG);
         if (pid > 0) {
             rdb->done();
@@ -90,11 +211,27 @@ std::string engine::get_snapshot_name()
 
 void engine::load_snapshot()
 {
+    lock();
     rdb->load();
+    unlock();
+}
+
+void engine::creat_snapshot_to(int fd)
+{
+    rdb->save_background_to(fd);
+}
+
+std::unique_ptr<snapshot_loader_t> engine::creat_snapshot_loader()
+{
+    return rdb->creat_stream_loader();
 }
 
 void engine::watch(context_t& con)
 {
+    if (is_sharded()) {
+        con.append_error("WATCH is not supported when mmdb-shards is enabled");
+        return;
+    }
     db()->watch(con);
 }
 
@@ -105,15 +242,12 @@ void engine::unwatch(context_t& con)
 
 void engine::server_cron()
 {
-    auto now = lru_clock;
+    auto now = lru_clock.load();
 
     if (aof->doing()) {
         pid_t pid = waitpid(aof->get_child_pid(), nullptr, WNOHANG);
-        if (pid > 0) {
-            aof->done();
-            aof->fsync_rewrite_buffer();
-            log_info("Background AOF rewrite finished successfully");
-        }
+        if (pid > 0)
+            aof->rewrite_done();
     }
 
     if (!rdb->doing() && !aof->doing()) {
@@ -148,13 +282,18 @@ void engine::server_cron()
 
     check_expire_keys();
 
-    aof->fsync();
+    // 分片模式下由各个分片自己做rehash，子进程存在时rehash会导致大量的写时复制，
+    // 不fork的快照进行期间则不需要暂停
+    if (!is_sharded() && rdb->get_child_pid() == -1 && !aof->doing())
+        DB::active_rehash(dbs);
+
+    aof->server_cron();
 }
 
 // 检查是否有阻塞的客户端超时
 void engine::check_blocked_clients()
 {
-    auto now = lru_clock;
+    auto now = lru_clock.load();
     std::string message;
     for (auto it = blocked_clients.begin(); it != blocked_clients.end(); ) {
         auto e = it++;
@@ -167,7 +306,7 @@ void engine::check_blocked_clients()
             double seconds = 1.0 * (now - context.block_start_time) / 1000;
             message.append(d2s(seconds));
             message.append("s)\r\n");
-            conn->send(message);
+            __server->unblock_reply(conn, std::move(message));
             message.clear();
             blocked_clients.erase(e);
             db->clear_blocking_keys_for_context(context);
@@ -175,148 +314,149 @@ void engine::check_blocked_clients()
     }
 }
 
-// 随机删除一定数量的过期键
+// 分片模式下由各个分片自己删除过期键
 void engine::check_expire_keys()
 {
-    auto now = lru_clock;
-    int dbnums = server_conf.mmdb_expire_check_dbnums;
-    int keys = server_conf.mmdb_expire_check_keys;
-    if (dbs.size() < dbnums) dbnums = dbs.size();
-    for (int i = 0; i < dbnums; i++) {
-        if (cur_check_db == dbs.size())
-            cur_check_db = 0;
-        DB *db = select_db(cur_check_db++);
-        if (keys > db->get_expire_keys().size())
-            keys = db->get_expire_keys().size();
-        for (int j = 0; j < keys; j++) {
-            if (db->get_expire_keys().empty()) break;
-            auto randkey = get_rand_hash_key(db->get_expire_keys());
-            size_t bucket = std::get<0>(randkey);
-            size_t where = std::get<1>(randkey);
-            for (auto it = db->get_expire_keys().cbegin(bucket);
-                    it != db->get_expire_keys().cend(bucket); ++it) {
-                if (where-- == 0) {
-                    if (it->second <= now) {
-                        db->del_key_with_expire(it->first);
-                    }
-                    break;
-                }
-            }
-        }
+    if (is_sharded()) return;
+    DB::active_expire_cycle(dbs, expire_cycle, false);
+    expire_cycle.update_rate(lru_clock);
+}
+
+void engine::before_sleep()
+{
+    aof->flush();
+    if (!is_sharded()) {
+        DB::active_expire_cycle(dbs, expire_cycle, true);
+        return;
     }
+    // 是否真正执行由各个分片自己决定，这里只是避免过于频繁地投递任务
+    auto now = angel::util::get_cur_time_us();
+    if (now < last_fast_expire + expire_cycle_t::FAST_DURATION * 2) return;
+    last_fast_expire = now;
+    for (auto& s : shards)
+        s->post([s = s.get()]{ s->active_expire(true); });
 }
 
-command_t *engine::find_command(const std::string& name)
+void engine::info(std::string& s)
 {
-    return db()->find_command(name);
+    if (!is_sharded()) {
+        expire_cycle.append_info(s);
+        return;
+    }
+    expire_cycle_t total;
+    lock();
+    for (auto& sh : shards)
+        total.merge(sh->get_expire_cycle(), shards.size());
+    unlock();
+    total.append_info(s);
 }
 
 void engine::clear()
 {
     for (auto& db : dbs)
         db->clear();
+    for (auto& s : shards)
+        s->clear();
 }
 
 DB::DB(mmdb::engine *e) : engine(e)
 {
-    cmdtable = {
-        { "SELECT",     { -2, IS_WRITE, BIND(select) } },
-        { "EXISTS",     { -2, IS_READ,  BIND(exists) } },
-        { "TYPE",       { -2, IS_READ,  BIND(type) } },
-        { "TTL",        { -2, IS_READ,  BIND(ttl) } },
-        { "PTTL",       { -2, IS_READ,  BIND(pttl) } },
-        { "EXPIRE",     { -3, IS_WRITE, BIND(expire) } },
-        { "PEXPIRE",    { -3, IS_WRITE, BIND(pexpire) } },
-        { "DEL",        {  2, IS_WRITE, BIND(del) } },
-        { "KEYS",       { -2, IS_READ,  BIND(keys) } },
-        { "SAVE",       { -1, IS_READ,  BIND(save) } },
-        { "BGSAVE",     { -1, IS_READ,  BIND(bgsave) } },
-        { "BGREWRITEAOF",{-1, IS_READ,  BIND(bgrewriteaof) } },
-        { "LASTSAVE",   { -1, IS_READ,  BIND(lastsave) } },
-        { "FLUSHDB",    { -1, IS_WRITE, BIND(flushdb) } },
-        { "FLUSHALL",   { -1, IS_WRITE, BIND(flushall) } },
-        { "DBSIZE",     { -1, IS_READ,  BIND(dbsize) } },
-        { "RENAME",     { -3, IS_WRITE, BIND(rename) } },
-        { "RENAMENX",   { -3, IS_WRITE, BIND(renamenx) } },
-        { "MOVE",       { -3, IS_WRITE, BIND(move) } },
-        { "LRU",        { -2, IS_READ,  BIND(lru) } },
-        { "SORT",       {  2, IS_READ,  BIND(sort) } },
-        { "SET",        {  3, IS_WRITE, BIND(set) } },
-        { "SETNX",      { -3, IS_WRITE, BIND(setnx) } },
-        { "GET",        { -2, IS_READ,  BIND(get) } },
-        { "GETSET",     { -3, IS_WRITE, BIND(getset) } },
-        { "APPEND",     { -3, IS_WRITE, BIND(append) } },
-        { "STRLEN",     { -2, IS_READ,  BIND(strlen) } },
-        { "MSET",       {  3, IS_WRITE, BIND(mset) } },
-        { "MGET",       {  2, IS_READ,  BIND(mget) } },
-        { "INCR",       { -2, IS_WRITE, BIND(incr) } },
-        { "INCRBY",     { -3, IS_WRITE, BIND(incrby) } },
-        { "DECR",       { -2, IS_WRITE, BIND(decr) } },
-        { "DECRBY",     { -3, IS_WRITE, BIND(decrby) } },
-        { "SETRANGE",   { -4, IS_WRITE, BIND(setrange) } },
-        { "GETRANGE",   { -4, IS_READ,  BIND(getrange) } },
-        { "LPUSH",      {  3, IS_WRITE, BIND(lpush) } },
-        { "LPUSHX",     { -3, IS_WRITE, BIND(lpushx) } },
-        { "RPUSH",      {  3, IS_WRITE, BIND(rpush) } },
-        { "RPUSHX",     { -3, IS_WRITE, BIND(rpushx) } },
-        { "LPOP",       { -2, IS_WRITE, BIND(lpop) } },
-        { "RPOP",       { -2, IS_WRITE, BIND(rpop) } },
-        { "RPOPLPUSH",  { -3, IS_WRITE, BIND(rpoplpush) } },
-        { "LREM",       { -4, IS_WRITE, BIND(lrem) } },
-        { "LLEN",       { -2, IS_READ,  BIND(llen) } },
-        { "LINDEX",     { -3, IS_READ,  BIND(lindex) } },
-        { "LSET",       { -4, IS_WRITE, BIND(lset) } },
-        { "LRANGE",     { -4, IS_READ,  BIND(lrange) } },
-        { "LTRIM",      { -4, IS_WRITE, BIND(ltrim) } },
-        { "BLPOP",      {  3, IS_READ,  BIND(blpop) } },
-        { "BRPOP",      {  3, IS_READ,  BIND(brpop) } },
-        { "BRPOPLPUSH", { -4, IS_READ,  BIND(brpoplpush) } },
-        { "HSET",       { -4, IS_WRITE, BIND(hset) } },
-        { "HSETNX",     { -4, IS_WRITE, BIND(hsetnx) } },
-        { "HGET",       { -3, IS_READ,  BIND(hget) } },
-        { "HEXISTS",    { -3, IS_READ,  BIND(hexists) } },
-        { "HDEL",       {  3, IS_WRITE, BIND(hdel) } },
-        { "HLEN",       { -2, IS_READ,  BIND(hlen) } },
-        { "HSTRLEN",    { -3, IS_READ,  BIND(hstrlen) } },
-        { "HINCRBY",    { -4, IS_WRITE, BIND(hincrby) } },
-        { "HMSET",      {  4, IS_WRITE, BIND(hmset) } },
-        { "HMGET",      {  3, IS_READ,  BIND(hmget) } },
-        { "HKEYS",      { -2, IS_READ,  BIND(hkeys) } },
-        { "HVALS",      { -2, IS_READ,  BIND(hvals) } },
-        { "HGETALL",    { -2, IS_READ,  BIND(hgetall) } },
-        { "SADD",       {  3, IS_WRITE, BIND(sadd) } },
-        { "SISMEMBER",  { -3, IS_READ,  BIND(sismember) } },
-        { "SPOP",       { -2, IS_WRITE, BIND(spop) } },
-        { "SRANDMEMBER",{  2, IS_READ,  BIND(srandmember) } },
-        { "SREM",       {  3, IS_WRITE, BIND(srem)  } },
-        { "SMOVE",      { -4, IS_WRITE, BIND(smove) } },
-        { "SCARD",      { -2, IS_READ,  BIND(scard) } },
-        { "SMEMBERS",   { -2, IS_READ,  BIND(smembers) } },
-        { "SINTER",     {  2, IS_READ,  BIND(sinter) } },
-        { "SINTERSTORE",{  3, IS_WRITE, BIND(sinterstore) } },
-        { "SUNION",     {  2, IS_READ,  BIND(sunion) } },
-        { "SUNIONSTORE",{  3, IS_WRITE, BIND(sunionstore) } },
-        { "ZADD",       {  4, IS_WRITE, BIND(zadd) } },
-        { "ZSCORE",     { -3, IS_READ,  BIND(zscore) } },
-        { "ZINCRBY",    { -4, IS_WRITE, BIND(zincrby) } },
-        { "ZCARD",      { -2, IS_READ,  BIND(zcard) } },
-        { "ZCOUNT",     { -4, IS_READ,  BIND(zcount) } },
-        { "ZRANGE",     {  4, IS_READ,  BIND(zrange) } },
-        { "ZREVRANGE",  {  4, IS_READ,  BIND(zrevrange) } },
-        { "ZRANK",      { -3, IS_READ,  BIND(zrank) } },
-        { "ZREVRANK",   { -3, IS_READ,  BIND(zrevrank) } },
-        { "ZREM",       {  3, IS_WRITE, BIND(zrem) } },
-        { "ZRANGEBYSCORE",      {  4, IS_READ,  BIND(zrangebyscore) } },
-        { "ZREVRANGEBYSCORE",   {  4, IS_READ,  BIND(zrevrangebyscore) } },
-        { "ZREMRANGEBYRANK",    { -4, IS_WRITE, BIND(zremrangebyrank) } },
-        { "ZREMRANGEBYSCORE",   { -4, IS_WRITE, BIND(zremrangebyscore) } },
-    };
+    if (server_conf.expire_index)
+        expire_index.reset(new expire_wheel(angel::util::get_cur_time_ms()));
+}
+
+size_t DB::expire_random_keys(int keys, size_t& sampled)
+{
+    auto now = lru_clock.load();
+    size_t expired = 0;
+    thread_local std::vector<expire_keys_t::iterator> samples;
+    samples.clear();
+    expire_keys.sample(keys, samples);
+    sampled = samples.size();
+    // 删除元素不会移动其他元素，所以剩下的迭代器仍然有效
+    for (auto& it : samples) {
+        if (it->second <= now) {
+            del_key_with_expire(it->first);
+            expired++;
+        }
+    }
+    return expired;
+}
+
+size_t DB::expire_due_keys(int keys)
+{
+    return expire_index->pop(lru_clock, keys,
+            [this](const std::string& key){ del_key_with_expire(key); });
+}
+
+// 每次检查mmdb_expire_check_dbnums个数据库，只要从一个数据库中取样到的键
+// 有较多已过期，就继续检查这个数据库，直到超出时间限制
+// 开启expire-index时不再取样，而是直接弹出所有已到期的键，直到超出时间限制
+void DB::active_expire_cycle(const std::vector<std::unique_ptr<DB>>& dbs,
+                             expire_cycle_t& cycle, bool fast)
+{
+    if (!cycle.begin(fast)) return;
+    int dbnums = server_conf.mmdb_expire_check_dbnums;
+    if (dbs.size() < dbnums) dbnums = dbs.size();
+    size_t total_sampled = 0, total_expired = 0;
+    bool timedout = false;
+    for (int i = 0; i < dbnums && !timedout; i++) {
+        if (cycle.cur_db >= dbs.size())
+            cycle.cur_db = 0;
+        DB *db = dbs[cycle.cur_db++].get();
+        if (db->expire_index) {
+            size_t keys = server_conf.mmdb_expire_check_keys;
+            size_t expired;
+            do {
+                expired = db->expire_due_keys(keys);
+                total_sampled += expired;
+                total_expired += expired;
+                if (cycle.timeout()) {
+                    timedout = true;
+                    break;
+                }
+            } while (expired == keys);
+            continue;
+        }
+        while (!db->expire_keys.empty()) {
+            size_t sampled;
+            size_t expired = db->expire_random_keys(server_conf.mmdb_expire_check_keys, sampled);
+            total_sampled += sampled;
+            total_expired += expired;
+            if (cycle.timeout()) {
+                timedout = true;
+                break;
+            }
+            if (!cycle.stale(sampled, expired)) break;
+        }
+    }
+    cycle.end(total_sampled, total_expired, timedout);
+}
+
+void DB::active_rehash(const std::vector<std::unique_ptr<DB>>& dbs)
+{
+    for (auto& db : dbs) {
+        db->dict.shrink();
+        db->expire_keys.shrink();
+    }
+    if (!server_conf.mmdb_active_rehashing) return;
+    for (auto& db : dbs) {
+        if (db->dict.rehashing()) {
+            db->dict.rehash_ms(1);
+            break;
+        }
+        if (db->expire_keys.rehashing()) {
+            db->expire_keys.rehash_ms(1);
+            break;
+        }
+    }
 }
 
 void DB::clear()
 {
     dict.clear();
     expire_keys.clear();
+    if (expire_index) expire_index->clear();
 }
 
 void DB::flushdb(context_t& con)
@@ -380,6 +520,17 @@ void DB::type(context_t& con)
         con.append(shared.hash_type);
 }
 
+// OBJECT ENCODING key
+void DB::object(context_t& con)
+{
+    auto& key = con.argv[2];
+    if (!con.isequal(1, "ENCODING")) ret(con, shared.syntax_err);
+    check_expire(key);
+    auto it = find(key);
+    if (not_found(it)) ret(con, shared.nil);
+    con.append_reply_string(it->second.encoding());
+}
+
 // (P)TTL key
 void DB::_ttl(context_t& con, bool is_ttl)
 {
@@ -492,7 +643,7 @@ void DB::rename(context_t& con)
     if (not_found(it)) ret(con, shared.no_such_key);
     if (key == newkey) ret(con, shared.ok);
     del_key_with_expire(newkey);
-    insert(newkey, it->second);
+    insert(newkey, std::move(it->second));
     del_key_with_expire(key);
     con.append(shared.ok);
 }
@@ -507,7 +658,7 @@ void DB::renamenx(context_t& con)
     if (not_found(it)) ret(con, shared.no_such_key);
     if (key == newkey) ret(con, shared.n0);
     if (!not_found(newkey)) ret(con, shared.n0);
-    insert(newkey, it->second);
+    insert(newkey, std::move(it->second));
     del_key_with_expire(key);
     con.append(shared.n1);
 }
@@ -517,8 +668,7 @@ void DB::lru(context_t& con)
     check_expire(con.argv[1]);
     auto it = find(con.argv[1]);
     if (not_found(it)) ret(con, shared.n_1);
-    auto seconds = (lru_clock - it->second.lru) / 1000;
-    con.append_reply_number(seconds);
+    con.append_reply_number(it->second.idle_time());
 }
 
 void DB::watch(context_t& con)
@@ -598,10 +748,9 @@ void DB::move(context_t& con)
     }
     auto it = find(key);
     if (not_found(it)) ret(con, shared.n0);
-    auto db = engine->select_db(dbnum);
-    it = db->find(key);
-    if (!not_found(it)) ret(con, shared.n0);
-    insert(it->first, it->second);
+    auto db = engine->select_db(dbnum, key);
+    if (!db->not_found(key)) ret(con, shared.n0);
+    db->insert(key, std::move(it->second));
     del_key_with_expire(key);
     con.append(shared.n1);
 }
@@ -615,7 +764,7 @@ void DB::check_expire(const key_t& key)
         return;
     del_key_with_expire(key);
     argv_t argv = { "DEL", key };
-    __server->append_write_command(argv, nullptr, 0);
+    engine->propagate(argv);
 }
 
 }
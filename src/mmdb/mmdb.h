@@ -12,13 +12,16 @@
 #include <set>
 #include <deque>
 #include <tuple>
-#include <any>
 
 #include <angel/util.h>
 
 #include "../db_base.h"
+#include "../task_queue.h"
 #include "../skiplist.h"
+#include "../expire_wheel.h"
 #include "../parser.h"
+#include "encoding.h"
+#include "dict.h"
 
 namespace alice {
 
@@ -28,6 +31,9 @@ class engine;
 class Rdb;
 class Aof;
 class DB;
+class shard;
+struct shard_part_t;
+struct shard_command_t;
 
 class engine : public db_base_t {
 public:
@@ -39,6 +45,8 @@ public:
     void start() override;
     void exit() override;
     void server_cron() override;
+    void before_sleep() override;
+    void info(std::string& s) override;
     void set_context(const angel::connection_ptr& conn)
     {
         conn->set_context(context_t(conn.get(), this));
@@ -53,21 +61,43 @@ public:
         set_context(conn);
     }
     void free_memory_if_needed() override;
+    bool dispatch_command(context_t& con, command_t *c,
+                          const char *query, size_t len, size_t seq) override;
+    void lock() override;
+    void unlock() override;
     void creat_snapshot() override;
     bool is_creating_snapshot() override;
     bool is_created_snapshot() override;
     std::string get_snapshot_name() override;
     void load_snapshot() override;
-    command_t *find_command(const std::string& name) override;
+    bool can_stream_snapshot() override { return true; }
+    void creat_snapshot_to(int fd) override;
+    std::unique_ptr<snapshot_loader_t> creat_snapshot_loader() override;
+    command_t *get_command(int id) override
+    {
+        return cmdtable.get(id);
+    }
     void do_after_exec_write_cmd(const argv_t& argv, const char *query, size_t len) override;
+    uint64_t write_log_seq() override;
+    const char *write_error() override;
     void watch(context_t& con) override;
     void unwatch(context_t& con) override;
     void check_blocked_clients();
     void check_expire_keys();
 
-    DB *db() { return dbs[cur_db_num].get(); }
+    // 在分片线程中执行命令时返回该分片上的数据库
+    DB *db() { return shard_db ? shard_db : dbs[cur_db_num].get(); }
     void switch_db(int dbnum) { cur_db_num = dbnum; }
     DB* select_db(int dbnum) { return dbs[dbnum].get(); }
+    // 键key所在的编号为dbnum的数据库
+    DB *select_db(int dbnum, const std::string& key);
+    // 编号为dbnum的所有数据库，分片模式下每个分片上都有一个
+    std::vector<DB*> get_dbs(int dbnum);
+    bool is_sharded() const { return !shards.empty(); }
+    // 在db()上执行fn，分片模式下会先找到命令所在的分片
+    void call(context_t& con, void (*fn)(DB*, context_t&));
+    // 传播执行命令过程中产生的写命令
+    void propagate(const argv_t& argv);
     int get_cur_db_num() const { return cur_db_num; }
     void add_block_client(size_t id)
     {
@@ -93,42 +123,124 @@ private:
     void evict_all_keys_with_random();
     void evict_volatile_with_random();
     void evict_volatile_with_ttl();
-    template <typename T>
-    void evict_key(const T& hash, int (evict)[2])
-    {
-        for (auto it = hash.cbegin(evict[0]); it != hash.end(evict[0]); ++it) {
-            if (evict[1]-- == 0) {
-                evict_key(it->first);
-                break;
-            }
-        }
-    }
     void evict_key(const std::string& key);
+    // sharding
+    void start_shards();
+    int shard_of(std::string_view key);
+    int make_plan(shard_command_t& cmd, const argv_t& argv);
+    void execute_part(shard_command_t& cmd, shard_part_t& part);
+    void merge_replies(shard_command_t& cmd);
+    void finish_part(const std::shared_ptr<shard_command_t>& cmd);
 
+    CommandTable cmdtable;
     int cur_db_num = 0;
-    int cur_check_db = 0;
+    expire_cycle_t expire_cycle;
+    int64_t last_fast_expire = 0;
     size_t dirty = 0; // 执行的写命令数
     std::list<size_t> blocked_clients;
+    std::vector<std::unique_ptr<shard>> shards;
+    // 分片线程将执行完的命令交给主线程
+    std::unique_ptr<task_queue> done_tasks;
+    int locked = 0;
+    inline static thread_local DB *shard_db = nullptr;
+    inline static thread_local std::string *shard_writes = nullptr;
 };
 
-// 表示一个键值对的值
-struct Value {
+// 表示一个键值对的值，所有类型的值都占用24个字节
+// 字符串有三种编码:
+// INT: 能够无损转换为整数的字符串直接保存为int64_t
+// EMBSTR: 不超过EMBSTR_MAX个字节的字符串直接保存在Value内部
+// RAW: 其余的字符串在堆上分配一个std::string
+// 列表、集合、哈希表和有序集合对象总是在堆上分配
+class Value {
 public:
-    Value() : value(0), lru(lru_clock) {  }
-    Value(std::any&& value) : value(value), lru(lru_clock)
+    enum Type { STRING, LIST, SET, ZSET, HASH };
+    enum Encoding { RAW, EMBSTR, INT };
+    static constexpr size_t EMBSTR_MAX = 16;
+    // lru时钟的精度为1s，24位可以表示约194天
+    static constexpr uint32_t LRU_MAX = (1 << 24) - 1;
+    Value() : Value(std::string_view()) {  }
+    Value(std::string_view s) : type_(STRING), lru_(lru_now()) { set_string(s); }
+    Value(const std::string& s) : Value(std::string_view(s)) {  }
+    Value(const char *s) : Value(std::string_view(s)) {  }
+    Value(std::string&& s);
+    Value(List&& list) : type_(LIST), enc_(RAW), lru_(lru_now()) { u.list = new List(std::move(list)); }
+    Value(Set&& set) : type_(SET), enc_(RAW), lru_(lru_now()) { u.set = new Set(std::move(set)); }
+    Value(Zset&& zset) : type_(ZSET), enc_(RAW), lru_(lru_now()) { u.zset = new Zset(std::move(zset)); }
+    Value(Hash&& hash) : type_(HASH), enc_(RAW), lru_(lru_now()) { u.hash = new Hash(std::move(hash)); }
+    Value(const Value& v);
+    Value(Value&& v) noexcept : type_(v.type_), enc_(v.enc_), lru_(v.lru_), len_(v.len_), u(v.u)
+    {
+        v.type_ = STRING;
+        v.enc_ = EMBSTR;
+        v.len_ = 0;
+    }
+    Value& operator=(Value&& v) noexcept
     {
+        if (this != &v) {
+            destroy();
+            type_ = v.type_;
+            enc_ = v.enc_;
+            lru_ = v.lru_;
+            len_ = v.len_;
+            u = v.u;
+            v.type_ = STRING;
+            v.enc_ = EMBSTR;
+            v.len_ = 0;
+        }
+        return *this;
     }
-    Value& operator=(std::any&& value) noexcept
+    Value& operator=(const Value& v)
     {
-        this->value = value;
-        this->lru = lru_clock;
+        if (this != &v) *this = Value(v);
         return *this;
     }
-    std::any value;
+    ~Value() { destroy(); }
+    Type type() const { return static_cast<Type>(type_); }
+    const char *encoding() const;
+    // 字符串的内容，INT编码时会先将整数格式化到buf中
+    std::string_view str(char (&buf)[32]) const;
+    // 将字符串转换为RAW编码并返回它，用于原地修改字符串
+    std::string& raw_string();
+    // INT编码，或者能够转换为整数的字符串
+    bool get_integer(int64_t& v) const;
+    List& list() const { return *u.list; }
+    Set& set() const { return *u.set; }
+    Zset& zset() const { return *u.zset; }
+    Hash& hash() const { return *u.hash; }
     // 最近一次访问该键的时间，用于进行lru内存淘汰
-    int64_t lru;
+    void touch() { lru_ = lru_now(); }
+    // 距离最近一次访问过去了多少秒
+    int64_t idle_time() const { return (lru_now() - lru_) & LRU_MAX; }
+    static uint32_t lru_now() { return (lru_clock / 1000) & LRU_MAX; }
+private:
+    void set_string(std::string_view s);
+    void destroy();
+
+    uint32_t type_ : 4;
+    uint32_t enc_ : 4;
+    uint32_t lru_ : 24;
+    uint8_t len_ = 0; // EMBSTR编码的字符串的长度
+    union {
+        int64_t ival;
+        char buf[EMBSTR_MAX];
+        std::string *raw;
+        List *list;
+        Set *set;
+        Zset *zset;
+        Hash *hash;
+    } u;
 };
 
+static_assert(sizeof(Value) == 24);
+
+template <typename T> constexpr Value::Type type_of();
+template <> constexpr Value::Type type_of<std::string>() { return Value::STRING; }
+template <> constexpr Value::Type type_of<List>() { return Value::LIST; }
+template <> constexpr Value::Type type_of<Set>() { return Value::SET; }
+template <> constexpr Value::Type type_of<Zset>() { return Value::ZSET; }
+template <> constexpr Value::Type type_of<Hash>() { return Value::HASH; }
+
 // 排序时会为每个待排序的元素(e)创建一个sortobj对象(s)，s->value存储
 // &e->value，s->u的值取决于按哪种方式进行排序
 struct sortobj {
@@ -144,86 +256,20 @@ struct sortobj {
     } u;
 };
 
-struct zslkey {
-    zslkey() {  }
-    zslkey(double score, const std::string& member)
-        : score(score), member(member) {  }
-    double score;
-    std::string member;
-};
-
-// 对于对象l和r，如果l.score < r.score，就认为l < r
-// 否则如果l.score == r.score，就继续比较键值，如果l.member < r.member，
-// 就认为l < r，否则就认为l >= r
-class zslkeycmp {
-public:
-    bool operator()(const zslkey& lhs, const zslkey& rhs) const
-    {
-        if (lhs.score < rhs.score) {
-            return true;
-        } else if (lhs.score == rhs.score) {
-            if (lhs.member.compare(rhs.member) < 0)
-                return true;
-        }
-        return false;
-    }
-};
-
-struct Zset {
-    using iterator = skiplist<zslkey, bool, zslkeycmp>::iterator;
-    bool empty() const { return zmap.empty(); }
-    size_t size() const { return zmap.size(); }
-    void insert(double score, const std::string& key)
-    {
-        zsl.insert(zslkey(score, key), false);
-        auto it = zmap.emplace(key, score);
-        if (!it.second) zmap[key] = score;
-    }
-    void erase(double score, const std::string& key)
-    {
-        zsl.erase(zslkey(score, key));
-        zmap.erase(key);
-    }
-    size_t order_of_key(double score, const std::string& key)
-    {
-        return zsl.order_of_key(zslkey(score, key));
-    }
-    size_t diff_range(iterator it, iterator last)
-    {
-        auto l = order_of_key(it->first.score, it->first.member);
-        if (last == zsl.end()) return zsl.size() - l + 1;
-        return order_of_key(last->first.score, last->first.member) - l;
-    }
-    iterator lower_bound(double score)
-    {
-        return zsl.lower_bound(zslkey(score, ""));
-    }
-    iterator upper_bound(double score)
-    {
-        return zsl.upper_bound(zslkey(score, ""));
-    }
-    double min_score() { return (*zsl.begin()).first.score; }
-    double max_score() { return (*--zsl.end()).first.score; }
-    // value(bool)不作使用
-    skiplist<zslkey, bool, zslkeycmp> zsl;
-    // 根据一个member可以在常数时间找到其score
-    std::unordered_map<std::string, double> zmap;
-};
-
 using zsk_range = std::pair<Zset::iterator, Zset::iterator>;
 
 class DB {
 public:
     using key_t = std::string;
-    using dict_t = std::unordered_map<key_t, Value>;
-    using expire_keys_t = std::unordered_map<key_t, int64_t>;
+    using dict_t = mmdb::dict<Value>;
+    using expire_keys_t = mmdb::dict<int64_t>;
     using watch_keys_t = std::unordered_map<key_t, std::vector<size_t>>;
-    using iterator = std::unordered_map<key_t, Value>::iterator;
+    using iterator = dict_t::iterator;
     // value-type
     using String = std::string;
-    using List = std::list<std::string>;
-    using Set = std::unordered_set<std::string>;
-    using Hash = std::unordered_map<std::string, std::string>;
+    using List = mmdb::List;
+    using Set = mmdb::Set;
+    using Hash = mmdb::Hash;
     // 因为排序结果集需要剪切，所以deque优于vector
     using sobj_list = std::deque<sortobj>;
     explicit DB(engine *);
@@ -232,22 +278,31 @@ public:
     expire_keys_t& get_expire_keys() { return expire_keys; }
     watch_keys_t& get_watch_keys() { return watch_keys; }
     void del_key(const key_t& key) { dict.erase(key); }
-    void del_expire_key(const key_t& key) { expire_keys.erase(key); }
-    void del_key_with_expire(const key_t& key)
+    void del_expire_key(const key_t& key)
     {
-        dict.erase(key);
+        if (expire_index) expire_index->remove(key);
         expire_keys.erase(key);
     }
+    // key可能引用的是两个字典中的键，所以要先找到再删除
+    void del_key_with_expire(const key_t& key)
+    {
+        auto it = dict.find(key);
+        auto e = expire_keys.find(key);
+        if (e != expire_keys.end() && expire_index) expire_index->remove(key);
+        if (it != dict.end()) dict.erase(it);
+        if (e != expire_keys.end()) expire_keys.erase(e);
+    }
 
-    template <typename T>
-    void add_key(const key_t& key, const T& value)
+    template <typename K, typename T>
+    void add_key(K&& key, T&& value)
     {
-        dict.emplace(key, value);
+        dict.emplace(std::forward<K>(key), std::forward<T>(value));
     }
 
     void add_expire_key(const key_t& key, int64_t expire)
     {
-        expire_keys[key] = expire;
+        expire_keys.insert_or_assign(key, expire);
+        if (expire_index) expire_index->add(key, expire);
     }
 
     void clear();
@@ -261,15 +316,21 @@ public:
             del_key_with_expire(key);
     }
 
-    command_t *find_command(const std::string& name)
+    // 随机检查keys个带过期时间的键，删除其中已过期的，返回删除的个数
+    size_t expire_random_keys(int keys, size_t& sampled);
+    // 从expire_index中弹出至多keys个已到期的键并删除，返回删除的个数
+    size_t expire_due_keys(int keys);
+    // 主动删除过期键，fast为真时为快速模式
+    static void active_expire_cycle(const std::vector<std::unique_ptr<DB>>& dbs,
+                                    expire_cycle_t& cycle, bool fast);
+    // 每条命令执行前迁移n个键，直到rehash完成
+    void rehash_step(size_t n)
     {
-        auto it = cmdtable.find(name);
-        if (it != cmdtable.end())
-            return &it->second;
-        else
-            return nullptr;
+        dict.rehash_step(n);
+        expire_keys.rehash_step(n);
     }
-
+    // 缩小过于稀疏的字典，并用至多1ms为其中一个正在rehash的字典迁移键
+    static void active_rehash(const std::vector<std::unique_ptr<DB>>& dbs);
     void touch_watch_key(const key_t& key);
     void clear_blocking_keys_for_context(context_t& con);
 
@@ -297,6 +358,7 @@ public:
     void lru(context_t& con);
     void move(context_t& con);
     void sort(context_t& con);
+    void object(context_t& con);
     // string operations
     void set(context_t& con);
     void setnx(context_t& con);
@@ -387,13 +449,16 @@ public:
         return not_found(find(key));
     }
     template <typename T>
-    void insert(const key_t& key, const T& value)
+    void insert(const key_t& key, T&& value)
     {
-        auto it = dict.emplace(key, value);
-        // emplace()和insert()都不会覆盖已存在的键
-        if (!it.second)
-            dict[key] = std::move(value);
-        if (typeid(T) == typeid(List))
+        Value v(std::forward<T>(value));
+        bool is_list = v.type() == Value::LIST;
+        auto it = dict.find(key);
+        if (it != dict.end())
+            it->second = std::move(v);
+        else
+            dict.emplace(key, std::move(v));
+        if (is_list)
             blocking_pop(key);
     }
 private:
@@ -420,15 +485,19 @@ private:
     void set_context_to_block(context_t& con, int timeout);
     void blocking_pop(const key_t& key);
 
-    int sort_get_result(context_t& con, sobj_list& result, const key_t& key, unsigned& cmdops);
-    void sort_by_pattern(sobj_list& result, const key_t& by, unsigned& cmdops);
-    void sort_by_get_keys(sobj_list& result, const std::vector<std::string>& getset, unsigned cmdops);
+    int sort_get_result(context_t& con, sobj_list& result, std::deque<std::string>& values,
+                        const key_t& key, unsigned& cmdops);
+    void sort_by_pattern(sobj_list& result, std::deque<std::string>& values,
+                         const key_t& by, unsigned& cmdops);
+    void sort_by_get_keys(sobj_list& result, std::deque<std::string>& values,
+                          const std::vector<std::string>& getset, unsigned cmdops);
     void sort_store(sobj_list& result, const key_t& des, unsigned cmdops);
 
-    CommandTable cmdtable;
-    std::unordered_map<key_t, Value> dict;
+    dict_t dict;
     // <键，键的到期时间>
-    std::unordered_map<key_t, int64_t> expire_keys;
+    expire_keys_t expire_keys;
+    // 开启expire-index时按到期时间索引expire_keys中的键
+    std::unique_ptr<expire_wheel> expire_index;
     // <键，监视该键的客户端列表>
     std::unordered_map<key_t, std::vector<size_t>> watch_keys;
     // 保存所有阻塞的键，每个键的值是阻塞于它的客户端列表
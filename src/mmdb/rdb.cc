@@ -8,6 +8,8 @@
 #include <arpa/inet.h>
 
 #include <tuple>
+#include <thread>
+#include <atomic>
 
 #include <snappy.h>
 
@@ -22,6 +24,7 @@ namespace alice {
 namespace mmdb {
 
 static unsigned char magic[5] = { 0x41, 0x4c, 0x49, 0x43, 0x45 };
+static unsigned char version = 2;
 static unsigned char select_db = 0xfe;
 static unsigned char eof = 0xff;
 static unsigned char string_type = 0;
@@ -32,10 +35,15 @@ static unsigned char zset_type = 4;
 static unsigned char expire_key = 5;
 static unsigned char compress_value = 0;
 static unsigned char uncompress_value = 1;
+static unsigned char raw_block = 0;
+static unsigned char snappy_block = 1;
+static unsigned char segment_magic[4] = { 0x53, 0x45, 0x47, 0x53 }; // "SEGS"
+// <raw-len(8)><stored-len(8)><block-type(1)><crc32c(4)>
+static const size_t block_header_size = 21;
 
 // <key>: <key-len><key>
 // <value>: <uncompress><origin-len><origin-value>
-//        | <compress><origin-len><compressed-len><compressed-value>
+//        | <compress><origin-len><compressed-len><compressed-value> (只出现在v1中)
 // <pair>: <key><value>
 //
 // <string>: <string-type><pair>
@@ -45,62 +53,187 @@ static unsigned char uncompress_value = 1;
 // <zset>: <zset-type><key><zset-len><<pair> ...>
 //
 // <any-value>: <<string>|<list>|<set>|<hash>|<zset>>
-// <db>: <<key><any-value> ...>
+// <record>: <select-db><db-num> | [<expire-key><expire(8)>]<any-value> | <eof>
 //
-// rdb-file:
-// <magic><<db-num><db> ...><eof>
+// <block>: <raw-len(8)><stored-len(8)><block-type(1)><crc32c(4)><stored-data>
+// 块中是若干条完整的记录，压缩后更小时存储snappy压缩后的数据，
+// crc32c覆盖块头的前17个字节和stored-data
+//
+// <segment>: <<block> ...>，第一条记录是<select-db>
+// <segment-index>: <raw-block><segment-count><<segment-offset> ...><index-offset>>
+//
+// rdb-file(v2):
+// <magic><version><<segment> ...><segment-index><index-offset(8)><segment-magic>
+//
+// 最后一个段的最后一条记录是<eof>，一个数据库的键会被切分成多个约segment_size大小的段，
+// 所以可以根据段索引并行地载入各个段，每个线程每次只需要读入一个块
+//
+// rdb-file(v1):
+// <magic><<record> ...>，逐个压缩value，载入时仍然兼容
+
+// 读取时不移动文件偏移，可以在多个线程中使用同一个fd
+static bool pread_full(int fd, char *buf, size_t n, uint64_t off)
+{
+    while (n > 0) {
+        ssize_t r = ::pread(fd, buf, n, off);
+        if (r <= 0) return false;
+        buf += r;
+        n -= r;
+        off += r;
+    }
+    return true;
+}
+
+// 打开临时文件并写入文件头
+int Rdb::open_tmpfile(std::string& tmpfile)
+{
+    char name[16];
+    strcpy(name, "tmp.XXXXX");
+    mktemp(name);
+    tmpfile = name;
+    fd = open(name, O_RDWR | O_CREAT | O_APPEND, 0660);
+    write_header();
+    return fd;
+}
+
+void Rdb::write_header()
+{
+    fwrite(fd, reinterpret_cast<char*>(magic), sizeof(magic));
+    fwrite(fd, reinterpret_cast<char*>(&version), 1);
+    written = sizeof(magic) + 1;
+    buffer.clear();
+    segments.clear();
+    segment_start = 0;
+    segment_db = -1;
+}
 
 void Rdb::save()
 {
-    char tmpfile[16];
-    strcpy(tmpfile, "tmp.XXXXX");
-    mktemp(tmpfile);
-    fd = open(tmpfile, O_RDWR | O_CREAT | O_APPEND, 0660);
-    append(magic, 5);
+    save(server_conf.mmdb_rdb_file);
+}
+
+void Rdb::save(const std::string& filename)
+{
+    std::string tmpfile;
+    open_tmpfile(tmpfile);
+    save_dbs();
+    save_end();
+    rename(tmpfile.c_str(), filename.c_str());
+}
+
+void Rdb::save_dbs()
+{
     auto now = angel::util::get_cur_time_ms();
-    int index = 0;
-    for (auto& db : engine->dbs) {
-        auto& dict = db->get_dict();
-        auto& expire_keys = db->get_expire_keys();
-        if (dict.empty()) {
-            index++;
-            continue;
+    for (int index = 0; index < server_conf.mmdb_databases; index++) {
+        // 分片模式下同一个数据库的键分布在各个分片上
+        for (auto db : engine->get_dbs(index)) {
+            auto& dict = db->get_dict();
+            for (auto it = dict.begin(); it != dict.end(); ++it)
+                save_entry(index, db, it, now);
         }
+    }
+}
+
+// 无盘复制时在子进程中调用，fd是管道的写端，文件格式与rdb文件完全相同
+void Rdb::save_to(int pipefd)
+{
+    fd = pipefd;
+    write_header();
+    save_dbs();
+    save_tail();
+    close(fd);
+    fd = -1;
+}
+
+// 已过期的键不会被保存
+void Rdb::save_entry(int index, DB *db, const iterator& it, int64_t now)
+{
+    auto& expire_keys = db->get_expire_keys();
+    auto expire = expire_keys.find(it->first);
+    if (expire != expire_keys.end() && expire->second <= now)
+        return;
+    if (segment_start == 0 || written - segment_start >= segment_size) {
+        flush();
+        segment_start = written;
+        segments.push_back(segment_start);
+        segment_db = -1;
+    }
+    if (segment_db != index) {
         save_len(select_db);
         save_len(index);
-        for (auto it = dict.begin(); it != dict.end(); ++it) {
-            auto expire = expire_keys.find(it->first);
-            if (expire != expire_keys.end()) {
-                if (expire->second <= now) {
-                    db->del_key_with_expire(it->first);
-                    continue;
-                } else {
-                    save_len(expire_key);
-                    append(&expire->second, 8);
-                }
-            }
-            if (is_type(it, DB::String)) {
-                save_string(it);
-            } else if (is_type(it, DB::List)) {
-                save_list(it);
-            } else if (is_type(it, DB::Set)) {
-                save_set(it);
-            } else if (is_type(it, DB::Hash)) {
-                save_hash(it);
-            } else if (is_type(it, Zset)) {
-                save_zset(it);
-            }
-        }
-        index++;
+        segment_db = index;
+    }
+    if (expire != expire_keys.end()) {
+        save_len(expire_key);
+        append(&expire->second, 8);
+    }
+    if (is_type(it, DB::String)) {
+        save_string(it);
+    } else if (is_type(it, DB::List)) {
+        save_list(it);
+    } else if (is_type(it, DB::Set)) {
+        save_set(it);
+    } else if (is_type(it, DB::Hash)) {
+        save_hash(it);
+    } else if (is_type(it, Zset)) {
+        save_zset(it);
     }
+    end_record();
+}
+
+void Rdb::save_tail()
+{
     save_len(eof);
-    if (buffer.size() > 0) flush();
-    __server->fsync(fd);
-    rename(tmpfile, server_conf.mmdb_rdb_file.c_str());
+    flush();
+    segments.push_back(written);
+    save_segment_index();
+}
+
+void Rdb::save_end()
+{
+    save_tail();
+    // 之后就会rename()替换掉原来的快照，所以必须先同步地落盘
+    ::fsync(fd);
+    close(fd);
+    fd = -1;
+}
+
+// segments的最后一项是段索引自己的偏移
+void Rdb::save_segment_index()
+{
+    uint64_t index_offset = written;
+    save_len(segments.size() - 1);
+    for (auto off : segments)
+        save_len(off);
+    write_block(buffer, false);
+    buffer.clear();
+    fwrite(fd, reinterpret_cast<char*>(&index_offset), 8);
+    fwrite(fd, reinterpret_cast<char*>(segment_magic), sizeof(segment_magic));
+    written += 8 + sizeof(segment_magic);
+}
+
+// 无盘复制总是使用fork()，由主进程把管道中的数据转发给从服务器
+void Rdb::save_background_to(int pipefd)
+{
+    engine->lock();
+    child_pid = fork();
+    if (child_pid == 0) {
+        save_to(pipefd);
+        done();
+        abort();
+    }
+    engine->unlock();
 }
 
 void Rdb::save_background()
 {
+    // 分片模式下各个数据库属于不同的线程，只能使用fork()
+    if (server_conf.mmdb_forkless_snapshot && !engine->is_sharded()) {
+        save_incremental();
+        return;
+    }
+    // 分片线程必须在fork()时停下来，子进程才能看到一致的数据
+    engine->lock();
     child_pid = fork();
     // logInfo("Background saving started by pid %ld", _childPid);
     if (child_pid == 0) {
@@ -108,6 +241,109 @@ void Rdb::save_background()
         done();
         abort();
     }
+    engine->unlock();
+}
+
+// 开始时翻转所有字典的标记位，此后插入的键都不会被保存，
+// 原有的键被保存后会被重新标记，所以每个键只会被保存一次
+void Rdb::save_incremental()
+{
+    if (doing()) return;
+    inc.reset(new incremental_t());
+    open_tmpfile(inc->tmpfile);
+    for (auto& db : engine->dbs)
+        db->get_dict().flip_mark();
+    log_info("Background saving started without fork");
+    schedule_step();
+}
+
+void Rdb::schedule_step()
+{
+    __server->get_loop()->queue_in_loop([this]{
+        if (!inc) return;
+        save_step();
+        if (inc) schedule_step();
+    });
+}
+
+// 每次最多占用1ms，遍历过程中表被替换了，或者遍历第二张表时元素被移动了就从头开始，
+// 已经保存过的键不是stale()的，只需要跳过它们
+void Rdb::save_step()
+{
+    auto start = angel::util::get_cur_time_us();
+    auto now = start / 1000;
+    size_t visits = 0;
+    while (inc->index < server_conf.mmdb_databases) {
+        DB *db = engine->select_db(inc->index);
+        auto& dict = db->get_dict();
+        bool moved = dict.generation() != inc->gen &&
+                     (dict.table_generation() != inc->table_gen ||
+                      !dict.in_first_table(inc->it));
+        if (!inc->started || moved) {
+            inc->started = true;
+            inc->it = dict.begin();
+            inc->table_gen = dict.table_generation();
+        }
+        inc->gen = dict.generation();
+        for (auto& it = inc->it; it != dict.end(); ++it) {
+            if (dict.stale(it)) {
+                save_entry(inc->index, db, it, now);
+                dict.mark(it);
+            }
+            if (++visits % 64 == 0 && angel::util::get_cur_time_us() - start >= 1000)
+                return;
+        }
+        inc->index++;
+        inc->started = false;
+    }
+    save_end();
+    rename(inc->tmpfile.c_str(), server_conf.mmdb_rdb_file.c_str());
+    inc.reset();
+    inc_done = true;
+}
+
+void Rdb::finish_incremental()
+{
+    while (inc)
+        save_step();
+}
+
+bool Rdb::take_incremental_done()
+{
+    bool done = inc_done;
+    inc_done = false;
+    return done;
+}
+
+// FLUSHDB和FLUSHALL会删除所有的键，只能先完成快照
+void Rdb::before_command(DB *db, const argv_t& argv)
+{
+    if (!inc) return;
+    if (strcasecmp(argv[0].c_str(), "FLUSHDB") == 0 ||
+        strcasecmp(argv[0].c_str(), "FLUSHALL") == 0) {
+        finish_incremental();
+        return;
+    }
+    for (size_t i = 1; i < argv.size(); i++)
+        before_modify(db, argv[i]);
+}
+
+void Rdb::before_modify(DB *db, const std::string& key)
+{
+    if (!inc) return;
+    auto& dict = db->get_dict();
+    auto it = dict.find(key);
+    if (it == dict.end() || !dict.stale(it)) return;
+    save_entry(index_of(db), db, it, angel::util::get_cur_time_ms());
+    dict.mark(it);
+}
+
+int Rdb::index_of(DB *db)
+{
+    for (size_t i = 0; i < engine->dbs.size(); i++)
+        if (engine->dbs[i].get() == db)
+            return i;
+    return 0;
 }
 
 int Rdb::save_len(uint64_t len)
@@ -115,34 +351,26 @@ int Rdb::save_len(uint64_t len)
     return alice::save_len(buffer, len);
 }
 
-void Rdb::save_key(const std::string& key)
+void Rdb::save_key(std::string_view key)
 {
     save_len(key.size());
-    append(key);
+    append(key.data(), key.size());
 }
 
-void Rdb::save_value(const std::string& value)
+// 压缩以块为单位进行
+void Rdb::save_value(std::string_view value)
 {
-    if (can_compress(value.size())) {
-        save_len(compress_value);
-        save_len(value.size());
-        std::string output;
-        compress(value.data(), value.size(), &output);
-        save_len(output.size());
-        append(output);
-    } else {
-        save_len(uncompress_value);
-        save_len(value.size());
-        append(value);
-    }
+    save_len(uncompress_value);
+    save_len(value.size());
+    append(value.data(), value.size());
 }
 
 void Rdb::save_string(const iterator& it)
 {
     save_len(string_type);
     save_key(it->first);
-    auto& value = get_string_value(it);
-    save_value(value);
+    char buf[32];
+    save_value(it->second.str(buf));
 }
 
 void Rdb::save_list(const iterator& it)
@@ -151,9 +379,9 @@ void Rdb::save_list(const iterator& it)
     save_key(it->first);
     auto& list = get_list_value(it);
     save_len(list.size());
-    for (auto& value : list) {
+    list.for_each([this](std::string_view value){
         save_value(value);
-    }
+    });
 }
 
 void Rdb::save_set(const iterator& it)
@@ -162,9 +390,9 @@ void Rdb::save_set(const iterator& it)
     save_key(it->first);
     auto& set = get_set_value(it);
     save_len(set.size());
-    for (auto& value : set) {
+    set.for_each([this](std::string_view value){
         save_value(value);
-    }
+    });
 }
 
 void Rdb::save_hash(const iterator& it)
@@ -173,10 +401,10 @@ void Rdb::save_hash(const iterator& it)
     save_key(it->first);
     auto& hash = get_hash_value(it);
     save_len(hash.size());
-    for (auto& pair : hash) {
-        save_key(pair.first);
-        save_value(pair.second);
-    }
+    hash.for_each([this](std::string_view field, std::string_view value){
+        save_key(field);
+        save_value(value);
+    });
 }
 
 void Rdb::save_zset(const iterator& it)
@@ -185,53 +413,351 @@ void Rdb::save_zset(const iterator& it)
     save_key(it->first);
     auto& zset = get_zset_value(it);
     save_len(zset.size());
-    for (auto& it : zset.zmap) {
-        save_len(strlen(d2s(it.second)));
-        append(d2s(it.second));
-        save_value(it.first);
-    }
+    zset.for_each([this](std::string_view member, double score){
+        save_len(strlen(d2s(score)));
+        append(d2s(score));
+        save_value(member);
+    });
 }
 
 void Rdb::load()
 {
-    int fd = open(server_conf.mmdb_rdb_file.c_str(), O_RDONLY);
-    if (fd < 0) return;
+    load(server_conf.mmdb_rdb_file);
+}
+
+// 载入的数据会替换掉所有的键，正在进行的快照已经没有意义了
+void Rdb::cancel_incremental()
+{
+    if (!inc) return;
+    ::close(fd);
+    fd = -1;
+    unlink(inc->tmpfile.c_str());
+    inc.reset();
+}
+
+bool Rdb::load(const std::string& filename)
+{
+    cancel_incremental();
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    char header[sizeof(magic) + 1];
+    if (!pread_full(fd, header, sizeof(header), 0) || memcmp(header, magic, sizeof(magic))) {
+        close(fd);
+        return false;
+    }
+    engine->clear();
+    if (static_cast<unsigned char>(header[sizeof(magic)]) != version) {
+        load_v1(fd);
+        close(fd);
+        return true;
+    }
+    std::vector<segment> segments;
+    if (server_conf.mmdb_rdb_load_threads > 1 &&
+            load_segment_index(fd, get_filesize(fd), segments) && segments.size() > 1)
+        load_parallel(fd, segments);
+    else
+        load_serial(fd);
+    close(fd);
+    return true;
+}
+
+// 从服务器边接收边载入主服务器发来的快照，每收到一个完整的数据块就载入它，
+// 只接受v2格式，不使用段索引
+class Rdb::stream_loader : public snapshot_loader_t {
+public:
+    explicit stream_loader(Rdb *rdb) : rdb(rdb)
+    {
+        rdb->cancel_incremental();
+        rdb->engine->lock();
+        rdb->engine->clear();
+        rdb->engine->unlock();
+    }
+    bool feed(const char *data, size_t len) override
+    {
+        if (failed) return false;
+        if (done) return true; // 忽略末尾的段索引
+        pending.append(data, len);
+        if (!header_checked) {
+            if (pending.size() < sizeof(magic) + 1) return true;
+            if (memcmp(pending.data(), magic, sizeof(magic)) ||
+                    static_cast<unsigned char>(pending[sizeof(magic)]) != version)
+                return fail("not a v2 rdb stream");
+            header_checked = true;
+            off = sizeof(magic) + 1;
+        }
+        auto now = angel::util::get_cur_time_ms();
+        rdb->engine->lock();
+        while (!done && pending.size() - off >= block_header_size) {
+            uint64_t stored_len;
+            memcpy(&stored_len, pending.data() + off + 8, 8);
+            if (pending.size() - off - block_header_size < stored_len) break;
+            stored.assign(pending.data() + off + block_header_size, stored_len);
+            const char *err = rdb->decode_block(pending.data() + off, stored, raw);
+            if (err) {
+                rdb->engine->unlock();
+                return fail(err);
+            }
+            off += block_header_size + stored_len;
+            done = rdb->load_records(raw.data(), raw.data() + raw.size(), dbnum,
+                    [this, now](int dbnum, entry& e){
+                rdb->load_entry_into(rdb->engine->select_db(dbnum, e.key), e, now);
+            });
+        }
+        rdb->engine->unlock();
+        pending.erase(0, off);
+        off = 0;
+        return true;
+    }
+    bool finish() override { return done; }
+private:
+    bool fail(const char *err)
+    {
+        log_warn("Bad rdb stream from master: %s", err);
+        failed = true;
+        return false;
+    }
+
+    Rdb *rdb;
+    std::string pending; // 还不是完整数据块的数据
+    size_t off = 0;
+    std::string stored;
+    std::string raw;
+    int dbnum = 0;
+    bool header_checked = false;
+    bool done = false; // 已经读到<eof>
+    bool failed = false;
+};
+
+std::unique_ptr<snapshot_loader_t> Rdb::creat_stream_loader()
+{
+    return std::make_unique<stream_loader>(this);
+}
+
+// 旧格式的文件没有数据块和校验和，只能映射到内存中顺序载入
+void Rdb::load_v1(int fd)
+{
     off_t size = get_filesize(fd);
     void *start = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
     if (start == MAP_FAILED) return;
     char *buf = reinterpret_cast<char*>(start);
-    if (size < 5 || strncmp(buf, "ALICE", 5))
-        return;
-    buf += 5;
-    engine->clear();
-    uint64_t type;
-    int64_t timeval = 0;
+    auto now = angel::util::get_cur_time_ms();
+    int dbnum = 0;
+    load_records(buf + sizeof(magic), buf + size, dbnum, [this, now](int dbnum, entry& e){
+        load_entry_into(engine->select_db(dbnum, e.key), e, now);
+    });
+    munmap(start, size);
+}
+
+void Rdb::load_serial(int fd)
+{
+    auto now = angel::util::get_cur_time_ms();
+    int dbnum = 0;
+    uint64_t off = sizeof(magic) + 1;
+    std::string raw;
     while (true) {
-        int len = load_len(buf, &type);
+        if (!read_block(fd, off, raw))
+            log_fatal("Bad rdb file: unexpected end of file");
+        bool done = load_records(raw.data(), raw.data() + raw.size(), dbnum,
+                [this, now](int dbnum, entry& e){
+            load_entry_into(engine->select_db(dbnum, e.key), e, now);
+        });
+        if (done) break;
+    }
+}
+
+// 在多个线程中执行f(0), f(1), ..., f(n - 1)
+template <typename F>
+static void parallel_for(size_t n, F f)
+{
+    size_t threads = std::min<size_t>(server_conf.mmdb_rdb_load_threads, n);
+    std::atomic_size_t next = 0;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back([&next, &f, n]{
+            for (size_t j; (j = next++) < n; )
+                f(j);
+        });
+    }
+    for (auto& t : workers)
+        t.join();
+}
+
+// 多个线程并行地解码各个段，每解码完一个数据块就把其中的键插入所属的数据库，
+// 内存中积压的只有每个线程正在处理的那个数据块。字典不是线程安全的，插入时
+// 按数据库加锁，分片模式下同一个数据库的键分布在各个分片上，插入也能并行
+void Rdb::load_parallel(int fd, std::vector<segment>& segments)
+{
+    // 先创建好所有的锁，之后各个线程只会查找，不会修改locks
+    std::unordered_map<DB*, std::mutex> locks;
+    for (int i = 0; i < server_conf.mmdb_databases; i++)
+        for (auto db : engine->get_dbs(i))
+            locks[db];
+    auto now = angel::util::get_cur_time_ms();
+    parallel_for(segments.size(), [this, fd, &segments, &locks, now](size_t i){
+        load_segment(fd, segments[i], locks, now);
+    });
+}
+
+void Rdb::load_segment(int fd, segment& seg, std::unordered_map<DB*, std::mutex>& locks, int64_t now)
+{
+    std::string raw;
+    std::unordered_map<DB*, std::vector<entry>> entries;
+    for (uint64_t off = seg.start; off < seg.end; ) {
+        if (!read_block(fd, off, raw))
+            log_fatal("Bad rdb file: unexpected end of file");
+        load_records(raw.data(), raw.data() + raw.size(), seg.dbnum,
+                [this, &entries](int dbnum, entry& e){
+            entries[engine->select_db(dbnum, e.key)].emplace_back(std::move(e));
+        });
+        // 按数据库分组后再插入，一个数据块对每个数据库只需要加一次锁
+        for (auto& [db, block] : entries) {
+            if (block.empty()) continue;
+            std::lock_guard<std::mutex> guard(locks.at(db));
+            for (auto& e : block)
+                load_entry_into(db, e, now);
+            block.clear();
+        }
+    }
+}
+
+// 文件的最后12个字节是段索引的偏移和segment_magic，没有段索引时只能顺序载入
+bool Rdb::load_segment_index(int fd, size_t size, std::vector<segment>& segments)
+{
+    size_t trailer_size = 8 + sizeof(segment_magic);
+    if (size < sizeof(magic) + 1 + trailer_size)
+        return false;
+    char trailer[8 + sizeof(segment_magic)];
+    if (!pread_full(fd, trailer, trailer_size, size - trailer_size) ||
+            memcmp(trailer + 8, segment_magic, sizeof(segment_magic)))
+        return false;
+    uint64_t index_offset;
+    memcpy(&index_offset, trailer, 8);
+    if (index_offset < sizeof(magic) + 1 || index_offset >= size - trailer_size)
+        return false;
+    uint64_t off = index_offset;
+    std::string raw;
+    if (!read_block(fd, off, raw) || off != size - trailer_size || raw.empty())
+        return false;
+    char *ptr = raw.data();
+    uint64_t count;
+    ptr += load_len(ptr, &count);
+    // 每个偏移至少占1个字节
+    if (count + 1 > raw.size())
+        return false;
+    std::vector<uint64_t> offsets(count + 1);
+    for (auto& o : offsets)
+        ptr += load_len(ptr, &o);
+    if (ptr > raw.data() + raw.size() || offsets[count] != index_offset)
+        return false;
+    for (size_t i = 0; i < count; i++) {
+        if (offsets[i] < sizeof(magic) + 1 || offsets[i] > offsets[i + 1])
+            return false;
+        segment seg;
+        seg.start = offsets[i];
+        seg.end = offsets[i + 1];
+        segments.emplace_back(std::move(seg));
+    }
+    return true;
+}
+
+// 从off处读出一个数据块，校验后将解压出的记录放到raw中，并将off移到下一个块
+// 文件在off处结束时返回false，块损坏时直接退出
+bool Rdb::read_block(int fd, uint64_t& off, std::string& raw)
+{
+    char header[block_header_size];
+    if (!pread_full(fd, header, block_header_size, off))
+        return false;
+    uint64_t stored_len;
+    memcpy(&stored_len, header + 8, 8);
+    thread_local std::string stored;
+    stored.resize(stored_len);
+    if (!pread_full(fd, stored.data(), stored_len, off + block_header_size))
+        log_fatal("Bad rdb file: truncated block at offset %llu", (unsigned long long)off);
+    const char *err = decode_block(header, stored, raw);
+    if (err)
+        log_fatal("Bad rdb file: %s at offset %llu", err, (unsigned long long)off);
+    off += block_header_size + stored_len;
+    return true;
+}
+
+// 校验并解压一个数据块，出错时返回错误信息，stored可能会被交换到raw中
+const char *Rdb::decode_block(const char *header, std::string& stored, std::string& raw)
+{
+    uint64_t raw_len;
+    uint32_t crc;
+    memcpy(&raw_len, header, 8);
+    unsigned char type = header[16];
+    memcpy(&crc, header + 17, 4);
+    if (type != raw_block && type != snappy_block)
+        return "unknown block type";
+    if (crc32c(crc32c(0, header, 17), stored.data(), stored.size()) != crc)
+        return "checksum mismatch";
+    if (type == snappy_block) {
+        raw.clear();
+        uncompress(stored.data(), stored.size(), &raw);
+    } else {
+        raw.swap(stored);
+    }
+    if (raw.size() != raw_len)
+        return "bad block length";
+    return nullptr;
+}
+
+// 解码[ptr, end)中的记录，对每个键调用f(dbnum, e)，遇到<eof>时返回true
+// v2中的块总是包含完整的记录
+template <typename F>
+bool Rdb::load_records(char *ptr, char *end, int& dbnum, F f)
+{
+    uint64_t type;
+    while (ptr < end) {
+        ptr += load_len(ptr, &type);
         if (type == eof)
-            break;
+            return true;
         if (type == select_db) {
-            buf += len;
-            buf += load_len(buf, &type);
-            cur_db = engine->select_db(type);
+            ptr += load_len(ptr, &type);
+            dbnum = type;
             continue;
         }
-        if (type == expire_key) {
-            timeval = *reinterpret_cast<int64_t*>(buf+len);
-            buf += len + 8;
-        } else if (type == string_type) {
-            buf = load_string(buf + len, &timeval);
-        } else if (type == list_type) {
-            buf = load_list(buf + len, &timeval);
-        } else if (type == set_type) {
-            buf = load_set(buf + len, &timeval);
-        } else if (type == hash_type) {
-            buf = load_hash(buf + len, &timeval);
-        } else if (type == zset_type)
-            buf = load_zset(buf + len, &timeval);
+        entry e;
+        ptr = load_entry(ptr, type, e);
+        f(dbnum, e);
     }
-    munmap(start, size);
-    close(fd);
+    if (ptr != end)
+        log_fatal("Bad rdb file: record crosses the end of block");
+    return false;
+}
+
+void Rdb::load_entry_into(DB *db, entry& e, int64_t now)
+{
+    if (e.expire > 0 && e.expire <= now)
+        return;
+    // 先复制一份给过期字典，再把键移动到主字典中
+    if (e.expire > 0)
+        db->add_expire_key(e.key, e.expire);
+    db->add_key(std::move(e.key), std::move(e.value));
+}
+
+char *Rdb::load_entry(char *ptr, uint64_t type, entry& e)
+{
+    if (type == expire_key) {
+        memcpy(&e.expire, ptr, 8);
+        ptr += 8;
+        ptr += load_len(ptr, &type);
+    }
+    if (type == string_type) {
+        ptr = load_string(ptr, e);
+    } else if (type == list_type) {
+        ptr = load_list(ptr, e);
+    } else if (type == set_type) {
+        ptr = load_set(ptr, e);
+    } else if (type == hash_type) {
+        ptr = load_hash(ptr, e);
+    } else if (type == zset_type) {
+        ptr = load_zset(ptr, e);
+    } else {
+        log_fatal("Bad rdb file: unknown value type %d", (int)type);
+    }
+    return ptr;
 }
 
 // load_xxx()不能使用stack-array，不然如果key/value太长的话
@@ -250,71 +776,67 @@ char *Rdb::load_value(char *ptr, std::string *value)
 {
     uint64_t compress_if;
     ptr += load_len(ptr, &compress_if);
-    assert(compress_if == compress_value || compress_if == uncompress_value);
     if (compress_if == compress_value) {
         uint64_t origin_len, compressed_len;
         ptr += load_len(ptr, &origin_len);
         ptr += load_len(ptr, &compressed_len);
         uncompress(ptr, compressed_len, value);
-        assert(value->size() == origin_len);
+        if (value->size() != origin_len)
+            log_fatal("Bad rdb file: bad compressed value");
         ptr += compressed_len;
-    } else {
+    } else if (compress_if == uncompress_value) {
         uint64_t value_len;
         ptr += load_len(ptr, &value_len);
         value->assign(ptr, value_len);
         ptr += value_len;
+    } else {
+        log_fatal("Bad rdb file: unknown value encoding %d", (int)compress_if);
     }
     return ptr;
 }
 
-char *Rdb::load_string(char *ptr, int64_t *tvptr)
+char *Rdb::load_string(char *ptr, entry& e)
 {
-    std::string key, value;
-    ptr = load_key(ptr, &key);
+    std::string value;
+    ptr = load_key(ptr, &e.key);
     ptr = load_value(ptr, &value);
-    cur_db->add_key(key, value);
-    load_expire_key(key, tvptr);
+    e.value = Value(std::move(value));
     return ptr;
 }
 
-char *Rdb::load_list(char *ptr, int64_t *tvptr)
+char *Rdb::load_list(char *ptr, entry& e)
 {
-    std::string key;
-    ptr = load_key(ptr, &key);
+    ptr = load_key(ptr, &e.key);
     uint64_t list_len;
     ptr += load_len(ptr, &list_len);
     DB::List list;
     while (list_len-- > 0) {
         std::string value;
         ptr = load_value(ptr, &value);
-        list.emplace_back(std::move(value));
+        list.push_back(value);
     }
-    cur_db->add_key(key, list);
-    load_expire_key(key, tvptr);
+    e.value = Value(std::move(list));
     return ptr;
 }
 
-char *Rdb::load_set(char *ptr, int64_t *tvptr)
+char *Rdb::load_set(char *ptr, entry& e)
 {
-    std::string key;
-    ptr = load_key(ptr, &key);
+    ptr = load_key(ptr, &e.key);
     uint64_t set_len;
     ptr += load_len(ptr, &set_len);
     DB::Set set;
     while (set_len-- > 0) {
         std::string value;
         ptr = load_value(ptr, &value);
-        set.emplace(std::move(value));
+        set.insert(value);
     }
-    cur_db->add_key(key, set);
-    load_expire_key(key, tvptr);
+    e.value = Value(std::move(set));
     return ptr;
 }
 
-char *Rdb::load_hash(char *ptr, int64_t *tvptr)
+char *Rdb::load_hash(char *ptr, entry& e)
 {
-    std::string key;
-    ptr = load_key(ptr, &key);
+    ptr = load_key(ptr, &e.key);
     uint64_t hash_len;
     ptr += load_len(ptr, &hash_len);
     DB::Hash hash;
@@ -322,17 +844,15 @@ char *Rdb::load_hash(char *ptr, int64_t *tvptr)
         std::string field, value;
         ptr = load_key(ptr, &field);
         ptr = load_value(ptr, &value);
-        hash.emplace(std::move(field), std::move(value));
+        hash.insert(field, value);
     }
-    cur_db->add_key(key, hash);
-    load_expire_key(key, tvptr);
+    e.value = Value(std::move(hash));
     return ptr;
 }
 
-char *Rdb::load_zset(char *ptr, int64_t *tvptr)
+char *Rdb::load_zset(char *ptr, entry& e)
 {
-    std::string key;
-    ptr = load_key(ptr, &key);
+    ptr = load_key(ptr, &e.key);
     uint64_t zset_len;
     ptr += load_len(ptr, &zset_len);
     Zset zset;
@@ -343,20 +863,10 @@ char *Rdb::load_zset(char *ptr, int64_t *tvptr)
         ptr = load_value(ptr, &value);
         zset.insert(score, value);
     }
-    cur_db->add_key(key, std::move(zset));
-    load_expire_key(key, tvptr);
+    e.value = Value(std::move(zset));
     return ptr;
 }
 
-void Rdb::load_expire_key(const std::string& key, int64_t *tvptr)
-{
-    if (*tvptr > 0) {
-        *tvptr += angel::util::get_cur_time_ms();
-        cur_db->add_expire_key(key, *tvptr);
-        *tvptr = 0;
-    }
-}
-
 void Rdb::append(const std::string& data)
 {
     append(data.data(), data.size());
@@ -365,19 +875,49 @@ void Rdb::append(const std::string& data)
 void Rdb::append(const void *data, size_t len)
 {
     buffer.append(reinterpret_cast<const char*>(data), len);
-    if (buffer.size() >= buffer_flush_size)
+}
+
+// 只在记录之间切分数据块
+void Rdb::end_record()
+{
+    if (buffer.size() >= block_size)
         flush();
 }
 
 void Rdb::flush()
 {
-    fwrite(fd, buffer.data(), buffer.size());
+    if (buffer.empty()) return;
+    write_block(buffer, can_compress(buffer.size()));
     buffer.clear();
 }
 
-bool Rdb::can_compress(size_t value_len)
+void Rdb::write_block(const std::string& data, bool try_compress)
+{
+    const std::string *stored = &data;
+    unsigned char type = raw_block;
+    std::string output;
+    if (try_compress) {
+        compress(data.data(), data.size(), &output);
+        if (output.size() < data.size()) {
+            stored = &output;
+            type = snappy_block;
+        }
+    }
+    char header[block_header_size];
+    uint64_t raw_len = data.size(), stored_len = stored->size();
+    memcpy(header, &raw_len, 8);
+    memcpy(header + 8, &stored_len, 8);
+    header[16] = type;
+    uint32_t crc = crc32c(crc32c(0, header, 17), stored->data(), stored->size());
+    memcpy(header + 17, &crc, 4);
+    fwrite(fd, header, block_header_size);
+    fwrite(fd, stored->data(), stored->size());
+    written += block_header_size + stored->size();
+}
+
+bool Rdb::can_compress(size_t len)
 {
-    return server_conf.mmdb_rdb_compress && value_len > server_conf.mmdb_rdb_compress_limit;
+    return server_conf.mmdb_rdb_compress && len > server_conf.mmdb_rdb_compress_limit;
 }
 
 void Rdb::compress(const char *input, size_t input_len,
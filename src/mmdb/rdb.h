@@ -1,6 +1,10 @@
 #ifndef _ALICE_SRC_MMDB_RDB_H
 #define _ALICE_SRC_MMDB_RDB_H
 
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
 #include "mmdb.h"
 
 namespace alice {
@@ -11,51 +15,126 @@ class Rdb {
 public:
     using iterator = DB::iterator;
 
-    static const size_t buffer_flush_size = 4096;
+    // 每个数据块中至少有这么多字节的记录(最后一个块除外)
+    static const size_t block_size = 64 * 1024;
+    // 每写入这么多字节就开始一个新的段
+    static const size_t segment_size = 4 * 1024 * 1024;
 
     explicit Rdb(engine *engine)
         : engine(engine),
         child_pid(-1),
-        cur_db(nullptr),
         fd(-1)
     {
     }
     void save();
+    // 将所有数据库保存到filename中，aof重写也用它生成aof的基础文件
+    void save(const std::string& filename);
     void save_background();
+    // 无盘复制: 在子进程中将快照写到管道pipefd中
+    void save_background_to(int pipefd);
+    // 从服务器在收到快照的同时载入它
+    std::unique_ptr<snapshot_loader_t> creat_stream_loader();
     pid_t get_child_pid() const { return child_pid; }
-    bool doing() { return child_pid != -1; }
+    bool doing() { return child_pid != -1 || inc; }
     void done() { child_pid = -1; }
     void load();
+    // filename不是rdb文件时返回false，不会清空数据库
+    bool load(const std::string& filename);
+    // 不fork的快照：在事件循环中分多次遍历各个数据库，每次最多占用1ms，
+    // 写命令执行前先保存它将要修改的、还没有保存过的键，所以快照仍然是开始时的数据
+    void save_incremental();
+    bool incremental() const { return inc != nullptr; }
+    // 不fork的快照完成后返回一次true
+    bool take_incremental_done();
+    // 同步地完成正在进行的不fork的快照
+    void finish_incremental();
+    // 在db上执行argv之前调用，argv中的参数只要是还没有保存过的键就先保存它
+    void before_command(DB *db, const argv_t& argv);
+    // 修改或删除db中的key之前调用
+    void before_modify(DB *db, const std::string& key);
 private:
+    // 不fork的快照的遍历进度
+    struct incremental_t {
+        std::string tmpfile;
+        int index = 0; // 正在遍历的数据库编号
+        bool started = false; // 是否已经开始遍历dbs[index]
+        iterator it;
+        // 开始遍历时字典的generation()和table_generation()，
+        // 迭代器在第二张表中时元素移动后需要从头开始遍历
+        size_t gen = 0;
+        size_t table_gen = 0;
+    };
+    class stream_loader;
+    int open_tmpfile(std::string& tmpfile);
+    void write_header();
+    void save_dbs();
+    void save_to(int pipefd);
+    void save_entry(int index, DB *db, const iterator& it, int64_t now);
+    void save_tail();
+    void save_end();
+    void cancel_incremental();
+    void save_step();
+    void schedule_step();
+    int index_of(DB *db);
+    // 从rdb文件中解码出的一个键
+    struct entry {
+        std::string key;
+        Value value;
+        int64_t expire = 0;
+    };
+    // 段是文件中一段连续的数据块，第一条记录是<select-db>，可以独立解码
+    struct segment {
+        uint64_t start;
+        uint64_t end;
+        int dbnum = 0;
+    };
+    void save_segment_index();
+    bool load_segment_index(int fd, size_t size, std::vector<segment>& segments);
+    void load_v1(int fd);
+    void load_serial(int fd);
+    void load_parallel(int fd, std::vector<segment>& segments);
+    void load_segment(int fd, segment& seg, std::unordered_map<DB*, std::mutex>& locks, int64_t now);
+    bool read_block(int fd, uint64_t& off, std::string& raw);
+    const char *decode_block(const char *header, std::string& stored, std::string& raw);
+    template <typename F>
+    bool load_records(char *ptr, char *end, int& dbnum, F f);
+    void load_entry_into(DB *db, entry& e, int64_t now);
+    char *load_entry(char *ptr, uint64_t type, entry& e);
     int save_len(uint64_t len);
-    void save_key(const std::string& key);
-    void save_value(const std::string& value);
+    void save_key(std::string_view key);
+    void save_value(std::string_view value);
     void save_string(const iterator& it);
     void save_list(const iterator& it);
     void save_set(const iterator& it);
     void save_hash(const iterator& it);
     void save_zset(const iterator& it);
-    void load_expire_key(const std::string& key, int64_t *tvptr);
     char *load_key(char *ptr, std::string *key);
     char *load_value(char *ptr, std::string *value);
-    char *load_string(char *ptr, int64_t *tvptr);
-    char *load_list(char *ptr, int64_t *tvptr);
-    char *load_set(char *ptr, int64_t *tvptr);
-    char *load_hash(char *ptr, int64_t *tvptr);
-    char *load_zset(char *ptr, int64_t *tvptr);
+    char *load_string(char *ptr, entry& e);
+    char *load_list(char *ptr, entry& e);
+    char *load_set(char *ptr, entry& e);
+    char *load_hash(char *ptr, entry& e);
+    char *load_zset(char *ptr, entry& e);
     void append(const std::string& data);
     void append(const void *data, size_t len);
+    void end_record();
     void flush();
+    void write_block(const std::string& data, bool try_compress);
 
-    bool can_compress(size_t value_len);
+    bool can_compress(size_t len);
     void compress(const char *input, size_t input_len, std::string *output);
     void uncompress(const char *compressed, size_t compressed_len, std::string *origin);
 
     engine *engine;
     pid_t child_pid;
     std::string buffer;
-    DB *cur_db;
+    size_t written = 0; // 已经写入文件的字节数
+    std::vector<uint64_t> segments; // 已经写入的段的偏移
+    uint64_t segment_start = 0; // 当前的段的偏移，为0时还没有开始第一个段
+    int segment_db = -1; // 当前的段中最近一次<select-db>的数据库编号
     int fd;
+    std::unique_ptr<incremental_t> inc;
+    bool inc_done = false;
 };
 }
 }
@@ -0,0 +1,469 @@
+#include "../config.h"
+#include "../server.h"
+
+#include "internal.h"
+#include "rdb.h"
+#include "shard.h"
+
+namespace alice {
+
+namespace mmdb {
+
+enum {
+    PLAN_OK,        // 命令可以交给分片执行
+    PLAN_GLOBAL,    // 命令不针对具体的键，需要锁住所有分片后在主线程中执行
+    PLAN_ERR,       // 命令无法执行，cmd.reply中是错误回复
+};
+
+enum {
+    MERGE_NONE,
+    MERGE_MGET,     // 按键的顺序重新排列各部分的回复
+    MERGE_SUM,      // 回复是各部分回复的整数之和
+    MERGE_OK,
+    MERGE_KEYS,     // 拼接各部分回复的所有元素
+    MERGE_SINTER,   // 各部分的回复是SMEMBERS的结果
+    MERGE_SUNION,
+};
+
+static const char *crossslot_err = "-CROSSSLOT Keys in request don't hash to the same shard\r\n";
+static const char *blocking_err = "-ERR blocking commands are not supported when mmdb-shards is enabled\r\n";
+
+static constexpr int command_id(std::string_view name)
+{
+    return lookup_command(name);
+}
+
+shard::shard(mmdb::engine *e, int id)
+    : engine(e),
+    id(id)
+{
+    for (int i = 0; i < server_conf.mmdb_databases; i++) {
+        std::unique_ptr<DB> db(new DB(e));
+        dbs.emplace_back(std::move(db));
+    }
+    loop = thread.wait_loop();
+    tasks.reset(new task_queue(loop));
+    loop->run_in_loop([this]{
+            this->loop->run_every(100, [this]{ this->server_cron(); });
+            });
+}
+
+void shard::pause()
+{
+    post([this]{
+            std::unique_lock<std::mutex> lk(mutex);
+            paused = true;
+            cond.notify_all();
+            cond.wait(lk, [this]{ return !paused; });
+            });
+}
+
+void shard::wait_paused()
+{
+    std::unique_lock<std::mutex> lk(mutex);
+    cond.wait(lk, [this]{ return paused; });
+}
+
+void shard::resume()
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    paused = false;
+    cond.notify_all();
+}
+
+void shard::clear()
+{
+    for (auto& db : dbs)
+        db->clear();
+}
+
+void shard::server_cron()
+{
+    active_expire(false);
+    expire_cycle.update_rate(lru_clock);
+    DB::active_rehash(dbs);
+}
+
+// 如果键中含有{tag}，就只用tag来计算分片，这样可以让相关的键落在同一个分片上
+int engine::shard_of(std::string_view key)
+{
+    auto l = key.find('{');
+    if (l != key.npos) {
+        auto r = key.find('}', l + 1);
+        if (r != key.npos && r > l + 1)
+            key = key.substr(l + 1, r - l - 1);
+    }
+    return std::hash<std::string_view>()(key) % shards.size();
+}
+
+DB *engine::select_db(int dbnum, const std::string& key)
+{
+    if (!is_sharded()) return select_db(dbnum);
+    return shards[shard_of(key)]->select_db(dbnum);
+}
+
+std::vector<DB*> engine::get_dbs(int dbnum)
+{
+    if (!is_sharded()) return { select_db(dbnum) };
+    std::vector<DB*> dblist;
+    for (auto& s : shards)
+        dblist.push_back(s->select_db(dbnum));
+    return dblist;
+}
+
+void engine::start_shards()
+{
+    for (int i = 0; i < server_conf.mmdb_shards; i++) {
+        std::unique_ptr<shard> s(new shard(this, i));
+        shards.emplace_back(std::move(s));
+    }
+    if (is_sharded())
+        done_tasks.reset(new task_queue(__server->get_loop()));
+}
+
+void engine::lock()
+{
+    if (!is_sharded() || locked++ > 0) return;
+    for (auto& s : shards)
+        s->pause();
+    for (auto& s : shards)
+        s->wait_paused();
+    // 分片已经执行完的命令可能还在done_tasks中等待写入日志，必须在返回之前写入，
+    // 否则锁住期间fork出的快照会包含这些修改，而它们的日志却在fork之后才写入，
+    // 重放aof或者从服务器同步时就会被执行两次
+    done_tasks->run_pending();
+}
+
+void engine::unlock()
+{
+    if (!is_sharded() || --locked > 0) return;
+    for (auto& s : shards)
+        s->resume();
+}
+
+// 在分片线程中执行命令时，删除过期键等产生的写命令先暂存起来，
+// 随命令的回复一起交给主线程
+void engine::propagate(const argv_t& argv)
+{
+    if (shard_writes)
+        conv2resp(*shard_writes, argv);
+    else
+        __server->append_write_command(argv, nullptr, 0);
+}
+
+// 决定一条命令要在哪些分片上执行
+int engine::make_plan(shard_command_t& cmd, const argv_t& argv)
+{
+    size_t argc = argv.size();
+    auto add_part = [&cmd](int shard, argv_t argv) {
+        cmd.parts.emplace_back();
+        cmd.parts.back().shard = shard;
+        cmd.parts.back().argv = std::move(argv);
+    };
+    auto same_shard = [this, &argv](size_t first) {
+        for (size_t i = first + 1; i < argv.size(); i++)
+            if (shard_of(argv[i]) != shard_of(argv[first]))
+                return false;
+        return true;
+    };
+    switch (cmd.id) {
+    case command_id("SELECT"):
+    case command_id("SAVE"):
+    case command_id("BGSAVE"):
+    case command_id("BGREWRITEAOF"):
+    case command_id("LASTSAVE"):
+    case command_id("FLUSHALL"):
+        return PLAN_GLOBAL;
+    case command_id("BLPOP"):
+    case command_id("BRPOP"):
+    case command_id("BRPOPLPUSH"):
+        cmd.reply = blocking_err;
+        return PLAN_ERR;
+    case command_id("KEYS"):
+    case command_id("DBSIZE"):
+    case command_id("FLUSHDB"):
+        for (size_t i = 0; i < shards.size(); i++)
+            add_part(i, argv);
+        if (cmd.id == command_id("KEYS")) cmd.merge = MERGE_KEYS;
+        else if (cmd.id == command_id("DBSIZE")) cmd.merge = MERGE_SUM;
+        else cmd.merge = MERGE_OK;
+        return PLAN_OK;
+    case command_id("MGET"):
+    case command_id("DEL"):
+    case command_id("MSET"): {
+        size_t step = 1;
+        if (cmd.id == command_id("MSET")) {
+            if (argc % 2 == 0) {
+                cmd.reply = shared.argnumber_err;
+                return PLAN_ERR;
+            }
+            step = 2;
+        }
+        // <shard, index of parts>
+        std::vector<int> index(shards.size(), -1);
+        for (size_t i = 1; i < argc; i += step) {
+            int s = shard_of(argv[i]);
+            if (index[s] < 0) {
+                index[s] = cmd.parts.size();
+                add_part(s, { argv[0] });
+            }
+            auto& part = cmd.parts[index[s]];
+            cmd.where.emplace_back(index[s], part.argv.size() - 1);
+            part.argv.insert(part.argv.end(), argv.begin() + i, argv.begin() + i + step);
+        }
+        if (cmd.id == command_id("MGET")) cmd.merge = MERGE_MGET;
+        else if (cmd.id == command_id("DEL")) cmd.merge = MERGE_SUM;
+        else cmd.merge = MERGE_OK;
+        return PLAN_OK;
+    }
+    case command_id("SINTER"):
+    case command_id("SUNION"):
+        if (same_shard(1)) break;
+        for (size_t i = 1; i < argc; i++)
+            add_part(shard_of(argv[i]), { "SMEMBERS", argv[i] });
+        cmd.merge = (cmd.id == command_id("SINTER")) ? MERGE_SINTER : MERGE_SUNION;
+        return PLAN_OK;
+    case command_id("SINTERSTORE"):
+    case command_id("SUNIONSTORE"):
+        if (!same_shard(1)) {
+            cmd.reply = crossslot_err;
+            return PLAN_ERR;
+        }
+        break;
+    case command_id("RENAME"):
+    case command_id("RENAMENX"):
+    case command_id("RPOPLPUSH"):
+    case command_id("SMOVE"):
+        if (shard_of(argv[1]) != shard_of(argv[2])) {
+            cmd.reply = crossslot_err;
+            return PLAN_ERR;
+        }
+        break;
+    case command_id("OBJECT"):
+        add_part(shard_of(argv[2]), argv);
+        return PLAN_OK;
+    case command_id("SORT"):
+        // BY和GET引用的键只会在argv[1]所在的分片上查找
+        for (size_t i = 2; i + 1 < argc; i++) {
+            if (strcasecmp(argv[i].c_str(), "STORE") == 0 &&
+                shard_of(argv[i+1]) != shard_of(argv[1])) {
+                cmd.reply = crossslot_err;
+                return PLAN_ERR;
+            }
+        }
+        break;
+    }
+    add_part(shard_of(argv[1]), argv);
+    return PLAN_OK;
+}
+
+// 在分片线程中执行，或者在主线程锁住所有分片后执行
+void engine::execute_part(shard_command_t& cmd, shard_part_t& part)
+{
+    context_t con(nullptr, this);
+    con.argv.swap(part.argv);
+    shard_db = shards[part.shard]->select_db(cmd.dbnum);
+    shard_writes = &part.writes;
+    auto c = cmdtable.get(lookup_command(con.argv[0]));
+    if (c->perm & IS_WRITE)
+        free_memory_if_needed();
+    auto start = angel::util::get_cur_time_us();
+    c->call(con);
+    part.duration = angel::util::get_cur_time_us() - start;
+    part.reply.swap(con.buf);
+    shard_db = nullptr;
+    shard_writes = nullptr;
+}
+
+// 将"*<n>\r\n<elem>..."形式的回复拆分成各个元素，每个元素为
+// "$<len>\r\n<data>\r\n"或"$-1\r\n"
+static std::vector<std::string_view> split_multi_reply(std::string_view reply)
+{
+    std::vector<std::string_view> elems;
+    if (reply.empty() || reply[0] != '*') return elems;
+    long n = atol(reply.data() + 1);
+    size_t pos = reply.find("\r\n") + 2;
+    for (long i = 0; i < n; i++) {
+        long len = atol(reply.data() + pos + 1);
+        size_t end = reply.find("\r\n", pos) + 2;
+        if (len >= 0) end += len + 2;
+        elems.push_back(reply.substr(pos, end - pos));
+        pos = end;
+    }
+    return elems;
+}
+
+static std::string_view bulk_data(std::string_view elem)
+{
+    size_t pos = elem.find("\r\n") + 2;
+    return elem.substr(pos, elem.size() - pos - 2);
+}
+
+void engine::merge_replies(shard_command_t& cmd)
+{
+    if (cmd.parts.size() == 1) {
+        cmd.reply.swap(cmd.parts[0].reply);
+        return;
+    }
+    for (auto& part : cmd.parts) {
+        if (part.reply[0] == '-') {
+            cmd.reply.swap(part.reply);
+            return;
+        }
+    }
+    context_t con;
+    switch (cmd.merge) {
+    case MERGE_MGET: {
+        std::vector<std::vector<std::string_view>> values;
+        for (auto& part : cmd.parts)
+            values.emplace_back(split_multi_reply(part.reply));
+        con.append_reply_multi(cmd.where.size());
+        for (auto& [i, j] : cmd.where)
+            con.append(values[i][j].data(), values[i][j].size());
+        break;
+    }
+    case MERGE_SUM: {
+        int64_t sum = 0;
+        for (auto& part : cmd.parts)
+            sum += atoll(part.reply.c_str() + 1);
+        con.append_reply_number(sum);
+        break;
+    }
+    case MERGE_OK:
+        con.append(shared.ok);
+        break;
+    case MERGE_KEYS: {
+        std::vector<std::string_view> keys;
+        for (auto& part : cmd.parts) {
+            auto elems = split_multi_reply(part.reply);
+            keys.insert(keys.end(), elems.begin(), elems.end());
+        }
+        con.append_reply_multi(keys.size());
+        for (auto& key : keys)
+            con.append(key.data(), key.size());
+        break;
+    }
+    case MERGE_SINTER:
+    case MERGE_SUNION: {
+        std::unordered_set<std::string_view> rset;
+        for (size_t i = 0; i < cmd.parts.size(); i++) {
+            auto elems = split_multi_reply(cmd.parts[i].reply);
+            if (cmd.merge == MERGE_SUNION) {
+                for (auto& e : elems)
+                    rset.emplace(bulk_data(e));
+                continue;
+            }
+            // 不存在的键被视为空集
+            if (elems.empty()) {
+                rset.clear();
+                break;
+            }
+            if (i == 0) {
+                for (auto& e : elems)
+                    rset.emplace(bulk_data(e));
+            } else {
+                std::unordered_set<std::string_view> set;
+                for (auto& e : elems)
+                    set.emplace(bulk_data(e));
+                for (auto it = rset.begin(); it != rset.end(); ) {
+                    if (set.count(*it)) ++it;
+                    else it = rset.erase(it);
+                }
+            }
+        }
+        if (rset.empty()) {
+            con.append(shared.nil);
+            break;
+        }
+        con.append_reply_multi(rset.size());
+        for (auto& member : rset)
+            con.append_reply_string(std::string(member));
+        break;
+    }
+    }
+    cmd.reply.swap(con.buf);
+}
+
+void engine::finish_part(const std::shared_ptr<shard_command_t>& cmd)
+{
+    if (--cmd->remaining > 0) return;
+    int64_t duration = 0;
+    for (auto& part : cmd->parts) {
+        duration = std::max(duration, part.duration);
+        cmd->writes.append(part.writes);
+    }
+    cmd->end = cmd->start + duration;
+    merge_replies(*cmd);
+    if (locked == 0) {
+        __server->finish_command(*cmd);
+        return;
+    }
+    // 在lock()中执行时，主线程可能正在执行同一个连接的命令，
+    // 所以只立即写入日志，回复留到当前的命令结束之后再发送
+    __server->log_command(*cmd);
+    __server->get_loop()->queue_in_loop([cmd]{ __server->reply_command(*cmd); });
+}
+
+bool engine::dispatch_command(context_t& con, command_t *c,
+                              const char *query, size_t len, size_t seq)
+{
+    if (!is_sharded() || locked > 0 || c->priv != this) return false;
+    auto cmd = std::make_shared<shard_command_t>();
+    cmd->id = lookup_command(con.argv[0]);
+    cmd->dbnum = cur_db_num;
+    if (make_plan(*cmd, con.argv) != PLAN_OK) return false;
+    cmd->conn = __server->get_connection(con);
+    if (!cmd->conn) return false;
+    cmd->seq = seq;
+    cmd->perm = c->perm;
+    cmd->argv.swap(con.argv);
+    if (query) cmd->query.assign(query, len);
+    cmd->remaining = cmd->parts.size();
+    cmd->start = angel::util::get_cur_time_us();
+    for (size_t i = 0; i < cmd->parts.size(); i++) {
+        shards[cmd->parts[i].shard]->post([this, cmd, i]{
+                this->execute_part(*cmd, cmd->parts[i]);
+                this->done_tasks->post([this, cmd]{ this->finish_part(cmd); });
+                });
+    }
+    return true;
+}
+
+// 主线程中同步执行一条命令，比如事务中的命令、载入aof文件
+void engine::call(context_t& con, void (*fn)(DB*, context_t&))
+{
+    if (!is_sharded() || shard_db) {
+        // 每条命令最多插入argv.size()个键，迁移两倍于此的键可以保证
+        // 新表在迁移完成前不会被填满
+        // 不fork的快照进行期间也要继续迁移，快照会先保存命令要修改的键
+        rdb->before_command(db(), con.argv);
+        db()->rehash_step(con.argv.size() * 2);
+        fn(db(), con);
+        return;
+    }
+    shard_command_t cmd;
+    cmd.id = lookup_command(con.argv[0]);
+    cmd.dbnum = cur_db_num;
+    int plan = make_plan(cmd, con.argv);
+    if (plan == PLAN_ERR) {
+        con.append(cmd.reply);
+        return;
+    }
+    lock();
+    if (plan == PLAN_GLOBAL) {
+        fn(db(), con);
+    } else {
+        for (auto& part : cmd.parts)
+            execute_part(cmd, part);
+        merge_replies(cmd);
+        con.append(cmd.reply);
+        for (auto& part : cmd.parts) {
+            if (!part.writes.empty())
+                __server->append_write_command({}, part.writes.data(), part.writes.size());
+        }
+    }
+    unlock();
+}
+
+}
+}
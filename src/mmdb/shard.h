@@ -0,0 +1,72 @@
+#ifndef _ALICE_SRC_MMDB_SHARD_H
+#define _ALICE_SRC_MMDB_SHARD_H
+
+#include <mutex>
+#include <condition_variable>
+
+#include <angel/evloop.h>
+
+#include "../task_queue.h"
+
+#include "mmdb.h"
+
+namespace alice {
+
+namespace mmdb {
+
+// 一条命令在某个分片上执行的部分
+struct shard_part_t {
+    int shard;
+    argv_t argv;
+    std::string reply;
+    std::string writes;
+    int64_t duration = 0;
+};
+
+// 分片模式下的一条命令，多键命令会按键所在的分片被拆分成多个部分，
+// 所有部分都执行完后再在主线程中合并出最终的回复
+struct shard_command_t : async_command_t {
+    int id = -1;
+    int dbnum = 0;
+    int merge = 0;
+    std::vector<shard_part_t> parts;
+    // for MGET
+    // 第i个键的值是parts[where[i].first]的回复中的第where[i].second个元素
+    std::vector<std::pair<int, int>> where;
+    size_t remaining = 0;
+};
+
+// 每个分片都有mmdb_databases个数据库，但只保存属于自己的键，
+// 这些数据只能在分片自己的线程中访问，除非主线程调用了engine::lock()
+class shard {
+public:
+    shard(engine *e, int id);
+    DB *select_db(int dbnum) { return dbs[dbnum].get(); }
+    void post(task_queue::task_t task) { tasks->post(std::move(task)); }
+    // 在分片线程执行完之前投递的所有任务之后暂停它
+    void pause();
+    void wait_paused();
+    void resume();
+    void clear();
+    void active_expire(bool fast) { DB::active_expire_cycle(dbs, expire_cycle, fast); }
+    // 只能在engine::lock()之后访问
+    const expire_cycle_t& get_expire_cycle() const { return expire_cycle; }
+private:
+    void server_cron();
+
+    engine *engine;
+    int id;
+    std::vector<std::unique_ptr<DB>> dbs;
+    expire_cycle_t expire_cycle;
+    angel::evloop_thread thread;
+    angel::evloop *loop;
+    std::unique_ptr<task_queue> tasks;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool paused = false;
+};
+
+}
+}
+
+#endif // _ALICE_SRC_MMDB_SHARD_H
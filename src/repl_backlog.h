@@ -0,0 +1,95 @@
+#ifndef _ALICE_SRC_REPL_BACKLOG_H
+#define _ALICE_SRC_REPL_BACKLOG_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+namespace alice {
+// 复制积压缓冲区，保存复制流中最近的至少limit个字节
+// 数据按顺序追加到一串块中，块只会追加不会修改，总大小超过limit时从头部整块地丢弃，
+// 块是引用计数的，持有块的一段数据的地方(例如从服务器的输出队列)在块被丢弃后仍然可以使用它，
+// 所以部分重同步和向从服务器发送命令都可以直接引用块中的数据，而不需要再拷贝一份
+//
+// 偏移是复制流中的全局偏移(即master_offset)，是64位的，大小不受4GB的限制
+class repl_backlog {
+public:
+    static constexpr size_t chunk_size = 64 * 1024;
+
+    struct chunk {
+        chunk(uint64_t start, size_t capacity) : start(start) { data.reserve(capacity); }
+        const uint64_t start; // 第一个字节在复制流中的偏移
+        // 预先分配好容量，追加时不会重新分配，所以已有数据的地址不会改变
+        std::string data;
+    };
+    using chunk_ptr = std::shared_ptr<chunk>;
+
+    // 一个块中的一段连续数据
+    struct slice {
+        chunk_ptr chunk;
+        size_t off;
+        size_t len;
+        const char *data() const { return chunk->data.data() + off; }
+    };
+
+    explicit repl_backlog(size_t limit) : limit(limit) {  }
+    // 最旧的仍然保存着的数据的偏移
+    uint64_t start_offset() const
+    {
+        return chunks.empty() ? end : chunks.front()->start;
+    }
+    // 下一个字节的偏移
+    uint64_t end_offset() const { return end; }
+    size_t size() const { return end - start_offset(); }
+    void put(const char *from, size_t len)
+    {
+        while (len > 0) {
+            if (chunks.empty() || chunks.back()->data.size() == chunks.back()->data.capacity()) {
+                // 大的命令单独占用一个块，避免被切得太碎
+                chunks.push_back(std::make_shared<chunk>(end, std::max(chunk_size, len)));
+            }
+            auto& tail = chunks.back()->data;
+            size_t n = std::min(len, tail.capacity() - tail.size());
+            tail.append(from, n);
+            from += n;
+            len -= n;
+            end += n;
+        }
+        trim();
+    }
+    // 对[from, end_offset())中的每一段数据调用f(slice)，from已经被丢弃时返回false
+    template <typename F>
+    bool get(uint64_t from, F f) const
+    {
+        if (from < start_offset() || from > end) return false;
+        // 从后往前找，通常只需要最近的一两个块
+        auto it = chunks.end();
+        while (it != chunks.begin() && (*std::prev(it))->start > from)
+            --it;
+        if (it != chunks.begin()) --it;
+        for (; it != chunks.end(); ++it) {
+            auto& c = *it;
+            size_t off = from - c->start;
+            if (off >= c->data.size()) continue;
+            f(slice{ c, off, c->data.size() - off });
+            from = c->start + c->data.size();
+        }
+        return true;
+    }
+private:
+    // 丢弃第一个块后仍然至少有limit个字节时才丢弃它
+    void trim()
+    {
+        while (chunks.size() > 1 && end - chunks[1]->start >= limit)
+            chunks.pop_front();
+    }
+
+    std::deque<chunk_ptr> chunks;
+    size_t limit;
+    uint64_t end = 0;
+};
+}
+
+#endif // _ALICE_SRC_REPL_BACKLOG_H
@@ -44,7 +44,7 @@
 
 namespace alice {
 
-#define BIND(f) std::bind(&Sentinel::f, this, std::placeholders::_1)
+#define BIND(f) [](void *s, context_t& con) { static_cast<Sentinel*>(s)->f(con); }
 
 // 选举领头和投票时设置的超时定时器的基值
 #define ELECT_TIMEOUT 1000
@@ -60,29 +60,28 @@ Sentinel::Sentinel(angel::evloop *loop, angel::inet_addr listen_addr)
     server.set_message_handler([this](const angel::connection_ptr& conn, angel::buffer& buf){
             this->message_handler(conn, buf);
             });
-    cmdtable = {
+    cmdtable = CommandTable(this, {
         { "PING",       { -1, 0, BIND(ping) } },
         { "INFO",       { -3, 0, BIND(info) } },
         { "SENTINEL",   {  2, 0, BIND(sentinel) } },
-    };
+    });
     run_id = generate_run_id();
     // server.daemon();
 }
 
 void Sentinel::executor(context_t& con)
 {
-    std::transform(con.argv[0].begin(), con.argv[0].end(), con.argv[0].begin(), ::toupper);
     auto c = cmdtable.find(con.argv[0]);
-    if (c == cmdtable.end()) {
+    if (c == nullptr) {
         con.append("-ERR unknown command `" + con.argv[0] + "`\r\n");
         goto end;
     }
-    if ((c->second.arity > 0 && con.argv.size() < c->second.arity) ||
-        (c->second.arity < 0 && con.argv.size() != -c->second.arity)) {
+    if ((c->arity > 0 && con.argv.size() < c->arity) ||
+        (c->arity < 0 && con.argv.size() != -c->arity)) {
         con.append("-ERR wrong number of arguments for '" + con.argv[0] + "'\r\n");
         goto end;
     }
-    c->second.command_cb(con);
+    c->call(con);
 end:
     con.argv.clear();
 }
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <angel/util.h>
 
@@ -9,17 +11,18 @@
 namespace alice {
 
 shared_obj shared;
-int64_t lru_clock = angel::util::get_cur_time_ms();
+std::atomic<int64_t> lru_clock = angel::util::get_cur_time_ms();
 dbserver *__server;
 
 void dbserver::executor(context_t& con, const char *query, size_t len)
 {
-    size_t pos;
+    size_t pos, begin = con.buf.size();
     time_t start, end;
-    std::transform(con.argv[0].begin(), con.argv[0].end(), con.argv[0].begin(), ::toupper);
-    auto c = db->find_command(con.argv[0]);
+    uint64_t log_seq;
+    int id = lookup_command(con.argv[0]);
+    auto c = db->get_command(id);
     if (c == nullptr) {
-        c = find_command(con.argv[0]);
+        c = get_command(id);
         if (c == nullptr) {
             con.append("-ERR unknown command `" + con.argv[0] + "`\r\n");
             goto err;
@@ -34,6 +37,19 @@ void dbserver::executor(context_t& con, const char *query, size_t len)
         con.append("-ERR wrong number of arguments for '" + con.argv[0] + "'\r\n");
         goto err;
     }
+    // 从服务器落后主服务器太多时拒绝访问数据
+    if (con.max_staleness > 0 && (flags & SLAVE) && db->get_command(id) &&
+        repl_staleness() > con.max_staleness) {
+        con.append("-STALE the replica is too far behind the master\r\n");
+        goto err;
+    }
+    // 日志写入失败时拒绝写命令，来自主服务器的命令除外
+    if ((c->perm & IS_WRITE) && !(con.flags & context_t::CONNECT_WITH_MASTER)) {
+        if (auto err = db->write_error()) {
+            con.append(err);
+            goto err;
+        }
+    }
     con.last_cmd = con.argv[0];
     if (con.flags & context_t::EXEC_MULTI) {
         if (con.argv[0].compare("MULTI") &&
@@ -49,14 +65,27 @@ void dbserver::executor(context_t& con, const char *query, size_t len)
     }
     if (c->perm & IS_WRITE)
         db->free_memory_if_needed();
+    if (db->dispatch_command(con, c, query, len, con.pending_seq + con.pending_replies.size())) {
+        con.pending_replies.emplace_back();
+        goto end;
+    }
     pos = con.buf.size();
+    log_seq = db->write_log_seq();
     start = angel::util::get_cur_time_us();
-    c->command_cb(con);
+    c->call(con);
     end = angel::util::get_cur_time_us();
     slowlog.add_slowlog_if_needed(con.argv, start, end);
     if ((c->perm & IS_WRITE) && con.buf[pos] != '-') {
         do_write_command(con.argv, query, len);
     }
+    // 执行期间写入了日志，回复要等到日志持久化之后才能发送
+    if (db->write_log_seq() != log_seq && con.buf.size() > pos &&
+        !(con.flags & context_t::CONNECT_WITH_MASTER)) {
+        size_t seq = con.pending_seq + con.pending_replies.size();
+        con.pending_replies.emplace_back();
+        hold_reply(get_connection(con), seq, con.buf.substr(pos), db->write_log_seq());
+        con.buf.resize(pos);
+    }
     goto end;
 err:
     if (con.flags & context_t::EXEC_MULTI) {
@@ -64,25 +93,192 @@ err:
         con.flags |= context_t::EXEC_MULTI_ERR;
     }
 end:
-    con.argv.clear();
+    // 之前的命令还未完成，这条命令的回复只能排在它们之后发送
+    if (!con.pending_replies.empty() && con.buf.size() > begin) {
+        con.pending_replies.emplace_back(con.buf.substr(begin));
+        con.buf.resize(begin);
+    }
+    // 不清空con.argv，以便下一个请求复用其中的string
+    return;
+}
+
+// 异步执行的命令完成后，在主线程中完成剩下的工作并按请求的顺序发送回复
+void dbserver::finish_command(async_command_t& ac)
+{
+    log_command(ac);
+    reply_command(ac);
+}
+
+void dbserver::log_command(async_command_t& ac)
+{
+    uint64_t log_seq = db->write_log_seq();
+    if (!ac.writes.empty())
+        append_write_command({}, ac.writes.data(), ac.writes.size());
+    slowlog.add_slowlog_if_needed(ac.argv, ac.start, ac.end);
+    if ((ac.perm & IS_WRITE) && ac.reply[0] != '-') {
+        do_write_command(ac.argv, ac.query.data(), ac.query.size());
+    }
+    if (db->write_log_seq() != log_seq)
+        ac.log_seq = db->write_log_seq();
+}
+
+void dbserver::reply_command(async_command_t& ac)
+{
+    auto& con = get_context(ac.conn);
+    if (ac.log_seq > 0) {
+        hold_reply(ac.conn, ac.seq, std::move(ac.reply), ac.log_seq);
+        return;
+    }
+    complete_reply(con, ac.seq, std::move(ac.reply));
+    send_response(ac.conn);
+}
+
+// 填入序号为seq的回复，并按请求的顺序追加所有已经完成的回复
+void dbserver::complete_reply(context_t& con, size_t seq, std::string&& reply)
+{
+    con.pending_replies[seq - con.pending_seq] = std::move(reply);
+    while (!con.pending_replies.empty() && con.pending_replies.front()) {
+        con.append(*con.pending_replies.front());
+        con.pending_replies.pop_front();
+        con.pending_seq++;
+    }
+}
+
+// pending_replies中序号为seq的位置一直空着，直到日志持久化到log_seq
+void dbserver::hold_reply(const angel::connection_ptr& conn, size_t seq,
+                          std::string&& reply, uint64_t log_seq)
+{
+    durable_replies.push_back({ conn, seq, std::move(reply), log_seq });
+    // 由before_sleep()把这一轮的命令交给aof线程
+    queue_before_sleep();
+}
+
+void dbserver::release_durable_replies(uint64_t seq)
+{
+    while (!durable_replies.empty() && durable_replies.front().log_seq <= seq) {
+        auto& r = durable_replies.front();
+        complete_reply(get_context(r.conn), r.seq, std::move(r.reply));
+        send_response(r.conn);
+        durable_replies.pop_front();
+    }
+}
+
+angel::connection_ptr dbserver::get_connection(context_t& con)
+{
+    if (con.flags & context_t::CONNECT_WITH_MASTER)
+        return master_cli ? master_cli->conn() : nullptr;
+    return server.get_connection(con.conn->id());
+}
+
+// 运行在连接所属的io线程中，只负责解析请求，不访问连接的context_t
+void dbserver::io_message_handler(const angel::connection_ptr& conn, angel::buffer& buf)
+{
+    thread_local argv_view_t argv_view;
+    auto batch = std::make_shared<request_batch_t>();
+    const char *s = buf.peek(), *es = buf.peek() + buf.readable();
+    const char *p = s;
+    bool err = false;
+    while (true) {
+        ssize_t n = parse_request(argv_view, p, es);
+        if (n < 0) {
+            err = true;
+            break;
+        }
+        if (n == 0) break;
+        // argv会交给主线程并在那里释放，所以这里不复用string
+        argv_t argv(argv_view.begin(), argv_view.end());
+        if (!argv.empty())
+            std::transform(argv[0].begin(), argv[0].end(), argv[0].begin(), ::toupper);
+        batch->requests.emplace_back(std::move(argv), n);
+        p += n;
+    }
+    if (p > s) {
+        batch->query.assign(s, p - s);
+        buf.retrieve(p - s);
+        loop->run_in_loop([this, conn, batch]{ this->execute_requests(conn, *batch); });
+    }
+    if (err) {
+        log_error("conn %d protocol error: %s", conn->id(), buf.c_str());
+        conn->close();
+    }
+}
+
+// 在主线程中依次执行一个连接的一批请求
+void dbserver::execute_requests(const angel::connection_ptr& conn, request_batch_t& batch)
+{
+    auto& con = get_context(conn);
+    const char *query = batch.query.data();
+    for (auto& [argv, len] : batch.requests) {
+        con.argv.swap(argv);
+        executor(con, query, len);
+        query += len;
+    }
+    send_response(conn);
+    queue_before_sleep();
+}
+
+// angel没有提供事件循环进入等待之前的回调，所以排在本轮已经到达的事件之后执行，
+// 效果上近似于在进入等待之前执行
+void dbserver::queue_before_sleep()
+{
+    if (before_sleep_queued) return;
+    before_sleep_queued = true;
+    loop->queue_in_loop([this]{
+            before_sleep_queued = false;
+            flush_slaves_output();
+            db->before_sleep();
+            });
+}
+
+void dbserver::queue_reply(const angel::connection_ptr& conn, context_t& con)
+{
+    if (con.buf.empty()) return;
+    pending_replies[conn->get_loop()].emplace_back(conn, std::move(con.buf));
+    if (!flush_replies_queued) {
+        flush_replies_queued = true;
+        // 排在已经到达的请求之后执行，使得一个io线程每轮只被唤醒一次
+        loop->queue_in_loop([this]{ this->flush_replies(); });
+    }
+}
+
+void dbserver::flush_replies()
+{
+    flush_replies_queued = false;
+    for (auto& [io_loop, replies] : pending_replies) {
+        if (replies.empty()) continue;
+        auto list = std::make_shared<reply_list_t>();
+        list->swap(replies);
+        io_loop->run_in_loop([list]{
+                for (auto& [conn, reply] : *list)
+                    conn->send(reply);
+                });
+    }
 }
 
 void dbserver::server_cron()
 {
     lru_clock = angel::util::get_cur_time_ms();
 
-    if (db->is_created_snapshot()) {
+    // 无盘复制由转发线程读完管道后结束，子进程可能在那之前就已经退出了
+    if (db->is_created_snapshot() && !snapshot_relay.joinable()) {
         if (flags & PSYNC) {
             flags &= ~PSYNC;
             send_snapshot_to_slaves();
         }
         if (flags & PSYNC_DELAY) {
             flags &= ~PSYNC_DELAY;
-            flags |= PSYNC;
-            db->creat_snapshot();
+            start_full_sync();
         }
     }
 
+    // 心跳使从服务器可以知道自己落后了多久，也使WAIT能及时收到ACK
+    if (!slaves.empty()) {
+        getack_queued = true;
+        queue_before_sleep();
+    }
+    if (!wait_replies.empty())
+        check_wait_replies(lru_clock);
+
     if (flags & DISCONNECT_WITH_MASTER) {
         flags &= ~DISCONNECT_WITH_MASTER;
         connect_master_server();
@@ -95,16 +291,11 @@ void dbserver::server_cron()
 // 如果query为假，则使用argv，然后将其转换为RESP形式的字符串，不过这种情况很少见
 void dbserver::do_write_command(const argv_t& argv, const char *query, size_t len)
 {
+    uint64_t from = copy_backlog_buffer.end_offset();
     append_write_command(argv, query, len);
-    if (!slaves.empty()) {
-        if (!query) {
-            std::string buffer;
-            conv2resp(buffer, argv);
-            sync_command_to_slaves(buffer.data(), buffer.size());
-        } else
-            sync_command_to_slaves(query, len);
-    }
-    if (flags & SLAVE) slave_offset += len;
+    // 同步给从服务器的正是刚刚追加到积压缓冲区中的数据
+    if (!slaves.empty())
+        sync_command_to_slaves(from);
 }
 
 void dbserver::append_write_command(const argv_t& argv, const char *query, size_t len)
@@ -127,31 +318,95 @@ void dbserver::append_write_command(const argv_t& argv, const char *query, size_
     }
 }
 
-void dbserver::sync_command_to_slaves(const char *query, size_t len)
+// 只是把命令加入各个从服务器的输出队列，一轮事件循环中的所有命令由flush_slaves_output()一起发送
+void dbserver::sync_command_to_slaves(uint64_t from)
 {
-    for (auto& it : slaves) {
-        auto conn = server.get_connection(it.first);
+    bool queued = false;
+    for (auto& [id, slave] : slaves) {
+        auto conn = server.get_connection(id);
         if (!conn) continue;
         auto& con = get_context(conn);
-        if (con.repl_state == context_t::SYNC_COMMAND) {
-            conn->send(query, len);
+        if (con.repl_state != context_t::SYNC_COMMAND) continue;
+        copy_backlog_buffer.get(from, [&slave = slave](const repl_backlog::slice& slice){
+            slave.append_output(slice);
+        });
+        queued = true;
+    }
+    if (queued) queue_before_sleep();
+}
+
+// 每个从服务器每轮只发送一次，输出队列中有多段时先拼接起来
+void dbserver::flush_slaves_output()
+{
+    thread_local std::string buffer;
+    for (auto& [id, slave] : slaves) {
+        if (slave.output.empty()) continue;
+        auto conn = server.get_connection(id);
+        if (conn) {
+            if (slave.output.size() == 1) {
+                conn->send(slave.output.front().data(), slave.output.front().len);
+            } else {
+                buffer.clear();
+                for (auto& slice : slave.output)
+                    buffer.append(slice.data(), slice.len);
+                conn->send(buffer);
+            }
+        }
+        slave.output.clear();
+    }
+    // 排在这一轮的命令之后，从服务器回复ACK时已经执行完了它们
+    if (getack_queued) {
+        getack_queued = false;
+        for (auto& it : slaves) {
+            auto conn = server.get_connection(it.first);
+            if (!conn) continue;
+            if (get_context(conn).repl_state == context_t::SYNC_COMMAND)
+                conn->send("*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n");
+        }
+    }
+}
+
+size_t dbserver::count_acked_slaves(size_t offset)
+{
+    size_t acked = 0;
+    for (auto& it : slaves)
+        if (it.second.ack_offset >= offset)
+            acked++;
+    return acked;
+}
+
+void dbserver::check_wait_replies(int64_t now)
+{
+    for (auto it = wait_replies.begin(); it != wait_replies.end(); ) {
+        size_t acked = count_acked_slaves(it->offset);
+        if (acked < it->numslaves && (it->deadline == 0 || now < it->deadline)) {
+            ++it;
+            continue;
         }
+        complete_reply(get_context(it->conn), it->seq, std::string(":") + i2s(acked) + "\r\n");
+        send_response(it->conn);
+        it = wait_replies.erase(it);
     }
 }
 
-// 主服务器将命令写入到复制积压缓冲区中
+int64_t dbserver::repl_staleness()
+{
+    if (master_heartbeat_time == 0) return INT64_MAX;
+    return angel::util::get_cur_time_ms() - master_heartbeat_time;
+}
+
 void dbserver::append_copy_backlog_buffer(const char *query, size_t len)
 {
     master_offset += len;
     copy_backlog_buffer.put(query, len);
 }
 
+// 直接从积压缓冲区的各个块中取出数据，不再经过临时的缓冲区
 void dbserver::append_partial_resync_data(context_t& con, size_t off)
 {
-    std::string buffer;
-    buffer.reserve(off);
-    copy_backlog_buffer.get(buffer.data(), off);
-    con.append(buffer);
+    copy_backlog_buffer.get(master_offset - off, [&con](const repl_backlog::slice& slice){
+        con.append(slice.data(), slice.len);
+    });
 }
 
 static void append_timestamp(context_t& con, const std::string& timestr, bool is_seconds)
@@ -217,6 +472,9 @@ void dbserver::connect_master_server()
 
 void dbserver::reset_connection_with_master()
 {
+    sync_eof_mark.clear();
+    sync_loader.reset();
+    master_heartbeat_time = 0;
     if (!master_cli) return;
     if (heartbeat_timer_id > 0)
         loop->cancel_timer(heartbeat_timer_id);
@@ -246,6 +504,7 @@ void dbserver::send_ping_to_master(const angel::connection_ptr& conn)
 // +FULLRESYNC\r\n<runid>\r\n<offset>\r\n
 // +CONTINUE\r\n
 // <snapshot-file-size>\r\n\r\n<snapshot>
+// $EOF:<mark>\r\n<snapshot><mark>
 // <sync command>
 // SYNC_PING -> SYNC_CONF -> SYNC_WAIT -> SYNC_FULL -> SYNC_COMMAND
 //                                          -> SYNC_COMMAND
@@ -261,6 +520,9 @@ void dbserver::recv_sync_from_master(const angel::connection_ptr& conn, angel::b
         break;
     case context_t::SYNC_WAIT:
         slave_sync_wait(conn, buf);
+        // 快照可能和+FULLRESYNC一起到达
+        if (con.repl_state == context_t::SYNC_FULL && buf.readable() > 0)
+            recv_snapshot_from_master(conn, buf);
         break;
     case context_t::SYNC_FULL:
         recv_snapshot_from_master(conn, buf);
@@ -395,11 +657,49 @@ void dbserver::send_ack_to_master(const angel::connection_ptr& conn)
     conn->send(message);
 }
 
+// 转发线程最多领先于最慢的从服务器这么多字节
+static const size_t relay_lag_limit = 64 * 1024 * 1024;
+// 从服务器每收到这么多字节的快照就确认一次
+static const size_t snapshot_ack_bytes = 1024 * 1024;
+
+// 无盘复制时从服务器向主服务器确认已经收到的快照字节数，主服务器据此控制转发速度
+void dbserver::send_snapshot_ack_to_master(const angel::connection_ptr& conn)
+{
+    std::string message;
+    argv_t argv = { "REPLCONF", "SNAPSHOT-ACK", i2s(sync_recv_bytes) };
+    conv2resp(message, argv);
+    conn->send(message);
+    sync_acked_bytes = sync_recv_bytes;
+}
+
 // 从服务器接收来自主服务器的快照
 void dbserver::recv_snapshot_from_master(const angel::connection_ptr& conn, angel::buffer& buf)
 {
-    auto& con = get_context(conn);
+    if (!sync_eof_mark.empty()) {
+        recv_eof_snapshot_from_master(conn, buf);
+        return;
+    }
     if (sync_file_size == 0) {
+        if (buf.starts_with("$EOF:")) {
+            int crlf = buf.find("\r\n");
+            if (crlf < 0) return;
+            sync_eof_mark.assign(buf.peek() + 5, crlf - 5);
+            buf.retrieve(crlf + 2);
+            sync_recv_bytes = 0;
+            send_snapshot_ack_to_master(conn);
+            if (server_conf.repl_diskless_load)
+                sync_loader = db->creat_snapshot_loader();
+            if (!sync_loader) {
+                strcpy(sync_tmp_file, "tmp.XXXXX");
+                mktemp(sync_tmp_file);
+                sync_fd = open(sync_tmp_file, O_RDWR | O_APPEND | O_CREAT, 0660);
+            }
+            log_info("Recvd the diskless snapshot header, %s",
+                    sync_loader ? "loading it directly" : "saving it to disk");
+            if (buf.readable() > 0)
+                recv_eof_snapshot_from_master(conn, buf);
+            return;
+        }
         int crlf = buf.find("\r\n\r\n");
         if (crlf <= 0) return;
         sync_file_size = atoll(buf.peek());
@@ -422,11 +722,68 @@ void dbserver::recv_snapshot_from_master(const angel::connection_ptr& conn, ange
     fsync(sync_fd);
     rename(sync_tmp_file, db->get_snapshot_name().c_str());
     db->load_snapshot();
+    finish_recv_snapshot(conn, buf);
+}
+
+// 无盘复制的快照没有长度，一直读到结束标记为止
+void dbserver::recv_eof_snapshot_from_master(const angel::connection_ptr& conn, angel::buffer& buf)
+{
+    std::string_view data(buf.peek(), buf.readable());
+    size_t pos = data.find(sync_eof_mark);
+    bool end = pos != std::string_view::npos;
+    // 末尾不足一个标记长度的数据可能是标记的一部分，等收到更多数据后再处理
+    size_t n = pos;
+    if (!end)
+        n = data.size() >= sync_eof_mark.size() ? data.size() - sync_eof_mark.size() + 1 : 0;
+    if (n > 0) {
+        if (sync_loader) {
+            if (!sync_loader->feed(buf.peek(), n)) {
+                // 部分载入的数据会在下一次完整重同步时被清空
+                buf.retrieve_all();
+                flags |= DISCONNECT_WITH_MASTER;
+                return;
+            }
+        } else if (write(sync_fd, buf.peek(), n) != static_cast<ssize_t>(n)) {
+            log_error("write(%s): %s", sync_tmp_file, angel::util::strerrno());
+            buf.retrieve_all();
+            flags |= DISCONNECT_WITH_MASTER;
+            return;
+        }
+        buf.retrieve(n);
+        sync_recv_bytes += n;
+        if (sync_recv_bytes - sync_acked_bytes >= snapshot_ack_bytes)
+            send_snapshot_ack_to_master(conn);
+    }
+    if (!end) return;
+    buf.retrieve(sync_eof_mark.size());
+    sync_eof_mark.clear();
+    if (sync_loader) {
+        bool ok = sync_loader->finish();
+        sync_loader.reset();
+        if (!ok) {
+            log_error("The diskless snapshot from master is incomplete, try to replicate again");
+            flags |= DISCONNECT_WITH_MASTER;
+            return;
+        }
+    } else {
+        fsync(sync_fd);
+        rename(sync_tmp_file, db->get_snapshot_name().c_str());
+        db->load_snapshot();
+    }
+    finish_recv_snapshot(conn, buf);
+}
+
+void dbserver::finish_recv_snapshot(const angel::connection_ptr& conn, angel::buffer& buf)
+{
+    auto& con = get_context(conn);
     con.flags |= context_t::CONNECT_WITH_MASTER;
     con.repl_state = 0;
     reset_slave_message_handler();
     set_heartbeat_timer(conn);
     log_info("Recvd snapshot, replication is complete");
+    // 紧跟在快照后面的同步命令
+    if (buf.readable() > 0)
+        slave_message_handler(conn, buf);
 }
 
 // 主服务器将生成的rdb快照发送给从服务器
@@ -472,6 +829,129 @@ void dbserver::send_snapshot_to_slaves()
     close(fd);
 }
 
+void dbserver::start_full_sync()
+{
+    if (server_conf.repl_diskless_sync && db->can_stream_snapshot()) {
+        start_diskless_sync();
+        return;
+    }
+    flags |= MASTER | PSYNC;
+    db->creat_snapshot();
+}
+
+// 无盘复制: 子进程将快照写到管道中，转发线程读出后交给主线程发送给从服务器，
+// 快照以$EOF:<mark>\r\n开始，以<mark>结束，之后再发送生成快照期间的写命令
+void dbserver::start_diskless_sync()
+{
+    int fds[2];
+    if (pipe(fds) < 0) {
+        log_error("pipe(): %s", angel::util::strerrno());
+        return;
+    }
+    diskless_eof_mark = generate_run_id();
+    diskless_slaves.clear();
+    for (auto& it : slaves) {
+        auto conn = server.get_connection(it.first);
+        if (!conn) continue;
+        auto& con = get_context(conn);
+        if (con.repl_state == context_t::SYNC_SNAPSHOT) {
+            diskless_slaves.push_back(it.first);
+            it.second.snapshot_sent = it.second.snapshot_acked = 0;
+            it.second.snapshot_acking = false;
+            // 发起这次同步的从服务器的+FULLRESYNC回复还在con.buf中，
+            // 快照的开头必须排在它后面，所以也走回复的路径发送
+            con.append("$EOF:" + diskless_eof_mark + "\r\n");
+            send_response(conn);
+        }
+    }
+    relay_queued = relay_lag = 0;
+    flags |= MASTER | PSYNC;
+    db->creat_snapshot_to(fds[1]);
+    close(fds[1]);
+    snapshot_relay = std::thread([this, fd = fds[0]]{ this->relay_snapshot(fd); });
+    log_info("Start streaming the snapshot to %zu slaves", diskless_slaves.size());
+}
+
+// 从服务器接收得太慢时暂停读取管道，以免整个快照都堆积在主服务器的内存中
+void dbserver::relay_snapshot(int fd)
+{
+    char buf[64 * 1024];
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(relay_mutex);
+            relay_cond.wait(lk, [this]{ return relay_queued + relay_lag <= relay_lag_limit; });
+        }
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        {
+            std::lock_guard<std::mutex> lk(relay_mutex);
+            relay_queued += n;
+        }
+        loop->queue_in_loop([this, data = std::string(buf, n)]{
+                this->send_to_diskless_slaves(data);
+                });
+    }
+    close(fd);
+    loop->queue_in_loop([this]{ this->finish_diskless_sync(); });
+}
+
+void dbserver::send_to_diskless_slaves(const std::string& data)
+{
+    for (auto id : diskless_slaves) {
+        auto conn = server.get_connection(id);
+        auto it = slaves.find(id);
+        if (!conn || it == slaves.end()) continue;
+        conn->send(data);
+        it->second.snapshot_sent += data.size();
+    }
+    {
+        std::lock_guard<std::mutex> lk(relay_mutex);
+        relay_queued -= data.size();
+    }
+    update_relay_lag();
+}
+
+// 在主线程中调用，重新计算最慢的从服务器落后的字节数并唤醒转发线程
+void dbserver::update_relay_lag()
+{
+    size_t lag = 0;
+    for (auto id : diskless_slaves) {
+        auto it = slaves.find(id);
+        if (it == slaves.end() || !it->second.snapshot_acking) continue;
+        auto& slave = it->second;
+        lag = std::max(lag, slave.snapshot_sent - std::min(slave.snapshot_acked, slave.snapshot_sent));
+    }
+    std::lock_guard<std::mutex> lk(relay_mutex);
+    relay_lag = lag;
+    relay_cond.notify_one();
+}
+
+void dbserver::finish_diskless_sync()
+{
+    snapshot_relay.join();
+    for (auto id : diskless_slaves) {
+        auto conn = server.get_connection(id);
+        if (!conn) continue;
+        auto& con = get_context(conn);
+        if (con.repl_state != context_t::SYNC_SNAPSHOT) continue;
+        conn->send(diskless_eof_mark);
+        con.repl_state = context_t::SYNC_COMMAND;
+        if (sync_buffer.size() > 0)
+            conn->send(sync_buffer);
+    }
+    diskless_slaves.clear();
+    diskless_eof_mark.clear();
+    sync_buffer.clear();
+    flags &= ~PSYNC;
+    log_info("Finished streaming the snapshot");
+    // 子进程已经退出时server_cron()不会再处理被延迟的psync
+    if ((flags & PSYNC_DELAY) && !db->is_creating_snapshot()) {
+        flags &= ~PSYNC_DELAY;
+        start_full_sync();
+    }
+}
+
 // SLAVEOF host port
 // SLAVEOF no one
 void dbserver::slaveof(context_t& con)
@@ -522,18 +1002,19 @@ sync:
     con.append("\r\n");
     con.append(i2s(master_offset));
     con.append("\r\n");
-    if (db->is_creating_snapshot()) {
+    if (db->is_creating_snapshot() || snapshot_relay.joinable()) {
         // 虽然服务器后台正在生成快照，但没有从服务器在等待，即服务器并没有
         // 记录此期间执行的写命令，所以之后仍然需要重新生成一次快照
-        if (!(flags & PSYNC)) flags |= PSYNC_DELAY;
+        // 无盘复制的快照已经开始发送了，新的从服务器也只能等下一次
+        if (!(flags & PSYNC) || snapshot_relay.joinable()) flags |= PSYNC_DELAY;
         return;
     }
-    flags |= MASTER | PSYNC;
-    db->creat_snapshot();
+    start_full_sync();
 }
 
 // REPLCONF info <host> <engine>
 // REPLCONF ack repl_off
+// REPLCONF snapshot-ack <bytes>
 void dbserver::replconf(context_t& con)
 {
     if (con.isequal(1, "info")) {
@@ -546,7 +1027,7 @@ void dbserver::replconf(context_t& con)
         auto it = slaves.find(con.conn->id());
         if (it == slaves.end()) {
             log_info("Found a new slave <%s>", host.c_str());
-            slaves.emplace(con.conn->id(), master_offset);
+            slaves.emplace(con.conn->id(), slave_t{ master_offset });
         }
         con.slave_addr = angel::inet_addr(host);
         con.append("+OK\r\n");
@@ -554,7 +1035,21 @@ void dbserver::replconf(context_t& con)
         size_t slave_off = atoll(con.argv[2].c_str());
         auto it = slaves.find(con.conn->id());
         assert(it != slaves.end());
-        it->second = slave_off;
+        it->second.ack_offset = slave_off;
+        if (!wait_replies.empty())
+            check_wait_replies(angel::util::get_cur_time_ms());
+    } else if (con.isequal(1, "snapshot-ack")) {
+        auto it = slaves.find(con.conn->id());
+        if (it == slaves.end()) return;
+        it->second.snapshot_acked = atoll(con.argv[2].c_str());
+        it->second.snapshot_acking = true;
+        if (snapshot_relay.joinable()) update_relay_lag();
+    } else if (con.isequal(1, "getack")) {
+        // 主服务器的心跳，之前的命令都已经执行完了，立即回复ACK
+        if (!(con.flags & context_t::CONNECT_WITH_MASTER)) return;
+        master_heartbeat_time = angel::util::get_cur_time_ms();
+        auto conn = get_connection(con);
+        if (conn) send_ack_to_master(conn);
     }
 }
 
@@ -563,6 +1058,41 @@ void dbserver::ping(context_t& con)
     con.append("+PONG\r\n");
 }
 
+// WAIT numslaves timeout
+// 等到至少numslaves个从服务器确认执行了之前的所有写命令，或者超时(ms)，返回确认的从服务器个数
+void dbserver::wait(context_t& con)
+{
+    if (flags & SLAVE) ret(con, "-ERR WAIT cannot be used with slave instances\r\n");
+    long long numslaves = str2ll(con.argv[1]);
+    if (str2numerr() || numslaves < 0) ret(con, shared.integer_err);
+    long long timeout = str2ll(con.argv[2]);
+    if (str2numerr() || timeout < 0) ret(con, shared.integer_err);
+    size_t acked = count_acked_slaves(master_offset);
+    // 事务中不能等待
+    if (acked >= static_cast<size_t>(numslaves) || (con.flags & context_t::EXEC_MULTI)) {
+        con.append_reply_number(acked);
+        return;
+    }
+    int64_t deadline = timeout > 0 ? angel::util::get_cur_time_ms() + timeout : 0;
+    // 回复的位置先空着，由check_wait_replies()填入
+    size_t seq = con.pending_seq + con.pending_replies.size();
+    con.pending_replies.emplace_back();
+    wait_replies.push_back({ get_connection(con), seq, master_offset,
+                             static_cast<size_t>(numslaves), deadline });
+    getack_queued = true;
+    queue_before_sleep();
+}
+
+// MAXSTALENESS ms
+// 在从服务器上设置这个连接能容忍的最大延迟，超过时读请求返回-STALE，为0时不限制
+void dbserver::maxstaleness(context_t& con)
+{
+    long long ms = str2ll(con.argv[1]);
+    if (str2numerr() || ms < 0) ret(con, shared.integer_err);
+    con.max_staleness = ms;
+    con.append(shared.ok);
+}
+
 void dbserver::multi(context_t& con)
 {
     if (con.flags & context_t::EXEC_MULTI) {
@@ -594,15 +1124,19 @@ void dbserver::exec(context_t& con)
         __server->get_db()->free_memory_if_needed();
         __server->do_write_command(cl, nullptr, 0);
     }
+    // 事务中的命令必须在主线程中连续执行
+    db->lock();
     for (auto& argv : con.transaction_list) {
-        auto c = db->find_command(argv[0]);
-        if (!c) c = find_command(argv[0]);
+        int id = lookup_command(argv[0]);
+        auto c = db->get_command(id);
+        if (!c) c = get_command(id);
         con.argv.swap(argv);
-        c->command_cb(con);
+        c->call(con);
         if (is_write) {
             __server->do_write_command(con.argv, nullptr, 0);
         }
     }
+    db->unlock();
     if (is_write) {
         cl = { "EXEC" };
         __server->do_write_command(cl, nullptr, 0);
@@ -662,20 +1196,16 @@ size_t dbserver::pub_message(const std::string& msg, const std::string& channel)
 {
     auto idlist = pubsub_channels.find(channel);
     if (idlist == pubsub_channels.end()) return 0;
-    std::string message;
     size_t pub_clients = 0;
     for (auto& id : idlist->second) {
         auto conn = server.get_connection(id);
         if (!conn) continue;
-        message.append("*3\r\n$7\r\nmessage\r\n$");
-        message.append(i2s(channel.size()));
-        message.append("\r\n" + channel + "\r\n$");
-        message.append(i2s(msg.size()));
-        message.append("\r\n");
-        conn->send(message);
-        conn->send(msg);
-        conn->send("\r\n");
-        message.clear();
+        // 经由订阅者自己的回复缓冲区发送，保证消息不会越过它之前的回复
+        auto& con = get_context(conn);
+        con.append("*3\r\n$7\r\nmessage\r\n");
+        con.append_reply_string(channel);
+        con.append_reply_string(msg);
+        send_response(conn);
         pub_clients++;
     }
     return pub_clients;
@@ -700,38 +1230,57 @@ void dbserver::info(context_t& con)
     con.append("role:");
     if ((flags & MASTER) && (flags & SLAVE)) con.append("master-slave\n");
     else if (flags & MASTER) con.append("master\n");
-    else if (flags & SLAVE) ret(con, "slave\r\n");
-    con.append("connected_slaves:");
-    con.append(i2s(slaves.size()));
-    con.append("\n");
-    for (auto& it : slaves) {
-        auto conn = server.get_connection(it.first);
-        if (!conn) continue;
-        auto& context = get_context(conn);
-        con.append("slave");
-        con.append(i2s(i));
-        con.append(":ip=");
-        con.append(context.slave_addr.to_host_ip());
-        con.append(",port=");
-        con.append(i2s(context.slave_addr.to_host_port()));
-        con.append(",offset=");
-        con.append(i2s(it.second));
+    else if (flags & SLAVE) con.append("slave\n");
+    if (flags & SLAVE) {
+        con.append("repl_offset:");
+        con.append(i2s(slave_offset));
+        con.append("\n");
+        con.append("repl_staleness_ms:");
+        con.append(master_heartbeat_time ? i2s(repl_staleness()) : "-1");
         con.append("\n");
-        i++;
     }
+    // 只是从服务器时没有下属的从服务器，但存储引擎的信息仍然要输出
+    if (flags & MASTER) {
+        con.append("connected_slaves:");
+        con.append(i2s(slaves.size()));
+        con.append("\n");
+        for (auto& it : slaves) {
+            auto conn = server.get_connection(it.first);
+            if (!conn) continue;
+            auto& context = get_context(conn);
+            con.append("slave");
+            con.append(i2s(i));
+            con.append(":ip=");
+            con.append(context.slave_addr.to_host_ip());
+            con.append(",port=");
+            con.append(i2s(context.slave_addr.to_host_port()));
+            con.append(",offset=");
+            con.append(i2s(it.second.ack_offset));
+            // 从服务器还没有确认的字节数
+            con.append(",lag=");
+            con.append(i2s(master_offset > it.second.ack_offset ? master_offset - it.second.ack_offset : 0));
+            con.append("\n");
+            i++;
+        }
+    }
+    std::string s;
+    db->info(s);
+    con.append(s);
     con.append("\r\n");
 }
 
-#define BIND(f) std::bind(&dbserver::f, this, std::placeholders::_1)
+#define BIND(f) [](void *s, context_t& con) { static_cast<dbserver*>(s)->f(con); }
 
 void dbserver::start()
 {
     __server = this;
-    cmdtable = {
+    cmdtable = CommandTable(this, {
         { "SLAVEOF",    { -3, IS_READ, BIND(slaveof) } },
         { "PSYNC",      { -3, IS_READ, BIND(psync) } },
         { "REPLCONF",   {  3, IS_READ, BIND(replconf) } },
         { "PING",       { -1, IS_READ, BIND(ping) } },
+        { "WAIT",       { -3, IS_READ, BIND(wait) } },
+        { "MAXSTALENESS",       { -2, IS_READ, BIND(maxstaleness) } },
         { "PUBLISH",    { -3, IS_READ, BIND(publish) } },
         { "SUBSCRIBE",   {  2, IS_READ, BIND(subscribe) } },
         { "CONFIG",     {  3, IS_READ, BIND(config) } },
@@ -741,7 +1290,7 @@ void dbserver::start()
         { "DISCARD",    { -1, IS_READ,  BIND(discard) } },
         { "WATCH",      {  2, IS_READ,  BIND(watch) } },
         { "UNWATCH",    { -1, IS_READ,  BIND(unwatch) } },
-    };
+    });
     db->start();
     loop->run_every(100, [this]{ this->server_cron(); });
     server.set_exit_handler([this]{ this->db->exit(); });
@@ -4,12 +4,15 @@
 #include <angel/server.h>
 #include <angel/client.h>
 
+#include <condition_variable>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include "config.h"
 #include "db_base.h"
-#include "ring_buffer.h"
+#include "repl_backlog.h"
 #include "slowlog.h"
 #include "util.h"
 
@@ -18,6 +21,59 @@
 
 namespace alice {
 
+// io线程从一个连接中一次解析出的所有请求
+struct request_batch_t {
+    // 这些请求的原始RESP数据，按顺序首尾相接
+    std::string query;
+    // <argv, 该请求在query中的长度>
+    std::vector<std::pair<argv_t, size_t>> requests;
+};
+
+using reply_list_t = std::vector<std::pair<angel::connection_ptr, std::string>>;
+
+// 主服务器上一个从服务器的复制状态
+struct slave_t {
+    size_t ack_offset = 0; // 从服务器通过REPLCONF ACK确认的偏移
+    // 无盘复制时已经交给连接发送的快照字节数，和从服务器通过REPLCONF SNAPSHOT-ACK
+    // 确认收到的字节数，没有确认过的从服务器不参与流量控制
+    size_t snapshot_sent = 0;
+    size_t snapshot_acked = 0;
+    bool snapshot_acking = false;
+    // 这一轮事件循环中要同步给它的命令，直接引用积压缓冲区中的块，
+    // 在before_sleep()中一次性发送出去
+    std::deque<repl_backlog::slice> output;
+
+    void append_output(const repl_backlog::slice& slice)
+    {
+        // 同一个块中相邻的命令合并成一段
+        if (!output.empty()) {
+            auto& last = output.back();
+            if (last.chunk == slice.chunk && last.off + last.len == slice.off) {
+                last.len += slice.len;
+                return;
+            }
+        }
+        output.push_back(slice);
+    }
+};
+
+// 等待写命令持久化之后才能发送的回复
+struct durable_reply_t {
+    angel::connection_ptr conn;
+    size_t seq; // 在context_t::pending_replies中的序号
+    std::string reply;
+    uint64_t log_seq; // 写命令在日志中的序号
+};
+
+// 执行WAIT的客户端，等到足够多的从服务器确认了offset或者超时后才回复
+struct wait_reply_t {
+    angel::connection_ptr conn;
+    size_t seq; // 在context_t::pending_replies中的序号
+    size_t offset;
+    size_t numslaves;
+    int64_t deadline; // 为0时一直等待
+};
+
 class dbserver {
 public:
     enum FLAG {
@@ -38,14 +94,28 @@ public:
             db.reset(new mmdb::engine());
         else if (server_conf.engine == ENGINE_SSDB)
             db.reset(new ssdb::engine());
-        server.set_connection_handler([this](const angel::connection_ptr& conn){
-                this->connection_handler(conn); });
-        server.set_message_handler([this](const angel::connection_ptr& conn, angel::buffer& buf){
-                this->message_handler(conn, buf);
-                });
-        server.set_close_handler([this](const angel::connection_ptr& conn){
-                this->close_handler(conn);
-                });
+        if (server_conf.io_threads > 0) {
+            // 连接分散到各个io线程上，但对连接状态的修改总是交给主线程完成
+            server.set_connection_handler([this](const angel::connection_ptr& conn){
+                    this->loop->run_in_loop([this, conn]{ this->connection_handler(conn); });
+                    });
+            server.set_message_handler([this](const angel::connection_ptr& conn, angel::buffer& buf){
+                    this->io_message_handler(conn, buf);
+                    });
+            server.set_close_handler([this](const angel::connection_ptr& conn){
+                    this->loop->run_in_loop([this, conn]{ this->close_handler(conn); });
+                    });
+            server.start_io_threads(server_conf.io_threads);
+        } else {
+            server.set_connection_handler([this](const angel::connection_ptr& conn){
+                    this->connection_handler(conn); });
+            server.set_message_handler([this](const angel::connection_ptr& conn, angel::buffer& buf){
+                    this->message_handler(conn, buf);
+                    });
+            server.set_close_handler([this](const angel::connection_ptr& conn){
+                    this->close_handler(conn);
+                    });
+        }
         server.start_task_threads(1);
         run_id = generate_run_id();
     }
@@ -61,22 +131,25 @@ public:
     {
         auto& con = get_context(conn);
         while (true) {
-            ssize_t n = parse_request(con.argv, buf);
+            ssize_t n = parse_request(con.argv_view, buf.peek(), buf.peek() + buf.readable());
             if (n < 0) {
                 log_error("conn %d protocol error: %s", conn->id(), buf.c_str());
                 conn->close();
                 return;
             }
             if (n == 0) break;
+            assign_argv(con.argv, con.argv_spare, con.argv_view);
             executor(con, buf.peek(), n);
             buf.retrieve(n);
         }
         send_response(conn);
+        queue_before_sleep();
     }
     void close_handler(const angel::connection_ptr& conn)
     {
         auto it = slaves.find(conn->id());
         if (it != slaves.end()) slaves.erase(conn->id());
+        if (snapshot_relay.joinable()) update_relay_lag();
         db->close_handler(conn);
     }
     void slave_message_handler(const angel::connection_ptr& conn, angel::buffer& buf)
@@ -88,15 +161,20 @@ public:
                 update_heartbeat_time();
                 buf.retrieve(7);
             }
-            ssize_t n = parse_request(con.argv, buf);
+            ssize_t n = parse_request(con.argv_view, buf.peek(), buf.peek() + buf.readable());
             if (n < 0) {
                 log_error("conn %d protocol error: %s", conn->id(), buf.c_str());
                 conn->close();
                 return;
             }
             if (n == 0) return;
+            assign_argv(con.argv, con.argv_spare, con.argv_view);
+            // 偏移按实际收到的复制流计算，这样事务中的命令也会被计算在内，
+            // 主服务器直接发送的REPLCONF GETACK不计入它的偏移
+            bool counted = !con.isequal(0, "REPLCONF");
             executor(con, buf.peek(), n);
             buf.retrieve(n);
+            if (counted) slave_offset += n;
             send_response(conn);
         }
     }
@@ -104,17 +182,39 @@ public:
     {
         auto& con = get_context(conn);
         // 从服务器不应向主服务器发送回复信息
-        if (!(con.flags & context_t::CONNECT_WITH_MASTER))
-            conn->send(con.buf);
+        if (!(con.flags & context_t::CONNECT_WITH_MASTER)) {
+            if (conn->get_loop() != loop)
+                queue_reply(conn, con);
+            else
+                conn->send(con.buf);
+        }
         con.buf.clear();
     }
-    command_t *find_command(const std::string& name)
+    // io-threads
+    void io_message_handler(const angel::connection_ptr& conn, angel::buffer& buf);
+    void execute_requests(const angel::connection_ptr& conn, request_batch_t& batch);
+    void queue_reply(const angel::connection_ptr& conn, context_t& con);
+    void flush_replies();
+    void queue_before_sleep();
+    void complete_reply(context_t& con, size_t seq, std::string&& reply);
+    void hold_reply(const angel::connection_ptr& conn, size_t seq,
+                    std::string&& reply, uint64_t log_seq);
+    // 阻塞命令开始阻塞时先占住回复的位置，解除阻塞或超时后再填入回复，
+    // 这样它的回复不会越过之前还未发送的回复
+    void block_reply(context_t& con)
+    {
+        con.block_seq = con.pending_seq + con.pending_replies.size();
+        con.pending_replies.emplace_back();
+    }
+    void unblock_reply(const angel::connection_ptr& conn, std::string&& reply)
+    {
+        auto& con = get_context(conn);
+        complete_reply(con, con.block_seq, std::move(reply));
+        send_response(conn);
+    }
+    command_t *get_command(int id)
     {
-        auto it = cmdtable.find(name);
-        if (it != cmdtable.end())
-            return &it->second;
-        else
-            return nullptr;
+        return cmdtable.get(id);
     }
     angel::evloop *get_loop() { return loop; }
     angel::server& get_server() { return server; }
@@ -126,10 +226,23 @@ public:
     }
     void start();
     void server_cron();
+    // con.argv[0]必须已经是大写的命令名
     void executor(context_t& con, const char *query, size_t len);
+    void finish_command(async_command_t& ac);
+    // finish_command()分为写入日志和发送回复两步，两者可以分开执行
+    void log_command(async_command_t& ac);
+    void reply_command(async_command_t& ac);
+    // 发送日志序号不超过seq的所有等待持久化的回复
+    void release_durable_replies(uint64_t seq);
+    angel::connection_ptr get_connection(context_t& con);
     void do_write_command(const argv_t& argv, const char *query, size_t len);
     void append_write_command(const argv_t& argv, const char *query, size_t len);
-    void sync_command_to_slaves(const char *query, size_t len);
+    void sync_command_to_slaves(uint64_t from);
+    void flush_slaves_output();
+    size_t count_acked_slaves(size_t offset);
+    void check_wait_replies(int64_t now);
+    // 从服务器上一次收到主服务器的心跳距今的毫秒数
+    int64_t repl_staleness();
     void append_copy_backlog_buffer(const char *query, size_t len);
     void append_partial_resync_data(context_t& con, size_t off);
     void fsync(int fd)
@@ -151,8 +264,17 @@ public:
     void send_sync_command_to_master(const angel::connection_ptr& conn);
     void set_heartbeat_timer(const angel::connection_ptr& conn);
     void send_ack_to_master(const angel::connection_ptr& conn);
+    void send_snapshot_ack_to_master(const angel::connection_ptr& conn);
     void recv_snapshot_from_master(const angel::connection_ptr& conn, angel::buffer& buf);
+    void recv_eof_snapshot_from_master(const angel::connection_ptr& conn, angel::buffer& buf);
+    void finish_recv_snapshot(const angel::connection_ptr& conn, angel::buffer& buf);
     void send_snapshot_to_slaves();
+    void start_full_sync();
+    void start_diskless_sync();
+    void relay_snapshot(int fd);
+    void send_to_diskless_slaves(const std::string& data);
+    void update_relay_lag();
+    void finish_diskless_sync();
     void reset_slave_message_handler();
     void update_heartbeat_time();
     // replication command
@@ -160,6 +282,8 @@ public:
     void psync(context_t& con);
     void replconf(context_t& con);
     void ping(context_t& con);
+    void wait(context_t& con);
+    void maxstaleness(context_t& con);
     // transaction command
     void multi(context_t& con);
     void exec(context_t& con);
@@ -189,19 +313,49 @@ private:
     time_t last_recv_heartbeat_time = 0;
     size_t repl_timeout_timer_id = 0;
     // for master
-    // <conn_id, slave_offset>
-    std::unordered_map<size_t, size_t> slaves;
+    // <conn_id, slave>
+    std::unordered_map<size_t, slave_t> slaves;
     size_t master_offset = 0;
+    // 正在接收无盘复制的快照的从服务器
+    std::vector<size_t> diskless_slaves;
+    std::string diskless_eof_mark;
+    std::vector<wait_reply_t> wait_replies;
+    // 需要在这一轮发送完命令后向从服务器发送REPLCONF GETACK
+    bool getack_queued = false;
+    // 从管道中读出快照的转发线程
+    std::thread snapshot_relay;
+    // 转发线程交给主线程但还没有发送的字节数，加上最慢的从服务器还没有确认收到的字节数，
+    // 超过上限时转发线程暂停读取管道，子进程随之阻塞在管道上
+    std::mutex relay_mutex;
+    std::condition_variable relay_cond;
+    size_t relay_queued = 0;
+    size_t relay_lag = 0;
     // for slave
     angel::inet_addr master_addr;
     std::unique_ptr<angel::client> master_cli;
     size_t slave_offset = 0;
     std::string master_run_id;
+    // 上一次处理主服务器的REPLCONF GETACK的时间，为0时还没有与主服务器同步
+    int64_t master_heartbeat_time = 0;
     std::string sync_buffer;
-    ring_buffer copy_backlog_buffer;
+    // 无盘复制时快照的结束标记，为空时快照以长度开头
+    std::string sync_eof_mark;
+    // 不为空时直接从连接中载入快照
+    std::unique_ptr<snapshot_loader_t> sync_loader;
+    // 无盘复制时已经收到的和已经向主服务器确认的快照字节数
+    size_t sync_recv_bytes = 0;
+    size_t sync_acked_bytes = 0;
+    repl_backlog copy_backlog_buffer;
     std::unordered_map<std::string, std::vector<size_t>> pubsub_channels;
     slowlog_t slowlog;
-    std::unordered_map<std::string, command_t> cmdtable;
+    CommandTable cmdtable;
+    // <io_loop, [<conn, reply>]>
+    // 主线程产生的回复按所属的io线程暂存，一轮执行结束后再一起交给各个io线程发送
+    std::unordered_map<angel::evloop*, reply_list_t> pending_replies;
+    bool flush_replies_queued = false;
+    // 按log_seq排列
+    std::deque<durable_reply_t> durable_replies;
+    bool before_sleep_queued = false;
 };
 
 extern dbserver *__server;
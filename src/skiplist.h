@@ -113,14 +113,19 @@ public:
     skiplist(skiplist&& sl) : max_level(sl.max_level), length(sl.length),
         head(sl.head), tail(sl.tail), comp(sl.comp)
     {
+        // sl析构时仍会释放它的head
+        sl.max_level = 1;
+        sl.length = 0;
+        sl.head = sl.alloc_head();
+        sl.tail = nullptr;
     }
     skiplist& operator=(skiplist&& sl)
     {
-        max_level = sl.max_level;
-        length = sl.length;
-        head = sl.head;
-        tail = sl.tail;
-        comp = sl.comp;
+        std::swap(max_level, sl.max_level);
+        std::swap(length, sl.length);
+        std::swap(head, sl.head);
+        std::swap(tail, sl.tail);
+        std::swap(comp, sl.comp);
         return *this;
     }
     iterator begin() const { return head->level[0].next; }
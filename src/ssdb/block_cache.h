@@ -0,0 +1,48 @@
+#ifndef _ALICE_SRC_SSDB_BLOCK_CACHE_H
+#define _ALICE_SRC_SSDB_BLOCK_CACHE_H
+
+#include <leveldb/cache.h>
+
+#include <atomic>
+#include <memory>
+
+namespace alice {
+
+namespace ssdb {
+
+// leveldb的LRU块缓存本身不统计命中率，这里包装一层，统计Lookup()的命中和未命中次数
+// leveldb的后台线程也会调用Lookup()，所以计数器是原子的
+class block_cache : public leveldb::Cache {
+public:
+    explicit block_cache(size_t capacity) : cache(leveldb::NewLRUCache(capacity)) {  }
+    Handle *Insert(const leveldb::Slice& key, void *value, size_t charge,
+                   void (*deleter)(const leveldb::Slice& key, void *value)) override
+    {
+        return cache->Insert(key, value, charge, deleter);
+    }
+    Handle *Lookup(const leveldb::Slice& key) override
+    {
+        auto handle = cache->Lookup(key);
+        if (handle) hits.fetch_add(1, std::memory_order_relaxed);
+        else misses.fetch_add(1, std::memory_order_relaxed);
+        return handle;
+    }
+    void Release(Handle *handle) override { cache->Release(handle); }
+    void *Value(Handle *handle) override { return cache->Value(handle); }
+    void Erase(const leveldb::Slice& key) override { cache->Erase(key); }
+    uint64_t NewId() override { return cache->NewId(); }
+    void Prune() override { cache->Prune(); }
+    size_t TotalCharge() const override { return cache->TotalCharge(); }
+
+    size_t get_hits() const { return hits.load(std::memory_order_relaxed); }
+    size_t get_misses() const { return misses.load(std::memory_order_relaxed); }
+private:
+    std::unique_ptr<leveldb::Cache> cache;
+    std::atomic<size_t> hits = 0;
+    std::atomic<size_t> misses = 0;
+};
+
+}
+}
+
+#endif // _ALICE_SRC_SSDB_BLOCK_CACHE_H
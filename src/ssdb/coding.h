@@ -0,0 +1,94 @@
+#ifndef _ALICE_SRC_SSDB_CODING_H
+#define _ALICE_SRC_SSDB_CODING_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace alice {
+
+namespace ssdb {
+
+// ssdb中的整数和分数都编码为定长的大端字节序，按字节比较的结果和按数值比较的结果一致，
+// 所以leveldb可以直接使用默认的BytewiseComparator，不需要在每次比较时再解析键
+
+static inline void
+append_fixed64(std::string& buf, uint64_t value)
+{
+    char bytes[8];
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    buf.append(bytes, 8);
+}
+
+static inline uint64_t
+load_fixed64(const char *ptr)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | static_cast<unsigned char>(ptr[i]);
+    return value;
+}
+
+static inline void
+append_fixed32(std::string& buf, uint32_t value)
+{
+    char bytes[4];
+    for (int i = 3; i >= 0; i--) {
+        bytes[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    buf.append(bytes, 4);
+}
+
+static inline uint32_t
+load_fixed32(const char *ptr)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+        value = (value << 8) | static_cast<unsigned char>(ptr[i]);
+    return value;
+}
+
+// 翻转符号位后负数排在正数前面
+static inline void
+append_int64(std::string& buf, int64_t value)
+{
+    append_fixed64(buf, static_cast<uint64_t>(value) ^ (uint64_t(1) << 63));
+}
+
+static inline int64_t
+load_int64(const char *ptr)
+{
+    return static_cast<int64_t>(load_fixed64(ptr) ^ (uint64_t(1) << 63));
+}
+
+// 正数翻转符号位，负数翻转所有位，-0.0按0.0编码
+static inline void
+append_double(std::string& buf, double value)
+{
+    if (value == 0) value = 0;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (bits & (uint64_t(1) << 63)) bits = ~bits;
+    else bits |= uint64_t(1) << 63;
+    append_fixed64(buf, bits);
+}
+
+static inline double
+load_double(const char *ptr)
+{
+    uint64_t bits = load_fixed64(ptr);
+    if (bits & (uint64_t(1) << 63)) bits &= ~(uint64_t(1) << 63);
+    else bits = ~bits;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+}
+}
+
+#endif // _ALICE_SRC_SSDB_CODING_H
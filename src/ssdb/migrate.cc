@@ -0,0 +1,222 @@
+// alice-ssdb-migrate: 将旧的文本编码的ssdb数据库转换为定长二进制编码
+//
+// 旧的编码中列表的索引、hash/set的seq和元数据都是十进制文本，需要自定义的比较器
+// ssdb-keycomp在每次比较时解析它们，新的编码可以直接按字节比较，两者的数据库不兼容
+//
+// usage: alice-ssdb-migrate <old-db-dir> <new-db-dir>
+// 转换前需要先停止服务器，完成后用<new-db-dir>替换掉原来的数据库目录
+
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <leveldb/comparator.h>
+
+#include <string.h>
+
+#include <iostream>
+#include <memory>
+
+#include "../util.h"
+
+#include "coding.h"
+
+using namespace alice;
+using namespace alice::ssdb;
+
+// 旧的比较器，必须和写入旧数据库时的比较器完全一致
+struct old_keycomp : public leveldb::Comparator {
+    int Compare(const leveldb::Slice& l, const leveldb::Slice& r) const
+    {
+        if (l[0] == 'l' && r[0] == 'l') {
+            return list_compare(l, r);
+        } else if (l[0] == 'Z' && r[0] == 'Z') {
+            return zset_compare(l, r);
+        }
+        return l.compare(r);
+    }
+    const char* Name() const { return "ssdb-keycomp"; }
+    void FindShortestSeparator(std::string* start,
+                               const leveldb::Slice& limit) const {  }
+    void FindShortSuccessor(std::string* key) const {  }
+
+    int list_compare(const leveldb::Slice& l, const leveldb::Slice& r) const
+    {
+        auto begin1 = l.data() + 1, begin2 = r.data() + 1;
+        auto s1 = strrchr(begin1, ':');
+        auto s2 = strrchr(begin2, ':');
+        leveldb::Slice key1(begin1, s1 - begin1), key2(begin2, s2 - begin2);
+        int res = key1.compare(key2);
+        if (res) return res;
+        auto i1 = atoll(s1 + 1), i2 = atoll(s2 + 1);
+        return i1 - i2;
+    }
+    int zset_compare(const leveldb::Slice& l, const leveldb::Slice& r) const
+    {
+        uint64_t seq1, seq2;
+        if (l[l.size() - 1] != '0' || r[r.size() - 1] != '0')
+            return l.compare(r);
+        auto begin1 = const_cast<char*>(l.data()) + 1;
+        auto begin2 = const_cast<char*>(r.data()) + 1;
+        auto s1 = begin1 + load_len(begin1, &seq1);
+        auto s2 = begin2 + load_len(begin2, &seq2);
+        if (seq1 != seq2) return seq1 - seq2;
+        auto score1 = atof(s1), score2 = atof(s2);
+        if (score1 < score2) return -1;
+        if (score1 > score2) return 1;
+        s1 = strchr(s1, ':') + 1;
+        s2 = strchr(s2, ':') + 1;
+        leveldb::Slice member1(s1, begin1 - 1 + l.size() - 1 - s1);
+        leveldb::Slice member2(s2, begin2 - 1 + r.size() - 1 - s2);
+        return member1.compare(member2);
+    }
+};
+
+// [type][seq]:[size] -> [type][seq(8)][size(8)]
+static std::string convert_seq_meta_value(const std::string& value)
+{
+    std::string buf(1, value[0]);
+    const char *s = value.c_str() + 1;
+    append_fixed64(buf, strtoull(s, nullptr, 10));
+    append_fixed64(buf, atoll(strchr(s, ':') + 1));
+    return buf;
+}
+
+static std::string convert_meta_value(const std::string& value)
+{
+    switch (value[0]) {
+    case 'l': { // [l][li]:[ri]:[size]
+        std::string buf(1, value[0]);
+        const char *s = value.c_str() + 1;
+        append_int64(buf, atoll(s));
+        append_int64(buf, atoll(strchr(s, ':') + 1));
+        append_int64(buf, atoll(strrchr(s, ':') + 1));
+        return buf;
+    }
+    case 'h': case 'S':
+        return convert_seq_meta_value(value);
+    case 'z': { // [z][seq(varint)][size(varint)]
+        uint64_t seq, size;
+        char *ptr = const_cast<char*>(value.c_str()) + 1;
+        ptr += load_len(ptr, &seq);
+        load_len(ptr, &size);
+        std::string buf(1, value[0]);
+        append_fixed64(buf, seq);
+        append_fixed64(buf, size);
+        return buf;
+    }
+    default: // string和内置的键
+        return value;
+    }
+}
+
+// 返回false表示无法识别这个键
+static bool convert(const leveldb::Slice& key, const leveldb::Slice& value,
+                    std::string& new_key, std::string& new_value)
+{
+    new_key.assign(1, key[0]);
+    new_value = value.ToString();
+    std::string k = key.ToString();
+    switch (key[0]) {
+    case '@':
+        new_key = k;
+        new_value = convert_meta_value(new_value);
+        return true;
+    case 'l': { // [l][key]:[index]
+        auto pos = k.rfind(':');
+        if (pos == std::string::npos) return false;
+        append_fixed32(new_key, pos - 1);
+        new_key.append(k, 1, pos - 1);
+        append_int64(new_key, atoll(k.c_str() + pos + 1));
+        return true;
+    }
+    case 'h': case 'S': { // [type][seq]:[field]，anchor的field为空
+        auto pos = k.find(':');
+        if (pos == std::string::npos) return false;
+        append_fixed64(new_key, strtoull(k.c_str() + 1, nullptr, 10));
+        new_key.append(k, pos + 1);
+        return true;
+    }
+    case 'z': { // [z][seq(varint)][member] -> score
+        uint64_t seq;
+        size_t n = load_len(&k[1], &seq);
+        append_fixed64(new_key, seq);
+        new_key.append(k, 1 + n);
+        return true;
+    }
+    case 'Z': { // [Z][seq(varint)][-]、[Z][seq(varint)][:]或[Z][seq(varint)][score]:[member][0] -> member
+        uint64_t seq;
+        size_t n = load_len(&k[1], &seq);
+        append_fixed64(new_key, seq);
+        std::string rest = k.substr(1 + n);
+        if (rest == "-") {
+            return true;
+        } else if (rest == ":") {
+            new_key.append(8, '\xff');
+            return true;
+        }
+        auto pos = rest.find(':');
+        if (pos == std::string::npos || rest.back() != '0') return false;
+        auto score = rest.substr(0, pos);
+        append_double(new_key, str2f(score));
+        new_key.append(rest, pos + 1, rest.size() - pos - 2);
+        new_value = score;
+        return true;
+    }
+    default: // string、过期时间和内置的键的编码都没有变化
+        new_key = k;
+        return true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <old-db-dir> <new-db-dir>\n";
+        return 1;
+    }
+    old_keycomp comp;
+    leveldb::DB *old_db, *new_db;
+    leveldb::Options old_ops;
+    old_ops.comparator = &comp;
+    auto s = leveldb::DB::Open(old_ops, argv[1], &old_db);
+    if (!s.ok()) {
+        std::cerr << "open " << argv[1] << ": " << s.ToString() << "\n";
+        return 1;
+    }
+    leveldb::Options new_ops;
+    new_ops.create_if_missing = true;
+    new_ops.error_if_exists = true;
+    s = leveldb::DB::Open(new_ops, argv[2], &new_db);
+    if (!s.ok()) {
+        std::cerr << "open " << argv[2] << ": " << s.ToString() << "\n";
+        return 1;
+    }
+    std::unique_ptr<leveldb::DB> old_guard(old_db), new_guard(new_db);
+
+    size_t keys = 0, skips = 0;
+    leveldb::WriteBatch batch;
+    std::string new_key, new_value;
+    leveldb::ReadOptions read_ops;
+    read_ops.fill_cache = false;
+    std::unique_ptr<leveldb::Iterator> it(old_db->NewIterator(read_ops));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        if (!convert(it->key(), it->value(), new_key, new_value)) {
+            std::cerr << "skip unknown key: " << it->key().ToString() << "\n";
+            skips++;
+            continue;
+        }
+        batch.Put(new_key, new_value);
+        if (++keys % 1024 == 0) {
+            s = new_db->Write(leveldb::WriteOptions(), &batch);
+            if (!s.ok()) break;
+            batch.Clear();
+        }
+    }
+    if (s.ok()) s = it->status();
+    if (s.ok()) s = new_db->Write(leveldb::WriteOptions(), &batch);
+    if (!s.ok()) {
+        std::cerr << "migrate: " << s.ToString() << "\n";
+        return 1;
+    }
+    std::cout << "migrated " << keys << " keys, skipped " << skips << "\n";
+    return 0;
+}
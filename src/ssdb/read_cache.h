@@ -0,0 +1,166 @@
+#ifndef _ALICE_SRC_SSDB_READ_CACHE_H
+#define _ALICE_SRC_SSDB_READ_CACHE_H
+
+#include <leveldb/write_batch.h>
+
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace alice {
+
+namespace ssdb {
+
+// 热点键的读缓存，缓存元数据(@key)、过期时间(Tkey)和字符串的值(skey)
+// 写入时和其他的键放在同一个WriteBatch中，写入成功后再由update()更新缓存，
+// 所以缓存中的值总是和leveldb中的一致，不存在的键也会被缓存下来
+//
+// 按字节数限制大小，使用分段LRU(SLRU)淘汰: 新的键先进入试用段，再次命中后才
+// 晋升到保护段，一次性的扫描只会挤掉试用段中的键，不会冲掉真正的热点键
+// capacity为0时不缓存
+class read_cache {
+public:
+    explicit read_cache(size_t capacity)
+        : capacity(capacity), protected_capacity(capacity / 5 * 4) {  }
+    read_cache(const read_cache&) = delete;
+    read_cache& operator=(const read_cache&) = delete;
+
+    // 命中时返回true，*found表示这个键是否存在
+    bool get(const std::string& key, std::string *value, bool *found)
+    {
+        auto it = index.find(key);
+        if (it == index.end()) {
+            misses++;
+            return false;
+        }
+        hits++;
+        auto n = it->second;
+        *found = n->found;
+        if (*found) value->assign(n->value);
+        if (n->seg == PROBATION) {
+            move_to(n, PROTECTED);
+            while (used[PROTECTED] > protected_capacity)
+                move_to(std::prev(lru[PROTECTED].end()), PROBATION);
+        } else {
+            lru[PROTECTED].splice(lru[PROTECTED].begin(), lru[PROTECTED], n);
+        }
+        return true;
+    }
+    void put(std::string_view key, std::string_view value, bool found)
+    {
+        if (capacity == 0) return;
+        auto it = index.find(key);
+        // 太大的值不缓存，以免一个键就挤掉大量的热点键
+        if (charge(key, value) > capacity / 64) {
+            if (it != index.end()) erase(it->second);
+            return;
+        }
+        if (it != index.end()) {
+            auto n = it->second;
+            used[n->seg] -= n->charge();
+            n->value.assign(value.data(), value.size());
+            n->found = found;
+            used[n->seg] += n->charge();
+            lru[n->seg].splice(lru[n->seg].begin(), lru[n->seg], n);
+        } else {
+            lru[PROBATION].push_front({ std::string(key), std::string(value), found, PROBATION });
+            auto n = lru[PROBATION].begin();
+            used[PROBATION] += n->charge();
+            index.emplace(n->key, n);
+        }
+        evict();
+    }
+    // 写入成功后用batch中的键更新缓存
+    void update(const leveldb::WriteBatch& batch)
+    {
+        if (capacity == 0) return;
+        updater u(this);
+        batch.Iterate(&u);
+    }
+    void clear()
+    {
+        index.clear();
+        for (int i = 0; i < 2; i++) {
+            lru[i].clear();
+            used[i] = 0;
+        }
+    }
+    size_t size() const { return index.size(); }
+    size_t bytes() const { return used[PROBATION] + used[PROTECTED]; }
+    size_t get_hits() const { return hits; }
+    size_t get_misses() const { return misses; }
+private:
+    enum segment { PROBATION, PROTECTED };
+    // 每个节点在键和值之外大约还要占用的字节数
+    static constexpr size_t node_overhead = 96;
+
+    struct node {
+        std::string key;
+        std::string value;
+        bool found;
+        segment seg;
+        size_t charge() const { return key.size() + value.size() + node_overhead; }
+    };
+    using node_iterator = std::list<node>::iterator;
+
+    struct updater : public leveldb::WriteBatch::Handler {
+        explicit updater(read_cache *cache) : cache(cache) {  }
+        static bool is_cached(const leveldb::Slice& key)
+        {
+            return !key.empty() && (key[0] == '@' || key[0] == 'T' || key[0] == 's');
+        }
+        void Put(const leveldb::Slice& key, const leveldb::Slice& value) override
+        {
+            if (is_cached(key))
+                cache->put({ key.data(), key.size() }, { value.data(), value.size() }, true);
+        }
+        void Delete(const leveldb::Slice& key) override
+        {
+            if (is_cached(key))
+                cache->put({ key.data(), key.size() }, {}, false);
+        }
+        read_cache *cache;
+    };
+
+    static size_t charge(std::string_view key, std::string_view value)
+    {
+        return key.size() + value.size() + node_overhead;
+    }
+    void move_to(node_iterator n, segment seg)
+    {
+        used[n->seg] -= n->charge();
+        lru[seg].splice(lru[seg].begin(), lru[n->seg], n);
+        n->seg = seg;
+        used[seg] += n->charge();
+    }
+    void erase(node_iterator n)
+    {
+        used[n->seg] -= n->charge();
+        index.erase(n->key);
+        lru[n->seg].erase(n);
+    }
+    // 先淘汰试用段中最久未使用的键
+    void evict()
+    {
+        while (bytes() > capacity) {
+            if (!lru[PROBATION].empty())
+                erase(std::prev(lru[PROBATION].end()));
+            else
+                erase(std::prev(lru[PROTECTED].end()));
+        }
+    }
+
+    size_t capacity;
+    size_t protected_capacity;
+    std::list<node> lru[2];
+    size_t used[2] = { 0, 0 };
+    std::unordered_map<std::string_view, node_iterator> index;
+    size_t hits = 0;
+    size_t misses = 0;
+};
+
+}
+}
+
+#endif // _ALICE_SRC_SSDB_READ_CACHE_H
@@ -6,14 +6,15 @@ namespace ssdb {
 
 #define HASH_ANCHOR_VAL ""
 
+// hash-meta-value: [type][seq(8)][size(8)]
 static inline std::string
 encode_hash_meta_value(uint64_t seq, long long size)
 {
     std::string buf;
+    buf.reserve(1 + 8 * 2);
     buf.append(1, ktype::thash);
-    buf.append(i2s(seq));
-    buf.append(1, ':');
-    buf.append(i2s(size));
+    append_fixed64(buf, seq);
+    append_fixed64(buf, size);
     return buf;
 }
 
@@ -26,38 +27,38 @@ static inline hash_key_info
 decode_hash_meta_value(const std::string& value)
 {
     hash_key_info hk;
-    const char *s = value.c_str() + 1;
-    hk.seq = atoll(s);
-    hk.size = atoll(strchr(s, ':') + 1);
+    hk.seq = load_fixed64(value.data() + 1);
+    hk.size = load_fixed64(value.data() + 9);
     return hk;
 }
 
+// hash-key: [type][seq(8)][field]
 static inline std::string
 encode_hash_key(uint64_t seq, const std::string& field)
 {
     std::string buf;
+    buf.reserve(1 + 8 + field.size());
     buf.append(1, ktype::thash);
-    buf.append(i2s(seq));
-    buf.append(1, ':');
+    append_fixed64(buf, seq);
     buf.append(field);
     return buf;
 }
 
+static inline std::string get_hash_field(leveldb::Slice&& key)
+{
+    key.remove_prefix(1 + 8);
+    return key.ToString();
+}
+
+// 所有的field都排在anchor之后
 static inline std::string get_hash_anchor(uint64_t seq)
 {
     std::string buf;
     buf.append(1, ktype::thash);
-    buf.append(i2s(seq));
-    buf.append(1, ':');
+    append_fixed64(buf, seq);
     return buf;
 }
 
-static inline std::string get_hash_field(leveldb::Slice&& field)
-{
-    field.remove_prefix(strchr(field.data(), ':') + 1 - field.data());
-    return field.ToString();
-}
-
 // HSET key field value
 void DB::hset(context_t& con)
 {
@@ -68,13 +69,13 @@ void DB::hset(context_t& con)
     std::string value;
     leveldb::WriteBatch batch;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         auto seq = get_next_seq();
         batch.Put(meta_key, encode_hash_meta_value(seq, 1));
         batch.Put(encode_hash_key(seq, field), con.argv[3]);
         batch.Put(get_hash_anchor(seq), HASH_ANCHOR_VAL);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         ret(con, shared.n1);
     }
@@ -90,7 +91,7 @@ void DB::hset(context_t& con)
         batch.Put(meta_key, encode_hash_meta_value(hk.seq, ++hk.size));
     }
     batch.Put(enc_key, con.argv[3]);
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append(found ? shared.n0 : shared.n1);
 }
@@ -104,13 +105,13 @@ void DB::hsetnx(context_t& con)
     std::string value;
     leveldb::WriteBatch batch;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         auto seq = get_next_seq();
         batch.Put(meta_key, encode_hash_meta_value(seq, 1));
         batch.Put(encode_hash_key(seq, field), con.argv[3]);
         batch.Put(get_hash_anchor(seq), HASH_ANCHOR_VAL);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         touch_watch_key(key);
         ret(con, shared.n1);
@@ -124,7 +125,7 @@ void DB::hsetnx(context_t& con)
     if (!s.IsNotFound()) reterr(con, s);
     batch.Put(meta_key, encode_hash_meta_value(hk.seq, ++hk.size));
     batch.Put(enc_key, con.argv[3]);
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append(shared.n1);
@@ -137,7 +138,7 @@ void DB::hget(context_t& con)
     auto& field = con.argv[2];
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::thash);
@@ -155,7 +156,7 @@ void DB::hexists(context_t& con)
     auto& field = con.argv[2];
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::thash);
@@ -173,7 +174,7 @@ void DB::hdel(context_t& con)
     check_expire(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::thash);
@@ -190,13 +191,12 @@ void DB::hdel(context_t& con)
             reterr(con, s);
     }
     if (dels == hk.size) {
-        batch.Delete(meta_key);
-        batch.Delete(get_hash_anchor(hk.seq));
+        del_empty_key_batch(&batch, key, meta_key, { get_hash_anchor(hk.seq) });
     } else {
         assert(hk.size > dels);
         batch.Put(meta_key, encode_hash_meta_value(hk.seq, hk.size - dels));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(dels);
@@ -208,7 +208,7 @@ void DB::hlen(context_t& con)
     auto& key = con.argv[1];
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::thash);
@@ -223,7 +223,7 @@ void DB::hstrlen(context_t& con)
     auto& field = con.argv[2];
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::thash);
@@ -245,14 +245,14 @@ void DB::hincrby(context_t& con)
     if (str2numerr()) ret(con, shared.integer_err);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         leveldb::WriteBatch batch;
         uint64_t seq = get_next_seq();
         batch.Put(meta_key, encode_hash_meta_value(seq, 1));
         batch.Put(encode_hash_key(seq, field), incr_str);
         batch.Put(get_hash_anchor(seq), HASH_ANCHOR_VAL);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         touch_watch_key(key);
         ret(con, shared.n0);
@@ -266,12 +266,12 @@ void DB::hincrby(context_t& con)
         auto number = str2ll(value);
         if (str2numerr()) ret(con, shared.integer_err);
         incr += number;
-        s = db->Put(leveldb::WriteOptions(), enc_key, i2s(incr));
+        s = put(enc_key, i2s(incr));
     } else if (s.IsNotFound()) {
         leveldb::WriteBatch batch;
         batch.Put(meta_key, encode_hash_meta_value(hk.seq, ++hk.size));
         batch.Put(enc_key, incr_str);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
     } else
         reterr(con, s);
     check_status(con, s);
@@ -290,7 +290,7 @@ void DB::hmset(context_t& con)
     std::string value;
     leveldb::WriteBatch batch;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         auto seq = get_next_seq();
         for (size_t i = 2; i < size; i += 2) {
@@ -298,7 +298,7 @@ void DB::hmset(context_t& con)
         }
         batch.Put(meta_key, encode_hash_meta_value(seq, (size - 2) / 2));
         batch.Put(get_hash_anchor(seq), HASH_ANCHOR_VAL);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         ret(con, shared.ok);
     }
@@ -314,7 +314,7 @@ void DB::hmset(context_t& con)
         batch.Put(enc_key, con.argv[i+1]);
     }
     batch.Put(meta_key, encode_hash_meta_value(hk.seq, hk.size + nums));
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append(shared.ok);
 }
@@ -326,7 +326,7 @@ void DB::hmget(context_t& con)
     size_t size = con.argv.size();
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) {
         con.append_reply_multi(size-2);
         for (size_t i = 2; i < size; i++)
@@ -355,14 +355,14 @@ void DB::_hget(context_t& con, int what)
     auto& key = con.argv[1];
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::thash);
     auto hk = decode_hash_meta_value(value);
     auto anchor = get_hash_anchor(hk.seq);
     con.append_reply_multi(what == HGETALL ? hk.size * 2 : hk.size);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); hk.size-- > 0 && it->Valid(); it->Next()) {
         switch (what) {
         case HGETKEYS:
@@ -401,7 +401,7 @@ errstr_t DB::del_hash_key(const std::string& key)
     leveldb::WriteBatch batch;
     auto err = del_hash_key_batch(&batch, key);
     if (err) return err;
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     if (!s.ok()) return s;
     return std::nullopt;
 }
@@ -410,12 +410,12 @@ errstr_t DB::del_hash_key_batch(leveldb::WriteBatch *batch, const std::string& k
 {
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     auto hk = decode_hash_meta_value(value);
     auto anchor = get_hash_anchor(hk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); hk.size-- > 0 && it->Valid(); it->Next()) {
         batch->Delete(it->key());
     }
@@ -432,7 +432,7 @@ void DB::rename_hash_key(leveldb::WriteBatch *batch, const key_t& key,
     uint64_t newseq = get_next_seq();
     long long newsize = hk.size;
     auto anchor = get_hash_anchor(hk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
         batch->Put(encode_hash_key(newseq, get_hash_field(it->key())), it->value());
         batch->Delete(it->key());
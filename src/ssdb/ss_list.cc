@@ -6,18 +6,17 @@ namespace alice {
 
 namespace ssdb {
 
-// list-meta-value: [type][lindex][:][rindex][:][size]
+// list-meta-value: [type][lindex(8)][rindex(8)][size(8)]
 // range: [lindex, rindex]
 static inline std::string
 encode_list_meta_value(long long li, long long ri, long long size)
 {
     std::string buf;
+    buf.reserve(1 + 8 * 3);
     buf.append(1, ktype::tlist);
-    buf.append(i2s(li));
-    buf.append(1, ':');
-    buf.append(i2s(ri));
-    buf.append(1, ':');
-    buf.append(i2s(size));
+    append_int64(buf, li);
+    append_int64(buf, ri);
+    append_int64(buf, size);
     return buf;
 }
 
@@ -34,32 +33,36 @@ static inline list_key_info
 decode_list_meta_value(const std::string& value)
 {
     list_key_info lk;
-    const char *s = value.c_str() + 1;
-    lk.li = atoll(s);
-    lk.ri = atoll(strchr(s, ':') + 1);
-    lk.size = atoll(strrchr(s, ':') + 1);
+    const char *s = value.data() + 1;
+    lk.li = load_int64(s);
+    lk.ri = load_int64(s + 8);
+    lk.size = load_int64(s + 16);
     return lk;
 }
 
+// list-key: [type][keylen(4)][key][index(8)]
+// 带上键的长度，不同的键的元素不会交错在一起
 static inline std::string
 encode_list_key(const std::string& key, long long number)
 {
     std::string buf;
+    buf.reserve(1 + 4 + key.size() + 8);
     buf.append(1, ktype::tlist);
+    append_fixed32(buf, key.size());
     buf.append(key);
-    buf.append(1, ':');
-    buf.append(i2s(number));
+    append_int64(buf, number);
     return buf;
 }
 
 static inline long long get_list_index(leveldb::Slice&& key)
 {
-    return atoll(strrchr(key.data(), ':') + 1);
+    return load_int64(key.data() + key.size() - 8);
 }
 
-static void pop_key(DB *db, leveldb::WriteBatch *batch,
+// 弹出的元素会被放回同一个列表时(RPOPLPUSH key key)，列表不会真正变空，需要保留过期时间
+static void pop_key(DB *db, leveldb::WriteBatch *batch, const DB::key_t& key,
                  const std::string& meta_key, const std::string& enc_key,
-                 list_key_info& lk, bool is_lpop)
+                 list_key_info& lk, bool is_lpop, bool repush = false)
 {
     if (lk.is_no_hole()) {
         is_lpop ? ++lk.li : --lk.ri;
@@ -73,7 +76,10 @@ static void pop_key(DB *db, leveldb::WriteBatch *batch,
         else lk.ri = get_list_index(it->key());
     }
     batch->Put(meta_key, encode_list_meta_value(lk.li, lk.ri, --lk.size));
-    if (lk.size == 0) batch->Delete(meta_key);
+    if (lk.size == 0) {
+        if (repush) batch->Delete(meta_key);
+        else db->del_empty_key_batch(batch, key, meta_key);
+    }
     batch->Delete(enc_key);
 }
 
@@ -86,7 +92,7 @@ void DB::lpush(context_t& con)
     list_key_info lk;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (!s.IsNotFound() && !s.ok()) reterr(con, s);
     if (s.ok()) {
         check_type(con, value, ktype::tlist);
@@ -100,7 +106,7 @@ void DB::lpush(context_t& con)
     lk.size += con.argv.size() - 2;
     batch.Put(meta_key, encode_list_meta_value(lk.li + 1, lk.ri, lk.size));
 
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(lk.size);
@@ -116,7 +122,7 @@ void DB::rpush(context_t& con)
     list_key_info lk;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (!s.IsNotFound() && !s.ok()) reterr(con, s);
     if (s.ok()) {
         check_type(con, value, ktype::tlist);
@@ -130,7 +136,7 @@ void DB::rpush(context_t& con)
     lk.size += con.argv.size() - 2;
     batch.Put(meta_key, encode_list_meta_value(lk.li, lk.ri - 1, lk.size));
 
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(lk.size);
@@ -143,7 +149,7 @@ void DB::_lpushx(context_t& con, bool is_lpushx)
     std::string value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -152,7 +158,7 @@ void DB::_lpushx(context_t& con, bool is_lpushx)
     batch.Put(encode_list_key(key, is_lpushx ? --lk.li : ++lk.ri), con.argv[2]);
     batch.Put(meta_key, encode_list_meta_value(lk.li, lk.ri, ++lk.size));
 
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(lk.size);
@@ -177,7 +183,7 @@ void DB::_lpop(context_t& con, bool is_lpop)
     std::string value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -188,9 +194,9 @@ void DB::_lpop(context_t& con, bool is_lpop)
     auto enc_key = encode_list_key(key, is_lpop ? lk.li : lk.ri);
     s = db->Get(leveldb::ReadOptions(), enc_key, &value);
     check_status(con, s);
-    pop_key(this, &batch, meta_key, enc_key, lk, is_lpop);
+    pop_key(this, &batch, key, meta_key, enc_key, lk, is_lpop);
 
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_string(value);
@@ -215,7 +221,7 @@ void DB::llen(context_t& con)
     std::string value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -234,7 +240,7 @@ void DB::lrange(context_t& con)
     if (str2numerr()) ret(con, shared.integer_err);
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -270,10 +276,10 @@ void DB::_rpoplpush(context_t& con, bool is_nonblock)
         if (timeout < 0) ret(con, shared.timeout_out_of_range);
     }
     std::string src_value, des_value;
-    auto s = db->Get(leveldb::ReadOptions(), src_meta_key, &src_value);
+    auto s = cached_get(src_meta_key, &src_value);
     if (s.IsNotFound()) {
         if (is_nonblock) ret(con, shared.nil);
-        s = db->Get(leveldb::ReadOptions(), des_meta_key, &des_value);
+        s = cached_get(des_meta_key, &des_value);
         if (!s.ok() && !s.IsNotFound()) reterr(con, s);
         if (s.ok()) check_type(con, des_value, ktype::tlist);
         add_blocking_key(con, src_key);
@@ -289,14 +295,14 @@ void DB::_rpoplpush(context_t& con, bool is_nonblock)
     auto enc_key = encode_list_key(src_key, lk.ri);
     s = db->Get(leveldb::ReadOptions(), enc_key, &src_value);
     check_status(con, s);
-    pop_key(this, &batch, src_meta_key, enc_key, lk, false);
+    pop_key(this, &batch, src_key, src_meta_key, enc_key, lk, false, src_key == des_key);
     // put src_value to des_key
     if (src_key == des_key) {
         --lk.li;
         touch_watch_key(src_key);
     } else {
         lk.li = lk.ri = lk.size = 0;
-        s = db->Get(leveldb::ReadOptions(), des_meta_key, &des_value);
+        s = cached_get(des_meta_key, &des_value);
         if (s.ok()) {
             check_type(con, des_value, ktype::tlist);
             lk = decode_list_meta_value(des_value);
@@ -311,7 +317,7 @@ void DB::_rpoplpush(context_t& con, bool is_nonblock)
     batch.Put(encode_list_key(des_key, lk.li), src_value);
     batch.Put(des_meta_key, encode_list_meta_value(lk.li, lk.ri, ++lk.size));
 
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_string(src_value);
     blocking_pop(des_key);
@@ -331,7 +337,7 @@ void DB::lrem(context_t& con)
     std::string enc_key, value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -340,7 +346,7 @@ void DB::lrem(context_t& con)
     auto lk = decode_list_meta_value(value);
     // 因为可能会在中间删除元素，所以需要更新索引范围[li, ri]
     bool update = false;
-    auto it = newIterator();
+    auto it = newScanIterator();
     if (count > 0) {
         for (it->Seek(encode_list_key(key, lk.li)); it->Valid(); it->Next()) {
             if (it->value() == con.argv[3]) {
@@ -398,12 +404,12 @@ void DB::lrem(context_t& con)
         }
     }
     if (rems == lk.size) {
-        batch.Delete(meta_key);
+        del_empty_key_batch(&batch, key, meta_key);
     } else {
         assert(lk.size > rems);
         batch.Put(meta_key, encode_list_meta_value(lk.li, lk.ri, lk.size - rems));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(rems);
@@ -418,7 +424,7 @@ void DB::lindex(context_t& con)
     std::string value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -454,7 +460,7 @@ void DB::lset(context_t& con)
     std::string value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.no_such_key);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -477,7 +483,7 @@ void DB::lset(context_t& con)
         }
         assert(index == -1);
     }
-    s = db->Put(leveldb::WriteOptions(), enc_key, con.argv[3]);
+    s = put(enc_key, con.argv[3]);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_string(shared.ok);
@@ -494,7 +500,7 @@ void DB::ltrim(context_t& con)
     std::string value;
     auto meta_key = encode_meta_key(key);
     check_expire(meta_key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.ok);
     check_status(con, s);
     check_type(con, value, ktype::tlist);
@@ -511,7 +517,7 @@ void DB::ltrim(context_t& con)
     }
     long long i = 0;
     leveldb::WriteBatch batch;
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(encode_list_key(key, lk.li)); it->Valid(); it->Next()) {
         if (i == start) lk.li = get_list_index(it->key());
         if (i == stop) lk.ri = get_list_index(it->key());
@@ -521,7 +527,7 @@ void DB::ltrim(context_t& con)
     }
     lk.size -= stop - start;
     batch.Put(meta_key, encode_list_meta_value(lk.li, lk.ri, lk.size));
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append(shared.ok);
@@ -538,7 +544,7 @@ void DB::_blpop(context_t& con, bool is_blpop)
         std::string value;
         auto& key = con.argv[i];
         auto meta_key = encode_meta_key(key);
-        auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+        auto s = cached_get(meta_key, &value);
         if (s.ok()) {
             leveldb::WriteBatch batch;
             check_type(con, value, ktype::tlist);
@@ -546,8 +552,8 @@ void DB::_blpop(context_t& con, bool is_blpop)
             auto enc_key = encode_list_key(key, is_blpop ? lk.li : lk.ri);
             s = db->Get(leveldb::ReadOptions(), enc_key, &value);
             check_status(con, s);
-            pop_key(this, &batch, meta_key, enc_key, lk, is_blpop);
-            s = db->Write(leveldb::WriteOptions(), &batch);
+            pop_key(this, &batch, key, meta_key, enc_key, lk, is_blpop);
+            s = write(&batch);
             check_status(con, s);
             con.append_reply_multi(2);
             con.append_reply_string(key);
@@ -603,6 +609,7 @@ void DB::set_context_to_block(context_t& con, int timeout)
     con.flags |= context_t::CON_BLOCK;
     con.block_start_time = angel::util::get_cur_time_ms();
     con.blocked_time = timeout * 1000;
+    __server->block_reply(con);
     engine->add_block_client(con.conn->id());
 }
 
@@ -613,7 +620,7 @@ void DB::blocking_pop(const key_t& key)
     if (cl == blocking_keys.end()) return;
     auto now = angel::util::get_cur_time_ms();
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     assert(s.ok());
     auto lk = decode_list_meta_value(value);
 
@@ -630,17 +637,18 @@ void DB::blocking_pop(const key_t& key)
     context.append_reply_string(value);
     double seconds = 1.0 * (now - con.block_start_time) / 1000;
     context.append("+(").append(d2s(seconds)).append("s)\r\n");
-    conn->send(context.buf);
+    __server->unblock_reply(conn, std::move(context.buf));
 
     clear_blocking_keys_for_context(con);
     engine->del_block_client(conn->id());
 
     leveldb::WriteBatch batch;
-    pop_key(this, &batch, meta_key, enc_key, lk, bops == BLOCK_LPOP);
+    pop_key(this, &batch, key, meta_key, enc_key, lk, bops == BLOCK_LPOP,
+            bops == BLOCK_RPOPLPUSH && key == con.des);
     if (bops == BLOCK_RPOPLPUSH) {
         auto src_value = value;
         auto meta_key = encode_meta_key(con.des);
-        s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+        s = cached_get(meta_key, &value);
         assert(s.ok() || s.IsNotFound());
         if (s.IsNotFound()) {
             batch.Put(encode_list_key(con.des, 0), src_value);
@@ -652,7 +660,7 @@ void DB::blocking_pop(const key_t& key)
             batch.Put(meta_key, encode_list_meta_value(lk.li, lk.ri, lk.size));
         }
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     assert(s.ok());
     touch_watch_key(key);
 }
@@ -682,7 +690,7 @@ errstr_t DB::del_list_key(const key_t& key)
     leveldb::WriteBatch batch;
     auto err = del_list_key_batch(&batch, key);
     if (err) return err;
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     if (s.ok()) return std::nullopt;
     return s;
 }
@@ -691,11 +699,11 @@ errstr_t DB::del_list_key_batch(leveldb::WriteBatch *batch, const key_t& key)
 {
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     auto lk = decode_list_meta_value(value);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(encode_list_key(key, lk.li)); it->Valid(); it->Next()) {
         batch->Delete(it->key());
         if (--lk.size == 0)
@@ -711,7 +719,7 @@ void DB::rename_list_key(leveldb::WriteBatch *batch, const key_t& key,
 {
     long long i = 0;
     auto lk = decode_list_meta_value(meta_value);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(encode_list_key(key, lk.li)); it->Valid(); it->Next()) {
         batch->Put(encode_list_key(newkey, i++), it->value());
         batch->Delete(it->key());
@@ -723,17 +731,5 @@ void DB::rename_list_key(leveldb::WriteBatch *batch, const key_t& key,
     batch->Delete(encode_meta_key(key));
 }
 
-int keycomp::list_compare(const leveldb::Slice& l, const leveldb::Slice& r) const
-{
-    auto begin1 = l.data() + 1, begin2 = r.data() + 1;
-    auto s1 = strrchr(begin1, ':');
-    auto s2 = strrchr(begin2, ':');
-    leveldb::Slice key1(begin1, s1 - begin1), key2(begin2, s2 - begin2);
-    int res = key1.compare(key2);
-    if (res) return res;
-    auto i1 = atoll(s1 + 1), i2 = atoll(s2 + 1);
-    return i1 - i2;
-}
-
 }
 }
@@ -7,14 +7,15 @@ namespace ssdb {
 #define SET_VAL ""
 #define SET_ANCHOR_VAL ""
 
+// set-meta-value: [type][seq(8)][size(8)]
 static inline std::string
 encode_set_meta_value(uint64_t seq, long long size)
 {
     std::string buf;
+    buf.reserve(1 + 8 * 2);
     buf.append(1, ktype::tset);
-    buf.append(i2s(seq));
-    buf.append(1, ':');
-    buf.append(i2s(size));
+    append_fixed64(buf, seq);
+    append_fixed64(buf, size);
     return buf;
 }
 
@@ -27,35 +28,35 @@ static inline set_key_info
 decode_set_meta_value(const std::string& value)
 {
     set_key_info sk;
-    const char *s = value.c_str() + 1;
-    sk.seq = atoll(s);
-    sk.size = atoll(strchr(s, ':') + 1);
+    sk.seq = load_fixed64(value.data() + 1);
+    sk.size = load_fixed64(value.data() + 9);
     return sk;
 }
 
+// set-key: [type][seq(8)][member]
 static inline std::string
 encode_set_key(uint64_t seq, const std::string& member)
 {
     std::string buf;
+    buf.reserve(1 + 8 + member.size());
     buf.append(1, ktype::tset);
-    buf.append(i2s(seq));
-    buf.append(1, ':');
+    append_fixed64(buf, seq);
     buf.append(member);
     return buf;
 }
 
 static inline std::string get_set_member(leveldb::Slice&& key)
 {
-    key.remove_prefix(strchr(key.data(), ':') + 1 - key.data());
+    key.remove_prefix(1 + 8);
     return key.ToString();
 }
 
+// 所有的member都排在anchor之后
 static inline std::string get_set_anchor(uint64_t seq)
 {
     std::string buf;
     buf.append(1, ktype::tset);
-    buf.append(i2s(seq));
-    buf.append(1, ':');
+    append_fixed64(buf, seq);
     return buf;
 }
 
@@ -67,7 +68,7 @@ void DB::sadd(context_t& con)
     auto& key = con.argv[1];
     check_expire(key);
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     leveldb::WriteBatch batch;
     if (s.IsNotFound()) {
         uint64_t seq = get_next_seq();
@@ -90,7 +91,7 @@ void DB::sadd(context_t& con)
         batch.Put(meta_key, encode_set_meta_value(sk.seq, sk.size + adds));
     } else
         reterr(con, s);
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_number(adds);
     touch_watch_key(key);
@@ -102,7 +103,7 @@ void DB::sismember(context_t& con)
     std::string value;
     auto& key = con.argv[1];
     auto& member = con.argv[2];
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tset);
@@ -120,7 +121,7 @@ void DB::spop(context_t& con)
     auto& key = con.argv[1];
     check_expire(key);
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tset);
@@ -129,7 +130,7 @@ void DB::spop(context_t& con)
     std::uniform_int_distribution<uint64_t> u(0, sk.size - 1);
     uint64_t where = u(e);
     auto anchor = get_set_anchor(sk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     leveldb::Slice pop_key;
     leveldb::WriteBatch batch;
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
@@ -140,12 +141,11 @@ void DB::spop(context_t& con)
         }
     }
     if (--sk.size == 0) {
-        batch.Delete(meta_key);
-        batch.Delete(anchor);
+        del_empty_key_batch(&batch, key, meta_key, { anchor });
     } else {
         batch.Put(meta_key, encode_set_meta_value(sk.seq, sk.size));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_string(get_set_member(std::move(pop_key)));
     touch_watch_key(key);
@@ -193,7 +193,7 @@ void DB::srandmember(context_t& con)
         if (str2numerr()) ret(con, shared.integer_err);
         if (count == 0) ret(con, shared.nil);
     }
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tset);
@@ -201,7 +201,7 @@ void DB::srandmember(context_t& con)
     if (count >= sk.size) {
         con.append_reply_multi(sk.size);
         auto anchor = get_set_anchor(sk.seq);
-        auto it = newIterator();
+        auto it = newScanIterator();
         for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
             con.append_reply_string(get_set_member(it->key()));
             if (--sk.size == 0)
@@ -222,7 +222,7 @@ void DB::srandmember(context_t& con)
     auto origin_rands = rands;
     std::sort(rands.begin(), rands.end());
     auto anchor = get_set_anchor(sk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     long long i = 0;
     auto where = rands[i];
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
@@ -252,7 +252,7 @@ void DB::srem(context_t& con)
     auto& key = con.argv[1];
     check_expire(key);
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tset);
@@ -269,12 +269,11 @@ void DB::srem(context_t& con)
     }
     sk.size -= rems;
     if (sk.size == 0) {
-        batch.Delete(meta_key);
-        batch.Delete(get_set_anchor(sk.seq));
+        del_empty_key_batch(&batch, key, meta_key, { get_set_anchor(sk.seq) });
     } else {
         batch.Put(meta_key, encode_set_meta_value(sk.seq, sk.size));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_number(rems);
     touch_watch_key(key);
@@ -290,7 +289,7 @@ void DB::smove(context_t& con)
     check_expire(src_key);
     check_expire(des_key);
     auto src_meta_key = encode_meta_key(src_key);
-    auto s = db->Get(leveldb::ReadOptions(), src_meta_key, &value);
+    auto s = cached_get(src_meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tset);
@@ -305,14 +304,13 @@ void DB::smove(context_t& con)
     }
     leveldb::WriteBatch batch;
     if (--sk.size == 0) {
-        batch.Delete(src_meta_key);
-        batch.Delete(get_set_anchor(sk.seq));
+        del_empty_key_batch(&batch, src_key, src_meta_key, { get_set_anchor(sk.seq) });
     } else {
         batch.Put(src_meta_key, encode_set_meta_value(sk.seq, sk.size));
     }
     batch.Delete(rem_key);
     auto des_meta_key = encode_meta_key(des_key);
-    s = db->Get(leveldb::ReadOptions(), des_meta_key, &value);
+    s = cached_get(des_meta_key, &value);
     if (s.ok()) {
         check_type(con, value, ktype::tset);
         auto sk = decode_set_meta_value(value);
@@ -332,7 +330,7 @@ void DB::smove(context_t& con)
     } else {
         reterr(con, s);
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(src_key);
     touch_watch_key(des_key);
@@ -345,7 +343,7 @@ void DB::scard(context_t& con)
     std::string value;
     auto& key = con.argv[1];
     check_expire(key);
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tset);
@@ -359,13 +357,13 @@ void DB::smembers(context_t& con)
     std::string value;
     auto& key = con.argv[1];
     check_expire(key);
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tset);
     auto sk = decode_set_meta_value(value);
     auto anchor = get_set_anchor(sk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     con.append_reply_multi(sk.size);
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
         con.append_reply_string(get_set_member(it->key()));
@@ -383,7 +381,7 @@ void DB::_sinter(context_t& con, std::unordered_set<std::string>& rset, int star
     // 挑选出元素最少的集合
     for (size_t i = start; i < con.argv.size(); i++) {
         check_expire(con.argv[i]);
-        auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(con.argv[i]), &value);
+        auto s = cached_get(encode_meta_key(con.argv[i]), &value);
         if (s.IsNotFound()) ret(con, shared.nil);
         check_status(con, s);
         check_type(con, value, ktype::tset);
@@ -395,7 +393,7 @@ void DB::_sinter(context_t& con, std::unordered_set<std::string>& rset, int star
         }
     }
     auto anchor = get_set_anchor(seqmap[j]);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
         auto member = get_set_member(it->key());
         for (i = start; i < con.argv.size(); i++) {
@@ -417,13 +415,13 @@ void DB::_sunion(context_t& con, std::unordered_set<std::string>& rset, int star
     std::string value;
     for (size_t i = start; i < con.argv.size(); i++) {
         check_expire(con.argv[i]);
-        auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(con.argv[i]), &value);
+        auto s = cached_get(encode_meta_key(con.argv[i]), &value);
         if (s.IsNotFound()) continue;
         check_status(con, s);
         check_type(con, value, ktype::tset);
         auto sk = decode_set_meta_value(value);
         auto anchor = get_set_anchor(sk.seq);
-        auto it = newIterator();
+        auto it = newScanIterator();
         for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
             rset.emplace(get_set_member(it->key()));
             if (--sk.size == 0)
@@ -446,7 +444,7 @@ void DB::_sstore(context_t& con, std::unordered_set<std::string>& rset)
     std::string value;
     auto& key = con.argv[1];
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     leveldb::WriteBatch batch;
     if (!s.ok() && !s.IsNotFound()) reterr(con, s);
     if (s.ok()) del_set_key_batch(&batch, key);
@@ -456,7 +454,7 @@ void DB::_sstore(context_t& con, std::unordered_set<std::string>& rset)
     }
     batch.Put(meta_key, encode_set_meta_value(seq, rset.size()));
     batch.Put(get_set_anchor(seq), SET_ANCHOR_VAL);
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_number(rset.size());
 }
@@ -516,7 +514,7 @@ errstr_t DB::del_set_key(const key_t& key)
     leveldb::WriteBatch batch;
     auto err = del_set_key_batch(&batch, key);
     if (err) return err;
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     if (!s.ok()) return s;
     return std::nullopt;
 }
@@ -525,12 +523,12 @@ errstr_t DB::del_set_key_batch(leveldb::WriteBatch *batch, const key_t& key)
 {
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     auto sk = decode_set_meta_value(value);
     auto anchor = get_set_anchor(sk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
         batch->Delete(it->key());
         if (--sk.size == 0)
@@ -549,7 +547,7 @@ void DB::rename_set_key(leveldb::WriteBatch *batch, const key_t& key,
     uint64_t newseq = get_next_seq();
     long long newsize = sk.size;
     auto anchor = get_set_anchor(sk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
         batch->Put(encode_set_key(newseq, get_set_member(it->key())), it->value());
         batch->Delete(it->key());
@@ -35,7 +35,7 @@ void DB::set(context_t& con)
         ret(con, shared.syntax_err);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (cmdops & SET_NX) {
         if (s.ok()) ret(con, shared.nil);
         if (!s.IsNotFound()) reterr(con, s);
@@ -50,14 +50,14 @@ void DB::set(context_t& con)
     }
     batch.Put(encode_meta_key(key), encode_string_meta_value());
     batch.Put(encode_string_key(key), con.argv[2]);
-    s = db->Write(leveldb::WriteOptions(), &batch);
-    check_status(con, s);
-    touch_watch_key(key);
-    con.append(shared.ok);
     if (cmdops & (SET_EX | SET_PX)) {
         expire += angel::util::get_cur_time_ms();
-        add_expire_key(key, expire);
+        add_expire_key_batch(&batch, key, expire);
     }
+    s = write(&batch);
+    check_status(con, s);
+    touch_watch_key(key);
+    con.append(shared.ok);
 }
 
 // SETNX key value
@@ -66,14 +66,14 @@ void DB::setnx(context_t& con)
     std::string value;
     auto& key = con.argv[1];
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.ok()) ret(con, shared.n0);
     if (!s.IsNotFound()) reterr(con, s);
     check_type(con, value, ktype::tstring);
     leveldb::WriteBatch batch;
     batch.Put(meta_key, encode_string_meta_value());
     batch.Put(encode_string_key(key), con.argv[2]);
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append(shared.n1);
@@ -84,11 +84,11 @@ void DB::get(context_t& con)
 {
     std::string value;
     auto& key = con.argv[1];
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tstring);
-    s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+    s = cached_get(encode_string_key(key), &value);
     check_status(con, s);
     con.append_reply_string(value);
 }
@@ -102,21 +102,21 @@ void DB::getset(context_t& con)
     touch_watch_key(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     leveldb::WriteBatch batch;
     if (s.IsNotFound()) {
         batch.Put(meta_key, encode_string_meta_value());
         batch.Put(encode_string_key(key), new_value);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         ret(con, shared.nil);
     }
     check_status(con, s);
     check_type(con, value, ktype::tstring);
     auto enc_key = encode_string_key(key);
-    s = db->Get(leveldb::ReadOptions(), enc_key, &value);
+    s = cached_get(enc_key, &value);
     check_status(con, s);
-    s = db->Put(leveldb::WriteOptions(), enc_key, new_value);
+    s = put(enc_key, new_value);
     check_status(con, s);
     con.append_reply_string(value);
 }
@@ -126,11 +126,11 @@ void DB::strlen(context_t& con)
 {
     std::string value;
     auto& key = con.argv[1];
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tstring);
-    s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+    s = cached_get(encode_string_key(key), &value);
     check_status(con, s);
     con.append_reply_number(value.size());
 }
@@ -143,12 +143,12 @@ void DB::append(context_t& con)
     touch_watch_key(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         leveldb::WriteBatch batch;
         batch.Put(meta_key, encode_string_meta_value());
         batch.Put(encode_string_key(key), con.argv[2]);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         con.append_reply_number(con.argv[2].size());
         return;
@@ -156,10 +156,10 @@ void DB::append(context_t& con)
     check_type(con, value, ktype::tstring);
     check_status(con, s);
     auto enc_key = encode_string_key(key);
-    s = db->Get(leveldb::ReadOptions(), enc_key, &value);
+    s = cached_get(enc_key, &value);
     check_status(con, s);
     value.append(con.argv[2]);
-    s = db->Put(leveldb::WriteOptions(), enc_key, value);
+    s = put(enc_key, value);
     check_status(con, s);
     con.append_reply_number(value.size());
 }
@@ -175,7 +175,7 @@ void DB::mset(context_t& con)
         auto& key = con.argv[i];
         check_expire(key);
         auto meta_key = encode_meta_key(key);
-        auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+        auto s = cached_get(meta_key, &value);
         if (s.ok()) {
             auto err = del_key_with_expire_batch(&batch, key);
             if (err) reterr(con, err.value());
@@ -185,7 +185,7 @@ void DB::mset(context_t& con)
         batch.Put(encode_string_key(key), con.argv[i+1]);
         touch_watch_key(key);
     }
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     check_status(con, s);
     con.append(shared.ok);
 }
@@ -200,10 +200,10 @@ void DB::mget(context_t& con)
         check_expire(key);
         std::string value;
         auto meta_key = encode_meta_key(key);
-        auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+        auto s = cached_get(meta_key, &value);
         if (s.ok()) {
             if (get_type(value) == ktype::tstring) {
-                s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+                s = cached_get(encode_string_key(key), &value);
                 if (s.ok())
                     con.append_reply_string(value);
                 else
@@ -223,17 +223,21 @@ void DB::_incr(context_t& con, int64_t incr)
     check_expire(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
+    leveldb::WriteBatch batch;
     if (s.ok()) {
         check_type(con, value, ktype::tstring);
-        s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+        s = cached_get(encode_string_key(key), &value);
         check_status(con, s);
         auto number = str2ll(value);
         if (str2numerr()) ret(con, shared.integer_err);
         incr += number;
-    } else if (!s.IsNotFound())
+    } else if (s.IsNotFound()) {
+        batch.Put(meta_key, encode_string_meta_value());
+    } else
         reterr(con, s);
-    s = db->Put(leveldb::WriteOptions(), encode_string_key(key), i2s(incr));
+    batch.Put(encode_string_key(key), i2s(incr));
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_number(incr);
     touch_watch_key(key);
@@ -279,7 +283,7 @@ void DB::setrange(context_t& con)
     check_expire(key);
     touch_watch_key(key);
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         new_value.reserve(offset + arg_value.size());
         new_value.resize(offset, '\x00');
@@ -287,14 +291,14 @@ void DB::setrange(context_t& con)
         leveldb::WriteBatch batch;
         batch.Put(meta_key, encode_string_meta_value());
         batch.Put(encode_string_key(key), new_value);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         con.append_reply_number(new_value.size());
         return;
     }
     check_status(con, s);
     check_type(con, value, ktype::tstring);
-    s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+    s = cached_get(encode_string_key(key), &value);
     check_status(con, s);
     new_value.swap(value);
     size_t len = offset + arg_value.size();
@@ -303,7 +307,7 @@ void DB::setrange(context_t& con)
     if (offset > new_value.size())
         new_value.resize(offset, '\x00');
     std::copy(arg_value.begin(), arg_value.end(), new_value.begin()+offset);
-    s = db->Put(leveldb::WriteOptions(), encode_string_key(key), new_value);
+    s = put(encode_string_key(key), new_value);
     check_status(con, s);
     con.append_reply_number(new_value.size());
 }
@@ -319,10 +323,10 @@ void DB::getrange(context_t& con)
     check_expire(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_type(con, value, ktype::tstring);
-    s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+    s = cached_get(encode_string_key(key), &value);
     check_status(con, s);
     long long upper = value.size() - 1;
     long long lower = -value.size();
@@ -336,7 +340,7 @@ errstr_t DB::del_string_key(const key_t& key)
     leveldb::WriteBatch batch;
     auto err = del_string_key_batch(&batch, key);
     if (err) return err;
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     if (s.ok()) return std::nullopt;
     return s;
 }
@@ -344,7 +348,7 @@ errstr_t DB::del_string_key(const key_t& key)
 errstr_t DB::del_string_key_batch(leveldb::WriteBatch *batch, const key_t& key)
 {
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     batch->Delete(encode_meta_key(key));
@@ -357,7 +361,7 @@ void DB::rename_string_key(leveldb::WriteBatch *batch, const key_t& key,
 {
     UNUSED(meta_value);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_string_key(key), &value);
+    auto s = cached_get(encode_string_key(key), &value);
     assert(s.ok());
     batch->Put(encode_meta_key(newkey), encode_string_meta_value());
     batch->Put(encode_string_key(newkey), value);
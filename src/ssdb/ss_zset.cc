@@ -8,17 +8,15 @@ namespace ssdb {
 
 #define ZSET_ANCHOR_VAL ""
 
-static const char zset_score_key = '0';
-static const char zset_anchor = '-'; // ascii('-') = 45, ascii('.') = 46
-static const char zset_end_anchor = ':'; // ascii(':') = 58, ascii('9') = 57
-
+// zset-meta-value: [type][seq(8)][size(8)]
 static inline std::string
 encode_zset_meta_value(uint64_t seq, long long size)
 {
     std::string buf;
+    buf.reserve(1 + 8 * 2);
     buf.append(1, ktype::tzset);
-    save_len(buf, seq);
-    save_len(buf, (uint64_t)size);
+    append_fixed64(buf, seq);
+    append_fixed64(buf, size);
     return buf;
 }
 
@@ -26,34 +24,37 @@ static inline zsk_info
 decode_zset_meta_value(const std::string& value)
 {
     zsk_info zk;
-    char *ptr = const_cast<char*>(value.c_str()) + 1;
-    ptr += load_len(ptr, &zk.seq);
-    load_len(ptr, (uint64_t*)&zk.size);
+    zk.seq = load_fixed64(value.data() + 1);
+    zk.size = load_fixed64(value.data() + 9);
     return zk;
 }
 
 // 利用leveldb按score进行排序
 // <anchor><score,member><score1,member1>...<end-anchor>
+// score-key: [type][seq(8)][score(8)][member] -> score
 static inline std::string
-encode_zset_score(uint64_t seq, const std::string& score, const std::string& member)
+encode_zset_score(uint64_t seq, double score, const std::string& member)
 {
     std::string buf;
+    buf.reserve(1 + 8 + 8 + member.size());
     buf.append(1, ktype::tscore);
-    save_len(buf, seq);
-    buf.append(score);
-    buf.append(1, ':');
+    append_fixed64(buf, seq);
+    append_double(buf, score);
     buf.append(member);
-    buf.append(1, zset_score_key);
     return buf;
 }
 
-static inline std::string
+static inline double
 get_zset_score(leveldb::Slice&& slice)
 {
-    uint64_t seq;
-    char *ptr = const_cast<char*>(slice.data() + 1);
-    ptr += load_len(ptr, &seq);
-    return slice.ToString().substr(ptr - slice.data(), strchr(ptr, ':') - ptr);
+    return load_double(slice.data() + 1 + 8);
+}
+
+static inline std::string
+get_zset_member(leveldb::Slice&& slice)
+{
+    slice.remove_prefix(1 + 8 + 8);
+    return slice.ToString();
 }
 
 static inline std::string
@@ -61,28 +62,30 @@ get_zset_anchor(uint64_t seq)
 {
     std::string buf;
     buf.append(1, ktype::tscore);
-    save_len(buf, seq);
-    buf.append(1, zset_anchor);
+    append_fixed64(buf, seq);
     return buf;
 }
 
+// 编码后的score不会是8个0xff(最大的NaN也只有0xfff8...)
 static inline std::string
 get_zset_end_anchor(uint64_t seq)
 {
     std::string buf;
     buf.append(1, ktype::tscore);
-    save_len(buf, seq);
-    buf.append(1, zset_end_anchor);
+    append_fixed64(buf, seq);
+    buf.append(8, '\xff');
     return buf;
 }
 
 // 可以O(1)时间通过member找到score
+// member-key: [type][seq(8)][member] -> score
 static inline std::string
 encode_zset_member(uint64_t seq, const std::string& member)
 {
     std::string buf;
+    buf.reserve(1 + 8 + member.size());
     buf.append(1, ktype::tzset);
-    save_len(buf, seq);
+    append_fixed64(buf, seq);
     buf.append(member);
     return buf;
 }
@@ -125,7 +128,7 @@ zsk_iterator DB::zset_lower_bound(zsk_info& zk, double score)
 {
     auto it = zset_get_min(zk);
     for (size_t i = 0; i < zk.size && it.Valid(); it.Next(), ++i) {
-        auto x = str2f(get_zset_score(it.key()));
+        auto x = get_zset_score(it.key());
         if (x >= score) break;
     }
     return it;
@@ -134,7 +137,7 @@ zsk_iterator DB::zset_lower_bound(zsk_info& zk, double score)
 zsk_iterator DB::zset_upper_bound(zsk_info& zk, double score)
 {
     auto it = zset_lower_bound(zk, score);
-    while (it.Valid() && str2f(get_zset_score(it.key())) == score) {
+    while (it.Valid() && get_zset_score(it.key()) == score) {
         it.Next();
     }
     if (it.Valid()) {
@@ -151,8 +154,8 @@ zsk_range DB::zset_range(context_t& con, zsk_info& zk, unsigned cmdops, score_ra
 {
     auto it = zset_get_min(zk);
     auto last = zset_get_max(zk);
-    double min_score = str2f(get_zset_score(it.key()));
-    double max_score = str2f(get_zset_score(last.key()));
+    double min_score = get_zset_score(it.key());
+    double max_score = get_zset_score(last.key());
     if ((!r.lower && r.min > max_score) || (!r.upper && r.max < min_score)) {
         con.append(shared.n0);
         return { zsk_iterator(newErrorIterator(), 0), std::move(last) };
@@ -160,11 +163,11 @@ zsk_range DB::zset_range(context_t& con, zsk_info& zk, unsigned cmdops, score_ra
     if (!r.lower && r.min > min_score) it = zset_lower_bound(zk, r.min);
     if (!r.upper && r.max < max_score) last = zset_upper_bound(zk, r.max);
     if (!r.lower && (cmdops & LOI)) {
-        while (it.Valid() && str2f(get_zset_score(it.key())) == r.min)
+        while (it.Valid() && get_zset_score(it.key()) == r.min)
             it.Next();
     }
     if (!r.upper && (cmdops & ROI)) {
-        while (last.Valid() && str2f(get_zset_score(last.key())) == r.max)
+        while (last.Valid() && get_zset_score(last.key()) == r.max)
             last.Prev();
     }
     return { std::move(it), std::move(last) };
@@ -186,17 +189,17 @@ void DB::zadd(context_t& con)
     std::string value;
     leveldb::WriteBatch batch;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) { // create a new zset
         uint64_t seq = get_next_seq();
         add_zset_meta_info(&batch, meta_key, seq, (size - 2) / 2);
         for (size_t i = 2; i < size; i += 2) {
             auto& score = con.argv[i];
             auto& member = con.argv[i + 1];
-            batch.Put(encode_zset_score(seq, score, member), member);
+            batch.Put(encode_zset_score(seq, str2f(score), member), score);
             batch.Put(encode_zset_member(seq, member), score);
         }
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         con.append_reply_number((size - 2) / 2);
         return;
@@ -211,16 +214,16 @@ void DB::zadd(context_t& con)
         s = db->Get(leveldb::ReadOptions(), member_key, &value);
         if (!s.ok() && !s.IsNotFound()) reterr(con, s);
         if (s.ok()) { // 如果成员已存在，就更新它的分数
-            batch.Delete(encode_zset_score(zk.seq, value, member));
+            batch.Delete(encode_zset_score(zk.seq, str2f(value), member));
             batch.Delete(member_key);
         } else {
             adds++;
         }
-        batch.Put(encode_zset_score(zk.seq, score, member), member);
+        batch.Put(encode_zset_score(zk.seq, str2f(score), member), score);
         batch.Put(member_key, score);
     }
     batch.Put(meta_key, encode_zset_meta_value(zk.seq, zk.size + adds));
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_number(adds);
 }
@@ -233,7 +236,7 @@ void DB::zscore(context_t& con)
     check_expire(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -257,13 +260,13 @@ void DB::zincrby(context_t& con)
     std::string value;
     leveldb::WriteBatch batch;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) {
         uint64_t seq = get_next_seq();
         add_zset_meta_info(&batch, meta_key, seq, 1);
-        batch.Put(encode_zset_score(seq, score, member), member);
+        batch.Put(encode_zset_score(seq, str2f(score), member), score);
         batch.Put(encode_zset_member(seq, member), score);
-        s = db->Write(leveldb::WriteOptions(), &batch);
+        s = write(&batch);
         check_status(con, s);
         con.append_reply_string(score);
         return;
@@ -274,12 +277,15 @@ void DB::zincrby(context_t& con)
     s = db->Get(leveldb::ReadOptions(), encode_zset_member(zk.seq, member), &value);
     if (!s.ok() && !s.IsNotFound()) reterr(con, s);
     if (s.ok()) {
-        batch.Delete(encode_zset_score(zk.seq, score, member));
-        batch.Delete(encode_zset_member(zk.seq, member));
+        batch.Delete(encode_zset_score(zk.seq, str2f(value), member));
         score = d2s(str2f(value) + str2f(score));
+    } else {
+        batch.Put(meta_key, encode_zset_meta_value(zk.seq, zk.size + 1));
     }
-    batch.Put(encode_zset_score(zk.seq, score, member), member);
+    batch.Put(encode_zset_score(zk.seq, str2f(score), member), score);
     batch.Put(encode_zset_member(zk.seq, member), score);
+    s = write(&batch);
+    check_status(con, s);
     con.append_reply_string(score);
 }
 
@@ -289,7 +295,7 @@ void DB::zcard(context_t& con)
     auto& key = con.argv[1];
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -309,7 +315,7 @@ void DB::zcount(context_t& con)
         return;
     check_expire(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -335,7 +341,7 @@ void DB::_zrange(context_t& con, bool is_reverse)
     check_expire(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -356,9 +362,9 @@ void DB::_zrange(context_t& con, bool is_reverse)
         for (it->Seek(anchor), it->Next(); i < zk.size && it->Valid(); it->Next(), ++i) {
             if (i < start) continue;
             if (i > stop) break;
-            con.append_reply_string(it->value().ToString());
+            con.append_reply_string(get_zset_member(it->key()));
             if (withscores)
-                con.append_reply_string(get_zset_score(it->key()));
+                con.append_reply_string(it->value().ToString());
         }
     } else {
         auto anchor = get_zset_end_anchor(zk.seq);
@@ -367,9 +373,9 @@ void DB::_zrange(context_t& con, bool is_reverse)
             for (it->Seek(anchor), it->Prev(); i < zk.size && it->Valid(); it->Prev(), ++i) {
                 if (i < start) continue;
                 if (i > stop) break;
-                con.append_reply_string(it->value().ToString());
+                con.append_reply_string(get_zset_member(it->key()));
                 if (withscores)
-                    con.append_reply_string(get_zset_score(it->key()));
+                    con.append_reply_string(it->value().ToString());
             }
         }
     }
@@ -393,7 +399,7 @@ void DB::_zrank(context_t& con, bool is_reverse)
     check_expire(key);
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -401,19 +407,19 @@ void DB::_zrank(context_t& con, bool is_reverse)
     s = db->Get(leveldb::ReadOptions(), encode_zset_member(zk.seq, member), &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     // find score(value)'s rank(O(n))
-    auto it = newIterator();
+    auto it = newScanIterator();
     int rank = 0;
     if (!is_reverse) {
         auto anchor = get_zset_anchor(zk.seq);
         for (it->Seek(anchor), it->Next(); rank < zk.size && it->Valid(); it->Next(), ++rank) {
-            if (get_zset_score(it->key()) == value) {
+            if (get_zset_member(it->key()) == member) {
                 break;
             }
         }
     } else {
         auto anchor = get_zset_end_anchor(zk.seq);
         for (it->Seek(anchor), it->Prev(); rank < zk.size && it->Valid(); it->Prev(), ++rank) {
-            if (get_zset_score(it->key()) == value) {
+            if (get_zset_member(it->key()) == member) {
                 break;
             }
         }
@@ -447,7 +453,7 @@ void DB::_zrangebyscore(context_t& con, bool is_reverse)
     check_expire(key);
     auto meta_key = encode_meta_key(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.nil);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -480,17 +486,17 @@ void DB::_zrangefor(context_t& con, unsigned cmdops, zsk_iterator& it,
     con.append_reply_multi(withscores ? limit * 2 : limit);
     if (!is_reverse) {
         for ( ; it.Valid(); it.Next()) {
-            con.append_reply_string(it.value().ToString());
+            con.append_reply_string(get_zset_member(it.key()));
             if (withscores)
-                con.append_reply_string(get_zset_score(it.key()));
+                con.append_reply_string(it.value().ToString());
             if (is_limit && --limit == 0)
                 break;
         }
     } else {
         for ( ; it.Valid(); it.Prev()) {
-            con.append_reply_string(it.value().ToString());
+            con.append_reply_string(get_zset_member(it.key()));
             if (withscores)
-                con.append_reply_string(get_zset_score(it.key()));
+                con.append_reply_string(it.value().ToString());
             if (is_limit && --limit == 0)
                 break;
         }
@@ -514,7 +520,7 @@ void DB::zrem(context_t& con)
     check_expire(key);
     auto meta_key = encode_meta_key(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -528,17 +534,18 @@ void DB::zrem(context_t& con)
         s = db->Get(leveldb::ReadOptions(), member_key, &value);
         if (s.ok()) {
             batch.Delete(member_key);
-            batch.Delete(encode_zset_score(zk.seq, value, member));
+            batch.Delete(encode_zset_score(zk.seq, str2f(value), member));
             rems++;
         }
     }
     if (rems == zk.size) {
-        del_zset_meta_info(&batch, meta_key, zk.seq);
+        del_empty_key_batch(&batch, key, meta_key,
+                            { get_zset_anchor(zk.seq), get_zset_end_anchor(zk.seq) });
     } else {
         assert(zk.size > rems);
         batch.Put(meta_key, encode_zset_meta_value(zk.seq, zk.size - rems));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(rems);
@@ -555,7 +562,7 @@ void DB::zremrangebyrank(context_t& con)
     check_expire(key);
     auto meta_key = encode_meta_key(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -572,16 +579,17 @@ void DB::zremrangebyrank(context_t& con)
         if (i < start) continue;
         if (i > stop) break;
         batch.Delete(it->key());
-        batch.Delete(encode_zset_member(zk.seq, it->value().ToString()));
+        batch.Delete(encode_zset_member(zk.seq, get_zset_member(it->key())));
         rems++;
     }
     if (rems == zk.size) {
-        del_zset_meta_info(&batch, meta_key, zk.seq);
+        del_empty_key_batch(&batch, key, meta_key,
+                            { get_zset_anchor(zk.seq), get_zset_end_anchor(zk.seq) });
     } else {
         assert(zk.size > rems);
         batch.Put(meta_key, encode_zset_meta_value(zk.seq, zk.size - rems));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     touch_watch_key(key);
     con.append_reply_number(rems);
@@ -600,7 +608,7 @@ void DB::zremrangebyscore(context_t& con)
     check_expire(key);
     auto meta_key = encode_meta_key(key);
     std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     check_type(con, value, ktype::tzset);
@@ -611,17 +619,18 @@ void DB::zremrangebyscore(context_t& con)
     leveldb::WriteBatch batch;
     while (it.Valid() && it.order <= last.order) {
         batch.Delete(it.key());
-        batch.Delete(encode_zset_member(zk.seq, it.value().ToString()));
+        batch.Delete(encode_zset_member(zk.seq, get_zset_member(it.key())));
         it.Next();
         rems++;
     }
     if (rems == zk.size) {
-        del_zset_meta_info(&batch, meta_key, zk.seq);
+        del_empty_key_batch(&batch, key, meta_key,
+                            { get_zset_anchor(zk.seq), get_zset_end_anchor(zk.seq) });
     } else {
         assert(zk.size > rems);
         batch.Put(meta_key, encode_zset_meta_value(zk.seq, zk.size - rems));
     }
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    s = write(&batch);
     check_status(con, s);
     con.append_reply_number(rems);
 }
@@ -631,7 +640,7 @@ errstr_t DB::del_zset_key(const key_t& key)
     leveldb::WriteBatch batch;
     auto err = del_zset_key_batch(&batch, key);
     if (err) return err;
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     if (!s.ok()) return s;
     return std::nullopt;
 }
@@ -640,15 +649,15 @@ errstr_t DB::del_zset_key_batch(leveldb::WriteBatch *batch, const key_t& key)
 {
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     auto zk = decode_zset_meta_value(value);
     auto anchor = get_zset_anchor(zk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
         batch->Delete(it->key());
-        batch->Delete(encode_zset_member(zk.seq, it->value().ToString()));
+        batch->Delete(encode_zset_member(zk.seq, get_zset_member(it->key())));
         if (--zk.size == 0)
             break;
     }
@@ -664,12 +673,11 @@ void DB::rename_zset_key(leveldb::WriteBatch *batch, const key_t& key,
     uint64_t newseq = get_next_seq();
     long long newsize = zk.size;
     auto anchor = get_zset_anchor(zk.seq);
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->Seek(anchor), it->Next(); it->Valid(); it->Next()) {
-        auto score = get_zset_score(it->key());
-        auto member = it->value().ToString();
-        batch->Put(encode_zset_score(newseq, score, member), it->value());
-        batch->Put(encode_zset_member(newseq, member), score);
+        auto member = get_zset_member(it->key());
+        batch->Put(encode_zset_score(newseq, get_zset_score(it->key()), member), it->value());
+        batch->Put(encode_zset_member(newseq, member), it->value());
         batch->Delete(it->key());
         batch->Delete(encode_zset_member(zk.seq, member));
         if (--zk.size == 0)
@@ -680,25 +688,5 @@ void DB::rename_zset_key(leveldb::WriteBatch *batch, const key_t& key,
     del_zset_meta_info(batch, encode_meta_key(key), zk.seq);
 }
 
-int keycomp::zset_compare(const leveldb::Slice& l, const leveldb::Slice& r) const
-{
-    uint64_t seq1, seq2;
-    if (l[l.size() - 1] != zset_score_key || r[r.size() - 1] != zset_score_key)
-        return l.compare(r);
-    auto begin1 = const_cast<char*>(l.data()) + 1;
-    auto begin2 = const_cast<char*>(r.data()) + 1;
-    auto s1 = begin1 + load_len(begin1, &seq1);
-    auto s2 = begin2 + load_len(begin2, &seq2);
-    if (seq1 != seq2) return seq1 - seq2;
-    auto score1 = atof(s1), score2 = atof(s2);
-    if (score1 < score2) return -1;
-    if (score1 > score2) return 1;
-    s1 = strchr(s1, ':') + 1;
-    s2 = strchr(s2, ':') + 1;
-    leveldb::Slice member1(s1, begin1 - 1 + l.size() - 1 - s1);
-    leveldb::Slice member2(s2, begin2 - 1 + r.size() - 1 - s2);
-    return member1.compare(member2);
-}
-
 }
 }
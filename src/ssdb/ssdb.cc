@@ -8,16 +8,41 @@ namespace alice {
 
 namespace ssdb {
 
-#define BIND(f) std::bind(&DB::f, db.get(), std::placeholders::_1)
+#define BIND(f) [](void *db, context_t& con) { static_cast<DB*>(db)->f(con); }
 
 builtin_keys_t builtin_keys;
 
 void engine::server_cron()
 {
-    check_expire_keys();
+    active_expire_cycle(false);
+    expire_cycle.update_rate(lru_clock);
     check_blocked_clients();
 }
 
+void engine::before_sleep()
+{
+    active_expire_cycle(true);
+}
+
+void engine::info(std::string& s)
+{
+    expire_cycle.append_info(s);
+    auto& cache = db->get_read_cache();
+    s.append("read_cache_keys:").append(i2s(cache.size())).append("\n");
+    s.append("read_cache_bytes:").append(i2s(cache.bytes())).append("\n");
+    s.append("read_cache_hits:").append(i2s(cache.get_hits())).append("\n");
+    s.append("read_cache_misses:").append(i2s(cache.get_misses())).append("\n");
+    auto blocks = db->get_block_cache();
+    if (blocks) {
+        size_t hits = blocks->get_hits(), misses = blocks->get_misses();
+        double rate = hits + misses > 0 ? 1.0 * hits / (hits + misses) : 0;
+        s.append("block_cache_used:").append(i2s(blocks->TotalCharge())).append("\n");
+        s.append("block_cache_hits:").append(i2s(hits)).append("\n");
+        s.append("block_cache_misses:").append(i2s(misses)).append("\n");
+        s.append("block_cache_hit_rate:").append(d2s(rate)).append("\n");
+    }
+}
+
 void engine::creat_snapshot()
 {
     child_pid = fork();
@@ -90,34 +115,30 @@ void engine::unwatch(context_t& con)
     db->unwatch(con);
 }
 
-// 随机删除一定数量的过期键
-void engine::check_expire_keys()
-{
-    auto now = lru_clock;
-    int keys = server_conf.ssdb_expire_check_keys;
-    if (keys > db->expire_keys.size())
-        keys = db->expire_keys.size();
-    for (int j = 0; j < keys; j++) {
-        if (db->expire_keys.empty()) break;
-        auto randkey = get_rand_hash_key(db->expire_keys);
-        size_t bucket = std::get<0>(randkey);
-        size_t where = std::get<1>(randkey);
-        for (auto it = db->expire_keys.cbegin(bucket);
-                it != db->expire_keys.cend(bucket); ++it) {
-            if (where-- == 0) {
-                if (it->second <= now) {
-                    db->del_key_with_expire(it->first);
-                }
-                break;
-            }
+// 按到期时间顺序扫描过期索引，每批删除ssdb_expire_check_keys个已到期的键，
+// 直到没有已到期的键或者超出时间限制
+void engine::active_expire_cycle(bool fast)
+{
+    if (!expire_cycle.begin(fast)) return;
+    auto now = lru_clock.load();
+    size_t keys = server_conf.ssdb_expire_check_keys;
+    size_t total_expired = 0, expired;
+    bool timedout = false;
+    do {
+        expired = db->del_expired_keys(now, keys);
+        total_expired += expired;
+        if (expire_cycle.timeout()) {
+            timedout = true;
+            break;
         }
-    }
+    } while (expired == keys);
+    expire_cycle.end(total_expired, total_expired, timedout);
 }
 
 // 检查是否有阻塞的客户端超时
 void engine::check_blocked_clients()
 {
-    auto now = lru_clock;
+    auto now = lru_clock.load();
     for (auto it = blocked_clients.begin(); it != blocked_clients.end(); ) {
         auto e = it++;
         auto conn = __server->get_server().get_connection(*e);
@@ -127,7 +148,7 @@ void engine::check_blocked_clients()
             std::string message;
             double seconds = 1.0 * (now - context.block_start_time) / 1000;
             message.append("*-1\r\n+(").append(d2s(seconds)).append("s)\r\n");
-            conn->send(message);
+            __server->unblock_reply(conn, std::move(message));
             blocked_clients.erase(e);
             db->clear_blocking_keys_for_context(context);
         }
@@ -137,7 +158,7 @@ void engine::check_blocked_clients()
 engine::engine()
     : db(new DB(this))
 {
-    cmdtable = {
+    cmdtable = CommandTable(db.get(), {
         { "EXISTS",     { -2, IS_READ,  BIND(exists) } },
         { "TYPE",       { -2, IS_READ,  BIND(type) } },
         { "TTL",        { -2, IS_READ,  BIND(ttl) } },
@@ -219,7 +240,19 @@ engine::engine()
         { "ZREVRANGEBYSCORE",   {  4, IS_READ,  BIND(zrevrangebyscore) } },
         { "ZREMRANGEBYRANK",    { -4, IS_WRITE, BIND(zremrangebyrank) } },
         { "ZREMRANGEBYSCORE",   { -4, IS_WRITE, BIND(zremrangebyscore) } },
-    };
+    });
+}
+
+void DB::open()
+{
+    leveldb::Options ops = config_leveldb_options();
+    auto s = leveldb::DB::Open(ops, get_db_dir(), &db);
+    // 旧的文本编码使用自定义的比较器ssdb-keycomp，需要先用alice-ssdb-migrate转换
+    if (s.IsInvalidArgument() && s.ToString().find("ssdb-keycomp") != std::string::npos)
+        log_fatal("leveldb: %s is in the old text encoding, "
+                  "convert it with alice-ssdb-migrate first", get_db_dir().c_str());
+    if (!s.ok()) log_fatal("leveldb: %s", s.ToString().c_str());
+    set_builtin_keys();
 }
 
 void DB::set_builtin_keys()
@@ -237,20 +270,35 @@ void DB::set_builtin_keys()
     }
     s = db->Get(leveldb::ReadOptions(), builtin_keys.seq, &value);
     if (s.IsNotFound()) {
-        s = db->Put(leveldb::WriteOptions(), builtin_keys.seq, "1296");
+        value = "1296";
+        s = db->Put(leveldb::WriteOptions(), builtin_keys.seq, value);
         assert(s.ok());
     }
+    // 上次预留的seq不一定都用完了，直接从上界开始分配
+    seq_next = seq_limit = atoll(value.c_str());
+}
+
+leveldb::Status DB::cached_get(const std::string& key, std::string *value)
+{
+    bool found;
+    if (cache.get(key, value, &found))
+        return found ? leveldb::Status::OK() : leveldb::Status::NotFound(leveldb::Slice());
+    auto s = db->Get(leveldb::ReadOptions(), key, value);
+    if (s.ok()) cache.put(key, *value, true);
+    else if (s.IsNotFound()) cache.put(key, {}, false);
+    return s;
 }
 
 void DB::clear()
 {
     leveldb::WriteBatch batch;
-    auto it = newIterator();
+    auto it = newScanIterator();
     for (it->SeekToFirst(); it->Valid(); it->Next()) {
         batch.Delete(it->key());
     }
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     assert(s.ok());
+    cache.clear();
     set_builtin_keys();
 }
 
@@ -260,7 +308,7 @@ void DB::exists(context_t& con)
     std::string value;
     auto& key = con.argv[1];
     check_expire(key);
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.ok()) con.append(shared.n1);
     else if (s.IsNotFound()) con.append(shared.n0);
     else reterr(con, s);
@@ -272,7 +320,7 @@ void DB::type(context_t& con)
     std::string value;
     auto& key = con.argv[1];
     check_expire(key);
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.none_type);
     check_status(con, s);
     switch (get_type(value)) {
@@ -300,12 +348,12 @@ void DB::_ttl(context_t& con, bool is_ttl)
 {
     std::string value;
     auto& key = con.argv[1];
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n_2);
     check_status(con, s);
-    auto it = expire_keys.find(key);
-    if (it == expire_keys.end()) ret(con, shared.n_1);
-    auto ttl_ms = it->second - angel::util::get_cur_time_ms();
+    auto expire = get_expire(key);
+    if (expire == 0) ret(con, shared.n_1);
+    auto ttl_ms = expire - angel::util::get_cur_time_ms();
     if (is_ttl) ttl_ms /= 1000;
     con.append_reply_number(ttl_ms);
 }
@@ -329,7 +377,7 @@ void DB::_expire(context_t& con, bool is_expire)
     auto expire = str2ll(con.argv[2]);
     if (str2numerr()) ret(con, shared.integer_err);
     if (expire <= 0) ret(con, shared.timeout_err);
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.n0);
     check_status(con, s);
     if (is_expire) expire *= 1000;
@@ -368,10 +416,10 @@ void DB::_rename(context_t& con, bool is_nx)
     auto& key = con.argv[1];
     auto& newkey = con.argv[2];
     check_expire(key);
-    auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+    auto s = cached_get(encode_meta_key(key), &value);
     if (s.IsNotFound()) ret(con, shared.no_such_key);
     if (key == newkey) ret(con, is_nx ? shared.n0 : shared.ok);
-    s = db->Get(leveldb::ReadOptions(), encode_meta_key(newkey), &newvalue);
+    s = cached_get(encode_meta_key(newkey), &newvalue);
     leveldb::WriteBatch batch;
     if (s.ok()) {
         if (is_nx) ret(con, shared.n0);
@@ -381,7 +429,13 @@ void DB::_rename(context_t& con, bool is_nx)
         reterr(con, s);
     }
     rename_key(&batch, key, value, newkey);
-    s = db->Write(leveldb::WriteOptions(), &batch);
+    // 过期时间随键一起移动
+    auto expire = get_expire(key);
+    if (expire > 0) {
+        del_expire_key_batch(&batch, key);
+        add_expire_key_batch(&batch, newkey, expire);
+    }
+    s = write(&batch);
     check_status(con, s);
     con.append(is_nx ? shared.n1 : shared.ok);
 }
@@ -404,7 +458,7 @@ void DB::keys(context_t& con)
         ret(con, shared.unknown_option);
     int nums = 0;
     con.reserve_multi_head();
-    auto it = newIterator();
+    auto it = newScanIterator();
     it->Seek(builtin_keys.location);
     assert(it->Valid());
     for (it->Next(); it->Valid(); it->Next()) {
@@ -424,7 +478,7 @@ void DB::del(context_t& con)
     std::string value;
     leveldb::WriteBatch batch;
     for (size_t i = 1; i < con.argv.size(); i++) {
-        auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(con.argv[i]), &value);
+        auto s = cached_get(encode_meta_key(con.argv[i]), &value);
         if (s.ok()) {
             auto err = del_key_with_expire_batch(&batch, con.argv[i]);
             if (err) reterr(con, err.value());
@@ -432,16 +486,15 @@ void DB::del(context_t& con)
         } else if (!s.IsNotFound())
             reterr(con, s);
     }
-    auto s = db->Write(leveldb::WriteOptions(), &batch);
+    auto s = write(&batch);
     check_status(con, s);
     con.append_reply_number(dels);
 }
 
 void DB::check_expire(const key_t& key)
 {
-    auto it = expire_keys.find(key);
-    if (it == expire_keys.end()) return;
-    if (it->second > lru_clock) return;
+    auto expire = get_expire(key);
+    if (expire == 0 || expire > lru_clock) return;
     auto err = del_key_with_expire(key);
     if (err) {
         log_error("leveldb: %s", err->ToString().c_str());
@@ -451,6 +504,66 @@ void DB::check_expire(const key_t& key)
     __server->append_write_command(argv, nullptr, 0);
 }
 
+int64_t DB::get_expire(const key_t& key)
+{
+    std::string value;
+    auto s = cached_get(encode_expire_key(key), &value);
+    if (!s.ok()) return 0;
+    return atoll(value.c_str());
+}
+
+void DB::add_expire_key(const key_t& key, int64_t expire)
+{
+    leveldb::WriteBatch batch;
+    add_expire_key_batch(&batch, key, expire);
+    auto s = write(&batch);
+    if (!s.ok()) log_error("leveldb: %s", s.ToString().c_str());
+}
+
+void DB::add_expire_key_batch(leveldb::WriteBatch *batch, const key_t& key, int64_t expire)
+{
+    // 先删除旧的索引项
+    auto old = get_expire(key);
+    if (old > 0) batch->Delete(encode_expire_index_key(old, key));
+    batch->Put(encode_expire_key(key), i2s(expire));
+    batch->Put(encode_expire_index_key(expire, key), leveldb::Slice());
+}
+
+void DB::del_expire_key_batch(leveldb::WriteBatch *batch, const key_t& key)
+{
+    auto expire = get_expire(key);
+    if (expire == 0) return;
+    batch->Delete(encode_expire_key(key));
+    batch->Delete(encode_expire_index_key(expire, key));
+}
+
+size_t DB::del_expired_keys(int64_t now, size_t max)
+{
+    leveldb::WriteBatch batch;
+    std::string key;
+    size_t expired = 0;
+    auto it = newScanIterator();
+    char start = ktype::texpire_index;
+    for (it->Seek(leveldb::Slice(&start, 1)); it->Valid() && expired < max; it->Next()) {
+        auto index_key = it->key();
+        if (index_key.size() < 9 || index_key[0] != ktype::texpire_index) break;
+        if (decode_expire_index_key(index_key, &key) > now) break;
+        auto err = del_key_with_expire_batch(&batch, key);
+        if (err) {
+            log_error("leveldb: %s", err->ToString().c_str());
+            break;
+        }
+        expired++;
+    }
+    if (expired == 0) return 0;
+    auto s = write(&batch);
+    if (!s.ok()) {
+        log_error("leveldb: %s", s.ToString().c_str());
+        return 0;
+    }
+    return expired;
+}
+
 void DB::touch_watch_key(const key_t& key)
 {
     auto cl = watch_keys.find(key);
@@ -468,7 +581,7 @@ errstr_t DB::del_key(const key_t& key)
 {
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     auto type = get_type(value);
@@ -486,7 +599,7 @@ errstr_t DB::del_key_batch(leveldb::WriteBatch *batch, const key_t& key)
 {
     std::string value;
     auto meta_key = encode_meta_key(key);
-    auto s = db->Get(leveldb::ReadOptions(), meta_key, &value);
+    auto s = cached_get(meta_key, &value);
     if (s.IsNotFound()) return std::nullopt;
     if (!s.ok()) return s;
     auto type = get_type(value);
@@ -529,7 +642,7 @@ void DB::watch(context_t& con)
     for (size_t i = 1; i < con.argv.size(); i++) {
         auto& key = con.argv[i];
         check_expire(key);
-        auto s = db->Get(leveldb::ReadOptions(), encode_meta_key(key), &value);
+        auto s = cached_get(encode_meta_key(key), &value);
         if (s.IsNotFound()) continue;
         assert(s.ok());
         auto it = watch_keys.find(key);
@@ -561,14 +674,12 @@ void DB::unwatch(context_t& con)
 
 uint64_t DB::get_next_seq()
 {
-    uint64_t seq;
-    std::string value;
-    auto s = db->Get(leveldb::ReadOptions(), builtin_keys.seq, &value);
-    assert(s.ok());
-    seq = atoll(value.c_str());
-    s = db->Put(leveldb::WriteOptions(), builtin_keys.seq, i2s(seq + 1));
-    assert(s.ok());
-    return seq;
+    if (seq_next == seq_limit) {
+        seq_limit = seq_next + seq_reserve;
+        auto s = db->Put(leveldb::WriteOptions(), builtin_keys.seq, i2s(seq_limit));
+        assert(s.ok());
+    }
+    return seq_next++;
 }
 
 }
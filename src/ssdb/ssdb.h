@@ -3,8 +3,8 @@
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
-#include <leveldb/comparator.h>
 #include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
 
 #include <angel/logger.h>
 
@@ -16,11 +16,16 @@
 #include <unordered_map>
 #include <list>
 #include <optional> // for c++2a
+#include <initializer_list>
 
 #include "../db_base.h"
 #include "../config.h"
 #include "../parser.h"
 
+#include "coding.h"
+#include "read_cache.h"
+#include "block_cache.h"
+
 namespace alice {
 
 namespace ssdb {
@@ -32,6 +37,8 @@ class engine : public db_base_t {
 public:
     engine();
     void server_cron() override;
+    void before_sleep() override;
+    void info(std::string& s) override;
     void set_context(const angel::connection_ptr& conn)
     {
         conn->set_context(context_t(conn.get(), this));
@@ -53,13 +60,9 @@ public:
     bool is_created_snapshot() override;
     std::string get_snapshot_name() override;
     void load_snapshot() override;
-    command_t *find_command(const std::string& name) override
+    command_t *get_command(int id) override
     {
-        auto it = cmdtable.find(name);
-        if (it != cmdtable.end())
-            return &it->second;
-        else
-            return nullptr;
+        return cmdtable.get(id);
     }
     void do_after_exec_write_cmd(const argv_t& argv, const char *query, size_t len) override
     {
@@ -67,7 +70,7 @@ public:
     }
     void watch(context_t& con) override;
     void unwatch(context_t& con) override;
-    void check_expire_keys();
+    void active_expire_cycle(bool fast);
     void check_blocked_clients();
 
     void add_block_client(size_t id)
@@ -83,30 +86,11 @@ public:
             }
     }
 private:
-    std::unordered_map<std::string, command_t> cmdtable;
+    CommandTable cmdtable;
     std::unique_ptr<DB> db;
     std::list<size_t> blocked_clients;
     pid_t child_pid = -1;
-};
-
-struct keycomp : public leveldb::Comparator {
-    virtual ~keycomp() {  }
-    int Compare(const leveldb::Slice& l, const leveldb::Slice& r) const
-    {
-        if (l[0] == 'l' && r[0] == 'l') { // compare list key
-            return list_compare(l, r);
-        } else if (l[0] == 'Z' && r[0] == 'Z') {
-            return zset_compare(l, r);
-        }
-        return l.compare(r);
-    }
-    const char* Name() const { return "ssdb-keycomp"; }
-    void FindShortestSeparator(std::string* start,
-                               const leveldb::Slice& limit) const {  }
-    void FindShortSuccessor(std::string* key) const {  }
-
-    int list_compare(const leveldb::Slice& l, const leveldb::Slice& r) const;
-    int zset_compare(const leveldb::Slice& l, const leveldb::Slice& r) const;
+    expire_cycle_t expire_cycle;
 };
 
 using errstr_t = std::optional<leveldb::Status>;
@@ -141,13 +125,10 @@ using zsk_range = std::pair<zsk_iterator, zsk_iterator>;
 class DB {
 public:
     using key_t = std::string;
-    DB(engine *e) : engine(e)
+    DB(engine *e) : cache(server_conf.ssdb_read_cache_size), engine(e)
     {
         set_db_dir();
-        leveldb::Options ops = config_leveldb_options();
-        auto s = leveldb::DB::Open(ops, get_db_dir(), &db);
-        if (!s.ok()) log_fatal("leveldb: %s", s.ToString().c_str());
-        set_builtin_keys();
+        open();
     }
     ~DB()
     {
@@ -156,10 +137,8 @@ public:
     void reload()
     {
         delete db;
-        leveldb::Options ops = config_leveldb_options();
-        auto s = leveldb::DB::Open(ops, get_db_dir(), &db);
-        if (!s.ok()) log_fatal("leveldb: %s", s.ToString().c_str());
-        set_builtin_keys();
+        cache.clear();
+        open();
     }
     leveldb::Options config_leveldb_options()
     {
@@ -168,7 +147,16 @@ public:
         ops.max_open_files = server_conf.ssdb_leveldb_max_open_files;
         ops.max_file_size = server_conf.ssdb_leveldb_max_file_size;
         ops.write_buffer_size = server_conf.ssdb_leveldb_write_buffer_size;
-        ops.comparator = &comp;
+        ops.block_size = server_conf.ssdb_leveldb_block_size;
+        ops.compression = server_conf.ssdb_leveldb_compression ?
+                          leveldb::kSnappyCompression : leveldb::kNoCompression;
+        // reload()时继续使用原来的块缓存和过滤器
+        if (!blocks && server_conf.ssdb_leveldb_block_cache_size > 0)
+            blocks.reset(new block_cache(server_conf.ssdb_leveldb_block_cache_size));
+        if (!filter && server_conf.ssdb_leveldb_bloom_bits_per_key > 0)
+            filter.reset(leveldb::NewBloomFilterPolicy(server_conf.ssdb_leveldb_bloom_bits_per_key));
+        ops.block_cache = blocks.get();
+        ops.filter_policy = filter.get();
         return ops;
     }
     void clear();
@@ -178,31 +166,71 @@ public:
         return db_dir;
     }
 
-    void add_expire_key(const key_t& key, int64_t expire)
-    {
-        expire_keys[key] = expire;
-    }
+    // 过期时间保存在leveldb中: <T><key>记录键的到期时间，<E><expire><key>按到期时间
+    // 排序，定时任务只需要从头扫描<E>就能找到所有已到期的键
+    // 返回key的到期时间，没有设置过期时间时返回0
+    int64_t get_expire(const key_t& key);
+    void add_expire_key(const key_t& key, int64_t expire);
+    void add_expire_key_batch(leveldb::WriteBatch *batch, const key_t& key, int64_t expire);
     errstr_t del_key(const key_t& key);
     errstr_t del_key_batch(leveldb::WriteBatch *batch, const key_t& key);
-    void del_expire_key(const key_t& key)
-    {
-        expire_keys.erase(key);
-    }
+    void del_expire_key_batch(leveldb::WriteBatch *batch, const key_t& key);
     errstr_t del_key_with_expire(const key_t& key)
     {
-        del_expire_key(key);
-        return del_key(key);
+        leveldb::WriteBatch batch;
+        auto err = del_key_with_expire_batch(&batch, key);
+        if (err) return err;
+        auto s = write(&batch);
+        if (s.ok()) return std::nullopt;
+        return s;
     }
     errstr_t del_key_with_expire_batch(leveldb::WriteBatch *batch, const key_t& key)
     {
-        del_expire_key(key);
+        del_expire_key_batch(batch, key);
         return del_key_batch(batch, key);
     }
+    // 集合类型的键因为最后一个元素被删除而变空时调用，元数据、锚点和过期时间要一起删除，
+    // 否则残留的<T>key会让之后重新创建的同名键在旧的到期时间被删除
+    void del_empty_key_batch(leveldb::WriteBatch *batch, const key_t& key,
+                             const std::string& meta_key,
+                             std::initializer_list<std::string> anchors = {})
+    {
+        batch->Delete(meta_key);
+        for (auto& anchor : anchors) batch->Delete(anchor);
+        del_expire_key_batch(batch, key);
+    }
+    // 删除至多max个已到期的键，返回删除的个数
+    size_t del_expired_keys(int64_t now, size_t max);
+
+    // 读取元数据、过期时间或者字符串的值，优先从read_cache中查找
+    leveldb::Status cached_get(const std::string& key, std::string *value);
+    // 所有的修改都要通过write()或put()写入，以便同时更新read_cache
+    leveldb::Status write(leveldb::WriteBatch *batch)
+    {
+        auto s = db->Write(leveldb::WriteOptions(), batch);
+        if (s.ok()) cache.update(*batch);
+        return s;
+    }
+    leveldb::Status put(const std::string& key, const std::string& value)
+    {
+        leveldb::WriteBatch batch;
+        batch.Put(key, value);
+        return write(&batch);
+    }
+    const read_cache& get_read_cache() const { return cache; }
+    const block_cache *get_block_cache() const { return blocks.get(); }
 
     ldbIterator newIterator()
     {
         return ldbIterator(db->NewIterator(leveldb::ReadOptions()));
     }
+    // 用于遍历整个集合或者大范围的键，读到的数据块不放入块缓存，以免挤掉点查的热数据
+    ldbIterator newScanIterator()
+    {
+        leveldb::ReadOptions ops;
+        ops.fill_cache = false;
+        return ldbIterator(db->NewIterator(ops));
+    }
     ldbIterator newErrorIterator()
     {
         return ldbIterator(leveldb::NewErrorIterator(leveldb::Status::InvalidArgument("")));
@@ -315,6 +343,7 @@ private:
               .append("-ldb/");
         mkdir(db_dir.c_str(), 0777);
     }
+    void open();
     void set_builtin_keys();
     // return err-str if error else return null
     errstr_t del_list_key(const key_t& key);
@@ -372,13 +401,20 @@ private:
     void _zrangefor(context_t& con, unsigned cmdops, zsk_iterator& it,
                     long long dis, long long offset, long long limit, bool is_reverse);
 
+    // 每次从$seq$中预留seq_reserve个seq，用完之后再写一次$seq$
+    static constexpr uint64_t seq_reserve = 1024;
+
+    // 必须比db后析构
+    std::unique_ptr<block_cache> blocks;
+    std::unique_ptr<const leveldb::FilterPolicy> filter;
     leveldb::DB *db;
+    read_cache cache;
+    uint64_t seq_next = 0; // 下一个分配的seq
+    uint64_t seq_limit = 0; // 已经预留的seq的上界(不包含)
     std::string db_dir;
-    std::unordered_map<key_t, int64_t> expire_keys;
     std::unordered_map<key_t, std::vector<size_t>> watch_keys;
     std::unordered_map<key_t, std::vector<size_t>> blocking_keys;
     engine *engine;
-    keycomp comp;
     friend class engine;
 };
 
@@ -396,6 +432,8 @@ struct ktype {
     static const char tset     = 'S';
     static const char tzset    = 'z';
     static const char tscore   = 'Z';
+    static const char texpire  = 'T';
+    static const char texpire_index = 'E';
 };
 
 static inline const char
@@ -413,6 +451,35 @@ encode_meta_key(const std::string& key)
     return buf;
 }
 
+// <T><key> -> <expire>
+static inline std::string
+encode_expire_key(const std::string& key)
+{
+    std::string buf;
+    buf.append(1, ktype::texpire);
+    buf.append(key);
+    return buf;
+}
+
+// <E><expire(8, 大端)><key>，按字节比较时就是按到期时间排序
+static inline std::string
+encode_expire_index_key(int64_t expire, const std::string& key)
+{
+    std::string buf;
+    buf.reserve(1 + 8 + key.size());
+    buf.append(1, ktype::texpire_index);
+    append_fixed64(buf, static_cast<uint64_t>(expire));
+    buf.append(key);
+    return buf;
+}
+
+static inline int64_t
+decode_expire_index_key(const leveldb::Slice& index_key, std::string *key)
+{
+    key->assign(index_key.data() + 9, index_key.size() - 9);
+    return static_cast<int64_t>(load_fixed64(index_key.data() + 1));
+}
+
 extern builtin_keys_t builtin_keys;
 
 }
@@ -0,0 +1,130 @@
+#ifndef _ALICE_SRC_TASK_QUEUE_H
+#define _ALICE_SRC_TASK_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <functional>
+
+#include <angel/evloop.h>
+
+namespace alice {
+
+// 无锁的多生产者单消费者队列(Vyukov)
+// push()可以在任意线程中并发调用，pop()只能在一个线程中调用
+template <typename T>
+class mpsc_queue {
+public:
+    mpsc_queue() : head(new node()), tail(head.load()) {  }
+    ~mpsc_queue()
+    {
+        T value;
+        while (pop(value)) ;
+        delete tail;
+    }
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+    void push(T&& value)
+    {
+        node *n = new node(std::move(value));
+        node *prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+    // 队列为空时返回false
+    // 一个正在进行中的push()可能暂时不可见，它的调用者会负责再次唤醒消费者
+    bool pop(T& value)
+    {
+        node *next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+private:
+    struct node {
+        node() = default;
+        explicit node(T&& value) : value(std::move(value)) {  }
+        T value;
+        std::atomic<node*> next = nullptr;
+    };
+    std::atomic<node*> head;
+    node *tail;
+};
+
+// 有界的无锁单生产者单消费者环形队列，N必须是2的整数次幂
+// push()和pop()分别只能在一个线程中调用，队列满时push()会等待消费者，
+// 消费者可以用wait()等待新的元素
+template <typename T, size_t N>
+class spsc_ring {
+public:
+    static_assert(N > 0 && (N & (N - 1)) == 0);
+    spsc_ring() = default;
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+    void push(T&& value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h;
+        while (t - (h = head.load(std::memory_order_acquire)) == N)
+            head.wait(h, std::memory_order_acquire);
+        slots[t & (N - 1)] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+    bool pop(T& value)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        value = std::move(slots[h & (N - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+        return true;
+    }
+    bool empty() const
+    {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+    // 只能在消费者线程中调用，队列为空时阻塞直到有新的元素
+    void wait()
+    {
+        tail.wait(head.load(std::memory_order_relaxed), std::memory_order_acquire);
+    }
+private:
+    std::array<T, N> slots;
+    alignas(64) std::atomic_size_t head = 0;
+    alignas(64) std::atomic_size_t tail = 0;
+};
+
+// 投递到某个evloop上执行的任务队列
+// 入队不需要加锁，只有队列由空变为非空时才需要唤醒一次目标loop
+class task_queue {
+public:
+    using task_t = std::function<void()>;
+    explicit task_queue(angel::evloop *loop) : loop(loop) {  }
+    void post(task_t task)
+    {
+        queue.push(std::move(task));
+        if (!scheduled.exchange(true, std::memory_order_acq_rel))
+            loop->queue_in_loop([this]{ this->run(); });
+    }
+    // 只能在loop所在的线程中调用，立即执行所有已经入队的任务
+    void run_pending()
+    {
+        task_t task;
+        while (queue.pop(task)) task();
+    }
+private:
+    void run()
+    {
+        scheduled.store(false, std::memory_order_release);
+        run_pending();
+    }
+
+    angel::evloop *loop;
+    mpsc_queue<task_t> queue;
+    std::atomic<bool> scheduled = false;
+};
+
+}
+
+#endif // _ALICE_SRC_TASK_QUEUE_H
@@ -3,6 +3,7 @@
 
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -11,6 +12,11 @@
 #include <vector>
 #include <string>
 #include <numeric>
+#include <array>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
 
 #include "db_base.h"
 #include "util.h"
@@ -34,12 +40,11 @@ std::string generate_run_id()
 // if ok, return parsed-bytes
 // if not enough data, return 0
 // if error, return -1
-ssize_t parse_request(argv_t& argv, angel::buffer& buf)
+ssize_t parse_request(argv_view_t& argv, const char *s, const char *es)
 {
-    const char *s = buf.peek();
-    const char *es = s + buf.readable();
     const char *ps = s;
     size_t argc, len;
+    argv.clear();
     // 解析命令个数
     const char *next = std::find(s, es, '\n');
     if (next == es) goto clr;
@@ -68,6 +73,58 @@ err: // error
     return -1;
 }
 
+ssize_t parse_request(argv_t& argv, angel::buffer& buf)
+{
+    thread_local argv_view_t views;
+    const char *s = buf.peek();
+    ssize_t n = parse_request(views, s, s + buf.readable());
+    if (n <= 0) {
+        argv.clear();
+        return n;
+    }
+    for (auto& v : views)
+        argv.emplace_back(v);
+    return n;
+}
+
+// 复用的参数所能保留的最大容量，避免一次大请求之后一直占用内存
+static const size_t argv_reuse_limit = 64 * 1024;
+// spare中最多缓存的string个数，多出来的直接释放
+static const size_t argv_spare_limit = 64;
+
+// 将views中的参数拷贝到argv中，并将命令名转换为大写
+// argv中已有的string以及spare中缓存的string都会被复用，所以对于形状相似的请求序列
+// (例如SET key value)来说，这里不会发生任何内存分配；只有命令真正需要保存数据时
+// 才会从argv中再拷贝一次
+void assign_argv(argv_t& argv, argv_t& spare, const argv_view_t& views)
+{
+    size_t argc = views.size();
+    while (argv.size() > argc) {
+        if (spare.size() < argv_spare_limit && argv.back().capacity() <= argv_reuse_limit)
+            spare.emplace_back(std::move(argv.back()));
+        argv.pop_back();
+    }
+    // 一次参数很多的请求(例如MSET)之后不再保留那么大的数组
+    if (argv.capacity() > argv_spare_limit && argc <= argv_spare_limit)
+        argv.shrink_to_fit();
+    while (argv.size() < argc) {
+        if (spare.empty()) {
+            argv.emplace_back();
+        } else {
+            argv.emplace_back(std::move(spare.back()));
+            spare.pop_back();
+        }
+    }
+    for (size_t i = 0; i < argc; i++) {
+        auto& arg = argv[i];
+        if (arg.capacity() > argv_reuse_limit && views[i].size() <= argv_reuse_limit)
+            std::string().swap(arg);
+        arg.assign(views[i].data(), views[i].size());
+    }
+    if (argc > 0)
+        std::transform(argv[0].begin(), argv[0].end(), argv[0].begin(), ::toupper);
+}
+
 void conv2resp(std::string& buffer, const argv_t& argv)
 {
     context_t con;
@@ -331,4 +388,44 @@ int load_len(char *ptr, uint64_t *lenptr)
     return read_bytes;
 }
 
+// 支持SSE4.2时使用crc32指令，否则查表计算
+#if defined(__SSE4_2__)
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    uint64_t c = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = c;
+    for (; len > 0; len--, p++)
+        c32 = _mm_crc32_u8(c32, *p);
+    return ~c32;
+}
+#else
+static std::array<uint32_t, 256> make_crc32c_table()
+{
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+            c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+        table[i] = c;
+    }
+    return table;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    static const auto table = make_crc32c_table();
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+    while (len-- > 0)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+#endif
+
 }
@@ -4,6 +4,7 @@
 #include <angel/buffer.h>
 
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <random>
@@ -12,10 +13,15 @@
 namespace alice {
 
 using argv_t = std::vector<std::string>;
+// argv_view_t中的每个参数都直接指向输入缓冲区，解析时不会发生任何拷贝，
+// 所以它只在输入缓冲区被retrieve()之前有效
+using argv_view_t = std::vector<std::string_view>;
 
 std::string generate_run_id();
 
 ssize_t parse_request(argv_t& argv, angel::buffer& buf);
+ssize_t parse_request(argv_view_t& argv, const char *s, const char *es);
+void assign_argv(argv_t& argv, argv_t& spare, const argv_view_t& views);
 
 void conv2resp(std::string& buffer, const argv_t& argv);
 
@@ -52,8 +58,8 @@ template <typename Hash>
 std::tuple<size_t, size_t> get_rand_hash_key(const Hash& h)
 {
     size_t bucket;
+    static thread_local std::default_random_engine e(std::random_device{}());
     std::uniform_int_distribution<size_t> u(0, h.bucket_count() - 1);
-    std::default_random_engine e(clock());
     do {
         bucket = u(e);
     } while (h.bucket_size(bucket) == 0);
@@ -97,6 +103,9 @@ unsigned inline round_up_power_of_2(unsigned n)
 int save_len(std::string& s, uint64_t len);
 int load_len(char *ptr, uint64_t *lenptr);
 
+// 在crc的基础上继续计算data的CRC32C(Castagnoli)，初始值为0
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
 #define UNUSED(x) ((void)(x))
 
 }